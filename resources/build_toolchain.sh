@@ -75,6 +75,12 @@ fetch_source ()
     "ncurses")
         _fetch_source https://ftp.gnu.org/gnu/ncurses/ncurses-6.1.tar.gz
         ;;
+    "ccache")
+        _fetch_source https://github.com/ccache/ccache/releases/download/v3.7.12/ccache-3.7.12.tar.xz
+        ;;
+    "zstd")
+        _fetch_source https://github.com/facebook/zstd/releases/download/v1.4.5/zstd-1.4.5.tar.gz
+        ;;
     *)
         echo "Cannot recognized fetch source name: $1" >&2 && exit 1
     esac
@@ -185,8 +191,8 @@ if [ "$#" -ne 3 ]; then
     echo ""
     echo "  Available tools:"
     echo "    (GCC related tools) gcc, gmp, mpfr, mpc, isl, binutils, avrlibc"
-    echo "    (Shell utlis) busybox, make, bash"
-    echo "    (Libraries) avrdude, openssl, curl, libgit2, libiconv"
+    echo "    (Shell utlis) busybox, make, bash, ccache"
+    echo "    (Libraries) avrdude, openssl, curl, libgit2, libiconv, zstd"
     exit 1
 fi
 
@@ -107,4 +107,20 @@ build_native_gcc ()
     LD_LIBRARY_PATH=$NATIVE_PREFIX/lib \
     make -j $MAKE_JOB_COUNT install \
     || exit $?
-}
\ No newline at end of file
+}
+
+# Only the library, for resources/pack_toolchain.cpp.
+build_native_zstd ()
+{
+    [ -e $BUILD_ZSTD_ROOT/build/cmake/CMakeLists.txt ] || { echo "Not found: $BUILD_ZSTD_ROOT/build/cmake/CMakeLists.txt" >&2; exit 1; }
+    cmake $BUILD_ZSTD_ROOT/build/cmake \
+        -DZSTD_BUILD_PROGRAMS=OFF \
+        -DZSTD_BUILD_SHARED=OFF \
+        -DZSTD_BUILD_TESTS=OFF \
+        -DCMAKE_INSTALL_PREFIX=$NATIVE_PREFIX \
+        -DCMAKE_INSTALL_LIBDIR=lib \
+    && \
+    cmake --build . -- -j $MAKE_JOB_COUNT && \
+    cmake --build . --target install \
+    || exit $?
+}
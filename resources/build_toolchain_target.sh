@@ -450,4 +450,53 @@ build_target_ncurses ()
     PATH=$target_path make -j $MAKE_JOB_COUNT && \
     PATH=$target_arch_path make install -j $MAKE_JOB_COUNT \
     || exit $?
-}
\ No newline at end of file
+}
+
+# Compiler cache used in masquerade mode: lib/ccache/avr-gcc links to ccache (symlinkMaps.json),
+# and is put in front of bin in PATH by CompilerCache.kt.
+build_target_ccache ()
+{
+    [ -e $BUILD_CCACHE_ROOT/configure ] || { echo "Not found: $BUILD_CCACHE_ROOT/configure" >&2; exit 1; }
+    { [ -f Makefile ] || \
+    PATH=$target_path \
+    CFLAGS="$target_cflags -static" \
+    CXXFLAGS="$target_cxxflags" \
+    CC=$target_cc \
+    CXX=$target_cxx \
+    $BUILD_CCACHE_ROOT/configure --prefix=$TARGET_PREFIX \
+        --host=$target_host \
+        --with-bundled-zlib \
+    || exit $?; } && \
+    PATH=$target_path make -j $MAKE_JOB_COUNT && \
+    cp -f ./ccache $TARGET_PREFIX/bin/ccache && \
+    $target_strip $TARGET_PREFIX/bin/ccache \
+    || exit $?
+}
+
+# Decoder of toolchain.zst, linked into the app's native-lib.
+build_target_zstd ()
+{
+    [ -e $BUILD_ZSTD_ROOT/build/cmake/CMakeLists.txt ] || { echo "Not found: $BUILD_ZSTD_ROOT/build/cmake/CMakeLists.txt" >&2; exit 1; }
+    local cc=$ANDROID_NDK_TOOLCHAIN_ROOT/bin/$target_cc
+    PATH=$target_path \
+    cmake $BUILD_ZSTD_ROOT/build/cmake \
+        -DZSTD_BUILD_PROGRAMS=OFF \
+        -DZSTD_BUILD_SHARED=OFF \
+        -DZSTD_BUILD_TESTS=OFF \
+        -DZSTD_MULTITHREAD_SUPPORT=OFF \
+        -DCMAKE_SYSTEM_NAME=Linux \
+        -DCMAKE_SYSTEM_VERSION=Android \
+        -DCMAKE_AR=$ANDROID_NDK_TOOLCHAIN_ROOT/bin/aarch64-linux-android-ar \
+        -DCMAKE_C_COMPILER=$cc \
+        -DCMAKE_CXX_COMPILER=$cc++ \
+        -DCMAKE_C_FLAGS="$target_cflags" \
+        -DCMAKE_FIND_ROOT_PATH=$ANDROID_NDK_TOOLCHAIN_ROOT/sysroot \
+        -DCMAKE_INSTALL_PREFIX=$TARGET_LIBRARY_PREFIX \
+        -DCMAKE_INSTALL_LIBDIR=lib \
+    && \
+    PATH=$target_path \
+    cmake --build . -- -j $MAKE_JOB_COUNT &&
+    PATH=$target_path \
+    cmake --build . --target install \
+    || exit $?
+}
@@ -0,0 +1,217 @@
+// Packs a file tree into a seekable zstd archive read by ZstdArchive in the app (see the layout in
+// sources/app/src/main/jni/ZstdArchive.h).
+//
+// Usage: pack_toolchain [-l level] [-f frame-size] [-j threads] OUTPUT < LIST
+//
+// LIST names one path relative to the current directory per line, directories ending with '/'.
+// Files are grouped in list order into frames of about frame-size bytes, so similar files share a
+// frame and compress together; a file larger than frame-size gets a frame of its own. Frames are
+// compressed independently, on several threads.
+#include <zlib.h>
+#include <zstd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "ZstdArchive.h"
+
+using namespace zabuton::zstd;
+
+namespace
+{
+
+struct Entry
+{
+    std::string name;
+    uint32_t frame;
+    uint32_t mode;
+    uint64_t size;
+    uint32_t crc32;
+};
+
+struct Frame
+{
+    size_t firstEntry;
+    size_t endEntry;
+    uint64_t uncompressedSize;
+    std::string compressed;
+};
+
+[[noreturn]] void Fail(const std::string& message)
+{
+    std::cerr << "pack_toolchain: " << message << std::endl;
+    exit(1);
+}
+
+void Put16(std::string *out, uint16_t v)
+{
+    out->push_back(static_cast<char>(v));
+    out->push_back(static_cast<char>(v >> 8));
+}
+
+void Put32(std::string *out, uint32_t v)
+{
+    Put16(out, static_cast<uint16_t>(v));
+    Put16(out, static_cast<uint16_t>(v >> 16));
+}
+
+void Put64(std::string *out, uint64_t v)
+{
+    Put32(out, static_cast<uint32_t>(v));
+    Put32(out, static_cast<uint32_t>(v >> 32));
+}
+
+// Reads the files of frame, records their checksums and compresses them as one zstd frame.
+void CompressFrame(Frame *frame, std::vector<Entry> *entries, int level)
+{
+    std::string input;
+    input.reserve(static_cast<size_t>(frame->uncompressedSize));
+    for (size_t i = frame->firstEntry; i < frame->endEntry; i++) {
+        Entry& entry = (*entries)[i];
+        if (entry.frame == NoFrame) {
+            continue;
+        }
+        std::ifstream file(entry.name, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) {
+            Fail("cannot read " + entry.name);
+        }
+        if (data.size() != entry.size) {
+            Fail(entry.name + " changed while packing");
+        }
+        entry.crc32 = static_cast<uint32_t>(crc32(crc32(0, nullptr, 0),
+                reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size())));
+        input += data;
+    }
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    // The decoder reserves a window per thread; cap it so installing stays light on memory.
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, 23);
+    frame->compressed.resize(ZSTD_compressBound(input.size()));
+    size_t size = ZSTD_compress2(cctx, &frame->compressed[0], frame->compressed.size(), input.data(), input.size());
+    ZSTD_freeCCtx(cctx);
+    if (ZSTD_isError(size)) {
+        Fail(std::string("cannot compress: ") + ZSTD_getErrorName(size));
+    }
+    if (size > 0xffffffff) {
+        Fail("frame too large");
+    }
+    frame->compressed.resize(size);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    int level = 19;
+    uint64_t frameSize = 8 * 1024 * 1024;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    int opt;
+    while ((opt = getopt(argc, argv, "l:f:j:")) != -1) {
+        switch (opt) {
+        case 'l': level = atoi(optarg); break;
+        case 'f': frameSize = strtoull(optarg, nullptr, 10); break;
+        case 'j': threads = static_cast<unsigned int>(std::max(1, atoi(optarg))); break;
+        default:
+            Fail("usage: pack_toolchain [-l level] [-f frame-size] [-j threads] OUTPUT < LIST");
+        }
+    }
+    if (optind + 1 != argc) {
+        Fail("usage: pack_toolchain [-l level] [-f frame-size] [-j threads] OUTPUT < LIST");
+    }
+    const char *outputPath = argv[optind];
+
+    std::vector<Entry> entries;
+    std::vector<Frame> frames;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        if (line.size() > 0xffff) {
+            Fail("path too long: " + line);
+        }
+        Entry entry = { line, NoFrame, 0, 0, 0 };
+        if (line.back() != '/') {
+            struct stat st = {};
+            if (stat(line.c_str(), &st) != 0) {
+                Fail("cannot stat " + line + ": " + strerror(errno));
+            }
+            if (!S_ISREG(st.st_mode)) {
+                Fail("not a regular file: " + line);
+            }
+            entry.mode = st.st_mode & 0777;
+            entry.size = static_cast<uint64_t>(st.st_size);
+            if (entry.size > 0xffffffff) {
+                Fail("file too large: " + line);
+            }
+            // Start a new frame once the current one is full, or when this file would overflow
+            // the u32 frame size.
+            if (frames.empty() || frames.back().uncompressedSize >= frameSize
+                    || frames.back().uncompressedSize + entry.size > 0xffffffff) {
+                frames.push_back({ entries.size(), entries.size(), 0, std::string() });
+            }
+            entry.frame = static_cast<uint32_t>(frames.size() - 1);
+            frames.back().uncompressedSize += entry.size;
+            frames.back().endEntry = entries.size() + 1;
+        }
+        entries.push_back(std::move(entry));
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::min<size_t>(threads, frames.size()); i++) {
+        workers.emplace_back([&]() {
+            for (size_t f = next++; f < frames.size(); f = next++) {
+                CompressFrame(&frames[f], &entries, level);
+            }
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    std::string index;
+    for (const auto& frame : frames) {
+        Put32(&index, static_cast<uint32_t>(frame.compressed.size()));
+        Put32(&index, static_cast<uint32_t>(frame.uncompressedSize));
+    }
+    for (const auto& entry : entries) {
+        Put32(&index, entry.frame);
+        Put32(&index, entry.mode);
+        Put64(&index, entry.size);
+        Put32(&index, entry.crc32);
+        Put16(&index, static_cast<uint16_t>(entry.name.size()));
+        index += entry.name;
+    }
+    std::string trailer;
+    Put32(&trailer, SkippableFrameMagic);
+    Put32(&trailer, static_cast<uint32_t>(index.size() + IndexFooterSize));
+    trailer += index;
+    Put32(&trailer, static_cast<uint32_t>(index.size()));
+    Put32(&trailer, static_cast<uint32_t>(frames.size()));
+    Put32(&trailer, static_cast<uint32_t>(entries.size()));
+    Put32(&trailer, IndexMagic);
+
+    std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+    for (const auto& frame : frames) {
+        output.write(frame.compressed.data(), static_cast<std::streamsize>(frame.compressed.size()));
+    }
+    output.write(trailer.data(), static_cast<std::streamsize>(trailer.size()));
+    output.close();
+    if (!output) {
+        Fail(std::string("cannot write ") + outputPath);
+    }
+    return 0;
+}
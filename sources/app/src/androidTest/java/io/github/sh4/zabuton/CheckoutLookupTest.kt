@@ -0,0 +1,107 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.LibGit2Exception
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import kotlin.system.measureNanoTime
+
+private val TAG = CheckoutLookupTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class CheckoutLookupTest {
+    companion object {
+        private const val GIT_ENOTFOUND = -3
+        private const val ROUNDS = 200
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private val commits = HashMap<String, String>()
+
+    // Branches a and b each hold one keymap.c, with different contents.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        val repository = GitFixture(tempFolder.newFolder("fixture.git"))
+        val master = repository.commit(repository.tree(emptyMap()), "empty")
+        repository.branch("master", master)
+        for (name in listOf("a", "b")) {
+            val id = repository.commit(repository.tree(mapOf("keymap.c" to "// $name\n".toByteArray())), name, master)
+            repository.branch(name, id)
+            commits[name] = id.toHex()
+        }
+        fixture = repository
+    }
+
+    private fun clone(): Pair<Repository, File> {
+        val root = tempFolder.newFolder("worktree")
+        return fixture.clone(root) to root
+    }
+
+    @Test
+    fun checkoutByObjectId() {
+        val (repository, root) = clone()
+        repository.use {
+            it.checkout(commits["b"], ProgressMonitor())
+            Assert.assertEquals("// b\n", File(root, "keymap.c").readText())
+            // An abbreviated id still goes through revparse.
+            it.checkout(commits["a"]!!.substring(0, 12), ProgressMonitor())
+            Assert.assertEquals("// a\n", File(root, "keymap.c").readText())
+        }
+    }
+
+    @Test
+    fun failureCarriesLibGit2Error() {
+        val (repository, _) = clone()
+        repository.use {
+            try {
+                it.checkout("no-such-branch", ProgressMonitor())
+                Assert.fail("checkout of a missing branch succeeded")
+            } catch (e: LibGit2Exception) {
+                Assert.assertEquals(GIT_ENOTFOUND, e.returnCode)
+                Assert.assertNotEquals(0, e.errorClass)
+                Assert.assertTrue(e.message, e.message!!.endsWith("(${e.errorClass})"))
+            }
+        }
+    }
+
+    /**
+     * Switches between a and b ROUNDS times by object id and by remote branch name, the latter
+     * resolving the name and probing for the local branch on every checkout.
+     */
+    @Test
+    fun checkoutLookupBenchmark() {
+        val (repository, _) = clone()
+        repository.use {
+            val byId = measureNanoTime {
+                for (i in 0 until ROUNDS) {
+                    it.checkout(commits[if (i % 2 == 0) "a" else "b"], ProgressMonitor())
+                }
+            }
+            val byBranch = measureNanoTime {
+                for (i in 0 until ROUNDS) {
+                    it.checkout(if (i % 2 == 0) "origin/a" else "origin/b", ProgressMonitor())
+                }
+            }
+            Log.i(TAG, "checkout by id: ${byId / ROUNDS / 1000} [us], by branch: ${byBranch / ROUNDS / 1000} [us]")
+        }
+    }
+}
@@ -0,0 +1,129 @@
+package io.github.sh4.zabuton
+
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+
+@RunWith(AndroidJUnit4::class)
+class CommitIndexTest {
+    companion object {
+        private const val EPOCH = 1500000000L
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private lateinit var emptyTree: ByteArray
+    private lateinit var master: ByteArray
+
+    // master has 200 commits and merges feature, 30 commits branched at master~80; topic has 10
+    // commits branched at master~50. Every 37th commit is dated before its parent, as a rebase
+    // or a skewed clock leaves them.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        fixture = GitFixture(tempFolder.newFolder("fixture.git"))
+        emptyTree = fixture.tree(emptyMap())
+        val mainLine = ArrayList<ByteArray>()
+        for (i in 0 until 200) {
+            val time = EPOCH + i * 60 - if (i % 37 == 36) 3600 else 0
+            mainLine.add(fixture.commit(emptyTree, "master $i", *listOfNotNull(mainLine.lastOrNull()).toTypedArray(), time = time))
+        }
+        var feature = mainLine[120]
+        for (j in 0 until 30) {
+            feature = fixture.commit(emptyTree, "feature $j", feature, time = EPOCH + 120 * 60 + j * 90 + 20)
+        }
+        var topic = mainLine[150]
+        for (j in 0 until 10) {
+            topic = fixture.commit(emptyTree, "topic $j", topic, time = EPOCH + 150 * 60 + j * 70 + 15)
+        }
+        master = fixture.commit(emptyTree, "merge feature", mainLine.last(), feature, time = EPOCH + 200 * 60)
+        fixture.branch("master", master)
+        fixture.branch("feature", feature)
+        fixture.branch("topic", topic)
+    }
+
+    private fun cloneFixture(): Pair<File, Repository> {
+        val path = tempFolder.newFolder("clone")
+        return path to fixture.clone(path)
+    }
+
+    private fun fullLog(repository: Repository, start: String?) =
+            repository.logBatch(start, 10_000, CommitLogBatch.FIELD_ALL)
+
+    private fun assertSameLog(expected: CommitLogBatch, actual: CommitLogBatch) {
+        Assert.assertEquals(expected.count, actual.count)
+        for (i in 0 until expected.count) {
+            Assert.assertEquals(expected.getId(i), actual.getId(i))
+            Assert.assertEquals(expected.getParentCount(i), actual.getParentCount(i))
+            for (p in 0 until expected.getParentCount(i)) {
+                Assert.assertEquals(expected.getParentId(i, p), actual.getParentId(i, p))
+            }
+            for (column in 0 until CommitLogBatch.TEXT_COLUMNS) {
+                Assert.assertEquals(expected.getText(i, column), actual.getText(i, column))
+            }
+        }
+        Assert.assertArrayEquals(expected.authorTimes, actual.authorTimes)
+        Assert.assertArrayEquals(expected.authorTimeOffsets, actual.authorTimeOffsets)
+        Assert.assertArrayEquals(expected.committerTimes, actual.committerTimes)
+    }
+
+    @Test
+    fun indexedLogMatchesRevwalk() {
+        // The fixture itself was never indexed, so it is walked by libgit2.
+        val (path, clone) = cloneFixture()
+        Assert.assertTrue(File(path, ".git/zabuton-commit-index").exists())
+        Repository.open(fixture.root.absolutePath).use { bare ->
+            assertSameLog(fullLog(bare, null), fullLog(clone, null))
+            assertSameLog(fullLog(bare, "topic"), fullLog(clone, "origin/topic"))
+            Assert.assertEquals(231, fullLog(clone, null).count)
+        }
+        clone.close()
+    }
+
+    @Test
+    fun aheadBehindMatchesLibGit2() {
+        val (_, clone) = cloneFixture()
+        Assert.assertArrayEquals(intArrayOf(80, 10), clone.aheadBehind("master", "origin/topic"))
+        Assert.assertArrayEquals(intArrayOf(0, 0), clone.aheadBehind("master", "origin/master"))
+        Repository.open(fixture.root.absolutePath).use { bare ->
+            for ((local, upstream) in listOf("master" to "topic", "feature" to "topic", "topic" to "feature")) {
+                Assert.assertArrayEquals(bare.aheadBehind(local, upstream), clone.aheadBehind("origin/$local", "origin/$upstream"))
+            }
+        }
+        clone.close()
+    }
+
+    @Test
+    fun fetchIndexesNewCommits() {
+        val (path, clone) = cloneFixture()
+        val indexFile = File(path, ".git/zabuton-commit-index")
+        val indexSize = indexFile.length()
+        val next = fixture.commit(emptyTree, "after clone", master, time = EPOCH + 201 * 60)
+        fixture.branch("master", next)
+
+        clone.fetch("origin", ProgressMonitor())
+        Assert.assertTrue(indexFile.length() > indexSize)
+        Assert.assertArrayEquals(intArrayOf(0, 1), clone.aheadBehind("master", "origin/master"))
+        val log = clone.logBatch("origin/master", 2, CommitLogBatch.FIELD_ALL)
+        Assert.assertEquals("after clone\n", log.getMessage(0))
+        Assert.assertEquals(clone.logBatch(null, 1, CommitLogBatch.FIELD_ID).getId(0), log.getId(1))
+        clone.close()
+    }
+}
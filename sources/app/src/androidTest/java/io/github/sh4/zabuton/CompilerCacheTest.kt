@@ -0,0 +1,60 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry.getInstrumentation
+import io.github.sh4.zabuton.app.CompilerCache
+import io.github.sh4.zabuton.app.toolchainInstall
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.File
+
+private val TAG = CompilerCacheTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class CompilerCacheTest {
+    private val context = getInstrumentation().targetContext
+
+    private fun compile(cache: CompilerCache, root: File, source: File, output: File, vararg flags: String) {
+        // Started through the masquerade link, as make would find it in PATH.
+        val compiler = File(root, "lib/ccache/avr-gcc").absolutePath
+        val process = ProcessBuilder(listOf(compiler, "-mmcu=atmega32u4", "-Os") + flags +
+                listOf("-c", source.absolutePath, "-o", output.absolutePath)).apply {
+            environment().putAll(cache.environment(File(root, "bin").absolutePath))
+            redirectErrorStream(true)
+        }.start()
+        val log = process.inputStream.bufferedReader().use { it.readText() }
+        Assert.assertEquals(log, 0, process.waitFor())
+    }
+
+    @Test
+    fun repeatedCompileHitsCache() {
+        val root = File(context.filesDir, "root")
+        runBlocking { toolchainInstall(root, context) {} }
+        val cache = CompilerCache(root, File(context.cacheDir, "ccache-test"))
+        val workDir = File(context.cacheDir, "ccache-test-work").apply {
+            deleteRecursively()
+            mkdirs()
+        }
+        val source = File(workDir, "main.c")
+        source.writeText("#ifndef KEYMAP\n#define KEYMAP 0\n#endif\nint add(int a, int b) { return a + b + KEYMAP; }\n")
+
+        runBlocking {
+            cache.clear()
+            cache.zeroStatistics()
+            compile(cache, root, source, File(workDir, "first.o"))
+            compile(cache, root, source, File(workDir, "second.o"))
+            // A definition that changes the preprocessed source is a different object.
+            compile(cache, root, source, File(workDir, "third.o"), "-DKEYMAP=1")
+
+            val statistics = cache.statistics()
+            Log.d(TAG, "statistics: $statistics")
+            Assert.assertEquals(1L, statistics.hits)
+            Assert.assertEquals(2L, statistics.misses)
+            Assert.assertTrue(statistics.files > 0)
+        }
+        Assert.assertArrayEquals(File(workDir, "first.o").readBytes(), File(workDir, "second.o").readBytes())
+    }
+}
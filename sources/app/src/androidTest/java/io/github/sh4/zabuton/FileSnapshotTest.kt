@@ -0,0 +1,120 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import io.github.sh4.zabuton.util.FileSnapshot
+import io.github.sh4.zabuton.workspace.DirectoryWorktree
+import io.github.sh4.zabuton.workspace.Workspace
+import io.github.sh4.zabuton.workspace.WorkspaceId
+import io.github.sh4.zabuton.workspace.WorkspaceName
+import io.github.sh4.zabuton.workspace.WorktreeSnapshot
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.UUID
+import kotlin.system.measureTimeMillis
+
+private val TAG = FileSnapshotTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class FileSnapshotTest {
+    companion object {
+        // About the size of a QMK firmware checkout.
+        private const val FILE_COUNT = 30_000
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private fun File.write(path: String, text: String) = File(this, path).apply {
+        parentFile!!.mkdirs()
+        writeText(text)
+    }
+
+    @Test
+    fun changesSinceReportsAddedRemovedAndModifiedFiles() {
+        val root = tempFolder.newFolder("tree")
+        root.write("keyboards/a/keymap.c", "a")
+        root.write("keyboards/b/keymap.c", "b")
+        root.write("Makefile", "all:")
+        root.write(".git/HEAD", "ref: refs/heads/master")
+        root.write("keyboards/a/.build/keymap.o", "o")
+        FileSnapshot.take(root, ".git", ".build").use { before ->
+            Assert.assertEquals(3, before.getFileCount())
+            root.write("keyboards/a/keymap.c", "a, edited")
+            File(root, "keyboards/b/keymap.c").delete()
+            root.write("keyboards/c/keymap.c", "c")
+            root.write(".git/HEAD", "ref: refs/heads/other")
+            FileSnapshot.take(root, ".git", ".build").use { after ->
+                val changes = after.changesSince(before)
+                Assert.assertArrayEquals(arrayOf("keyboards/c/keymap.c"), changes.added)
+                Assert.assertArrayEquals(arrayOf("keyboards/b/keymap.c"), changes.removed)
+                Assert.assertArrayEquals(arrayOf("keyboards/a/keymap.c"), changes.modified)
+                Assert.assertTrue(after.changesSince(after).isEmpty)
+                Assert.assertEquals(3, after.changesSince(null).added.size)
+            }
+        }
+    }
+
+    @Test
+    fun savedSnapshotLoadsBack() {
+        val root = tempFolder.newFolder("tree")
+        (0 until 100).forEach { root.write("keyboards/kb${it / 10}/keymap$it.c", "$it") }
+        val file = File(tempFolder.root, "tree.snapshot")
+        FileSnapshot.take(root).use { snapshot ->
+            snapshot.save(file.absolutePath)
+            FileSnapshot.load(file.absolutePath)!!.use { loaded ->
+                Assert.assertEquals(100, loaded.getFileCount())
+                Assert.assertTrue(snapshot.changesSince(loaded).isEmpty)
+            }
+        }
+        Assert.assertNull(FileSnapshot.load(File(tempFolder.root, "missing").absolutePath))
+        file.writeText("not a snapshot")
+        Assert.assertNull(FileSnapshot.load(file.absolutePath))
+    }
+
+    @Test
+    fun worktreeSnapshotKeepsChangesUntilCommitted() = runBlocking {
+        val root = tempFolder.newFolder("qmk_firmware")
+        root.write("keyboards/a/keymap.c", "a")
+        val snapshot = WorktreeSnapshot(DirectoryWorktree(Workspace(WorkspaceId(UUID.randomUUID()), WorkspaceName("qmk")), root), File(tempFolder.root, "qmk.snapshot"))
+        Assert.assertArrayEquals(arrayOf("keyboards/a/keymap.c"), snapshot.changes().added)
+        // The build failed: nothing is committed and the same change is reported again.
+        Assert.assertArrayEquals(arrayOf("keyboards/a/keymap.c"), snapshot.changes().added)
+        snapshot.commit()
+        Assert.assertTrue(snapshot.changes().isEmpty)
+        root.write("keyboards/a/keymap.c", "a, edited")
+        Assert.assertArrayEquals(arrayOf("keyboards/a/keymap.c"), snapshot.changes().modified)
+    }
+
+    @Test
+    fun snapshotLargeTree() {
+        val root = tempFolder.newFolder("tree")
+        (0 until FILE_COUNT).forEach { i ->
+            val dir = File(root, "keyboards/kb${i / 300}/keymaps/km${i / 30 % 10}")
+            if (i % 30 == 0) dir.mkdirs()
+            File(dir, "file$i.c").writeText("$i")
+        }
+        lateinit var first: FileSnapshot
+        val takeMillis = measureTimeMillis { first = FileSnapshot.take(root) }
+        first.use {
+            Assert.assertEquals(FILE_COUNT, it.getFileCount())
+            File(root, "keyboards/kb7/keymaps/km3/file2190.c").writeText("edited")
+            FileSnapshot.take(root).use { second ->
+                lateinit var changes: FileSnapshot.Changes
+                val compareMillis = measureTimeMillis { changes = second.changesSince(it) }
+                Assert.assertArrayEquals(arrayOf("keyboards/kb7/keymaps/km3/file2190.c"), changes.modified)
+                Log.d(TAG, "$FILE_COUNT files: take $takeMillis [ms], compare $compareMillis [ms]")
+            }
+        }
+    }
+}
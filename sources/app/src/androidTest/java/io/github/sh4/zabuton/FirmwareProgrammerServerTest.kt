@@ -0,0 +1,307 @@
+package io.github.sh4.zabuton
+
+import android.system.Os
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import io.github.sh4.zabuton.programmer.FirmwareProgrammerServer
+import io.github.sh4.zabuton.programmer.SharedMemoryTransport
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.BufferedOutputStream
+import java.io.DataInputStream
+import java.io.DataOutputStream
+import java.io.FileInputStream
+import java.io.FileOutputStream
+import java.io.InputStream
+import java.io.OutputStream
+import kotlin.concurrent.thread
+import kotlin.random.Random
+import kotlin.system.measureTimeMillis
+
+private val TAG = FirmwareProgrammerServerTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class FirmwareProgrammerServerTest {
+    companion object {
+        // Protocol constants of FirmwareProgrammerServer.
+        private const val CLOSE = 1
+        private const val READ = 2
+        private const val WRITE = 3
+        private const val GET_LAST_ERROR = 13
+        private const val HELLO = 15
+        private const val BULK_WRITE = 16
+        private const val GENERIC_ERROR = -1024
+
+        // ATmega32U4 with the Caterina (avr109) bootloader: 28KB of application flash written
+        // in 128 byte pages, each a block write command answered by '\r'.
+        private const val FLASH_SIZE = 28 * 1024
+        private const val PAGE_SIZE = 128
+        private const val ACK: Byte = '\r'.toByte()
+        private const val USB_LATENCY_MILLISECONDS = 1L
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    // The avrdude side of the bridge.
+    private class Client(input: InputStream, output: OutputStream, private val onClose: () -> Unit = {}) {
+        val output = DataOutputStream(BufferedOutputStream(output))
+        val input = DataInputStream(input)
+
+        fun readBytes(size: Int) = ByteArray(size).also { input.readFully(it) }
+
+        fun close() {
+            output.writeByte(CLOSE)
+            output.flush()
+            Assert.assertEquals(0, input.readInt())
+            output.close()
+            input.close()
+            onClose()
+        }
+
+        companion object {
+            // Connected through pipes, as the avrdude process is.
+            fun overPipes(port: LoopbackUsbSerialPort): Client {
+                val requests = Os.pipe()
+                val responses = Os.pipe()
+                FirmwareProgrammerServer.startServer(port.port, FileInputStream(requests[0]), FileOutputStream(responses[1]))
+                return Client(FileInputStream(responses[0]), FileOutputStream(requests[1]))
+            }
+
+            // Connected through a memfd mapped by both ends.
+            fun overSharedMemory(port: LoopbackUsbSerialPort): Client {
+                val serverTransport = SharedMemoryTransport.create(SharedMemoryTransport.DEFAULT_CAPACITY)
+                val clientTransport = SharedMemoryTransport.connect(serverTransport.path)
+                val server = FirmwareProgrammerServer.startServer(port.port, serverTransport)
+                return Client(clientTransport.inputStream, clientTransport.outputStream) {
+                    while (server.isRunning) {
+                        Thread.sleep(1)
+                    }
+                    clientTransport.close()
+                    serverTransport.close()
+                }
+            }
+        }
+    }
+
+    private fun avr109Device(): (ByteArray) -> ByteArray = { data ->
+        if (data.isNotEmpty() && data[0] == 'B'.toByte()) byteArrayOf(ACK) else ByteArray(0)
+    }
+
+    private fun blockWrite(page: ByteArray) =
+            byteArrayOf('B'.toByte(), (page.size shr 8).toByte(), page.size.toByte(), 'F'.toByte()) + page
+
+    private fun flashImage() = Random(32).nextBytes(FLASH_SIZE)
+
+    @Test
+    fun helloNegotiatesVersion2() {
+        val client = Client.overPipes(LoopbackUsbSerialPort())
+        client.output.writeByte(HELLO)
+        client.output.writeInt(2)
+        client.output.flush()
+        Assert.assertEquals(2, client.input.readInt())
+        val maxBufferSize = client.input.readInt()
+        val windowBytes = client.input.readInt()
+        Assert.assertTrue(maxBufferSize > 0)
+        Assert.assertTrue(windowBytes in 1..maxBufferSize)
+        client.close()
+    }
+
+    @Test
+    fun pipelinedRequestsAreAnsweredInOrder() {
+        val port = LoopbackUsbSerialPort()
+        val client = Client.overPipes(port)
+        val packets = (0 until 8).map { Random(it).nextBytes(16) }
+        // All requests go out before any response is read.
+        for (packet in packets) {
+            client.output.writeByte(WRITE)
+            client.output.writeInt(packet.size)
+            client.output.write(packet)
+        }
+        client.output.writeByte(READ)
+        client.output.writeInt(packets.size * 16)
+        client.output.writeInt(1000)
+        client.output.writeByte(GET_LAST_ERROR)
+        client.output.writeInt(256)
+        client.output.flush()
+
+        for (packet in packets) {
+            Assert.assertEquals(packet.size, client.input.readInt())
+        }
+        Assert.assertEquals(packets.size * 16, client.input.readInt())
+        Assert.assertArrayEquals(packets.reduce { a, b -> a + b }, client.readBytes(packets.size * 16))
+        Assert.assertEquals(GENERIC_ERROR - 1, client.input.readInt())
+        client.close()
+    }
+
+    @Test
+    fun bulkWriteReadsAckPerChunk() {
+        bulkWriteReadsAckPerChunk { Client.overPipes(it) }
+        bulkWriteReadsAckPerChunk { Client.overSharedMemory(it) }
+    }
+
+    private fun bulkWriteReadsAckPerChunk(connect: (LoopbackUsbSerialPort) -> Client) {
+        val port = LoopbackUsbSerialPort(device = avr109Device())
+        val client = connect(port)
+        val image = flashImage()
+        val pages = image.toList().chunked(PAGE_SIZE) { blockWrite(it.toByteArray()) }
+        client.output.writeByte(BULK_WRITE)
+        client.output.writeInt(pages.size)
+        client.output.writeInt(1)
+        client.output.writeInt(1000)
+        for (page in pages) {
+            client.output.writeInt(page.size)
+            client.output.write(page)
+        }
+        client.output.flush()
+
+        Assert.assertArrayEquals(ByteArray(pages.size) { ACK }, client.readBytes(pages.size))
+        Assert.assertEquals(pages.sumBy { it.size }, client.input.readInt())
+        Assert.assertArrayEquals(pages.reduce { a, b -> a + b }, port.writtenBytes)
+        client.close()
+    }
+
+    @Test
+    fun bulkWriteReportsMissingAck() {
+        // The device never answers, so the first ack times out and the rest are skipped.
+        val port = LoopbackUsbSerialPort(device = { ByteArray(0) })
+        val client = Client.overPipes(port)
+        client.output.writeByte(BULK_WRITE)
+        client.output.writeInt(3)
+        client.output.writeInt(1)
+        client.output.writeInt(10)
+        repeat(3) {
+            client.output.writeInt(4)
+            client.output.write(byteArrayOf(1, 2, 3, 4))
+        }
+        client.output.flush()
+
+        Assert.assertArrayEquals(ByteArray(3), client.readBytes(3))
+        Assert.assertEquals(GENERIC_ERROR, client.input.readInt())
+        Assert.assertEquals(4, port.writtenBytes.size)
+        client.close()
+    }
+
+    /**
+     * Flashes a 28KB image through the loopback port as avrdude's avr109 programmer does, one
+     * WRITE and READ round trip per page, and with one BULK_WRITE.
+     */
+    @Test
+    fun flashImageBenchmark() {
+        val image = flashImage()
+        val pages = image.toList().chunked(PAGE_SIZE) { blockWrite(it.toByteArray()) }
+        val usbBoundMillis = pages.size * USB_LATENCY_MILLISECONDS
+
+        val perPagePort = LoopbackUsbSerialPort(USB_LATENCY_MILLISECONDS, avr109Device())
+        val perPage = Client.overPipes(perPagePort)
+        val perPageMillis = measureTimeMillis {
+            for (page in pages) {
+                perPage.output.writeByte(WRITE)
+                perPage.output.writeInt(page.size)
+                perPage.output.write(page)
+                perPage.output.flush()
+                Assert.assertEquals(page.size, perPage.input.readInt())
+                perPage.output.writeByte(READ)
+                perPage.output.writeInt(1)
+                perPage.output.writeInt(1000)
+                perPage.output.flush()
+                Assert.assertEquals(1, perPage.input.readInt())
+                Assert.assertEquals(ACK, perPage.input.readByte())
+            }
+        }
+        perPage.close()
+
+        val bulkPort = LoopbackUsbSerialPort(USB_LATENCY_MILLISECONDS, avr109Device())
+        val bulk = Client.overPipes(bulkPort)
+        val bulkMillis = measureTimeMillis {
+            bulk.output.writeByte(BULK_WRITE)
+            bulk.output.writeInt(pages.size)
+            bulk.output.writeInt(1)
+            bulk.output.writeInt(1000)
+            for (page in pages) {
+                bulk.output.writeInt(page.size)
+                bulk.output.write(page)
+            }
+            bulk.output.flush()
+            Assert.assertArrayEquals(ByteArray(pages.size) { ACK }, bulk.readBytes(pages.size))
+            Assert.assertEquals(pages.sumBy { it.size }, bulk.input.readInt())
+        }
+        bulk.close()
+
+        Log.d(TAG, "${image.size} bytes in ${pages.size} pages: per page $perPageMillis [ms], " +
+                "bulk $bulkMillis [ms], USB bound $usbBoundMillis [ms]")
+        Assert.assertArrayEquals(perPagePort.writtenBytes, bulkPort.writtenBytes)
+    }
+
+    @Test
+    fun sharedMemoryStreamsWrapAround() {
+        SharedMemoryTransport.create(4096).use { server ->
+            SharedMemoryTransport.connect(server.path).use { client ->
+                val data = Random(13).nextBytes(1024 * 1024)
+                val writer = thread {
+                    var offset = 0
+                    val random = Random(7)
+                    while (offset < data.size) {
+                        val size = minOf(data.size - offset, random.nextInt(1, 10000))
+                        client.outputStream.write(data, offset, size)
+                        offset += size
+                    }
+                    client.outputStream.close()
+                }
+                val received = server.inputStream.readBytes()
+                writer.join()
+                Assert.assertArrayEquals(data, received)
+                Assert.assertEquals(-1, server.inputStream.read())
+            }
+        }
+    }
+
+    @Test
+    fun sharedMemoryRejectsCapacityOutOfRange() {
+        for (capacity in listOf(0, -1, Int.MIN_VALUE, (1 shl 30) + 1)) {
+            try {
+                SharedMemoryTransport.create(capacity).close()
+                Assert.fail("capacity $capacity was accepted")
+            } catch (e: IllegalArgumentException) {
+            }
+        }
+    }
+
+    /**
+     * Streams a 28KB image back from the device in 4KB READs, as a verification after flashing
+     * does, over the pipes and over shared memory.
+     */
+    @Test
+    fun verifyReadBenchmark() {
+        val image = flashImage()
+        val repeat = 20
+        for ((name, connect) in listOf<Pair<String, (LoopbackUsbSerialPort) -> Client>>(
+                "pipes" to { port -> Client.overPipes(port) }, "shared memory" to { port -> Client.overSharedMemory(port) })) {
+            val port = LoopbackUsbSerialPort()
+            val client = connect(port)
+            val elapsed = measureTimeMillis {
+                repeat(repeat) {
+                    client.output.writeByte(WRITE)
+                    client.output.writeInt(image.size)
+                    client.output.write(image)
+                    client.output.flush()
+                    Assert.assertEquals(image.size, client.input.readInt())
+                    var offset = 0
+                    while (offset < image.size) {
+                        client.output.writeByte(READ)
+                        client.output.writeInt(4096)
+                        client.output.writeInt(1000)
+                        client.output.flush()
+                        val size = client.input.readInt()
+                        Assert.assertArrayEquals(image.copyOfRange(offset, offset + size), client.readBytes(size))
+                        offset += size
+                    }
+                }
+            }
+            client.close()
+            Log.d(TAG, "$name: ${repeat * image.size} bytes read back in $elapsed [ms]")
+        }
+    }
+}
@@ -0,0 +1,96 @@
+package io.github.sh4.zabuton
+
+import io.github.sh4.zabuton.git.ICloneProgress
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.Repository
+import java.io.ByteArrayOutputStream
+import java.io.File
+import java.security.MessageDigest
+import java.util.zip.Deflater
+import java.util.zip.DeflaterOutputStream
+
+const val TEST_REPOSITORY_URL = "https://github.com/sh4/test-git.git"
+
+fun ByteArray.toHex() = joinToString("") { "%02x".format(it) }
+
+/** Opens the repository at [path], cloning [url] there first unless a previous test did. */
+fun ensureRepositoryOpened(path: File, url: String = TEST_REPOSITORY_URL): Repository {
+    if (File(path, ".git").exists()) {
+        return Repository.open(path.absolutePath)
+    }
+    path.deleteRecursively()
+    return Repository.clone(url, path.absolutePath) { _: ICloneProgress? -> }
+}
+
+/**
+ * Writes a bare repository object by object as loose objects, for fixtures far larger than
+ * committing them one file at a time would allow. Object ids are raw 20 byte SHA-1s.
+ */
+class GitFixture(val root: File) {
+    private val deflater = Deflater(Deflater.BEST_SPEED)
+
+    init {
+        File(root, "objects").mkdirs()
+        File(root, "refs/heads").mkdirs()
+        File(root, "refs/tags").mkdirs()
+        File(root, "HEAD").writeText("ref: refs/heads/master\n")
+        File(root, "config").writeText("[core]\n\trepositoryformatversion = 0\n\tbare = true\n")
+    }
+
+    private fun write(type: String, content: ByteArray): ByteArray {
+        val header = "$type ${content.size}\u0000".toByteArray()
+        val id = MessageDigest.getInstance("SHA-1").run {
+            update(header)
+            digest(content)
+        }
+        val hex = id.toHex()
+        val file = File(root, "objects/${hex.substring(0, 2)}/${hex.substring(2)}")
+        if (!file.exists()) {
+            file.parentFile!!.mkdirs()
+            deflater.reset()
+            DeflaterOutputStream(file.outputStream(), deflater).use {
+                it.write(header)
+                it.write(content)
+            }
+        }
+        return id
+    }
+
+    fun blob(content: ByteArray) = write("blob", content)
+
+    /** Writes files, keyed by '/' separated paths, as a tree and its subtrees. */
+    fun tree(files: Map<String, ByteArray>): ByteArray {
+        val blobs = files.filterKeys { '/' !in it }.map { (name, content) -> Triple(name, "100644", blob(content)) }
+        val trees = files.entries.filter { '/' in it.key }
+                .groupBy({ it.key.substringBefore('/') }, { it.key.substringAfter('/') to it.value })
+                .map { (name, children) -> Triple(name, "40000", tree(children.toMap())) }
+        // Git orders the entries of a tree by name, a subtree as if its name ended with '/'.
+        val entries = (blobs + trees).sortedBy { (name, mode, _) -> if (mode == "40000") "$name/" else name }
+        val out = ByteArrayOutputStream()
+        for ((name, mode, id) in entries) {
+            out.write("$mode $name\u0000".toByteArray())
+            out.write(id)
+        }
+        return write("tree", out.toByteArray())
+    }
+
+    fun commit(tree: ByteArray, message: String, vararg parents: ByteArray, time: Long = 1500000000): ByteArray {
+        val text = buildString {
+            append("tree ${tree.toHex()}\n")
+            for (parent in parents) {
+                append("parent ${parent.toHex()}\n")
+            }
+            append("author Fixture <fixture@example.com> $time +0000\n")
+            append("committer Fixture <fixture@example.com> $time +0000\n")
+            append("\n$message\n")
+        }
+        return write("commit", text.toByteArray())
+    }
+
+    fun branch(name: String, commit: ByteArray) {
+        File(root, "refs/heads/$name").writeText(commit.toHex() + "\n")
+    }
+
+    /** Clones the fixture into [dir], with the fixture as origin. */
+    fun clone(dir: File): Repository = Repository.clone(root.absolutePath, dir.absolutePath, ProgressMonitor())
+}
@@ -0,0 +1,129 @@
+package io.github.sh4.zabuton
+
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.GitJob
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.ResetKind
+import io.github.sh4.zabuton.workspace.*
+import kotlinx.coroutines.async
+import kotlinx.coroutines.awaitAll
+import kotlinx.coroutines.runBlocking
+import org.junit.After
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.*
+import java.util.concurrent.CancellationException
+import java.util.concurrent.CountDownLatch
+import java.util.concurrent.TimeUnit
+
+@RunWith(AndroidJUnit4::class)
+class GitJobTest {
+    companion object {
+        private const val WORKTREE_COUNT = 10
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private lateinit var master: ByteArray
+    private var concurrency = 0
+
+    // Branches a and b each hold one keymap.c, with different contents.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        concurrency = GitJob.getMaxConcurrency()
+        fixture = GitFixture(tempFolder.newFolder("fixture.git"))
+        master = fixture.commit(fixture.tree(emptyMap()), "empty")
+        fixture.branch("master", master)
+        for (name in listOf("a", "b")) {
+            fixture.branch(name, fixture.commit(fixture.tree(mapOf("keymap.c" to "// $name\n".toByteArray())), name, master))
+        }
+    }
+
+    @After
+    fun tearDown() {
+        GitJob.setMaxConcurrency(concurrency)
+    }
+
+    // Records the order the jobs complete in, and their errors.
+    private class Completions(count: Int) {
+        val latch = CountDownLatch(count)
+        val names = Collections.synchronizedList(ArrayList<String>())
+        val errors = Collections.synchronizedList(ArrayList<Throwable>())
+
+        fun of(name: String) = GitJob.Callback { _, error ->
+            names.add(name)
+            error?.let { errors.add(it) }
+            latch.countDown()
+        }
+    }
+
+    @Test
+    fun higherPrioritiesStartFirst() {
+        val repositories = (0 until 3).map { fixture.clone(tempFolder.newFolder("worktree$it")) }
+        val completions = Completions(3)
+        GitJob.setMaxConcurrency(0)
+        val jobs = listOf(
+                GitJob.fetch(repositories[0], "origin", null, ProgressMonitor(), GitJob.PRIORITY_BACKGROUND, completions.of("fetch")),
+                GitJob.reset(repositories[1], ResetKind.HARD, ProgressMonitor(), GitJob.PRIORITY_NORMAL, completions.of("reset")),
+                GitJob.checkout(repositories[2], "origin/a", ProgressMonitor(), GitJob.PRIORITY_INTERACTIVE, completions.of("checkout")))
+        GitJob.setMaxConcurrency(1)
+        Assert.assertTrue(completions.latch.await(30, TimeUnit.SECONDS))
+        Assert.assertEquals(listOf("checkout", "reset", "fetch"), completions.names)
+        Assert.assertEquals(emptyList<Throwable>(), completions.errors)
+        Assert.assertEquals("// a\n", File(tempFolder.root, "worktree2/keymap.c").readText())
+        jobs.forEach { it.close() }
+        repositories.forEach { it.close() }
+    }
+
+    @Test
+    fun queuedJobCompletesOnCancel() {
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            val completions = Completions(1)
+            GitJob.setMaxConcurrency(0)
+            GitJob.checkout(repository, "origin/b", ProgressMonitor(), GitJob.PRIORITY_INTERACTIVE, completions.of("checkout")).use { job ->
+                job.cancel()
+                // The callback has been called by cancel() itself.
+                Assert.assertEquals(0, completions.latch.count)
+                Assert.assertTrue(completions.errors.single() is CancellationException)
+                job.cancel()
+            }
+            GitJob.setMaxConcurrency(concurrency)
+            Assert.assertFalse(File(tempFolder.root, "worktree/keymap.c").exists())
+            Assert.assertEquals(1, completions.names.size)
+        }
+    }
+
+    // The fetches of WORKTREE_COUNT worktrees share the workers while one thread awaits them all.
+    @Test
+    fun concurrentFetchesShareWorkers() {
+        val worktrees = (0 until WORKTREE_COUNT).map { i ->
+            fixture.clone(tempFolder.newFolder("worktree$i")).close()
+            val workspace = Workspace(WorkspaceId(UUID.randomUUID()), WorkspaceName("worktree$i"))
+            GitRepositoryWorktree(workspace, File(tempFolder.root, "worktree$i"))
+        }
+        fixture.branch("c", fixture.commit(fixture.tree(mapOf("keymap.c" to "// c\n".toByteArray())), "c", master))
+        runBlocking {
+            worktrees.map { async { it.fetch("origin") {} } }.awaitAll()
+        }
+        for (worktree in worktrees) {
+            Assert.assertTrue(worktree.remoteBranchNames.contains("origin/c"))
+            worktree.close()
+        }
+        val workers = Thread.getAllStackTraces().keys.count { it.name == "GitJob" }
+        Assert.assertTrue("$workers workers", workers in 1..GitJob.getMaxConcurrency())
+    }
+}
@@ -0,0 +1,95 @@
+package io.github.sh4.zabuton
+
+import android.system.Os
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.*
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.net.URL
+import java.util.*
+
+@RunWith(AndroidJUnit4::class)
+class GitMirrorCacheTest {
+    companion object {
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var upstream: URL
+    private lateinit var mirrors: GitMirrorCache
+
+    // A local bare repository stands in for the remote, so the test only hits the network once.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        val fixture = tempFolder.newFolder("upstream.git")
+        Repository.updateMirror(TEST_REPOSITORY_URL, fixture.absolutePath, null, ProgressMonitor())
+        upstream = URL("file://${fixture.absolutePath}")
+        mirrors = GitMirrorCache(tempFolder.newFolder("mirrors"))
+    }
+
+    private fun createWorktree(name: String) = runBlocking {
+        val workspace = Workspace(WorkspaceId(UUID.randomUUID()), WorkspaceName(name))
+        createGitRepositoryWorktree(workspace, tempFolder.newFolder(name), upstream, mirrors = mirrors) {}
+    }
+
+    private fun packsOf(gitDir: File) =
+            File(gitDir, "objects/pack").listFiles { file -> file.name.endsWith(".pack") }.orEmpty().toList()
+
+    @Test
+    fun worktreesLinkMirrorPacks() {
+        val first = createWorktree("first")
+        val second = createWorktree("second")
+        val mirror = mirrors.mirrorOf(upstream.toString())
+        Assert.assertTrue(mirror.isDirectory)
+        val mirrorPacks = packsOf(mirror).associateBy { it.name }
+        Assert.assertFalse(mirrorPacks.isEmpty())
+        for (worktree in listOf(first, second)) {
+            val packs = packsOf(File(worktree.root, ".git"))
+            Assert.assertEquals(mirrorPacks.keys, packs.map { it.name }.toSet())
+            for (pack in packs) {
+                Assert.assertEquals(Os.stat(mirrorPacks.getValue(pack.name).path).st_ino, Os.stat(pack.path).st_ino)
+            }
+            Assert.assertEquals(upstream.toString(), worktree.remotes.single { it.name == "origin" }.fetchUrl)
+        }
+
+        runBlocking {
+            second.fetch("origin") {}
+            second.checkout("origin/master") {}
+        }
+        Assert.assertArrayEquals(first.remoteBranchNames.sortedArray(), second.remoteBranchNames.sortedArray())
+        first.close()
+        second.close()
+    }
+
+    @Test
+    fun repackLeavesSinglePack() {
+        val first = createWorktree("first")
+        runBlocking { mirrors.repackAll() }
+        val mirror = mirrors.mirrorOf(upstream.toString())
+        Assert.assertEquals(1, packsOf(mirror).size)
+        Assert.assertTrue(File(mirror, "objects").list().orEmpty().none { it.length == 2 })
+
+        // The repacked mirror still clones, and the earlier worktree keeps its own links.
+        val second = createWorktree("second")
+        Assert.assertEquals(first.headName, second.headName)
+        Assert.assertEquals(packsOf(mirror).map { it.name }, packsOf(File(second.root, ".git")).map { it.name })
+        runBlocking { first.fetch("origin") {} }
+        first.close()
+        second.close()
+    }
+}
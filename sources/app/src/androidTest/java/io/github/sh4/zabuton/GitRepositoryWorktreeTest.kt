@@ -3,9 +3,11 @@ package io.github.sh4.zabuton
 import android.util.Log
 import androidx.test.ext.junit.runners.AndroidJUnit4
 import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
 import io.github.sh4.zabuton.workspace.*
 import kotlinx.coroutines.delay
 import kotlinx.coroutines.runBlocking
+import kotlinx.coroutines.withTimeout
 import org.junit.Assert
 import org.junit.Rule
 import org.junit.Test
@@ -64,4 +66,29 @@ class GitRepositoryWorktreeTest {
             worktree.checkout("origin/master") {}
         }
     }
+
+    @Test
+    fun logReturnsWhenBlockStopsReading() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        val fixture = GitFixture(tempFolder.newFolder("fixture.git"))
+        var tip: ByteArray? = null
+        for (i in 0 until 10) {
+            val tree = fixture.tree(mapOf("keymap.c" to "// $i\n".toByteArray()))
+            tip = fixture.commit(tree, "c$i", *listOfNotNull(tip).toTypedArray(), time = 1500000000L + i)
+        }
+        fixture.branch("master", tip!!)
+        fixture.clone(tempFolder.newFolder("worktree")).close()
+        val workspace = Workspace(WorkspaceId(UUID.randomUUID()), WorkspaceName("worktree"))
+        GitRepositoryWorktree(workspace, File(tempFolder.root, "worktree")).use { worktree ->
+            val first = runBlocking {
+                withTimeout(10_000) {
+                    var page: CommitLogBatch? = null
+                    worktree.log(pageSize = 2) { pages -> page = pages.receive() }
+                    page
+                }
+            }
+            Assert.assertEquals(2, first!!.count)
+            Assert.assertEquals("c9", first.getMessage(0).trim())
+        }
+    }
 }
\ No newline at end of file
@@ -57,14 +57,6 @@ class LibGit2Test {
         //assertNotEquals(0, p[0].getReceivedBytes());
     }
 
-    private fun ensureRepositoryOpened(reposPath: File): Repository {
-        if (reposPath.exists()) {
-            return Repository.open(reposPath.absolutePath)
-        } else {
-            return Repository.clone(CLONE_URL, reposPath.absolutePath) { cur: ICloneProgress? -> }
-        }
-    }
-
     @Test
     @Throws(IOException::class)
     fun checkoutBranch() {
@@ -123,6 +115,40 @@ class LibGit2Test {
         }
     }
 
+    @Test
+    fun cloneSingleBranchSparse() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        // Local fixture with both branches as local heads, cloned through the file:// transport.
+        val fixturePath = context.getDir("test-repos-fixture", Context.MODE_PRIVATE)
+        if (!File(fixturePath, ".git").exists()) {
+            fixturePath.deleteRecursively()
+            val fixture = Repository.clone(CLONE_URL, fixturePath.absolutePath) { cur: ICloneProgress? -> }
+            fixture.checkout("origin/sh4-patch-1") { p: ICheckoutProgress? -> }
+            fixture.checkout("master") { p: ICheckoutProgress? -> }
+        }
+        val reposPath = context.getDir("test-repos-sparse", Context.MODE_PRIVATE)
+        reposPath.deleteRecursively()
+        val options = CloneOptions()
+                .setSingleBranch("sh4-patch-1")
+                .setSparsePaths(listOf("Test/Another.txt"))
+        val repos = Repository.clone("file://${fixturePath.absolutePath}", reposPath.absolutePath, options, null, null)
+        Assert.assertEquals("sh4-patch-1", repos.headName)
+        Assert.assertArrayEquals(arrayOf("origin/sh4-patch-1"), repos.remoteBranchNames)
+        Assert.assertEquals(0, repos.tagNames.size)
+
+        val anotherBranchFile = File(reposPath, "Test/Another.txt")
+        val excludedFile = File(reposPath, "Test/Files.txt")
+        Assert.assertTrue(anotherBranchFile.exists())
+        Assert.assertFalse(excludedFile.exists())
+
+        // The sparse paths are kept in the repository and apply to later resets and fetches.
+        repos.reset(ResetKind.HARD) { p: ICheckoutProgress? -> }
+        Assert.assertFalse(excludedFile.exists())
+        repos.fetch("origin") { p: IFetchProgress? -> }
+        Assert.assertArrayEquals(arrayOf("origin/sh4-patch-1"), repos.remoteBranchNames)
+    }
+
     @Test
     fun tags() {
         val context = InstrumentationRegistry.getInstrumentation().targetContext
@@ -146,4 +172,126 @@ class LibGit2Test {
             return@log true
         }
     }
-}
\ No newline at end of file
+
+    @Test
+    fun logBatch() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos", Context.MODE_PRIVATE)
+        val repos = ensureRepositoryOpened(reposPath)
+        val messages = ArrayList<String>()
+        repos.log { commit ->
+            messages.add(commit.message)
+            return@log true
+        }
+        val pages = ArrayList<CommitLogBatch>()
+        repos.logWalker(null).use { walker ->
+            while (true) {
+                val batch = walker.next(2, CommitLogBatch.FIELD_ALL)
+                pages.add(batch)
+                if (batch.count < 2) break
+            }
+        }
+        Assert.assertEquals(messages.size, pages.sumBy { it.count })
+        val batchMessages = pages.flatMap { page -> (0 until page.count).map { page.getMessage(it) } }
+        Assert.assertEquals(messages, batchMessages)
+
+        val idsOnly = repos.logBatch(null, 1, CommitLogBatch.FIELD_ID)
+        Assert.assertEquals(1, idsOnly.count)
+        Assert.assertEquals(40, idsOnly.getId(0).length)
+        Assert.assertNull(idsOnly.text)
+        Assert.assertEquals(pages[0].getId(0), idsOnly.getId(0))
+    }
+
+    @Test
+    fun logRejectsNegativeCounts() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos", Context.MODE_PRIVATE)
+        val repos = ensureRepositoryOpened(reposPath)
+        repos.logWalker(null).use { walker ->
+            try {
+                walker.next(-1, CommitLogBatch.FIELD_ALL)
+                Assert.fail("negative maxCount was accepted")
+            } catch (e: IllegalArgumentException) {
+            }
+            // The walker is still usable.
+            Assert.assertEquals(1, walker.next(1, CommitLogBatch.FIELD_ID).count)
+        }
+        try {
+            repos.logForPath("README.md", -1)
+            Assert.fail("negative limit was accepted")
+        } catch (e: IllegalArgumentException) {
+        }
+        Assert.assertEquals(0, repos.logForPath("README.md", 0).count)
+    }
+
+    @Test
+    fun status() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-status", Context.MODE_PRIVATE)
+        reposPath.deleteRecursively()
+        val repos = Repository.clone(CLONE_URL, reposPath.absolutePath) { cur: ICloneProgress? -> }
+        Assert.assertTrue(repos.status().isEmpty)
+
+        val tracked = File(reposPath, "Test/Files.txt")
+        val original = tracked.readBytes()
+        tracked.appendText("changed\n")
+        val untracked = File(reposPath, "Test/New.txt")
+        untracked.writeText("new\n")
+        // Later scans are incremental and must still see every change.
+        repeat(2) {
+            val status = repos.status()
+            Assert.assertEquals(2, status.count)
+            Assert.assertEquals(StatusList.WT_MODIFIED, status.getStatus(status.indexOf("Test/Files.txt")))
+            Assert.assertEquals(StatusList.WT_NEW, status.getStatus(status.indexOf("Test/New.txt")))
+        }
+
+        tracked.writeBytes(original)
+        untracked.delete()
+        Assert.assertTrue(repos.status().isEmpty)
+
+        tracked.delete()
+        val deleted = repos.status()
+        Assert.assertEquals(1, deleted.count)
+        Assert.assertEquals("Test/Files.txt", deleted.getPath(0))
+        Assert.assertEquals(StatusList.WT_DELETED, deleted.getStatus(0))
+
+        val scoped = repos.status(StatusList.INCLUDE_UNTRACKED, arrayOf("Test/Another.txt"))
+        Assert.assertTrue(scoped.isEmpty)
+        repos.close()
+    }
+
+    // Ignore rules edited in place change no directory mtime, and info/exclude is outside the
+    // working tree; the incremental scan must notice both.
+    @Test
+    fun statusFollowsIgnoreRules() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val fixturePath = context.getDir("test-repos-ignore-fixture", Context.MODE_PRIVATE)
+        val reposPath = context.getDir("test-repos-ignore", Context.MODE_PRIVATE)
+        fixturePath.deleteRecursively()
+        reposPath.deleteRecursively()
+        val fixture = GitFixture(fixturePath)
+        fixture.branch("master", fixture.commit(fixture.tree(mapOf(
+                ".gitignore" to "*.o\n".toByteArray(),
+                "keymap.c" to "// keymap\n".toByteArray())), "ignore"))
+        fixture.clone(reposPath).use { repos ->
+            File(reposPath, "keymap.o").writeText("object\n")
+            Assert.assertTrue(repos.status().isEmpty)
+
+            File(reposPath, ".gitignore").writeText("*.a\n")
+            val edited = repos.status()
+            Assert.assertEquals(2, edited.count)
+            Assert.assertEquals(StatusList.WT_MODIFIED, edited.getStatus(edited.indexOf(".gitignore")))
+            Assert.assertEquals(StatusList.WT_NEW, edited.getStatus(edited.indexOf("keymap.o")))
+
+            File(reposPath, ".git/info").mkdirs()
+            File(reposPath, ".git/info/exclude").writeText("keymap.o\n")
+            val excluded = repos.status()
+            Assert.assertEquals(1, excluded.count)
+            Assert.assertEquals(".gitignore", excluded.getPath(0))
+        }
+    }
+}
@@ -0,0 +1,87 @@
+package io.github.sh4.zabuton
+
+import android.content.Context
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+
+private val TAG = LogBenchmarkTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class LogBenchmarkTest {
+    companion object {
+        private const val WARMUP_ITERATIONS = 3
+        private const val MEASURE_ITERATIONS = 20
+        private const val BATCH_SIZE = 256
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Test
+    fun logPerCommitCost() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-bench", Context.MODE_PRIVATE)
+        val repos = ensureRepositoryOpened(reposPath)
+
+        repeat(WARMUP_ITERATIONS) { countCommits(repos) }
+
+        var commits = 0L
+        val start = System.nanoTime()
+        repeat(MEASURE_ITERATIONS) { commits += countCommits(repos) }
+        val elapsed = System.nanoTime() - start
+
+        Assert.assertTrue(commits > 0)
+        Log.i(TAG, "log: ${commits / MEASURE_ITERATIONS} commits/iteration, " +
+                "${elapsed / commits} ns/commit (${MEASURE_ITERATIONS} iterations)")
+    }
+
+    @Test
+    fun logBatchPerCommitCost() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-bench", Context.MODE_PRIVATE)
+        val repos = ensureRepositoryOpened(reposPath)
+
+        repeat(WARMUP_ITERATIONS) { countBatchCommits(repos) }
+
+        var commits = 0L
+        val start = System.nanoTime()
+        repeat(MEASURE_ITERATIONS) { commits += countBatchCommits(repos) }
+        val elapsed = System.nanoTime() - start
+
+        Assert.assertTrue(commits > 0)
+        Log.i(TAG, "logBatch: ${commits / MEASURE_ITERATIONS} commits/iteration, " +
+                "${elapsed / commits} ns/commit (${MEASURE_ITERATIONS} iterations)")
+    }
+
+    private fun countBatchCommits(repos: Repository): Long {
+        var count = 0L
+        repos.logWalker(null).use { walker ->
+            while (true) {
+                val batch = walker.next(BATCH_SIZE, CommitLogBatch.FIELD_ALL)
+                count += batch.count
+                if (batch.count < BATCH_SIZE) break
+            }
+        }
+        return count
+    }
+
+    private fun countCommits(repos: Repository): Long {
+        var count = 0L
+        repos.log { commit ->
+            Assert.assertNotNull(commit)
+            count++
+            return@log true
+        }
+        return count
+    }
+}
@@ -0,0 +1,68 @@
+package io.github.sh4.zabuton
+
+import com.hoho.android.usbserial.driver.UsbSerialPort
+import java.io.ByteArrayOutputStream
+import java.lang.reflect.InvocationHandler
+import java.lang.reflect.Method
+import java.lang.reflect.Proxy
+import java.util.concurrent.TimeUnit
+import java.util.concurrent.locks.ReentrantLock
+import kotlin.concurrent.withLock
+
+/**
+ * A [UsbSerialPort] without hardware, for exercising the programmer bridge. Each write is handed
+ * to [device] after [latencyMillis] (standing in for the USB transfer), and what it answers is
+ * what the following reads return; the default device echoes. Only the transfer and control line
+ * methods are implemented, the port is a proxy so the rest of the driver interface can be left out.
+ */
+class LoopbackUsbSerialPort(
+        private val latencyMillis: Long = 0,
+        private val device: (ByteArray) -> ByteArray = { it }
+) : InvocationHandler {
+    private val lock = ReentrantLock()
+    private val readable = lock.newCondition()
+    private var pending = ByteArray(0)
+    private val received = ByteArrayOutputStream()
+
+    val port = Proxy.newProxyInstance(UsbSerialPort::class.java.classLoader,
+            arrayOf(UsbSerialPort::class.java), this) as UsbSerialPort
+
+    /** Everything written to the port so far. */
+    val writtenBytes: ByteArray get() = lock.withLock { received.toByteArray() }
+
+    private fun write(data: ByteArray): Int {
+        if (latencyMillis > 0) {
+            Thread.sleep(latencyMillis)
+        }
+        val answer = device(data)
+        lock.withLock {
+            received.write(data)
+            pending += answer
+            readable.signalAll()
+        }
+        return data.size
+    }
+
+    private fun read(buffer: ByteArray, timeoutMilliseconds: Int): Int = lock.withLock {
+        var remaining = TimeUnit.MILLISECONDS.toNanos(timeoutMilliseconds.toLong())
+        while (pending.isEmpty() && remaining > 0) {
+            remaining = readable.awaitNanos(remaining)
+        }
+        val size = minOf(buffer.size, pending.size)
+        pending.copyInto(buffer, 0, 0, size)
+        pending = pending.copyOfRange(size, pending.size)
+        size
+    }
+
+    override fun invoke(proxy: Any, method: Method, args: Array<out Any?>?): Any? = when (method.name) {
+        "write" -> write(args!![0] as ByteArray).takeIf { method.returnType == Int::class.javaPrimitiveType }
+        "read" -> read(args!![0] as ByteArray, args[1] as Int)
+        "open", "close", "setParameters", "setDTR", "setRTS", "purgeHwBuffers",
+        "getCD", "getCTS", "getDSR", "getDTR", "getRI", "getRTS" ->
+            if (method.returnType == Boolean::class.javaPrimitiveType) false else null
+        "hashCode" -> System.identityHashCode(proxy)
+        "equals" -> proxy === args!![0]
+        "toString" -> "LoopbackUsbSerialPort"
+        else -> throw UnsupportedOperationException(method.name)
+    }
+}
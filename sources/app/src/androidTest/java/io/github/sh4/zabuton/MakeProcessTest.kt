@@ -0,0 +1,89 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry.getInstrumentation
+import io.github.sh4.zabuton.app.CompilerCache
+import io.github.sh4.zabuton.app.toolchainInstall
+import io.github.sh4.zabuton.build.MakeEventKind
+import io.github.sh4.zabuton.build.MakeProcess
+import io.github.sh4.zabuton.build.runMake
+import kotlinx.coroutines.runBlocking
+import kotlinx.coroutines.withTimeoutOrNull
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.ByteArrayOutputStream
+import java.io.File
+
+private val TAG = MakeProcessTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class MakeProcessTest {
+    companion object {
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    private val context = getInstrumentation().targetContext
+    private val root = File(context.filesDir, "root")
+    private lateinit var workDir: File
+
+    @Before
+    fun setUp() {
+        runBlocking { toolchainInstall(root, context) {} }
+        workDir = File(context.cacheDir, "make-test").apply {
+            deleteRecursively()
+            mkdirs()
+        }
+    }
+
+    private fun environment() = System.getenv() +
+            CompilerCache(root, File(context.cacheDir, "ccache-test")).environment(File(root, "bin").absolutePath, workDir)
+
+    private fun make(vararg targets: String) = listOf("SHELL=${File(root, "bin/bash").absolutePath}") + targets
+
+    @Test
+    fun reportsOutputAndTargetTimings() {
+        File(workDir, "Makefile").writeText("all: slow fast\nslow:\n\t@sleep 1; echo slow\nfast:\n\t@echo fast\n\t@echo fast to stderr >&2\n")
+        val output = ByteArrayOutputStream()
+        val events = ArrayList<MakeEventKind>()
+        val result = runBlocking {
+            runMake(File(root, "bin/make"), workDir, make("all"), environment(), jobs = 2, output = output) {
+                events.add(it.kind)
+            }
+        }
+        Assert.assertEquals(0, result.exitCode)
+        Assert.assertEquals(listOf("fast", "fast to stderr", "slow"), output.toString().lines().filter { it.isNotEmpty() })
+        Assert.assertEquals(listOf("slow", "fast"), result.slowest(2).map { it.target })
+        Assert.assertTrue(result.timings.first { it.target == "slow" }.elapsedNanos >= 1_000_000_000L)
+        Assert.assertEquals(2, events.count { it == MakeEventKind.Started })
+        Log.d(TAG, "default job count: ${MakeProcess.getDefaultJobCount()}, timings: ${result.timings}")
+    }
+
+    @Test
+    fun reportsFailedTargets() {
+        File(workDir, "Makefile").writeText("all: broken fine\nbroken:\n\t@false\nfine:\n\t@true\n")
+        val result = runBlocking {
+            runMake(File(root, "bin/make"), workDir, make("-k", "all"), environment())
+        }
+        Assert.assertNotEquals(0, result.exitCode)
+        Assert.assertTrue(result.timings.first { it.target == "broken" }.failed)
+        Assert.assertFalse(result.timings.first { it.target == "fine" }.failed)
+    }
+
+    @Test
+    fun cancellingTerminatesMake() {
+        File(workDir, "Makefile").writeText("all:\n\t@sleep 60\n")
+        val started = System.nanoTime()
+        val result = runBlocking {
+            withTimeoutOrNull(1000) {
+                runMake(File(root, "bin/make"), workDir, make("all"), environment())
+            }
+        }
+        Assert.assertNull(result)
+        Assert.assertTrue(System.nanoTime() - started < 30_000_000_000L)
+    }
+}
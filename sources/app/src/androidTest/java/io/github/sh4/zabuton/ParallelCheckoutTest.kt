@@ -0,0 +1,144 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.LibGit2
+import io.github.sh4.zabuton.git.LibGit2Exception
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.After
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.function.Consumer
+import kotlin.system.measureTimeMillis
+
+private val TAG = ParallelCheckoutTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class ParallelCheckoutTest {
+    companion object {
+        // About the size of a QMK firmware checkout.
+        private const val FILE_COUNT = 30_000
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private lateinit var large: Map<String, ByteArray>
+    private lateinit var edited: Map<String, ByteArray>
+
+    // master is empty, large holds FILE_COUNT files in nested directories, and edited changes
+    // every 50th file of large and deletes every 97th.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        val repository = GitFixture(tempFolder.newFolder("fixture.git"))
+        large = (0 until FILE_COUNT).associate { i ->
+            "keyboards/kb${i / 300}/keymaps/km${i / 30 % 10}/file$i.c" to "// file $i\n${"x".repeat(i % 2048)}\n".toByteArray()
+        }
+        edited = large.entries.withIndex()
+                .filter { (i, _) -> i % 97 != 0 }
+                .associate { (i, e) -> e.key to if (i % 50 == 0) e.value + "edited\n".toByteArray() else e.value }
+        val master = repository.commit(repository.tree(emptyMap()), "empty")
+        repository.branch("master", master)
+        val largeCommit = repository.commit(repository.tree(large), "large", master)
+        repository.branch("large", largeCommit)
+        repository.branch("edited", repository.commit(repository.tree(edited), "edited", largeCommit))
+        fixture = repository
+    }
+
+    @After
+    fun tearDown() {
+        LibGit2.setCheckoutThreads(0)
+    }
+
+    private fun assertWorkingTree(root: File, files: Map<String, ByteArray>) {
+        val written = File(root, "keyboards").walk().filter { it.isFile }.count()
+        Assert.assertEquals(files.size, written)
+        for ((path, content) in files.entries.filterIndexed { i, _ -> i % 101 == 0 }) {
+            Assert.assertArrayEquals(path, content, File(root, path).readBytes())
+        }
+    }
+
+    @Test
+    fun checkoutWritesTreeAndIndex() {
+        val root = tempFolder.root.resolve("worktree")
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            repository.checkout("origin/large", ProgressMonitor())
+            assertWorkingTree(root, large)
+            // The index carries the stat data of the written files, so the tree is clean.
+            Assert.assertTrue(repository.status().isEmpty)
+
+            repository.checkout("origin/edited", ProgressMonitor())
+            assertWorkingTree(root, edited)
+            Assert.assertTrue(repository.status().isEmpty)
+        }
+    }
+
+    @Test
+    fun localChangesAreLeftToLibGit2() {
+        val root = tempFolder.root.resolve("worktree")
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            repository.checkout("origin/large", ProgressMonitor())
+            // Wait out the index timestamp, so the change is seen by its stat data.
+            Thread.sleep(1100)
+            val changed = File(root, large.keys.first())
+            changed.writeText("local change\n")
+            try {
+                repository.checkout("origin/edited", ProgressMonitor())
+                Assert.fail("checkout overwrote a local change")
+            } catch (e: LibGit2Exception) {
+                Log.d(TAG, "checkout refused: ${e.message}")
+            }
+            Assert.assertEquals("local change\n", changed.readText())
+        }
+    }
+
+    // A cancel once files are being written is too late: the checkout finishes, so the working
+    // tree never disagrees with the index.
+    @Test
+    fun cancelWhileWritingLeavesTreeClean() {
+        val root = tempFolder.root.resolve("worktree")
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            val monitor = ProgressMonitor(0)
+            repository.checkout("origin/large", Consumer { p ->
+                if (p.completedSteps in 1 until p.totalSteps) {
+                    monitor.cancel()
+                }
+            }, monitor)
+            Assert.assertTrue(monitor.isCancelled)
+            assertWorkingTree(root, large)
+            Assert.assertTrue(repository.status().isEmpty)
+            Assert.assertEquals("large", repository.headName)
+        }
+    }
+
+    /**
+     * Checks out the FILE_COUNT files of large into a fresh clone with 1 thread (libgit2) and
+     * with growing numbers of checkout threads.
+     */
+    @Test
+    fun checkoutBenchmark() {
+        val cores = LibGit2.getCheckoutThreads()
+        for (threads in listOf(1, 2, 4, cores).distinct().filter { it <= cores || it == 1 }) {
+            LibGit2.setCheckoutThreads(threads)
+            fixture.clone(tempFolder.newFolder("threads-$threads")).use { repository ->
+                val elapsed = measureTimeMillis { repository.checkout("origin/large", ProgressMonitor()) }
+                Log.i(TAG, "$FILE_COUNT files checked out with $threads threads in $elapsed [ms]")
+            }
+            tempFolder.root.resolve("threads-$threads").deleteRecursively()
+        }
+    }
+}
@@ -0,0 +1,100 @@
+package io.github.sh4.zabuton
+
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+
+@RunWith(AndroidJUnit4::class)
+class PathHistoryTest {
+    companion object {
+        private const val EPOCH = 1500000000L
+        private const val DEFAULT_KEYMAP = "keyboards/a/keymaps/default/keymap.c"
+        private const val OTHER_KEYMAP = "keyboards/a/keymaps/other/keymap.c"
+        private const val B_KEYMAP = "keyboards/b/keymaps/default/keymap.c"
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private val commits = HashMap<String, String>()
+
+    private fun lines(vararg lines: String) = lines.joinToString("") { "$it\n" }.toByteArray()
+
+    // c0 adds three keymaps, c1 edits b, c2 edits the default keymap of a, c3 the other one, m
+    // merges s1 (an edit of b branched at c1) into c3, and c4 edits the default keymap again.
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        fixture = GitFixture(tempFolder.newFolder("fixture.git"))
+        val original = (0 until 10).map { "L$it" }
+        val edited = original.toMutableList().apply { set(3, "X"); add("Y") }
+        var time = EPOCH
+        fun commit(name: String, files: Map<String, ByteArray>, vararg parents: ByteArray): ByteArray {
+            time += 60
+            val id = fixture.commit(fixture.tree(files), name, *parents, time = time)
+            commits[name] = id.toHex()
+            return id
+        }
+        val files = HashMap<String, ByteArray>()
+        files[DEFAULT_KEYMAP] = lines(*original.toTypedArray())
+        files[OTHER_KEYMAP] = lines("other")
+        files[B_KEYMAP] = lines("b")
+        val c0 = commit("c0", files)
+        files[B_KEYMAP] = lines("b", "c1")
+        val c1 = commit("c1", files, c0)
+        val side = HashMap(files)
+        files[DEFAULT_KEYMAP] = lines(*edited.toTypedArray())
+        val c2 = commit("c2", files, c1)
+        files[OTHER_KEYMAP] = lines("other", "c3")
+        val c3 = commit("c3", files, c2)
+        side[B_KEYMAP] = lines("b", "c1", "s1")
+        val s1 = commit("s1", side, c1)
+        files[B_KEYMAP] = side[B_KEYMAP]!!
+        val m = commit("m", files, c3, s1)
+        files[DEFAULT_KEYMAP] = lines("Z", *edited.toTypedArray())
+        fixture.branch("master", commit("c4", files, m))
+    }
+
+    private fun messages(batch: CommitLogBatch) = (0 until batch.count).map { batch.getMessage(it).trim() }
+
+    @Test
+    fun logForPathListsChangingCommits() {
+        Repository.open(fixture.root.absolutePath).use { repository ->
+            Assert.assertEquals(listOf("c4", "c2", "c0"), messages(repository.logForPath("keyboards/a/keymaps/default", 100)))
+            Assert.assertEquals(listOf("c4", "c2"), messages(repository.logForPath(DEFAULT_KEYMAP, 2)))
+            Assert.assertEquals(listOf("c3", "c0"), messages(repository.logForPath("keyboards/a/keymaps/other/", 100)))
+            // m took b from s1 as it was, so the walk goes down s1 only.
+            Assert.assertEquals(listOf("s1", "c1", "c0"), messages(repository.logForPath("keyboards/b", 100)))
+            Assert.assertEquals(listOf("c3", "c2", "c0"), messages(repository.logForPath(commits["c3"], "keyboards/a", 100, CommitLogBatch.FIELD_ALL)))
+            Assert.assertEquals(0, repository.logForPath("keyboards/c", 100).count)
+        }
+    }
+
+    @Test
+    fun blameAttributesLines() {
+        Repository.open(fixture.root.absolutePath).use { repository ->
+            val blame = repository.blame(DEFAULT_KEYMAP)
+            val runs = (0 until blame.count).map {
+                Triple(blame.getStartLine(it), blame.getLineCount(it), blame.commits.getMessage(blame.getCommitIndex(it)).trim())
+            }
+            Assert.assertEquals(listOf(Triple(1, 1, "c4"), Triple(2, 3, "c0"), Triple(5, 1, "c2"),
+                    Triple(6, 6, "c0"), Triple(12, 1, "c2")), runs)
+            Assert.assertEquals(commits["c4"], blame.getCommitId(0))
+            Assert.assertEquals(3, blame.commits.count)
+        }
+    }
+}
@@ -0,0 +1,120 @@
+package io.github.sh4.zabuton
+
+import android.content.Context
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.ICloneProgress
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.concurrent.CancellationException
+import kotlin.system.measureNanoTime
+
+private val TAG = ProgressMonitorTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class ProgressMonitorTest {
+    companion object {
+        private const val MAX_CANCEL_LATENCY_MILLIS = 100L
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    private fun prepareClonePath(): File {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-progress", Context.MODE_PRIVATE)
+        reposPath.deleteRecursively()
+        return reposPath
+    }
+
+    @Test
+    fun cloneWithMonitor() {
+        val reposPath = prepareClonePath()
+        val monitor = ProgressMonitor()
+        Assert.assertNotNull(Repository.clone(TEST_REPOSITORY_URL, reposPath.absolutePath, monitor))
+        Assert.assertNotEquals(0, monitor.totalObjects)
+        Assert.assertEquals(monitor.totalObjects, monitor.receivedObjects)
+        Assert.assertEquals(monitor.totalObjects, monitor.indexedObjects)
+        Assert.assertNotEquals(0, monitor.totalSteps)
+        Assert.assertEquals(monitor.totalSteps, monitor.completedSteps)
+        Assert.assertFalse(monitor.isCancelled)
+    }
+
+    @Test
+    fun consumerUpcallsAreThrottled() {
+        var everyCallback = 0
+        Repository.clone(TEST_REPOSITORY_URL, prepareClonePath().absolutePath, { _: ICloneProgress? -> everyCallback++ }, ProgressMonitor(0))
+        var throttled = 0
+        var last: ICloneProgress? = null
+        Repository.clone(TEST_REPOSITORY_URL, prepareClonePath().absolutePath, { p: ICloneProgress? -> throttled++; last = p }, ProgressMonitor())
+        Log.i(TAG, "consumer upcalls: $everyCallback unthrottled, $throttled throttled")
+        Assert.assertTrue(throttled <= everyCallback)
+        // The final state is always delivered.
+        Assert.assertEquals(last!!.totalSteps, last!!.completedSteps)
+        Assert.assertEquals(last!!.totalObjects, last!!.receivedObjects)
+    }
+
+    /**
+     * Clones a local copy with a consumer called on every libgit2 callback, so the rate is bound by
+     * the per-callback cost of the progress reporter rather than by the network.
+     */
+    @Test
+    fun cloneCallbackRate() {
+        val sourcePath = File(prepareClonePath(), "source")
+        Assert.assertNotNull(Repository.clone(TEST_REPOSITORY_URL, sourcePath.absolutePath, ProgressMonitor()))
+        val rounds = 10
+        var callbacks = 0L
+        val elapsedNanos = measureNanoTime {
+            for (i in 0 until rounds) {
+                val clonePath = File(sourcePath.parentFile, "clone-$i")
+                Repository.clone(sourcePath.absolutePath, clonePath.absolutePath, { _: ICloneProgress? -> callbacks++ }, ProgressMonitor(0))
+                clonePath.deleteRecursively()
+            }
+        }
+        val perSecond = callbacks * 1_000_000_000L / elapsedNanos
+        Log.i(TAG, "$callbacks consumer callbacks in ${elapsedNanos / 1_000_000}ms over $rounds local clones: $perSecond/s")
+        Assert.assertTrue(callbacks > 0)
+    }
+
+    @Test
+    fun cancelBeforeStart() {
+        val reposPath = prepareClonePath()
+        val monitor = ProgressMonitor()
+        monitor.cancel()
+        try {
+            Repository.clone(TEST_REPOSITORY_URL, reposPath.absolutePath, monitor)
+            Assert.fail("clone was not cancelled")
+        } catch (e: CancellationException) {
+            Assert.assertEquals(0, monitor.receivedBytes)
+        }
+    }
+
+    @Test
+    fun cancelDuringTransfer() {
+        val reposPath = prepareClonePath()
+        val monitor = ProgressMonitor(0)
+        var cancelledAt = 0L
+        try {
+            Repository.clone(TEST_REPOSITORY_URL, reposPath.absolutePath, { p: ICloneProgress? ->
+                if (cancelledAt == 0L && p!!.receivedBytes > 0) {
+                    cancelledAt = System.nanoTime()
+                    monitor.cancel()
+                }
+            }, monitor)
+            Assert.fail("clone was not cancelled")
+        } catch (e: CancellationException) {
+            val latencyMillis = (System.nanoTime() - cancelledAt) / 1_000_000
+            Log.i(TAG, "clone stopped ${latencyMillis}ms after cancel (received ${monitor.receivedObjects}/${monitor.totalObjects})")
+            Assert.assertNotEquals(0L, cancelledAt)
+            Assert.assertTrue(latencyMillis < MAX_CANCEL_LATENCY_MILLIS)
+        }
+    }
+}
@@ -0,0 +1,97 @@
+package io.github.sh4.zabuton
+
+import android.content.Context
+import android.os.Debug
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.ICloneProgress
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.File
+
+private val TAG = ReferenceListingStressTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class ReferenceListingStressTest {
+    companion object {
+        private const val SYNTHETIC_REF_COUNT = 50_000
+        private const val ITERATIONS = 10
+        private const val MAX_NATIVE_HEAP_GROWTH = 8L * 1024 * 1024
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Test
+    fun listManyReferences() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-refs", Context.MODE_PRIVATE)
+        reposPath.deleteRecursively()
+        val head = Repository.clone(TEST_REPOSITORY_URL, reposPath.absolutePath) { _: ICloneProgress? -> }
+                .logBatch(null, 1, CommitLogBatch.FIELD_ID)
+                .getId(0)
+        writeSyntheticPackedRefs(File(reposPath, ".git/packed-refs"), head)
+
+        val repos = Repository.open(reposPath.absolutePath)
+        // The first pass loads packed-refs into the libgit2 caches.
+        listAll(repos)
+        val baseline = measureNativeHeap()
+        repeat(ITERATIONS) {
+            val (tags, branches) = listAll(repos)
+            Assert.assertTrue(tags >= SYNTHETIC_REF_COUNT)
+            Assert.assertTrue(branches >= SYNTHETIC_REF_COUNT)
+        }
+        val growth = measureNativeHeap() - baseline
+        Log.i(TAG, "native heap growth after $ITERATIONS listings: $growth bytes")
+        Assert.assertTrue("native heap grew by $growth bytes", growth < MAX_NATIVE_HEAP_GROWTH)
+
+        var walked = 0
+        repos.log { _ ->
+            walked++
+            return@log true
+        }
+        Assert.assertTrue(walked > 0)
+    }
+
+    private fun listAll(repos: Repository): Pair<Int, Int> {
+        val tags = repos.tagNames.size
+        val branches = repos.localBranchNames.size
+        repos.remoteBranchNames
+        repos.remotes
+        return Pair(tags, branches)
+    }
+
+    private fun measureNativeHeap(): Long {
+        Runtime.getRuntime().gc()
+        System.runFinalization()
+        return Debug.getNativeHeapAllocatedSize()
+    }
+
+    private fun writeSyntheticPackedRefs(packedRefs: File, oid: String) {
+        // Keep the existing entries (and their peeled "^" lines) and drop the header,
+        // since the merged file is no longer guaranteed to be sorted.
+        val existing = if (packedRefs.exists()) {
+            packedRefs.readLines().filter { it.isNotEmpty() && !it.startsWith("#") }
+        } else {
+            emptyList()
+        }
+        packedRefs.bufferedWriter().use { writer ->
+            writer.write("# pack-refs with: peeled fully-peeled \n")
+            for (line in existing) {
+                writer.write(line)
+                writer.write("\n")
+            }
+            for (i in 0 until SYNTHETIC_REF_COUNT) {
+                writer.write("$oid refs/tags/stress-tag-$i\n")
+                writer.write("$oid refs/heads/stress-branch-$i\n")
+            }
+        }
+    }
+}
@@ -0,0 +1,137 @@
+package io.github.sh4.zabuton
+
+import android.content.Context
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.ICloneProgress
+import io.github.sh4.zabuton.git.IFetchProgress
+import io.github.sh4.zabuton.git.Repository
+import io.github.sh4.zabuton.workspace.initializeLibGit2
+import org.junit.Assert
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.concurrent.ConcurrentLinkedQueue
+import java.util.concurrent.CountDownLatch
+import java.util.concurrent.atomic.AtomicBoolean
+import java.util.concurrent.atomic.AtomicInteger
+import kotlin.concurrent.thread
+
+@RunWith(AndroidJUnit4::class)
+class RepositorySessionTest {
+    companion object {
+        private const val READER_THREADS = 4
+        private const val FETCH_ITERATIONS = 3
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    private fun cloneRepository(): File {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+        initializeLibGit2(context)
+        val reposPath = context.getDir("test-repos-session", Context.MODE_PRIVATE)
+        reposPath.deleteRecursively()
+        Repository.clone(TEST_REPOSITORY_URL, reposPath.absolutePath) { _: ICloneProgress? -> }.close()
+        return reposPath
+    }
+
+    @Test
+    fun concurrentQueriesDuringFetch() {
+        val reposPath = cloneRepository()
+        Repository.open(reposPath.absolutePath).use { repos ->
+            val expectedBranches = repos.localBranchNames.toList()
+            val expectedHead = repos.logBatch(null, 1, CommitLogBatch.FIELD_ID).getId(0)
+
+            val fetching = AtomicBoolean(true)
+            val started = CountDownLatch(READER_THREADS)
+            val queries = AtomicInteger()
+            val errors = ConcurrentLinkedQueue<Throwable>()
+            val readers = (0 until READER_THREADS).map {
+                thread {
+                    started.countDown()
+                    try {
+                        while (fetching.get()) {
+                            Assert.assertEquals(expectedBranches, repos.localBranchNames.toList())
+                            val batch = repos.logBatch(null, 16, CommitLogBatch.FIELD_ALL)
+                            Assert.assertEquals(expectedHead, batch.getId(0))
+                            queries.incrementAndGet()
+                        }
+                    } catch (e: Throwable) {
+                        errors.add(e)
+                    }
+                }
+            }
+            started.await()
+            try {
+                repeat(FETCH_ITERATIONS) {
+                    repos.fetch("origin") { _: IFetchProgress? -> }
+                }
+            } finally {
+                fetching.set(false)
+                readers.forEach { it.join() }
+            }
+            errors.firstOrNull()?.let { throw it }
+            Assert.assertTrue(queries.get() > 0)
+        }
+    }
+
+    @Test
+    fun closeReleasesSession() {
+        val reposPath = cloneRepository()
+        val first = Repository.open(reposPath.absolutePath)
+        val second = Repository.open(reposPath.absolutePath)
+        first.close()
+        // Another Repository opened on the same path keeps the shared session alive.
+        Assert.assertEquals("master", second.headName)
+        second.close()
+        try {
+            second.headName
+            Assert.fail("closed repository is still usable")
+        } catch (e: IllegalStateException) {
+        }
+        // Closing twice is harmless.
+        second.close()
+    }
+
+    @Test
+    fun walkerOutlivesClosedRepository() {
+        val reposPath = cloneRepository()
+        val repos = Repository.open(reposPath.absolutePath)
+        val expectedHead = repos.logBatch(null, 1, CommitLogBatch.FIELD_ID).getId(0)
+        repos.logWalker(null).use { walker ->
+            repos.close()
+            // The walker's lease no longer shares its session with a repository opened afterwards.
+            Repository.open(reposPath.absolutePath).use { reopened ->
+                Assert.assertEquals(expectedHead, reopened.logBatch(null, 1, CommitLogBatch.FIELD_ID).getId(0))
+            }
+            Assert.assertEquals(expectedHead, walker.next(1, CommitLogBatch.FIELD_ID).getId(0))
+        }
+    }
+
+    @Test
+    fun closingWalkerDuringNext() {
+        val reposPath = cloneRepository()
+        Repository.open(reposPath.absolutePath).use { repos ->
+            repeat(20) {
+                val walker = repos.logWalker(null)
+                val errors = ConcurrentLinkedQueue<Throwable>()
+                val reader = thread {
+                    try {
+                        while (walker.next(1, CommitLogBatch.FIELD_ALL).count == 1) {
+                        }
+                    } catch (e: IllegalStateException) {
+                        // Closed between two pages.
+                    } catch (e: Throwable) {
+                        errors.add(e)
+                    }
+                }
+                walker.close()
+                reader.join()
+                errors.firstOrNull()?.let { throw it }
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+package io.github.sh4.zabuton
+
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.git.CommitLogBatch
+import io.github.sh4.zabuton.git.ProgressMonitor
+import io.github.sh4.zabuton.workspace.*
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Before
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.*
+
+@RunWith(AndroidJUnit4::class)
+class StagedFetchTest {
+    companion object {
+        private val BRANCHES = listOf("master", "a", "b", "c", "d", "e")
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private lateinit var fixture: GitFixture
+    private val tips = HashMap<String, ByteArray>()
+
+    // Advances every branch by a commit that changes its own file.
+    private fun commitAll(round: Int) {
+        for (name in BRANCHES) {
+            val files = mapOf("$name.c" to "// $name $round\n".toByteArray())
+            val parents = tips[name]?.let { arrayOf(it) } ?: emptyArray()
+            tips[name] = fixture.commit(fixture.tree(files), "$name $round", *parents, time = 1500000000L + round)
+            fixture.branch(name, tips.getValue(name))
+        }
+    }
+
+    @Before
+    fun setUp() {
+        initializeLibGit2(InstrumentationRegistry.getInstrumentation().targetContext)
+        fixture = GitFixture(tempFolder.newFolder("fixture.git"))
+        commitAll(0)
+    }
+
+    @Test
+    fun stagesShareOneConnection() {
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            val before = tips.mapValues { it.value.toHex() }
+            commitAll(1)
+            val monitor = ProgressMonitor()
+            val stats = repository.fetchStaged("origin", null, 2, monitor)
+            Assert.assertEquals(3, stats.stageCount)
+            Assert.assertEquals(1, stats.connectionCount)
+            Assert.assertTrue(stats.receivedObjects > 0)
+            Assert.assertEquals(3, monitor.completedSteps)
+            Assert.assertEquals(3, monitor.totalSteps)
+            for (name in BRANCHES) {
+                Assert.assertArrayEquals(name, intArrayOf(1, 0), repository.aheadBehind("origin/$name", before[name]))
+            }
+
+            // Nothing is left to transfer, as after a drop nothing is for the stages fetched.
+            val again = repository.fetchStaged("origin", null, 2, ProgressMonitor())
+            Assert.assertEquals(0, again.receivedObjects)
+        }
+    }
+
+    @Test
+    fun fetchFromUrlUpdatesNamedRemote() {
+        fixture.clone(tempFolder.newFolder("worktree")).use { repository ->
+            commitAll(1)
+            val stats = repository.fetchStaged("origin", "file://${fixture.root.absolutePath}", 1, ProgressMonitor())
+            Assert.assertEquals(BRANCHES.size, stats.stageCount)
+            Assert.assertEquals(1, stats.connectionCount)
+            Assert.assertArrayEquals(BRANCHES.map { "origin/$it" }.sorted().toTypedArray(),
+                    repository.remoteBranchNames.sortedArray())
+            Assert.assertEquals(tips.getValue("master").toHex(), repository.logBatch("origin/master", 1, CommitLogBatch.FIELD_ID).getId(0))
+        }
+    }
+
+    @Test
+    fun worktreeFetchReportsStats() {
+        fixture.clone(tempFolder.newFolder("worktree")).close()
+        val workspace = Workspace(WorkspaceId(UUID.randomUUID()), WorkspaceName("worktree"))
+        GitRepositoryWorktree(workspace, File(tempFolder.root, "worktree")).use { worktree ->
+            commitAll(1)
+            val stats = runBlocking { worktree.fetch("origin") {} }
+            Assert.assertEquals((BRANCHES.size + FETCH_REFS_PER_STAGE - 1) / FETCH_REFS_PER_STAGE, stats.stageCount)
+            Assert.assertTrue(stats.receivedBytes > 0)
+        }
+    }
+}
@@ -3,6 +3,7 @@ package io.github.sh4.zabuton
 import android.util.Log
 import androidx.test.ext.junit.runners.AndroidJUnit4
 import androidx.test.platform.app.InstrumentationRegistry.getInstrumentation
+import io.github.sh4.zabuton.app.ToolchainAsset
 import io.github.sh4.zabuton.app.toolchainInstall
 import kotlinx.coroutines.delay
 import kotlinx.coroutines.runBlocking
@@ -21,7 +22,7 @@ class ToolchainInstallTest {
         val context = getInstrumentation().targetContext
         val filesDir = context.filesDir
         Assert.assertNotNull(filesDir)
-        context.assets.open("build/toolchain.zip").use {
+        ToolchainAsset.open(context).use {
             Assert.assertNotNull(it)
         }
         val root = File(context.filesDir, "root")
@@ -40,4 +41,29 @@ class ToolchainInstallTest {
         Log.d(TAG, "elapsed time = $elapsed [ms]")
         Assert.assertTrue(root.exists())
     }
+
+    @Test
+    fun testIncrementalUpgrade() {
+        val context = getInstrumentation().targetContext
+        val root = File(context.filesDir, "root")
+        runBlocking { toolchainInstall(root, context) {} }
+
+        val changed = File(root, "bin/avrdude")
+        val removed = File(root, "bin/make")
+        val untouched = File(root, "bin/bash")
+        val expectedLength = changed.length()
+        changed.writeText("stale")
+        removed.delete()
+        val untouchedModified = untouched.lastModified()
+
+        val elapsed = measureTimeMillis {
+            runBlocking { toolchainInstall(root, context) {} }
+        }
+        Log.d(TAG, "upgrade elapsed time = $elapsed [ms]")
+        Assert.assertEquals(expectedLength, changed.length())
+        Assert.assertTrue(changed.canExecute())
+        Assert.assertTrue(removed.exists())
+        Assert.assertEquals(untouchedModified, untouched.lastModified())
+        Assert.assertTrue(File(root, "bin/ls").exists())
+    }
 }
\ No newline at end of file
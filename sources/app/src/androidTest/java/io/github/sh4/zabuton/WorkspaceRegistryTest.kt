@@ -0,0 +1,144 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import io.github.sh4.zabuton.workspace.*
+import org.junit.Assert
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import org.junit.runner.RunWith
+import java.io.File
+import java.util.*
+import kotlin.system.measureNanoTime
+
+private val TAG = WorkspaceRegistryTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class WorkspaceRegistryTest {
+    companion object {
+        private const val WORKSPACES = 500
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    @Rule
+    @JvmField
+    val tempFolder = TemporaryFolder()
+
+    private val file by lazy { File(tempFolder.root, "workspaces") }
+
+    private fun workspace(i: Int) =
+            Workspace(WorkspaceId(UUID(0, i.toLong())), WorkspaceName("keyboard${i % 10}"), "rev $i", i % 7 == 0)
+
+    @Test
+    fun findAfterReopen() {
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val workspaces = RegistryWorkspaceRepository(registry)
+            for (i in 0 until 30) {
+                workspaces.save(workspace(i))
+            }
+            workspaces.save(workspace(3).copy(comment = "renamed"))
+            workspaces.delete(workspace(4).id)
+        }
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val workspaces = RegistryWorkspaceRepository(registry)
+            Assert.assertEquals(workspace(3).copy(comment = "renamed"), workspaces.find(workspace(3).id))
+            Assert.assertNull(workspaces.find(workspace(4).id))
+            for (request in listOf(WorkspaceFindRequest(name = WorkspaceName("keyboard1")),
+                                   WorkspaceFindRequest(name = WorkspaceName("keyboard0"), deleted = false),
+                                   WorkspaceFindRequest(deleted = true),
+                                   WorkspaceFindRequest(comment = "rev 2"),
+                                   WorkspaceFindRequest(id = workspace(5).id, deleted = false))) {
+                val expected = (0 until 30).filter { it != 4 }
+                        .map { if (it == 3) workspace(3).copy(comment = "renamed") else workspace(it) }
+                        .filter { request.matches(it) }
+                Assert.assertEquals(request.toString(), expected.toSet(), workspaces.find(request).toSet())
+            }
+        }
+    }
+
+    @Test
+    fun worktreeKeptAcrossSaves() {
+        val root = tempFolder.newFolder("worktree")
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val workspaces = RegistryWorkspaceRepository(registry)
+            workspaces.save(workspace(1))
+            Assert.assertFalse(registry.setWorktree(workspace(2).id.id, "directory", root.path))
+            RegistryWorktreeRepository(registry).save(DirectoryWorktree(workspace(1), root))
+            workspaces.save(workspace(1).copy(deleted = true))
+        }
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val worktrees = RegistryWorktreeRepository(registry)
+            val worktree = worktrees.find(workspace(1).id)
+            Assert.assertTrue(worktree is DirectoryWorktree)
+            Assert.assertEquals(root, worktree!!.root)
+            Assert.assertTrue(worktree.workspace.deleted)
+            worktrees.deletePermanently(workspace(1).id)
+            Assert.assertFalse(root.exists())
+            Assert.assertNull(worktrees.find(workspace(1).id))
+            Assert.assertNull(registry.get(workspace(1).id.id).worktreeKind)
+        }
+    }
+
+    @Test
+    fun deletingMissingWorktreeClearsRecord() {
+        val root = tempFolder.newFolder("worktree")
+        WorkspaceRegistry.open(file.path).use { registry ->
+            RegistryWorkspaceRepository(registry).save(workspace(1))
+            RegistryWorktreeRepository(registry).save(DirectoryWorktree(workspace(1), root))
+        }
+        root.deleteRecursively()
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val worktrees = RegistryWorktreeRepository(registry)
+            Assert.assertNull(worktrees.find(workspace(1).id))
+            worktrees.deletePermanently(workspace(1).id)
+            Assert.assertNull(registry.get(workspace(1).id.id).worktreeKind)
+            Assert.assertNull(registry.get(workspace(1).id.id).worktreeRoot)
+        }
+    }
+
+    // A write cut short by a crash is dropped on open, with the writes before it kept.
+    @Test
+    fun tornWriteIsDropped() {
+        WorkspaceRegistry.open(file.path).use { registry ->
+            RegistryWorkspaceRepository(registry).save(workspace(1))
+        }
+        file.appendBytes(ByteArray(100) { 0x55 })
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val workspaces = RegistryWorkspaceRepository(registry)
+            Assert.assertEquals(workspace(1), workspaces.find(workspace(1).id))
+            workspaces.save(workspace(2))
+        }
+        WorkspaceRegistry.open(file.path).use { registry ->
+            Assert.assertEquals(2, registry.getLogSize())
+            Assert.assertEquals(workspace(2), RegistryWorkspaceRepository(registry).find(workspace(2).id))
+        }
+    }
+
+    // The log is compacted as it grows, so opening a registry with many workspaces does not read
+    // one record per workspace.
+    @Test
+    fun openBenchmark() {
+        WorkspaceRegistry.open(file.path).use { registry ->
+            val workspaces = RegistryWorkspaceRepository(registry)
+            for (i in 0 until WORKSPACES) {
+                workspaces.save(workspace(i))
+            }
+            Assert.assertTrue(registry.getLogSize() < WORKSPACES)
+            registry.compact()
+            Assert.assertEquals(0, registry.getLogSize())
+        }
+        var found = 0
+        val open = measureNanoTime {
+            WorkspaceRegistry.open(file.path).use { registry ->
+                found = RegistryWorkspaceRepository(registry)
+                        .find(WorkspaceFindRequest(name = WorkspaceName("keyboard3"), deleted = false)).size
+            }
+        }
+        Assert.assertEquals((0 until WORKSPACES).count { it % 10 == 3 && it % 7 != 0 }, found)
+        Log.i(TAG, "open and scan of $WORKSPACES workspaces: ${open / 1000} [us]")
+    }
+}
@@ -0,0 +1,277 @@
+package io.github.sh4.zabuton
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.util.ZipArchive
+import io.github.sh4.zabuton.util.extractArchive
+import io.github.sh4.zabuton.util.extractZipAsParallel
+import io.github.sh4.zabuton.util.extractZipStream
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Assume
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.ByteArrayOutputStream
+import java.io.File
+import java.io.IOException
+import java.io.InputStream
+import java.io.PipedInputStream
+import java.io.PipedOutputStream
+import java.util.zip.CRC32
+import java.util.zip.ZipEntry
+import java.util.zip.ZipOutputStream
+import kotlin.concurrent.thread
+import kotlin.random.Random
+import kotlin.system.measureTimeMillis
+
+private val TAG = ZipArchiveTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class ZipArchiveTest {
+    companion object {
+        private const val TOOLCHAIN_ZIP = "build/toolchain.zip"
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    private val context = InstrumentationRegistry.getInstrumentation().targetContext
+
+    private fun writeZip(file: File, entries: Map<String, ByteArray>, storedNames: Set<String> = emptySet()) {
+        ZipOutputStream(file.outputStream()).use { zip ->
+            for ((name, data) in entries) {
+                val entry = ZipEntry(name)
+                if (name in storedNames) {
+                    entry.method = ZipEntry.STORED
+                    entry.size = data.size.toLong()
+                    entry.crc = CRC32().apply { update(data) }.value
+                }
+                zip.putNextEntry(entry)
+                zip.write(data)
+                zip.closeEntry()
+            }
+        }
+    }
+
+    @Test
+    fun extractStoredAndDeflatedEntries() {
+        val random = Random(42)
+        val entries = linkedMapOf(
+                "empty.txt" to ByteArray(0),
+                "a/b/c/deflated.txt" to "hello ".repeat(10000).toByteArray(),
+                "a/b/random.bin" to random.nextBytes(300 * 1024),
+                "a/stored.bin" to random.nextBytes(1024),
+                "d/" to ByteArray(0))
+        val zipFile = File(context.cacheDir, "extract-test.zip")
+        writeZip(zipFile, entries, storedNames = setOf("a/stored.bin"))
+        val extractDir = File(context.cacheDir, "extract-test")
+        extractDir.deleteRecursively()
+        extractDir.mkdirs()
+
+        ZipArchive.open(zipFile).use { archive ->
+            Assert.assertEquals(entries.size, archive.entryCount)
+            Assert.assertEquals(entries.values.sumBy { it.size }.toLong(), archive.uncompressedSize)
+            archive.extract(extractDir.absolutePath, 4)
+            Assert.assertEquals(archive.uncompressedSize, archive.extractedBytes)
+        }
+        for ((name, data) in entries) {
+            val file = File(extractDir, name)
+            if (name.endsWith("/")) {
+                Assert.assertTrue(file.isDirectory)
+            } else {
+                Assert.assertArrayEquals(name, data, file.readBytes())
+            }
+        }
+    }
+
+    // Stands in for an HTTP response body: the bytes arrive in pieces written by another thread.
+    private fun slowStream(data: ByteArray, pieceSize: Int = 16 * 1024): InputStream {
+        val input = PipedInputStream(pieceSize * 4)
+        val output = PipedOutputStream(input)
+        thread {
+            output.use {
+                for (i in data.indices step pieceSize) {
+                    it.write(data, i, minOf(pieceSize, data.size - i))
+                    Thread.sleep(1)
+                }
+            }
+        }
+        return input
+    }
+
+    private fun ByteArrayOutputStream.le16(value: Int) {
+        write(value and 0xff)
+        write(value ushr 8 and 0xff)
+    }
+
+    private fun ByteArrayOutputStream.le32(value: Long) {
+        le16((value and 0xffff).toInt())
+        le16((value ushr 16 and 0xffff).toInt())
+    }
+
+    // What a writer that cannot seek back produces for stored entries: the CRC and the sizes
+    // follow the data in a data descriptor, so a reader of the stream cannot tell where the data
+    // ends.
+    private fun storedZipWithDescriptors(entries: Map<String, ByteArray>, modes: Map<String, Int>): ByteArray {
+        val out = ByteArrayOutputStream()
+        val central = ByteArrayOutputStream()
+        for ((name, data) in entries) {
+            val offset = out.size().toLong()
+            val crc = CRC32().apply { update(data) }.value
+            val nameBytes = name.toByteArray()
+            out.le32(0x04034b50)
+            out.le16(10)
+            out.le16(1 shl 3)
+            out.le16(0)
+            out.le32(0)
+            out.le32(0)
+            out.le32(0)
+            out.le32(0)
+            out.le16(nameBytes.size)
+            out.le16(0)
+            out.write(nameBytes)
+            out.write(data)
+            out.le32(0x08074b50)
+            out.le32(crc)
+            out.le32(data.size.toLong())
+            out.le32(data.size.toLong())
+
+            central.le32(0x02014b50)
+            central.le16(3 shl 8 or 30)
+            central.le16(10)
+            central.le16(1 shl 3)
+            central.le16(0)
+            central.le32(0)
+            central.le32(crc)
+            central.le32(data.size.toLong())
+            central.le32(data.size.toLong())
+            central.le16(nameBytes.size)
+            central.le32(0)
+            central.le32(0)
+            central.le32(((0x8000 or (modes[name] ?: 420)).toLong()) shl 16)
+            central.le32(offset)
+            central.write(nameBytes)
+        }
+        val centralOffset = out.size().toLong()
+        central.writeTo(out)
+        out.le32(0x06054b50)
+        out.le32(0)
+        out.le16(entries.size)
+        out.le16(entries.size)
+        out.le32(central.size().toLong())
+        out.le32(centralOffset)
+        out.le16(0)
+        return out.toByteArray()
+    }
+
+    @Test
+    fun extractZipStreamWhileReceiving() {
+        val random = Random(7)
+        val entries = linkedMapOf(
+                "keyboards/a/keymap.c" to "keymap ".repeat(20000).toByteArray(),
+                "keyboards/a/stored.bin" to random.nextBytes(100 * 1024),
+                "keyboards/b/" to ByteArray(0),
+                "empty.txt" to ByteArray(0),
+                "random.bin" to random.nextBytes(500 * 1024))
+        val zipFile = File(context.cacheDir, "stream-test.zip")
+        writeZip(zipFile, entries, storedNames = setOf("keyboards/a/stored.bin"))
+        val bytes = zipFile.readBytes()
+        val extractDir = File(context.cacheDir, "stream-test")
+        val spillFile = File(context.cacheDir, "stream-test.spill")
+        extractDir.deleteRecursively()
+        extractDir.mkdirs()
+
+        runBlocking {
+            extractZipStream(slowStream(bytes), bytes.size.toLong(), extractDir, spillFile, {})
+        }
+        for ((name, data) in entries) {
+            val file = File(extractDir, name)
+            if (name.endsWith("/")) {
+                Assert.assertTrue(file.isDirectory)
+            } else {
+                Assert.assertArrayEquals(name, data, file.readBytes())
+            }
+        }
+        Assert.assertFalse(spillFile.exists())
+    }
+
+    @Test
+    fun extractZipStreamSpillsStoredEntriesWithDescriptors() {
+        val entries = linkedMapOf(
+                "util/run.sh" to "#!/bin/sh\necho run\n".toByteArray(),
+                "data.bin" to Random(3).nextBytes(64 * 1024))
+        val bytes = storedZipWithDescriptors(entries, mapOf("util/run.sh" to 493))
+        val extractDir = File(context.cacheDir, "stream-spill-test")
+        val spillFile = File(context.cacheDir, "stream-spill-test.spill")
+        extractDir.deleteRecursively()
+        extractDir.mkdirs()
+
+        runBlocking {
+            extractZipStream(slowStream(bytes, pieceSize = 1000), bytes.size.toLong(), extractDir, spillFile, {})
+        }
+        for ((name, data) in entries) {
+            Assert.assertArrayEquals(name, data, File(extractDir, name).readBytes())
+        }
+        Assert.assertTrue(File(extractDir, "util/run.sh").canExecute())
+        Assert.assertFalse(spillFile.exists())
+    }
+
+    @Test
+    fun extractZipStreamRejectsTruncatedArchive() {
+        val zipFile = File(context.cacheDir, "stream-truncated.zip")
+        writeZip(zipFile, mapOf("a.txt" to "a".repeat(10000).toByteArray(), "b.txt" to "b".toByteArray()))
+        val bytes = zipFile.readBytes().copyOf(100)
+        val extractDir = File(context.cacheDir, "stream-truncated")
+        extractDir.mkdirs()
+        try {
+            runBlocking {
+                extractZipStream(slowStream(bytes), bytes.size.toLong(), extractDir, File(context.cacheDir, "stream-truncated.spill"), {})
+            }
+            Assert.fail("a truncated archive was accepted")
+        } catch (e: IOException) {
+        }
+    }
+
+    @Test
+    fun rejectEntriesOutsideExtractDir() {
+        val zipFile = File(context.cacheDir, "extract-slip.zip")
+        writeZip(zipFile, mapOf("../escaped.txt" to "x".toByteArray()))
+        try {
+            ZipArchive.open(zipFile).close()
+            Assert.fail("unsafe entry name was accepted")
+        } catch (e: IOException) {
+        }
+    }
+
+    @Test
+    fun toolchainExtractBenchmark() {
+        // Packaged only when building with TOOLCHAIN_ARCHIVES including zip.
+        Assume.assumeTrue(context.assets.list("build")!!.contains("toolchain.zip"))
+        val streamDir = File(context.cacheDir, "toolchain-stream")
+        val nativeDir = File(context.cacheDir, "toolchain-native")
+        for (dir in listOf(streamDir, nativeDir)) {
+            dir.deleteRecursively()
+            dir.mkdirs()
+        }
+        val streamElapsed = measureTimeMillis {
+            runBlocking {
+                extractZipAsParallel({ context.assets.open(TOOLCHAIN_ZIP) }, streamDir, {})
+            }
+        }
+        val nativeElapsed = measureTimeMillis {
+            runBlocking {
+                context.assets.openFd(TOOLCHAIN_ZIP).use { fd ->
+                    extractArchive({ ZipArchive.open(fd) }, nativeDir, {})
+                }
+            }
+        }
+        Log.d(TAG, "toolchain.zip: stream $streamElapsed [ms], native $nativeElapsed [ms]")
+        val streamFiles = streamDir.walk().filter { it.isFile }.map { it.relativeTo(streamDir).path to it.length() }.toMap()
+        val nativeFiles = nativeDir.walk().filter { it.isFile }.map { it.relativeTo(nativeDir).path to it.length() }.toMap()
+        Assert.assertEquals(streamFiles, nativeFiles)
+        streamDir.deleteRecursively()
+        nativeDir.deleteRecursively()
+    }
+}
@@ -0,0 +1,216 @@
+package io.github.sh4.zabuton
+
+import android.content.res.AssetFileDescriptor
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import io.github.sh4.zabuton.util.NativeArchive
+import io.github.sh4.zabuton.util.ZipArchive
+import io.github.sh4.zabuton.util.ZstdArchive
+import io.github.sh4.zabuton.util.extractArchive
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert
+import org.junit.Assume
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.ByteArrayOutputStream
+import java.io.File
+import java.io.IOException
+import java.util.zip.CRC32
+import kotlin.random.Random
+import kotlin.system.measureTimeMillis
+
+private val TAG = ZstdArchiveTest::class.java.simpleName
+
+@RunWith(AndroidJUnit4::class)
+class ZstdArchiveTest {
+    companion object {
+        private const val TOOLCHAIN_ZSTD = "build/toolchain.zst"
+        private const val TOOLCHAIN_ZIP = "build/toolchain.zip"
+        // Layout constants of ZstdArchive.h.
+        private const val ZSTD_FRAME_MAGIC = 0xFD2FB528L
+        private const val SKIPPABLE_FRAME_MAGIC = 0x184D2A5EL
+        private const val INDEX_MAGIC = 0x5A425449L
+        private const val NO_FRAME = 0xFFFFFFFFL
+        private const val INDEX_FOOTER_SIZE = 16
+        private const val MAX_RAW_BLOCK_SIZE = 128 * 1024
+
+        init {
+            System.loadLibrary("native-lib")
+        }
+    }
+
+    private val context = InstrumentationRegistry.getInstrumentation().targetContext
+
+    private fun ByteArrayOutputStream.writeLe(value: Long, bytes: Int) {
+        for (i in 0 until bytes) {
+            write((value shr (8 * i)).toInt() and 0xff)
+        }
+    }
+
+    // A zstd frame of raw (stored) blocks, which needs no compressor to write.
+    private fun rawZstdFrame(data: ByteArray): ByteArray {
+        val out = ByteArrayOutputStream()
+        out.writeLe(ZSTD_FRAME_MAGIC, 4)
+        // Single segment with a 4 byte content size and no checksum.
+        out.write(0xA0)
+        out.writeLe(data.size.toLong(), 4)
+        var offset = 0
+        do {
+            val size = minOf(data.size - offset, MAX_RAW_BLOCK_SIZE)
+            val last = if (offset + size == data.size) 1 else 0
+            out.writeLe((last or (size shl 3)).toLong(), 3)
+            out.write(data, offset, size)
+            offset += size
+        } while (offset < data.size)
+        return out.toByteArray()
+    }
+
+    // Writes entries as pack_toolchain does, starting a new frame after frameSize bytes.
+    private fun writeZstdArchive(file: File, entries: Map<String, ByteArray>, frameSize: Int,
+                                 corruptCrcOf: String? = null) {
+        val frames = ArrayList<ByteArrayOutputStream>()
+        val index = ByteArrayOutputStream()
+        for ((name, data) in entries) {
+            var frame = NO_FRAME
+            if (!name.endsWith("/")) {
+                if (frames.isEmpty() || frames.last().size() >= frameSize) {
+                    frames.add(ByteArrayOutputStream())
+                }
+                frames.last().write(data)
+                frame = frames.size - 1L
+            }
+            val crc = CRC32().apply { update(data) }.value + if (name == corruptCrcOf) 1 else 0
+            val nameBytes = name.toByteArray()
+            index.writeLe(frame, 4)
+            index.writeLe(420, 4) // 0644
+            index.writeLe(data.size.toLong(), 8)
+            index.writeLe(crc, 4)
+            index.writeLe(nameBytes.size.toLong(), 2)
+            index.write(nameBytes)
+        }
+        val compressedFrames = frames.map { rawZstdFrame(it.toByteArray()) }
+        val frameTable = ByteArrayOutputStream()
+        for ((compressed, frame) in compressedFrames.zip(frames)) {
+            frameTable.writeLe(compressed.size.toLong(), 4)
+            frameTable.writeLe(frame.size().toLong(), 4)
+        }
+        val indexSize = frameTable.size() + index.size()
+        file.outputStream().use { out ->
+            compressedFrames.forEach { out.write(it) }
+            val trailer = ByteArrayOutputStream()
+            trailer.writeLe(SKIPPABLE_FRAME_MAGIC, 4)
+            trailer.writeLe((indexSize + INDEX_FOOTER_SIZE).toLong(), 4)
+            frameTable.writeTo(trailer)
+            index.writeTo(trailer)
+            trailer.writeLe(indexSize.toLong(), 4)
+            trailer.writeLe(frames.size.toLong(), 4)
+            trailer.writeLe(entries.size.toLong(), 4)
+            trailer.writeLe(INDEX_MAGIC, 4)
+            trailer.writeTo(out)
+        }
+    }
+
+    private fun newExtractDir(name: String) = File(context.cacheDir, name).apply {
+        deleteRecursively()
+        mkdirs()
+    }
+
+    @Test
+    fun extractFramesAndSelectedEntries() {
+        val random = Random(42)
+        val entries = linkedMapOf(
+                "a/" to ByteArray(0),
+                "a/empty.txt" to ByteArray(0),
+                "a/b/large.bin" to random.nextBytes(300 * 1024),
+                "a/small.txt" to "hello".toByteArray(),
+                "c/" to ByteArray(0),
+                "c/d/random.bin" to random.nextBytes(70 * 1024),
+                "c/last.txt" to "world".repeat(1000).toByteArray())
+        val archiveFile = File(context.cacheDir, "extract-test.zst")
+        writeZstdArchive(archiveFile, entries, frameSize = 64 * 1024)
+
+        val extractDir = newExtractDir("extract-test-zstd")
+        ZstdArchive.open(archiveFile).use { archive ->
+            Assert.assertEquals(entries.size, archive.entryCount)
+            Assert.assertEquals(entries.values.sumBy { it.size }.toLong(), archive.uncompressedSize)
+            archive.extract(extractDir.absolutePath, 4)
+            Assert.assertEquals(archive.uncompressedSize, archive.extractedBytes)
+        }
+        for ((name, data) in entries) {
+            val file = File(extractDir, name)
+            if (name.endsWith("/")) {
+                Assert.assertTrue(file.isDirectory)
+            } else {
+                Assert.assertArrayEquals(name, data, file.readBytes())
+            }
+        }
+
+        val selectedDir = newExtractDir("extract-test-zstd-selected")
+        ZstdArchive.open(archiveFile).use { archive ->
+            archive.extract(selectedDir.absolutePath, arrayOf("a/small.txt", "c/last.txt"), 2)
+            Assert.assertEquals(5L + 5000L, archive.extractedBytes)
+        }
+        Assert.assertArrayEquals(entries["c/last.txt"], File(selectedDir, "c/last.txt").readBytes())
+        Assert.assertFalse(File(selectedDir, "a/b/large.bin").exists())
+    }
+
+    @Test
+    fun rejectChecksumMismatch() {
+        val archiveFile = File(context.cacheDir, "extract-corrupt.zst")
+        writeZstdArchive(archiveFile, mapOf("x.txt" to "x".repeat(100).toByteArray()), frameSize = 1024,
+                corruptCrcOf = "x.txt")
+        val extractDir = newExtractDir("extract-corrupt-zstd")
+        ZstdArchive.open(archiveFile).use { archive ->
+            try {
+                archive.extract(extractDir.absolutePath, 1)
+                Assert.fail("checksum mismatch was accepted")
+            } catch (e: IOException) {
+            }
+        }
+        Assert.assertEquals(emptyList<String>(), extractDir.list()!!.toList())
+    }
+
+    // Resets the peak resident set size reported by peakRssKb() when the kernel allows it.
+    private fun resetPeakRss() {
+        try {
+            File("/proc/self/clear_refs").writeText("5")
+        } catch (e: IOException) {
+            Log.d(TAG, "peak RSS cannot be reset; reporting the process-wide peak")
+        }
+    }
+
+    // Peak resident set size of the process in kB.
+    private fun peakRssKb() = File("/proc/self/status").readLines()
+            .first { it.startsWith("VmHWM:") }.split(Regex("\\s+"))[1].toLong()
+
+    /**
+     * Compares the toolchain archive formats packaged in the APK. Build with
+     * `make TOOLCHAIN_ARCHIVES="zst zip"` to package both.
+     */
+    @Test
+    fun toolchainArchiveBenchmark() {
+        val formats = linkedMapOf<String, (AssetFileDescriptor) -> NativeArchive>(
+                TOOLCHAIN_ZSTD to { fd -> ZstdArchive.open(fd) },
+                TOOLCHAIN_ZIP to { fd -> ZipArchive.open(fd) })
+        val trees = HashMap<String, Map<String, Long>>()
+        for ((name, open) in formats) {
+            val fd = try {
+                context.assets.openFd(name)
+            } catch (e: IOException) {
+                Log.d(TAG, "$name is not packaged")
+                continue
+            }
+            val extractDir = newExtractDir("toolchain-benchmark")
+            resetPeakRss()
+            val elapsed = fd.use {
+                measureTimeMillis { runBlocking { extractArchive({ open(it) }, extractDir, {}) } }
+            }
+            Log.d(TAG, "$name: asset ${fd.length} [bytes], install $elapsed [ms], peak RSS ${peakRssKb()} [kB]")
+            trees[name] = extractDir.walk().filter { it.isFile }.map { it.relativeTo(extractDir).path to it.length() }.toMap()
+            extractDir.deleteRecursively()
+        }
+        Assume.assumeTrue(trees.isNotEmpty())
+        Assert.assertEquals(1, trees.values.distinct().size)
+    }
+}
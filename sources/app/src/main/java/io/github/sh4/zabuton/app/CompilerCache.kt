@@ -0,0 +1,96 @@
+package io.github.sh4.zabuton.app
+
+import android.content.Context
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.io.File
+import java.io.IOException
+
+private const val CCACHE_DIR = "ccache"
+// Links named after the compilers that point at ccache, see symlinkMaps.json.
+private const val CCACHE_MASQUERADE_DIR = "lib/ccache"
+private const val DEFAULT_MAX_SIZE_BYTES = 512L * 1024 * 1024
+
+/**
+ * Counters of the compiler cache. Hits are compilations answered from the cache, misses the
+ * ones that ran the compiler and stored its output; other calls (linking, preprocessing only,
+ * failed compilations, ...) are neither.
+ */
+data class CompilerCacheStatistics(
+        val directHits: Long,
+        val preprocessedHits: Long,
+        val misses: Long,
+        val files: Long,
+        val sizeBytes: Long
+) {
+    val hits get() = directHits + preprocessedHits
+
+    val hitRatio get() = if (hits + misses == 0L) 0.0 else hits.toDouble() / (hits + misses)
+}
+
+/**
+ * The ccache of the installed toolchain, used in masquerade mode: with [environment] applied,
+ * avr-gcc found through PATH is ccache, which runs the real compiler on a miss. Objects are keyed
+ * by a hash of the source (the preprocessed source when the include files changed), the flags
+ * and the compiler, and kept in [cacheDir] up to [maxSizeBytes] with the oldest evicted first.
+ */
+class CompilerCache(
+        private val toolchainRoot: File,
+        val cacheDir: File,
+        private val maxSizeBytes: Long = DEFAULT_MAX_SIZE_BYTES
+) {
+    constructor(toolchainRoot: File, context: Context) : this(toolchainRoot, File(context.cacheDir, CCACHE_DIR))
+
+    private val ccache = File(toolchainRoot, "bin/ccache")
+
+    /**
+     * Variables to set for a build whose PATH is [path]. Paths below [baseDir] are hashed
+     * relative to the working directory, so the same sources built from another worktree still
+     * hit the cache.
+     */
+    fun environment(path: String, baseDir: File? = null): Map<String, String> {
+        val environment = linkedMapOf(
+                "PATH" to "${File(toolchainRoot, CCACHE_MASQUERADE_DIR).absolutePath}:$path",
+                "CCACHE_DIR" to cacheDir.absolutePath,
+                "CCACHE_TEMPDIR" to File(cacheDir, "tmp").absolutePath,
+                "CCACHE_MAXSIZE" to "${maxSizeBytes / 1024}Ki")
+        if (baseDir != null) {
+            environment["CCACHE_BASEDIR"] = baseDir.absolutePath
+        }
+        return environment
+    }
+
+    suspend fun statistics(): CompilerCacheStatistics {
+        val counters = run("--print-stats").lines().mapNotNull { line ->
+            val fields = line.split('\t')
+            fields.getOrNull(1)?.toLongOrNull()?.let { fields[0] to it }
+        }.toMap()
+        return CompilerCacheStatistics(
+                directHits = counters["cache_hit_direct"] ?: 0,
+                preprocessedHits = counters["cache_hit_preprocessed"] ?: 0,
+                misses = counters["cache_miss"] ?: 0,
+                files = counters["files_in_cache"] ?: 0,
+                sizeBytes = (counters["cache_size_kibibyte"] ?: 0) * 1024)
+    }
+
+    suspend fun zeroStatistics() {
+        run("--zero-stats")
+    }
+
+    suspend fun clear() {
+        run("--clear")
+    }
+
+    private suspend fun run(vararg args: String) = withContext(Dispatchers.IO) {
+        cacheDir.mkdirs()
+        val process = ProcessBuilder(listOf(ccache.absolutePath) + args).apply {
+            environment().putAll(environment(System.getenv("PATH") ?: ""))
+            redirectErrorStream(true)
+        }.start()
+        val output = process.inputStream.bufferedReader().use { it.readText() }
+        if (process.waitFor() != 0) {
+            throw IOException("ccache ${args.joinToString(" ")} failed: $output")
+        }
+        output
+    }
+}
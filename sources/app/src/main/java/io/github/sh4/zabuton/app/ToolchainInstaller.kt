@@ -1,45 +1,151 @@
 package io.github.sh4.zabuton.app
 
 import android.content.Context
+import android.content.res.AssetFileDescriptor
 import android.system.Os
 import com.squareup.moshi.JsonClass
 import com.squareup.moshi.JsonReader
 import com.squareup.moshi.Moshi
+import io.github.sh4.zabuton.util.FileLayout
+import io.github.sh4.zabuton.util.NativeArchive
 import io.github.sh4.zabuton.util.Progress
+import io.github.sh4.zabuton.util.ZipArchive
+import io.github.sh4.zabuton.util.ZstdArchive
+import io.github.sh4.zabuton.util.extractArchive
 import io.github.sh4.zabuton.util.extractZipAsParallel
 import kotlinx.coroutines.*
 import kotlinx.coroutines.channels.ReceiveChannel
 import okio.Okio
 import java.io.File
+import java.io.IOException
+import java.io.InputStream
 import java.io.InputStreamReader
 
 private const val INSTALL_TOOLCHAIN = "build/toolchain.zip"
+private const val INSTALL_TOOLCHAIN_ZSTD = "build/toolchain.zst"
+private const val INSTALL_MANIFEST = "build/toolchainManifest.txt"
 private const val INSTALL_SYMLINK_MAPS = "build/symlinkMaps.json"
 private val INSTALL_EXECUTABLE_DIRS = arrayOf("avr", "bin", "libexec")
+// Copy of the manifest the installed tree was built from. It is written last and removed before
+// an upgrade touches the tree, so its presence means the tree matches it.
+private const val INSTALLED_MANIFEST = ".toolchainManifest.txt"
 
 private const val MODE_OWNER_EXECUTE = 64
 private const val MODE_OWNER_WRITE = 128
 private const val MODE_OWNER_READ = 256
 private const val MODE_OWNER_RWX = MODE_OWNER_EXECUTE + MODE_OWNER_WRITE + MODE_OWNER_READ
+private const val MODE_ANY_EXECUTE = 73 // 0111
 
 @JsonClass(generateAdapter = true)
 data class SymlinkMapEntry(val target: String, val src: String)
 @JsonClass(generateAdapter = true)
 data class SymlinkMaps(val files: List<SymlinkMapEntry>)
 
+/**
+ * The toolchain archive packaged in the APK without compression: toolchain.zst when the build
+ * packaged it (TOOLCHAIN_ARCHIVES in the Makefile), otherwise toolchain.zip.
+ */
+class ToolchainAsset(val name: String, val fd: AssetFileDescriptor) : AutoCloseable {
+    fun open(): NativeArchive = if (name == INSTALL_TOOLCHAIN_ZSTD) ZstdArchive.open(fd) else ZipArchive.open(fd)
+
+    override fun close() = fd.close()
+
+    companion object {
+        /**
+         * Returns null when only a toolchain.zip compressed inside the APK is available, which can
+         * be read as a stream only.
+         */
+        fun open(context: Context): ToolchainAsset? {
+            for (name in arrayOf(INSTALL_TOOLCHAIN_ZSTD, INSTALL_TOOLCHAIN)) {
+                try {
+                    return ToolchainAsset(name, context.assets.openFd(name))
+                } catch (e: IOException) {
+                    // Missing, or compressed inside the APK.
+                }
+            }
+            return null
+        }
+    }
+}
+
+/**
+ * A file of the toolchain archive as listed in toolchainManifest.txt: its git blob id, permission
+ * bits, size and path.
+ */
+data class ToolchainManifestEntry(val id: String, val mode: Int, val size: Long, val path: String)
+
+fun readToolchainManifest(input: InputStream): Map<String, ToolchainManifestEntry> =
+        input.bufferedReader().useLines { lines ->
+            lines.filter { it.isNotEmpty() }.map { line ->
+                val fields = line.split(' ', limit = 4)
+                ToolchainManifestEntry(fields[0], fields[1].toInt(8), fields[2].toLong(), fields[3])
+            }.associateBy { it.path }
+        }
+
 suspend fun toolchainInstall(
         installRoot: File,
         context: Context,
         block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit
 ) = coroutineScope {
-    val installRootTemp = File(installRoot.absolutePath + ".tmp")
-    if (installRootTemp.exists()) {
-        installRootTemp.deleteRecursively()
+    val manifest = try {
+        context.assets.open(INSTALL_MANIFEST).use { readToolchainManifest(it) }
+    } catch (e: IOException) {
+        null
+    }
+    val installedManifestFile = File(installRoot, INSTALLED_MANIFEST)
+    val installedManifest = if (manifest != null && installedManifestFile.exists()) {
+        installedManifestFile.inputStream().use { readToolchainManifest(it) }
+    } else null
+    val toolchainAsset = ToolchainAsset.open(context)
+    if (manifest != null && installedManifest != null && toolchainAsset != null) {
+        toolchainAsset.use { upgradeToolchain(installRoot, manifest, installedManifest, it, block) }
+    } else {
+        val installRootTemp = File(installRoot.absolutePath + ".tmp")
+        if (installRootTemp.exists()) {
+            installRootTemp.deleteRecursively()
+        }
+        installRootTemp.mkdir()
+        if (toolchainAsset != null) {
+            toolchainAsset.use { extractArchive({ it.open() }, installRootTemp, block) }
+        } else {
+            extractZipAsParallel({ context.assets.open(INSTALL_TOOLCHAIN) }, installRootTemp, block)
+        }
+        replaceToolchainRoot(installRoot, installRootTemp)
+    }
+    installPostProcess(installRoot, context, manifest)
+    if (manifest != null) {
+        withContext(Dispatchers.IO) {
+            installedManifestFile.outputStream().use { context.assets.open(INSTALL_MANIFEST).copyTo(it) }
+        }
+    }
+}
+
+// Rewrites only the files whose content changed since the installed manifest, and removes the
+// ones that are gone.
+private suspend fun upgradeToolchain(
+        root: File,
+        manifest: Map<String, ToolchainManifestEntry>,
+        installedManifest: Map<String, ToolchainManifestEntry>,
+        toolchainAsset: ToolchainAsset,
+        block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit
+) {
+    val changed = withContext(Dispatchers.IO) {
+        manifest.values.filter { entry ->
+            val file = File(root, entry.path)
+            installedManifest[entry.path]?.id != entry.id || !file.isFile || file.length() != entry.size
+        }
+    }
+    File(root, INSTALLED_MANIFEST).delete()
+    withContext(Dispatchers.IO) {
+        for (path in installedManifest.keys - manifest.keys) {
+            File(root, path).delete()
+        }
+    }
+    if (changed.isNotEmpty()) {
+        extractArchive({ toolchainAsset.open() }, root, block,
+                names = changed.map { it.path },
+                total = changed.fold(0L) { total, entry -> total + entry.size })
     }
-    installRootTemp.mkdir()
-    extractZipAsParallel({ context.assets.open(INSTALL_TOOLCHAIN) }, installRootTemp, block)
-    replaceToolchainRoot(installRoot, installRootTemp)
-    installPostProcess(installRoot, context)
 }
 
 private fun replaceToolchainRoot(root: File, newRoot: File) {
@@ -55,37 +161,41 @@ private fun replaceToolchainRoot(root: File, newRoot: File) {
     }
 }
 
-private suspend fun installPostProcess(toolchainRoot: File, context: Context) = coroutineScope {
-    // set executable bits
-    for (file in INSTALL_EXECUTABLE_DIRS.map { File(toolchainRoot, it) }) {
-        file.walk().filter { it.isFile }.forEach {
-            Os.chmod(it.absolutePath, MODE_OWNER_RWX)
-        }
-    }
-    // create symlinks
-    val crateBusyBoxSymlinkJob = launch(Dispatchers.IO) {
-        val busyboxFile = File(toolchainRoot, "bin/busybox")
-        ProcessBuilder(mutableListOf(busyboxFile.absolutePath, "--list")).start().let {
-            InputStreamReader(it.inputStream).useLines { lines ->
-                val busyboxPath = busyboxFile.absolutePath
-                for (line in lines) {
-                    Os.symlink(busyboxPath, File(toolchainRoot, "bin/${line}").absolutePath)
-                }
+// Sets executable bits and creates the busybox applet and symlinkMaps.json links in a single
+// native pass.
+private suspend fun installPostProcess(
+        toolchainRoot: File,
+        context: Context,
+        manifest: Map<String, ToolchainManifestEntry>?
+) = withContext(Dispatchers.IO) {
+    val executables = manifest?.values?.filter { it.mode and MODE_ANY_EXECUTE != 0 }?.map { it.path }
+            ?: INSTALL_EXECUTABLE_DIRS.flatMap { dir ->
+                File(toolchainRoot, dir).walk().filter { it.isFile }.map { it.relativeTo(toolchainRoot).path }.toList()
+            }
+    val linkPaths = ArrayList<String>()
+    val linkTargets = ArrayList<String>()
+
+    val busyboxFile = File(toolchainRoot, "bin/busybox")
+    Os.chmod(busyboxFile.absolutePath, MODE_OWNER_RWX)
+    ProcessBuilder(mutableListOf(busyboxFile.absolutePath, "--list")).start().let {
+        InputStreamReader(it.inputStream).useLines { lines ->
+            val busyboxPath = busyboxFile.absolutePath
+            for (line in lines) {
+                linkPaths.add("bin/${line}")
+                linkTargets.add(busyboxPath)
             }
         }
     }
-    val createSpecificSymlinkJob = launch(Dispatchers.IO) {
-        val moshi = Moshi.Builder().build()
-        Okio.buffer(Okio.source(context.assets.open(INSTALL_SYMLINK_MAPS))).use {
-            val symlinkMaps = moshi.adapter(SymlinkMaps::class.java).fromJson(JsonReader.of(it))
-            for (file in symlinkMaps?.files.orEmpty()) {
-                val source = File(toolchainRoot, file.src)
-                val target = File(toolchainRoot, file.target)
-                val targetDir = target.parentFile
-                if (!targetDir.exists()) targetDir.mkdir()
-                Os.symlink(source.absolutePath, target.absolutePath)
-            }
+    val moshi = Moshi.Builder().build()
+    Okio.buffer(Okio.source(context.assets.open(INSTALL_SYMLINK_MAPS))).use {
+        val symlinkMaps = moshi.adapter(SymlinkMaps::class.java).fromJson(JsonReader.of(it))
+        for (file in symlinkMaps?.files.orEmpty()) {
+            linkPaths.add(file.target)
+            linkTargets.add(File(toolchainRoot, file.src).absolutePath)
         }
     }
-    joinAll(crateBusyBoxSymlinkJob, createSpecificSymlinkJob)
-}
\ No newline at end of file
+
+    FileLayout.apply(toolchainRoot.absolutePath,
+            executables.toTypedArray(), IntArray(executables.size) { MODE_OWNER_RWX },
+            linkPaths.toTypedArray(), linkTargets.toTypedArray())
+}
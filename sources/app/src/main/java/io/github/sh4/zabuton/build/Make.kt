@@ -0,0 +1,93 @@
+package io.github.sh4.zabuton.build
+
+import kotlinx.coroutines.*
+import java.io.File
+import java.io.OutputStream
+
+private const val MAKE_EVENT_POLL_INTERVAL_MILLIS = 100L
+private const val MAKE_OUTPUT_BUFFER_SIZE = 64 * 1024
+
+enum class MakeEventKind {
+    Started,
+    Finished,
+    Failed,
+}
+
+data class MakeEvent(val kind: MakeEventKind, val target: String, val timeNanos: Long)
+
+/** How long a target took, from its first recipe line starting to its last one ending. */
+data class TargetTiming(val target: String, val startNanos: Long, val elapsedNanos: Long, val failed: Boolean)
+
+class MakeResult(val exitCode: Int, val timings: List<TargetTiming>) {
+    val succeeded get() = exitCode == 0
+
+    /** The targets that took longest, e.g. the translation units that dominate a QMK build. */
+    fun slowest(count: Int) = timings.sortedByDescending { it.elapsedNanos }.take(count)
+}
+
+/**
+ * Builds [targets] with [make] in [dir], running up to [jobs] recipes at once. [environment] is
+ * the whole environment of make, e.g. System.getenv() with a CompilerCache.environment added.
+ * The output of make and the compilers is copied to [output] in large chunks as it is produced,
+ * and [onEvent] is called on the calling coroutine for every target started and finished.
+ * Cancelling the calling coroutine terminates make and everything it started.
+ */
+suspend fun runMake(
+        make: File,
+        dir: File,
+        targets: List<String>,
+        environment: Map<String, String>,
+        jobs: Int = MakeProcess.getDefaultJobCount(),
+        output: OutputStream? = null,
+        onEvent: (MakeEvent) -> Unit = {}
+): MakeResult {
+    val args = (listOf("-j${jobs.coerceAtLeast(1)}") + targets).toTypedArray()
+    val process = withContext(Dispatchers.IO) {
+        MakeProcess.start(make.absolutePath, args, environment, dir.absolutePath)
+    }
+    val starts = HashMap<String, Long>()
+    val timings = ArrayList<TargetTiming>()
+    fun takeEvents() {
+        val batch = process.takeEvents()
+        for (i in 0 until batch.count) {
+            val kind = MakeEventKind.values()[batch.getKind(i)]
+            val target = batch.getTarget(i)
+            val time = batch.getTimeNanos(i)
+            if (kind == MakeEventKind.Started) {
+                starts[target] = time
+            } else {
+                val start = starts.remove(target) ?: time
+                timings.add(TargetTiming(target, start, time - start, kind == MakeEventKind.Failed))
+            }
+            onEvent(MakeEvent(kind, target, time))
+        }
+    }
+    // The process is closed only after the threads reading it have returned.
+    val exitCode = process.use {
+        val code = coroutineScope {
+            launch(Dispatchers.IO) {
+                val buffer = ByteArray(MAKE_OUTPUT_BUFFER_SIZE)
+                while (true) {
+                    val bytes = process.outputStream.read(buffer)
+                    if (bytes < 0) {
+                        break
+                    }
+                    output?.write(buffer, 0, bytes)
+                }
+            }
+            val exit = async(Dispatchers.IO) { process.waitFor() }
+            try {
+                while (withTimeoutOrNull(MAKE_EVENT_POLL_INTERVAL_MILLIS) { exit.join() } == null) {
+                    takeEvents()
+                }
+            } catch (e: CancellationException) {
+                process.terminate()
+                throw e
+            }
+            exit.await()
+        }
+        takeEvents()
+        code
+    }
+    return MakeResult(exitCode, timings)
+}
@@ -0,0 +1,40 @@
+package io.github.sh4.zabuton.build;
+
+/**
+ * Job events of a {@link MakeProcess}, in the order make printed them. Times are nanoseconds
+ * since make was started.
+ */
+public class MakeEventBatch {
+    // Kinds shared with MakeEventKind in MakeProcess.h.
+    public static final int STARTED = 0;
+    public static final int FINISHED = 1;
+    public static final int FAILED = 2;
+
+    private final int count;
+    private final int[] kinds;
+    private final String[] targets;
+    private final long[] timesNanos;
+
+    private MakeEventBatch(int count, int[] kinds, String[] targets, long[] timesNanos) {
+        this.count = count;
+        this.kinds = kinds;
+        this.targets = targets;
+        this.timesNanos = timesNanos;
+    }
+
+    public int getCount() {
+        return count;
+    }
+
+    public int getKind(int index) {
+        return kinds[index];
+    }
+
+    public String getTarget(int index) {
+        return targets[index];
+    }
+
+    public long getTimeNanos(int index) {
+        return timesNanos[index];
+    }
+}
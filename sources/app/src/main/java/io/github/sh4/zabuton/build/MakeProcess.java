@@ -0,0 +1,93 @@
+package io.github.sh4.zabuton.build;
+
+import java.io.Closeable;
+import java.io.IOException;
+import java.io.InputStream;
+import java.util.Map;
+
+/**
+ * GNU make run natively (see MakeProcess.h). Its stdout and stderr are read together through
+ * {@link #getOutputStream()}, without the job lines of --debug=j, which are reported as
+ * {@link MakeEventBatch} events instead: when each target started and finished or failed.
+ * As with a pipe, the output must be read: make blocks once about a megabyte of it is waiting.
+ *
+ * The output and the events may be read from different threads while another waits in
+ * {@link #waitFor()}; {@link #close()} must not race with them.
+ */
+public class MakeProcess implements Closeable {
+    private long processHandle;
+    private final InputStream outputStream = new InputStream() {
+        private final byte[] oneByte = new byte[1];
+
+        @Override
+        public int read() {
+            return read(oneByte, 0, 1) < 0 ? -1 : oneByte[0] & 0xff;
+        }
+
+        @Override
+        public int read(byte[] b, int off, int len) {
+            if (off < 0 || len < 0 || len > b.length - off) {
+                throw new IndexOutOfBoundsException();
+            }
+            return len == 0 ? 0 : MakeProcess.this.read(b, off, len);
+        }
+    };
+
+    private MakeProcess(long processHandle) {
+        this.processHandle = processHandle;
+    }
+
+    /**
+     * The number of jobs worth running at once: the online cores but those of the slowest
+     * cluster, so that a long build stays off the little cores and heats the device less.
+     */
+    public static native int getDefaultJobCount();
+
+    /**
+     * Starts make in dir with args and exactly the given environment. --debug=j is added to the
+     * arguments.
+     */
+    public static MakeProcess start(String make, String[] args, Map<String, String> environment, String dir)
+            throws IOException {
+        String[] variables = new String[environment.size()];
+        int i = 0;
+        for (Map.Entry<String, String> variable : environment.entrySet()) {
+            variables[i++] = variable.getKey() + "=" + variable.getValue();
+        }
+        return start(make, args, variables, dir);
+    }
+
+    private static native MakeProcess start(String make, String[] args, String[] environment, String dir)
+            throws IOException;
+
+    /** The build output, ending once make and every process it started closed it. */
+    public InputStream getOutputStream() {
+        return outputStream;
+    }
+
+    // Blocks until some output is available; -1 at the end.
+    private native int read(byte[] b, int off, int len);
+
+    /** The events since the last call. */
+    public native MakeEventBatch takeEvents();
+
+    /** Waits for make to exit; its exit code, or 128 plus the number of the signal that killed it. */
+    public native int waitFor();
+
+    /** Sends SIGTERM to make and everything it started. */
+    public native void terminate();
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    // Kills make unless it has exited.
+    private native void destroy();
+}
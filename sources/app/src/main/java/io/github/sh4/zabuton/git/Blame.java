@@ -0,0 +1,34 @@
+package io.github.sh4.zabuton.git;
+
+/**
+ * The commit that last changed each line of a file, as runs of consecutive lines.
+ *
+ * Line numbers are 1-based. Run i covers getLineCount(i) lines from getStartLine(i) and belongs
+ * to commit getCommitIndex(i) of {@link #getCommits()}, which holds every blamed commit once with
+ * the requested fields and always its id.
+ */
+public class Blame {
+    private final int count;
+    private final int[] startLines;
+    private final int[] lineCounts;
+    private final int[] commitIndexes;
+    private final CommitLogBatch commits;
+
+    private Blame(int count, int[] startLines, int[] lineCounts, int[] commitIndexes, CommitLogBatch commits) {
+        this.count = count;
+        this.startLines = startLines;
+        this.lineCounts = lineCounts;
+        this.commitIndexes = commitIndexes;
+        this.commits = commits;
+    }
+
+    public int getCount() { return count; }
+    public int getStartLine(int index) { return startLines[index]; }
+    public int getLineCount(int index) { return lineCounts[index]; }
+    public int getCommitIndex(int index) { return commitIndexes[index]; }
+    public CommitLogBatch getCommits() { return commits; }
+
+    public String getCommitId(int index) {
+        return commits.getId(commitIndexes[index]);
+    }
+}
@@ -0,0 +1,52 @@
+package io.github.sh4.zabuton.git;
+
+import java.util.Collection;
+
+/**
+ * Narrows what {@link Repository#clone} downloads and writes to the working directory.
+ */
+public final class CloneOptions {
+    private String branch;
+    private String[] sparsePaths;
+    private String mirror;
+
+    /**
+     * Fetches and checks out only the given branch, without tags. Later fetches of the
+     * cloned remote stay limited to that branch.
+     */
+    public CloneOptions setSingleBranch(String branch) {
+        this.branch = branch;
+        return this;
+    }
+
+    /**
+     * Checks out only the given pathspecs (e.g. "keyboards/planck", "quantum").
+     * They are stored in the repository config and also applied to later checkouts and resets.
+     */
+    public CloneOptions setSparsePaths(Collection<String> paths) {
+        this.sparsePaths = paths == null ? null : paths.toArray(new String[0]);
+        return this;
+    }
+
+    /**
+     * Clones from a local bare mirror of the url (see {@link Repository#updateMirror}) instead of
+     * the network. The mirror's packs are hard-linked, so they take no extra space, and origin
+     * points to the url afterwards.
+     */
+    public CloneOptions setMirror(String mirrorPath) {
+        this.mirror = mirrorPath;
+        return this;
+    }
+
+    public String getSingleBranch() {
+        return branch;
+    }
+
+    public String[] getSparsePaths() {
+        return sparsePaths;
+    }
+
+    public String getMirror() {
+        return mirror;
+    }
+}
@@ -0,0 +1,115 @@
+package io.github.sh4.zabuton.git;
+
+import java.nio.charset.StandardCharsets;
+
+/**
+ * A page of commit history stored column by column.
+ *
+ * Commit ids are packed as raw 20-byte oids, times as epoch milliseconds with a separate
+ * timezone offset in minutes, and every string of the page shares one UTF-8 blob that is
+ * addressed through {@link #getTextOffsets()}. Columns that were not requested are null.
+ */
+public class CommitLogBatch {
+    public static final int FIELD_ID = 1;
+    public static final int FIELD_PARENTS = 1 << 1;
+    public static final int FIELD_AUTHOR = 1 << 2;
+    public static final int FIELD_COMMITTER = 1 << 3;
+    public static final int FIELD_MESSAGE = 1 << 4;
+    public static final int FIELD_ALL = FIELD_ID | FIELD_PARENTS | FIELD_AUTHOR | FIELD_COMMITTER | FIELD_MESSAGE;
+
+    public static final int OID_LENGTH = 20;
+
+    public static final int TEXT_AUTHOR_NAME = 0;
+    public static final int TEXT_AUTHOR_EMAIL = 1;
+    public static final int TEXT_COMMITTER_NAME = 2;
+    public static final int TEXT_COMMITTER_EMAIL = 3;
+    public static final int TEXT_MESSAGE = 4;
+    public static final int TEXT_COLUMNS = 5;
+
+    private static final char[] HEX_DIGITS = "0123456789abcdef".toCharArray();
+
+    private final int count;
+    private final int fields;
+    private final byte[] ids;
+    private final int[] parentOffsets;
+    private final byte[] parentIds;
+    private final long[] authorTimes;
+    private final int[] authorTimeOffsets;
+    private final long[] committerTimes;
+    private final int[] committerTimeOffsets;
+    private final byte[] text;
+    private final int[] textOffsets;
+
+    private CommitLogBatch(int count, int fields,
+                           byte[] ids,
+                           int[] parentOffsets, byte[] parentIds,
+                           long[] authorTimes, int[] authorTimeOffsets,
+                           long[] committerTimes, int[] committerTimeOffsets,
+                           byte[] text, int[] textOffsets) {
+        this.count = count;
+        this.fields = fields;
+        this.ids = ids;
+        this.parentOffsets = parentOffsets;
+        this.parentIds = parentIds;
+        this.authorTimes = authorTimes;
+        this.authorTimeOffsets = authorTimeOffsets;
+        this.committerTimes = committerTimes;
+        this.committerTimeOffsets = committerTimeOffsets;
+        this.text = text;
+        this.textOffsets = textOffsets;
+    }
+
+    public int getCount() { return count; }
+    public int getFields() { return fields; }
+
+    /** Raw oids, {@link #OID_LENGTH} bytes per commit. */
+    public byte[] getIds() { return ids; }
+
+    /** Parents of commit i are oids parentOffsets[i] until parentOffsets[i + 1] in {@link #getParentIds()}. */
+    public int[] getParentOffsets() { return parentOffsets; }
+    public byte[] getParentIds() { return parentIds; }
+
+    public long[] getAuthorTimes() { return authorTimes; }
+    public int[] getAuthorTimeOffsets() { return authorTimeOffsets; }
+    public long[] getCommitterTimes() { return committerTimes; }
+    public int[] getCommitterTimeOffsets() { return committerTimeOffsets; }
+
+    /** Column c of commit i spans textOffsets[i * TEXT_COLUMNS + c] until the next offset in {@link #getText()}. */
+    public byte[] getText() { return text; }
+    public int[] getTextOffsets() { return textOffsets; }
+
+    public String getId(int index) {
+        return ids == null ? null : toHex(ids, index * OID_LENGTH);
+    }
+
+    public int getParentCount(int index) {
+        return parentOffsets == null ? 0 : parentOffsets[index + 1] - parentOffsets[index];
+    }
+
+    public String getParentId(int index, int parent) {
+        return toHex(parentIds, (parentOffsets[index] + parent) * OID_LENGTH);
+    }
+
+    public String getText(int index, int column) {
+        if (textOffsets == null) {
+            return null;
+        }
+        int i = index * TEXT_COLUMNS + column;
+        int begin = textOffsets[i];
+        return new String(text, begin, textOffsets[i + 1] - begin, StandardCharsets.UTF_8);
+    }
+
+    public String getMessage(int index) {
+        return (fields & FIELD_MESSAGE) != 0 ? getText(index, TEXT_MESSAGE) : null;
+    }
+
+    private static String toHex(byte[] bytes, int offset) {
+        char[] hex = new char[OID_LENGTH * 2];
+        for (int i = 0; i < OID_LENGTH; i++) {
+            int b = bytes[offset + i] & 0xff;
+            hex[i * 2] = HEX_DIGITS[b >>> 4];
+            hex[i * 2 + 1] = HEX_DIGITS[b & 0x0f];
+        }
+        return new String(hex);
+    }
+}
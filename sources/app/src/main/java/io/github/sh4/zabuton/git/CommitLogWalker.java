@@ -0,0 +1,36 @@
+package io.github.sh4.zabuton.git;
+
+/**
+ * Cursor over the commit history, sorted by time, that is read in {@link CommitLogBatch} pages.
+ * The native calls are synchronized, so a close or the finalizer never frees the walker under a
+ * running {@link #next}.
+ */
+public class CommitLogWalker implements AutoCloseable {
+    // The walker borrows its own native handle, so it stays usable even if the repository is closed first.
+    private final Repository repository;
+    private long walkerHandle;
+
+    private CommitLogWalker(Repository repository, long walkerHandle) {
+        this.repository = repository;
+        this.walkerHandle = walkerHandle;
+    }
+
+    /**
+     * Reads up to maxCount commits, which must not be negative. A batch shorter than maxCount
+     * means the history is exhausted.
+     */
+    public synchronized native CommitLogBatch next(int maxCount, int fields);
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private synchronized native void destroy();
+}
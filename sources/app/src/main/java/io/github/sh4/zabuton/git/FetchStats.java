@@ -0,0 +1,59 @@
+package io.github.sh4.zabuton.git;
+
+/**
+ * What a {@link Repository#fetchStaged} transferred, summed over its stages.
+ */
+public final class FetchStats {
+    private final int stageCount;
+    private final int connectionCount;
+    private final long receivedBytes;
+    private final long receivedObjects;
+    private final long localObjects;
+    private final long indexedDeltas;
+    private final long elapsedNanos;
+
+    private FetchStats(int stageCount, int connectionCount, long receivedBytes, long receivedObjects,
+                       long localObjects, long indexedDeltas, long elapsedNanos) {
+        this.stageCount = stageCount;
+        this.connectionCount = connectionCount;
+        this.receivedBytes = receivedBytes;
+        this.receivedObjects = receivedObjects;
+        this.localObjects = localObjects;
+        this.indexedDeltas = indexedDeltas;
+        this.elapsedNanos = elapsedNanos;
+    }
+
+    public int getStageCount() {
+        return stageCount;
+    }
+
+    /** How many times the remote was connected; 1 when every stage reused the first connection. */
+    public int getConnectionCount() {
+        return connectionCount;
+    }
+
+    public long getReceivedBytes() {
+        return receivedBytes;
+    }
+
+    public long getReceivedObjects() {
+        return receivedObjects;
+    }
+
+    /** Objects the packs referred to that were taken from the repository instead of the network. */
+    public long getLocalObjects() {
+        return localObjects;
+    }
+
+    public long getIndexedDeltas() {
+        return indexedDeltas;
+    }
+
+    public long getElapsedNanos() {
+        return elapsedNanos;
+    }
+
+    public long getBytesPerSecond() {
+        return elapsedNanos > 0 ? receivedBytes * 1_000_000_000L / elapsedNanos : 0;
+    }
+}
@@ -0,0 +1,87 @@
+package io.github.sh4.zabuton.git;
+
+/**
+ * A clone, fetch, checkout or reset queued on the native git workers (see GitJobQueue.h), which
+ * run at most {@link #getMaxConcurrency()} operations at a time, higher priorities first. The
+ * {@link Callback} is called exactly once, on a worker thread, with what the blocking
+ * {@link Repository} method would have returned or thrown; nothing waits for it meanwhile.
+ *
+ * Progress is read from the monitor as for the blocking methods. Closing the job only releases
+ * its handle; the operation goes on unless it is cancelled.
+ */
+public class GitJob implements AutoCloseable {
+    public static final int PRIORITY_BACKGROUND = 0;
+    public static final int PRIORITY_NORMAL = 1;
+    public static final int PRIORITY_INTERACTIVE = 2;
+
+    public interface Callback {
+        /**
+         * result is the cloned Repository for a clone, the FetchStats for a staged fetch and null
+         * otherwise; error is null on success.
+         */
+        void onComplete(Object result, Throwable error);
+    }
+
+    private long jobHandle;
+    private final ProgressMonitor monitor;
+
+    private GitJob(long jobHandle, ProgressMonitor monitor) {
+        this.jobHandle = jobHandle;
+        this.monitor = monitor;
+    }
+
+    public static native GitJob clone(String url, String cloneRepoPath, CloneOptions options,
+                                      ProgressMonitor monitor, int priority, Callback callback);
+
+    public static native GitJob updateMirror(String url, String mirrorPath,
+                                             ProgressMonitor monitor, int priority, Callback callback);
+
+    /**
+     * Fetches the named remote from url, or from the remote's own url when null, like
+     * {@link Repository#fetch} and {@link Repository#fetchFromMirror}.
+     */
+    public static native GitJob fetch(Repository repository, String remoteName, String url,
+                                      ProgressMonitor monitor, int priority, Callback callback);
+
+    /** Completes with the {@link FetchStats} of {@link Repository#fetchStaged}. */
+    public static native GitJob fetchStaged(Repository repository, String remoteName, String url, int refsPerStage,
+                                            ProgressMonitor monitor, int priority, Callback callback);
+
+    public static native GitJob checkout(Repository repository, String refspec,
+                                         ProgressMonitor monitor, int priority, Callback callback);
+
+    public static native GitJob reset(Repository repository, ResetKind resetKind,
+                                      ProgressMonitor monitor, int priority, Callback callback);
+
+    /**
+     * A job still queued is removed and completed with a CancellationException before this
+     * returns; a running one stops at its next libgit2 callback and completes with one from its
+     * worker. A job that has completed is left alone.
+     */
+    public void cancel() {
+        monitor.cancel();
+        cancelQueued();
+    }
+
+    private native boolean cancelQueued();
+
+    /**
+     * Background jobs may take all workers but one when there are several, so that a job of a higher priority never
+     * waits for a worker behind them. 0 holds every queued job until it is raised again.
+     */
+    public static native void setMaxConcurrency(int concurrency);
+    public static native int getMaxConcurrency();
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
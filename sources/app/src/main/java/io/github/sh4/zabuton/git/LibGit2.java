@@ -2,4 +2,13 @@ package io.github.sh4.zabuton.git;
 
 public class LibGit2 {
     public static native void init(String sslCertificatePath);
+
+    /**
+     * Sets the threads that write the files of a clone or checkout. With 1 every checkout runs
+     * on libgit2's single thread; 0 restores the default, one per online core (up to 8). Small
+     * changes and working trees with local changes on the way are always left to libgit2.
+     */
+    public static native void setCheckoutThreads(int threads);
+
+    public static native int getCheckoutThreads();
 }
@@ -1,16 +1,42 @@
 package io.github.sh4.zabuton.git;
 
+/**
+ * A libgit2 failure: its return code (a git_error_code, such as -3 for GIT_ENOTFOUND), the
+ * git_error_t class of the error and its message, all captured natively when the call failed.
+ */
 public class LibGit2Exception extends Exception {
-    private static native String getLastError();
+    // The git_error_t classes of failures to reach or talk to a remote.
+    public static final int ERROR_CLASS_OS = 2;
+    public static final int ERROR_CLASS_NET = 12;
+    public static final int ERROR_CLASS_SSL = 16;
 
     private final int returnCode;
+    private final int errorClass;
+    private final String errorMessage;
 
-    public LibGit2Exception(int returnCode) {
-        super(getLastError());
+    public LibGit2Exception(int returnCode, int errorClass, String errorMessage) {
+        super(errorMessage);
         this.returnCode = returnCode;
+        this.errorClass = errorClass;
+        this.errorMessage = errorMessage;
     }
 
     public int getReturnCode() {
         return returnCode;
     }
+
+    public int getErrorClass() {
+        return errorClass;
+    }
+
+    /** Whether the failure was the network's, such as a dropped connection, which may pass on retry. */
+    public boolean isNetworkError() {
+        return errorClass == ERROR_CLASS_OS || errorClass == ERROR_CLASS_NET || errorClass == ERROR_CLASS_SSL;
+    }
+
+    @Override
+    public String getMessage() {
+        // Formatted on demand; most of these are caught without a look at the message.
+        return errorMessage.isEmpty() ? errorMessage : errorMessage + " (" + errorClass + ")";
+    }
 }
@@ -0,0 +1,103 @@
+package io.github.sh4.zabuton.git;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Progress of a clone, fetch, checkout or reset that the native side writes into a shared direct buffer.
+ * It can be polled from any thread without calling into native code, and {@link #cancel()} stops the
+ * running operation at its next libgit2 callback with a {@link java.util.concurrent.CancellationException}.
+ */
+public final class ProgressMonitor implements ICloneProgress {
+    public static final long DEFAULT_INTERVAL_MILLIS = 100;
+
+    // Slot layout shared with ProgressSlot in ProgressFields.h.
+    static final int SLOT_COMPLETED_STEPS = 0;
+    static final int SLOT_TOTAL_STEPS = 1;
+    static final int SLOT_TOTAL_OBJECTS = 2;
+    static final int SLOT_INDEXED_OBJECTS = 3;
+    static final int SLOT_RECEIVED_OBJECTS = 4;
+    static final int SLOT_LOCAL_OBJECTS = 5;
+    static final int SLOT_TOTAL_DELTAS = 6;
+    static final int SLOT_INDEXED_DELTAS = 7;
+    static final int SLOT_RECEIVED_BYTES = 8;
+    static final int SLOT_CANCELLED = 9;
+    static final int SLOT_COUNT = 10;
+
+    private final ByteBuffer state;
+    // Minimum time between two progress consumer upcalls.
+    private final long intervalNanos;
+    private volatile String sidebandMessage;
+
+    public ProgressMonitor() {
+        this(DEFAULT_INTERVAL_MILLIS);
+    }
+
+    public ProgressMonitor(long intervalMillis) {
+        this.state = ByteBuffer.allocateDirect(SLOT_COUNT * Long.BYTES).order(ByteOrder.nativeOrder());
+        this.intervalNanos = TimeUnit.MILLISECONDS.toNanos(intervalMillis);
+    }
+
+    public void cancel() {
+        state.putLong(SLOT_CANCELLED * Long.BYTES, 1);
+    }
+
+    public boolean isCancelled() {
+        return get(SLOT_CANCELLED) != 0;
+    }
+
+    private long get(int slot) {
+        return state.getLong(slot * Long.BYTES);
+    }
+
+    @Override
+    public long getCompletedSteps() {
+        return get(SLOT_COMPLETED_STEPS);
+    }
+
+    @Override
+    public long getTotalSteps() {
+        return get(SLOT_TOTAL_STEPS);
+    }
+
+    @Override
+    public long getTotalObjects() {
+        return get(SLOT_TOTAL_OBJECTS);
+    }
+
+    @Override
+    public long getIndexedObjects() {
+        return get(SLOT_INDEXED_OBJECTS);
+    }
+
+    @Override
+    public long getReceivedObjects() {
+        return get(SLOT_RECEIVED_OBJECTS);
+    }
+
+    @Override
+    public long getLocalObjects() {
+        return get(SLOT_LOCAL_OBJECTS);
+    }
+
+    @Override
+    public long getTotalDeltas() {
+        return get(SLOT_TOTAL_DELTAS);
+    }
+
+    @Override
+    public long getIndexedDeltas() {
+        return get(SLOT_INDEXED_DELTAS);
+    }
+
+    @Override
+    public long getReceivedBytes() {
+        return get(SLOT_RECEIVED_BYTES);
+    }
+
+    @Override
+    public String getSidebandMessage() {
+        return sidebandMessage;
+    }
+}
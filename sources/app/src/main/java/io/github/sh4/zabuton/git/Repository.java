@@ -3,7 +3,12 @@ package io.github.sh4.zabuton.git;
 import java.util.function.Consumer;
 import java.util.function.Function;
 
-public class Repository {
+/**
+ * A working tree opened through a native session. Repositories opened on the same path share the
+ * session and its libgit2 caches; fetch, checkout and reset are serialized, while the read-only
+ * queries may run concurrently from any thread. Close it to release the native handles.
+ */
+public class Repository implements AutoCloseable {
     private final long repositoryHandle;
 
     private Repository(long repositoryHandle) {
@@ -19,11 +24,94 @@ public class Repository {
     // remote: Total 169903 (delta 0), reused 1 (delta 0), pack-reused 169901
     // Receiving objects: 100% (169903/169903), 126.51 MiB | 5.29 MiB/s, done.
     // Resolving deltas: 100% (112118/112118), done.
-    public static native Repository clone(String url, String cloneRepoPath, Consumer<ICloneProgress> progress);
+    public static Repository clone(String url, String cloneRepoPath, Consumer<ICloneProgress> progress) {
+        return clone(url, cloneRepoPath, null, progress, null);
+    }
+
+    public static Repository clone(String url, String cloneRepoPath, ProgressMonitor monitor) {
+        return clone(url, cloneRepoPath, null, null, monitor);
+    }
+
+    public static Repository clone(String url, String cloneRepoPath,
+                                   Consumer<ICloneProgress> progress, ProgressMonitor monitor) {
+        return clone(url, cloneRepoPath, null, progress, monitor);
+    }
+
+    /**
+     * The options (optional) narrow the clone to one branch and/or a sparse set of paths.
+     * The progress consumer (optional) is called at most once per monitor interval and once more on completion.
+     * The monitor (optional) is updated on every libgit2 callback and can be used to cancel the clone.
+     */
+    public static native Repository clone(String url, String cloneRepoPath, CloneOptions options,
+                                          Consumer<ICloneProgress> progress, ProgressMonitor monitor);
 
-    public native void fetch(String remoteName, Consumer<IFetchProgress> progress);
-    public native void checkout(String refspec, Consumer<ICheckoutProgress> progress);
-    public native void reset(ResetKind resetKind, Consumer<ICheckoutProgress> progress);
+    /**
+     * Creates a bare mirror of url at mirrorPath (every ref of the remote under its own name), or
+     * fetches into it and prunes deleted refs if it exists. Worktrees are then cloned from the
+     * mirror with {@link CloneOptions#setMirror} and fetched with {@link #fetchFromMirror}.
+     * Callers serialize operations on one mirror.
+     */
+    public static native void updateMirror(String url, String mirrorPath,
+                                           Consumer<IFetchProgress> progress, ProgressMonitor monitor);
+
+    public void fetch(String remoteName, Consumer<IFetchProgress> progress) {
+        fetch(remoteName, progress, null);
+    }
+
+    public void fetch(String remoteName, ProgressMonitor monitor) {
+        fetch(remoteName, null, monitor);
+    }
+
+    public void fetch(String remoteName, Consumer<IFetchProgress> progress, ProgressMonitor monitor) {
+        fetchFrom(remoteName, null, progress, monitor);
+    }
+
+    /**
+     * Fetches the refs of the named remote from a local mirror of it instead of its url.
+     */
+    public void fetchFromMirror(String remoteName, String mirrorPath, ProgressMonitor monitor) {
+        fetchFrom(remoteName, mirrorPath, null, monitor);
+    }
+
+    // Fetches from url, or from the remote's own url when null.
+    private native void fetchFrom(String remoteName, String url, Consumer<IFetchProgress> progress, ProgressMonitor monitor);
+
+    /**
+     * Fetches the branches of the named remote (from url instead when not null) in stages of
+     * refsPerStage branches, the branch its HEAD points to first, each downloaded into a pack of
+     * its own and its tracking refs updated before the next stage starts. Over smart HTTP and
+     * from local paths the stages share one connection. When the connection drops, the stages
+     * done are kept, so fetching again only transfers the rest: a pack cannot be resumed halfway,
+     * but a stage can be made small. The monitor's completed and total steps count the stages.
+     */
+    public native FetchStats fetchStaged(String remoteName, String url, int refsPerStage, ProgressMonitor monitor);
+
+    /**
+     * Writes every object reachable from the refs of a bare repository into a single pack and
+     * deletes the loose objects and the other packs, as git gc does for a mirror. Deltas are
+     * computed anew, so this takes a while on a large repository.
+     */
+    public native void repack();
+
+    public void checkout(String refspec, Consumer<ICheckoutProgress> progress) {
+        checkout(refspec, progress, null);
+    }
+
+    public void checkout(String refspec, ProgressMonitor monitor) {
+        checkout(refspec, null, monitor);
+    }
+
+    public native void checkout(String refspec, Consumer<ICheckoutProgress> progress, ProgressMonitor monitor);
+
+    public void reset(ResetKind resetKind, Consumer<ICheckoutProgress> progress) {
+        reset(resetKind, progress, null);
+    }
+
+    public void reset(ResetKind resetKind, ProgressMonitor monitor) {
+        reset(resetKind, null, monitor);
+    }
+
+    public native void reset(ResetKind resetKind, Consumer<ICheckoutProgress> progress, ProgressMonitor monitor);
 
     public native String getHeadName();
     public native String[] getRemoteBranchNames();
@@ -33,6 +121,71 @@ public class Repository {
 
     public native void log(Function<ICommitObject, Boolean> callback);
 
+    /**
+     * Opens a time-sorted history cursor starting at the given revision (HEAD when null).
+     */
+    public native CommitLogWalker logWalker(String start);
+
+    /**
+     * Reads the first maxCount commits reachable from start in a single native call.
+     */
+    public CommitLogBatch logBatch(String start, int maxCount, int fields) {
+        try (CommitLogWalker walker = logWalker(start)) {
+            return walker.next(maxCount, fields);
+        }
+    }
+
+    /**
+     * Commits reachable from start (HEAD when null) that changed path, a file or a directory such
+     * as "keyboards/planck/keymaps/default", newest first and at most limit of them. Like git log
+     * -- path, a merge is only listed when path differs from every parent, and otherwise only
+     * the parent it came from is followed.
+     */
+    public native CommitLogBatch logForPath(String start, String path, int limit, int fields);
+
+    public CommitLogBatch logForPath(String path, int limit) {
+        return logForPath(null, path, limit, CommitLogBatch.FIELD_ALL);
+    }
+
+    /**
+     * Blames each line of the file at path in start (HEAD when null) on the commit that last
+     * changed it. Lines brought in by the second parent of a merge are blamed on the merge.
+     */
+    public native Blame blame(String start, String path, int fields);
+
+    public Blame blame(String path) {
+        return blame(null, path, CommitLogBatch.FIELD_ALL);
+    }
+
+    /**
+     * Counts the commits reachable from local but not from upstream and the reverse, returned as
+     * {ahead, behind}. Both are revisions, such as "master" and "origin/master".
+     */
+    public native int[] aheadBehind(String local, String upstream);
+
+    /**
+     * Adds the commits reachable from the refs to the commit index that log walks and
+     * {@link #aheadBehind} read instead of the commit objects. Clone and fetch update it by
+     * themselves; commits made otherwise are found the slow way until the next update.
+     */
+    public native void updateCommitIndex();
+
+    /**
+     * Changed paths of the working tree. Options are StatusList.INCLUDE_* bits. Without pathspecs
+     * the whole tree is scanned, and repeated scans only look at what changed on disk since the
+     * previous one. Paths outside a sparse checkout are never reported.
+     */
+    public native StatusList status(int options, String[] pathspecs);
+
+    public StatusList status() {
+        return status(StatusList.INCLUDE_UNTRACKED, null);
+    }
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
     @Override
     protected void finalize() throws Throwable {
         destroy();
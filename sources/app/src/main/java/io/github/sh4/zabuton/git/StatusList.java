@@ -0,0 +1,62 @@
+package io.github.sh4.zabuton.git;
+
+import java.nio.charset.StandardCharsets;
+
+/**
+ * Changed paths of a working tree, sorted by path.
+ *
+ * Statuses are git_status_t bit sets, so a path staged and modified again has both an INDEX_ and
+ * a WT_ bit. Untracked directories that are not recursed into end with '/'. All paths share one
+ * UTF-8 blob that is addressed through pathOffsets.
+ */
+public class StatusList {
+    // Options of Repository.status
+    public static final int INCLUDE_UNTRACKED = 1;
+    public static final int RECURSE_UNTRACKED_DIRS = 1 << 1;
+    public static final int INCLUDE_IGNORED = 1 << 2;
+
+    public static final int INDEX_NEW = 1;
+    public static final int INDEX_MODIFIED = 1 << 1;
+    public static final int INDEX_DELETED = 1 << 2;
+    public static final int INDEX_RENAMED = 1 << 3;
+    public static final int INDEX_TYPECHANGE = 1 << 4;
+    public static final int WT_NEW = 1 << 7;
+    public static final int WT_MODIFIED = 1 << 8;
+    public static final int WT_DELETED = 1 << 9;
+    public static final int WT_TYPECHANGE = 1 << 10;
+    public static final int WT_RENAMED = 1 << 11;
+    public static final int WT_UNREADABLE = 1 << 12;
+    public static final int IGNORED = 1 << 14;
+    public static final int CONFLICTED = 1 << 15;
+
+    private final int count;
+    private final int[] statuses;
+    private final byte[] paths;
+    private final int[] pathOffsets;
+
+    private StatusList(int count, int[] statuses, byte[] paths, int[] pathOffsets) {
+        this.count = count;
+        this.statuses = statuses;
+        this.paths = paths;
+        this.pathOffsets = pathOffsets;
+    }
+
+    public int getCount() { return count; }
+    public boolean isEmpty() { return count == 0; }
+
+    public int getStatus(int index) { return statuses[index]; }
+
+    public String getPath(int index) {
+        int begin = pathOffsets[index];
+        return new String(paths, begin, pathOffsets[index + 1] - begin, StandardCharsets.UTF_8);
+    }
+
+    public int indexOf(String path) {
+        for (int i = 0; i < count; i++) {
+            if (getPath(i).equals(path)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+}
@@ -1,21 +1,33 @@
 package io.github.sh4.zabuton.programmer;
 
 import android.util.Log;
+import android.util.SparseArray;
 
 import com.hoho.android.usbserial.driver.UsbSerialPort;
 
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
 import java.io.DataInputStream;
 import java.io.DataOutputStream;
 import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
 import java.nio.charset.StandardCharsets;
+import java.util.Arrays;
 import java.util.concurrent.atomic.AtomicInteger;
 
 public class FirmwareProgrammerServer {
     private static final String TAG = FirmwareProgrammerServer.class.getSimpleName();
     private static final int MAX_BUFFER_SIZE = 1024 * 128;
     private static final int DEFAULT_TIMEOUT_MILLISECONDS = 1000 * 5;
+    private static final int PROTOCOL_VERSION = 2;
+    // Bytes of responses a v2 client may leave unread while it keeps sending requests. Kept below
+    // the pipe capacity, so the server never blocks on a response while the client blocks on a request.
+    private static final int WINDOW_BYTES = 1024 * 32;
+    private static final int MAX_POOLED_BUFFERS = 16;
+    // Only coalesces the response headers on the shared memory transport; payloads are larger and
+    // go straight to the ring.
+    private static final int SHARED_MEMORY_HEADER_BUFFER_SIZE = 64;
 
     private class Error {
         static final int GENERIC_ERROR = -1024;
@@ -40,6 +52,9 @@ public class FirmwareProgrammerServer {
         static final int SET_RTS = 12;
         static final int GET_LAST_ERROR = 13;
         static final int SET_PROGRESS = 14;
+        // Protocol version 2
+        static final int HELLO = 15;
+        static final int BULK_WRITE = 16;
     }
 
     private final UsbSerialPort usbSerialPort;
@@ -47,15 +62,17 @@ public class FirmwareProgrammerServer {
     private final DataOutputStream outputStream;
     private final AtomicInteger percentProgress;
     private final AtomicInteger elapsedTimeMilliseconds;
+    // Transfer buffers by length; the serial port reads and writes whole arrays.
+    private final SparseArray<byte[]> bufferPool = new SparseArray<>();
     private Throwable lastException;
     private Thread serverThread;
     private boolean serverClosed;
 
 
-    private FirmwareProgrammerServer(UsbSerialPort usbSerialPort, InputStream input, OutputStream output) {
+    private FirmwareProgrammerServer(UsbSerialPort usbSerialPort, DataInputStream inputStream, DataOutputStream outputStream) {
         this.usbSerialPort = usbSerialPort;
-        this.inputStream = new DataInputStream(input);
-        this.outputStream = new DataOutputStream(output);
+        this.inputStream = inputStream;
+        this.outputStream = outputStream;
         this.percentProgress = new AtomicInteger();
         this.elapsedTimeMilliseconds = new AtomicInteger();
     }
@@ -76,7 +93,7 @@ public class FirmwareProgrammerServer {
         inputStream.close();
         outputStream.close();
         serverClosed = true;
-        serverThread.wait();
+        serverThread.join();
         serverThread = null;
         serverClosed = false;
     }
@@ -94,7 +111,10 @@ public class FirmwareProgrammerServer {
                     if (!executeCommand(inputStream, outputStream)) {
                         break;
                     }
-                    outputStream.flush();
+                    // A v2 client sends requests ahead of the responses; answer them in one write.
+                    if (inputStream.available() == 0) {
+                        outputStream.flush();
+                    }
                 }
             } catch (IOException e) {
                 Log.d(TAG, "Server socket error occurred: " + e.toString());
@@ -174,17 +194,116 @@ public class FirmwareProgrammerServer {
             case Command.SET_PROGRESS:
                 commandSetProgress(inputStream, outputStream);
                 break;
+            // HELLO C:[Command 15 (1byte)][client protocol version (4byte)]
+            // S:[server protocol version (4byte)][max buffer size (4byte)][window bytes (4byte)]
+            // From version 2 the client may send requests without waiting for the responses of the
+            // previous ones, as long as the responses it has not read add up to at most window bytes.
+            // Requests are executed and answered in order.
+            case Command.HELLO:
+                commandHello(inputStream, outputStream);
+                break;
+            // BULK_WRITE C:[Command 16 (1byte)][ChunkCount (4byte)][AckLength (4byte)][AckTimeoutMilliseconds (4byte)]
+            // and ChunkCount times [ChunkLength (4byte)][ChunkBytes... (ChunkLength)]
+            // S:ChunkCount times [AckBytes... (AckLength)], then [Response Error.GENERIC_ERROR or WrittenByteLength (4byte)]
+            // Each chunk is written to the port, then AckLength bytes are read back from it, so a whole
+            // flash image with a device reply per page costs one round trip. After an error the
+            // remaining chunks are skipped and their acks are zero.
+            case Command.BULK_WRITE:
+                commandBulkWrite(inputStream, outputStream);
+                break;
             default:
                 break;
         }
         return true;
     }
 
+    private byte[] getBuffer(int length) {
+        byte[] buffer = bufferPool.get(length);
+        if (buffer == null) {
+            if (bufferPool.size() >= MAX_POOLED_BUFFERS) {
+                bufferPool.clear();
+            }
+            buffer = new byte[length];
+            bufferPool.put(length, buffer);
+        }
+        return buffer;
+    }
+
+    private void commandHello(DataInputStream inputStream, DataOutputStream outputStream) throws IOException {
+        int clientVersion = inputStream.readInt();
+        Log.d(TAG, "commandHello: clientVersion=" + clientVersion);
+        outputStream.writeInt(PROTOCOL_VERSION);
+        outputStream.writeInt(MAX_BUFFER_SIZE);
+        outputStream.writeInt(WINDOW_BYTES);
+    }
+
+    private void commandBulkWrite(DataInputStream inputStream, DataOutputStream outputStream) throws IOException {
+        int chunkCount = inputStream.readInt();
+        int ackLength = inputStream.readInt();
+        int ackTimeoutMilliseconds = inputStream.readInt();
+        long writtenBytes = 0;
+        IOException error = null;
+        if (ackLength < 0 || ackLength > MAX_BUFFER_SIZE) {
+            error = new IOException("ack length out of range: " + ackLength);
+            ackLength = 0;
+        }
+        byte[] ack = ackLength > 0 ? getBuffer(ackLength) : null;
+        for (int i = 0; i < chunkCount; i++) {
+            int chunkLength = inputStream.readInt();
+            for (int offset = 0; offset < chunkLength; offset += MAX_BUFFER_SIZE) {
+                byte[] buffer = getBuffer(Math.min(chunkLength - offset, MAX_BUFFER_SIZE));
+                inputStream.readFully(buffer);
+                if (error == null) {
+                    try {
+                        writtenBytes += usbSerialPort.write(buffer, DEFAULT_TIMEOUT_MILLISECONDS);
+                    } catch (IOException e) {
+                        error = e;
+                    }
+                }
+            }
+            if (ack == null) {
+                continue;
+            }
+            int readBytes = 0;
+            if (error == null) {
+                try {
+                    readBytes = readAck(ack, ackTimeoutMilliseconds);
+                    if (readBytes < ack.length) {
+                        error = new IOException("ack timed out after chunk " + i + ": " + readBytes + "/" + ack.length + " bytes");
+                    }
+                } catch (IOException e) {
+                    error = e;
+                }
+            }
+            Arrays.fill(ack, readBytes, ack.length, (byte) 0);
+            outputStream.write(ack);
+        }
+        if (error != null) {
+            setLastException(outputStream, error);
+            return;
+        }
+        outputStream.writeInt((int) writtenBytes);
+    }
+
+    // Reads until ack is full or the port has nothing more within the timeout.
+    private int readAck(byte[] ack, int timeoutMilliseconds) throws IOException {
+        int readBytes = 0;
+        while (readBytes < ack.length) {
+            byte[] buffer = getBuffer(ack.length - readBytes);
+            int n = usbSerialPort.read(buffer, timeoutMilliseconds);
+            if (n <= 0) {
+                break;
+            }
+            System.arraycopy(buffer, 0, ack, readBytes, n);
+            readBytes += n;
+        }
+        return readBytes;
+    }
+
     private void commandSetProgress(DataInputStream inputStream, DataOutputStream outputStream) throws IOException {
         try {
             int progress = inputStream.readByte(); // 0-100
             int elapsed = inputStream.readInt();
-            Log.d(TAG, "commandSetProgress: percentProgress=" + progress + ", elapsed=" + elapsed + "ms");
             percentProgress.set(progress);
             elapsedTimeMilliseconds.set(elapsed);
             outputStream.writeInt(0);
@@ -196,13 +315,14 @@ public class FirmwareProgrammerServer {
 
     private void commandGetLastError(DataInputStream inputStream, DataOutputStream outputStream) throws IOException {
         Log.d(TAG, "commandGetLastError");
+        // Always consumed, so a pipelined request stream stays in sync.
+        int clientBufferSize = inputStream.readInt();
         if (lastException == null) {
             outputStream.writeInt(Error.LAST_ERROR_IS_EMPTY);
             return;
         }
         String exceptionMessage = lastException.toString();
         byte[] bytes = exceptionMessage.getBytes(StandardCharsets.UTF_8);
-        int clientBufferSize = inputStream.readInt();
         if (bytes.length > clientBufferSize) {
             outputStream.writeInt(Error.INEFFICIENT_BUFFER);
             outputStream.writeInt(bytes.length);
@@ -309,14 +429,10 @@ public class FirmwareProgrammerServer {
             int writeBytesLength = inputStream.readInt();
             int writtenBytes = 0;
             if (writeBytesLength > 0) {
-                byte[] buffer = new byte[writeBytesLength];
-                int readBytes = 0;
-                while (readBytes < writeBytesLength) {
-                    readBytes += inputStream.read(buffer, readBytes, writeBytesLength - readBytes);
-                }
+                byte[] buffer = getBuffer(writeBytesLength);
+                inputStream.readFully(buffer);
                 writtenBytes = usbSerialPort.write(buffer, DEFAULT_TIMEOUT_MILLISECONDS);
             }
-            Log.d(TAG, "commandWrite bufferLength=" + writeBytesLength + ", writtenBytes=" + writtenBytes);
             outputStream.writeInt(writtenBytes);
         } catch (IOException e) {
             setLastException(outputStream, e);
@@ -328,9 +444,8 @@ public class FirmwareProgrammerServer {
             int bufferLength = inputStream.readInt();
             int timeoutMilliseconds = inputStream.readInt();
 
-            byte[] buffer = new byte[Math.min(bufferLength, MAX_BUFFER_SIZE)];
+            byte[] buffer = getBuffer(Math.min(bufferLength, MAX_BUFFER_SIZE));
             int readBytes = usbSerialPort.read(buffer, timeoutMilliseconds);
-            Log.d(TAG, "commandRead: bufferLength=" + bufferLength + ", readBytes=" + readBytes + ", timeout=" + timeoutMilliseconds);
             outputStream.writeInt(readBytes);
             if (readBytes > 0) {
                 outputStream.write(buffer, 0, readBytes);
@@ -360,9 +475,24 @@ public class FirmwareProgrammerServer {
     }
 
     public static FirmwareProgrammerServer startServer(UsbSerialPort openedUsbSerialPort, InputStream input, OutputStream output) throws IOException {
-        FirmwareProgrammerServer server = new FirmwareProgrammerServer(openedUsbSerialPort, input, output);
+        FirmwareProgrammerServer server = new FirmwareProgrammerServer(openedUsbSerialPort,
+                new DataInputStream(new BufferedInputStream(input, MAX_BUFFER_SIZE)),
+                new DataOutputStream(new BufferedOutputStream(output, MAX_BUFFER_SIZE)));
         server.start();
         Log.d(TAG, "server started.");
         return server;
     }
+
+    /**
+     * Serves the same commands over shared memory. The ring already buffers, so payloads are
+     * copied once between it and the transfer buffers.
+     */
+    public static FirmwareProgrammerServer startServer(UsbSerialPort openedUsbSerialPort, SharedMemoryTransport transport) {
+        FirmwareProgrammerServer server = new FirmwareProgrammerServer(openedUsbSerialPort,
+                new DataInputStream(transport.getInputStream()),
+                new DataOutputStream(new BufferedOutputStream(transport.getOutputStream(), SHARED_MEMORY_HEADER_BUFFER_SIZE)));
+        server.start();
+        Log.d(TAG, "server started on shared memory.");
+        return server;
+    }
 }
@@ -0,0 +1,151 @@
+package io.github.sh4.zabuton.programmer;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+
+/**
+ * Connects avrdude and {@link FirmwareProgrammerServer} through two ring buffers in a shared memory
+ * file instead of the process pipes (see the layout in SharedRing.h). Reads and writes copy
+ * straight between the mapped rings and the caller's arrays, and a side waiting for the other
+ * sleeps on a futex in the mapping.
+ *
+ * The server end is created with one of the create methods and the client end maps the same file
+ * with {@link #connect(String)}. The streams may be used from one reading and one writing thread;
+ * {@link #close()} must not race with them.
+ */
+public class SharedMemoryTransport implements Closeable {
+    public static final int DEFAULT_CAPACITY = 1024 * 256;
+
+    private long transportHandle;
+    private String path;
+    private final InputStream inputStream = new InputStream() {
+        private final byte[] oneByte = new byte[1];
+
+        @Override
+        public int read() throws IOException {
+            return read(oneByte, 0, 1) < 0 ? -1 : oneByte[0] & 0xff;
+        }
+
+        @Override
+        public int read(byte[] b, int off, int len) throws IOException {
+            checkRange(b, off, len);
+            return len == 0 ? 0 : SharedMemoryTransport.this.read(b, off, len);
+        }
+
+        @Override
+        public int available() {
+            return SharedMemoryTransport.this.available();
+        }
+
+        @Override
+        public void close() {
+            closeInput();
+        }
+    };
+    private final OutputStream outputStream = new OutputStream() {
+        private final byte[] oneByte = new byte[1];
+
+        @Override
+        public void write(int b) throws IOException {
+            oneByte[0] = (byte) b;
+            write(oneByte, 0, 1);
+        }
+
+        @Override
+        public void write(byte[] b, int off, int len) throws IOException {
+            checkRange(b, off, len);
+            if (len > 0) {
+                SharedMemoryTransport.this.write(b, off, len);
+            }
+        }
+
+        @Override
+        public void close() {
+            closeOutput();
+        }
+    };
+
+    private SharedMemoryTransport(long transportHandle) {
+        this.transportHandle = transportHandle;
+    }
+
+    /**
+     * Creates the server end in an anonymous memfd. Its {@link #getPath()} only opens in this
+     * process, which is enough for a loopback client.
+     */
+    public static SharedMemoryTransport create(int capacity) throws IOException {
+        SharedMemoryTransport transport = createInMemory(capacity);
+        transport.path = "/proc/self/fd/" + transport.getFd();
+        return transport;
+    }
+
+    /**
+     * Creates the server end in file, which a client in another process, such as avrdude, opens by
+     * its path.
+     */
+    public static SharedMemoryTransport create(File file, int capacity) throws IOException {
+        SharedMemoryTransport transport = open(file.getAbsolutePath(), capacity, true);
+        transport.path = file.getAbsolutePath();
+        return transport;
+    }
+
+    public static SharedMemoryTransport connect(String path) throws IOException {
+        SharedMemoryTransport transport = open(path, 0, false);
+        transport.path = path;
+        return transport;
+    }
+
+    public String getPath() {
+        return path;
+    }
+
+    /** Reads what the other end writes. Closing it makes the other end's writes fail. */
+    public InputStream getInputStream() {
+        return inputStream;
+    }
+
+    /** Writes what the other end reads. Closing it ends the other end's stream once drained. */
+    public OutputStream getOutputStream() {
+        return outputStream;
+    }
+
+    private static void checkRange(byte[] b, int off, int len) {
+        if (off < 0 || len < 0 || len > b.length - off) {
+            throw new IndexOutOfBoundsException();
+        }
+    }
+
+    private static native SharedMemoryTransport createInMemory(int capacity) throws IOException;
+
+    private static native SharedMemoryTransport open(String path, int capacity, boolean create) throws IOException;
+
+    private native int getFd();
+
+    private native int available();
+
+    // Blocks until at least one byte is readable; -1 at the end of the stream.
+    private native int read(byte[] b, int off, int len);
+
+    // Blocks until all of len bytes are written.
+    private native void write(byte[] b, int off, int len) throws IOException;
+
+    private native void closeInput();
+
+    private native void closeOutput();
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
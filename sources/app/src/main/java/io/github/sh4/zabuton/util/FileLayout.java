@@ -0,0 +1,19 @@
+package io.github.sh4.zabuton.util;
+
+import java.io.IOException;
+
+/**
+ * Applies permissions and symlinks to an extracted tree in a single native call.
+ */
+public final class FileLayout {
+    private FileLayout() {
+    }
+
+    /**
+     * Sets the permission bits of root/paths[i] to modes[i], then points root/linkPaths[i] at
+     * linkTargets[i]. Links that already point there are left alone, and a regular file is never
+     * replaced by a link.
+     */
+    public static native void apply(String root, String[] paths, int[] modes,
+                                    String[] linkPaths, String[] linkTargets) throws IOException;
+}
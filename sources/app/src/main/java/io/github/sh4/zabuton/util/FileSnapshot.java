@@ -0,0 +1,84 @@
+package io.github.sh4.zabuton.util;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.IOException;
+
+/**
+ * The size, mtime, inode and mode of every file below a directory, taken natively with
+ * getdents64 and fstatat on several threads (see FileSnapshot.h). Two snapshots of the same tree
+ * tell which files changed without running make over it.
+ */
+public final class FileSnapshot implements Closeable {
+    private long snapshotHandle;
+
+    private FileSnapshot(long snapshotHandle) {
+        this.snapshotHandle = snapshotHandle;
+    }
+
+    /**
+     * Files added, removed and modified between two snapshots, as paths relative to the root
+     * with '/' separators, each sorted.
+     */
+    public static final class Changes {
+        private final String[] added;
+        private final String[] removed;
+        private final String[] modified;
+
+        private Changes(String[] added, String[] removed, String[] modified) {
+            this.added = added;
+            this.removed = removed;
+            this.modified = modified;
+        }
+
+        public String[] getAdded() {
+            return added;
+        }
+
+        public String[] getRemoved() {
+            return removed;
+        }
+
+        public String[] getModified() {
+            return modified;
+        }
+
+        public boolean isEmpty() {
+            return added.length == 0 && removed.length == 0 && modified.length == 0;
+        }
+    }
+
+    /**
+     * Snapshots root, skipping every directory named one of excludedNames. threads is the number
+     * of walking threads, 0 for one per core.
+     */
+    public static native FileSnapshot take(String root, String[] excludedNames, int threads) throws IOException;
+
+    public static FileSnapshot take(File root, String... excludedNames) throws IOException {
+        return take(root.getAbsolutePath(), excludedNames, 0);
+    }
+
+    /** Reads a snapshot written by {@link #save(String)}; null if file is missing or unreadable. */
+    public static native FileSnapshot load(String path);
+
+    /** Writes the snapshot to path, replacing what was there atomically. */
+    public native void save(String path) throws IOException;
+
+    public native int getFileCount();
+
+    /** The changes from previous to this snapshot; every file is added when previous is null. */
+    public native Changes changesSince(FileSnapshot previous);
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
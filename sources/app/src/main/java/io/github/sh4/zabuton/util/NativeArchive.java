@@ -0,0 +1,31 @@
+package io.github.sh4.zabuton.util;
+
+import java.io.IOException;
+
+/**
+ * An archive whose entries are extracted natively on several threads, see extractArchive in
+ * ParallelZipExtractor.kt.
+ *
+ * {@link #getExtractedBytes()} and {@link #cancel()} may be called from any thread while
+ * extracting; the other methods must not race with each other.
+ */
+public interface NativeArchive extends AutoCloseable {
+    int getEntryCount();
+
+    long getUncompressedSize();
+
+    /**
+     * Extracts the named entries, or every entry when names is null, below extractDir using up
+     * to the given number of threads. Existing files are replaced atomically.
+     *
+     * @throws java.util.concurrent.CancellationException when {@link #cancel()} was called.
+     */
+    void extract(String extractDir, String[] names, int threads) throws IOException;
+
+    long getExtractedBytes();
+
+    void cancel();
+
+    @Override
+    void close();
+}
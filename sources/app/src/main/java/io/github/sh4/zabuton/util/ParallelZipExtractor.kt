@@ -1,11 +1,128 @@
 package io.github.sh4.zabuton.util
 
 import kotlinx.coroutines.*
+import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.channels.ReceiveChannel
 import java.io.File
 import java.io.InputStream
 import java.util.zip.ZipInputStream
 
+private const val EXTRACT_PROGRESS_POLL_INTERVAL_MILLIS = 100L
+private const val STREAM_CHUNK_SIZE = 64 * 1024
+// Chunks read ahead of the inflater, 4MiB at most.
+private const val STREAM_QUEUED_CHUNKS = 64
+
+/**
+ * Extracts [open]'s archive natively, reading its directory once and decoding entries on
+ * [parallelLevel] threads with random access. Only [names] are extracted when given, and [total]
+ * is then their uncompressed size. Cancelling the calling coroutine stops the extraction between
+ * two chunks.
+ */
+suspend fun extractArchive(
+        open: () -> NativeArchive,
+        extractDir: File,
+        block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit,
+        defaultProgressContext: ProgressContext<Unit>? = null,
+        parallelLevel: Int = Runtime.getRuntime().availableProcessors(),
+        names: Collection<String>? = null,
+        total: Long? = null
+) = coroutineScope {
+    val progressContext = defaultProgressContext ?: ProgressContext(this, block)
+    open().use { archive ->
+        val progress = progressContext.next(ProgressType.ExtractZip, total ?: archive.uncompressedSize)
+        // The archive is closed only after the native extraction has returned.
+        coroutineScope {
+            val task = launch(Dispatchers.IO) {
+                archive.extract(extractDir.absolutePath, names?.toTypedArray(), parallelLevel.coerceAtLeast(1))
+            }
+            try {
+                while (withTimeoutOrNull(EXTRACT_PROGRESS_POLL_INTERVAL_MILLIS) { task.join() } == null) {
+                    progress.report(archive.extractedBytes)
+                }
+            } catch (e: CancellationException) {
+                archive.cancel()
+                throw e
+            }
+        }
+        progress.finish()
+    }
+    if (defaultProgressContext == null) {
+        progressContext.finish()
+    }
+}
+
+private class StreamChunk(val buffer: ByteArray, val size: Int)
+
+/**
+ * Extracts the zip read from [input] while it is still arriving, e.g. an HTTP response body. One
+ * coroutine reads [input] into a bounded queue while another inflates the queued chunks natively
+ * (see [ZipStream]), so the whole takes about as long as the slower of the two and the archive is
+ * never stored. [total] is the size of the archive, or [PROGRESS_NOT_SPECIFIED]. [spillFile] is
+ * only created for archives holding stored entries with data descriptors, and removed at once.
+ */
+suspend fun extractZipStream(
+        input: InputStream,
+        total: Long,
+        extractDir: File,
+        spillFile: File,
+        block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit,
+        defaultProgressContext: ProgressContext<Unit>? = null,
+        parallelLevel: Int = Runtime.getRuntime().availableProcessors()
+) = coroutineScope {
+    val progressContext = defaultProgressContext ?: ProgressContext(this, block)
+    val downloadProgress = progressContext.next(ProgressType.DownloadFile, total)
+    val extractProgress = progressContext.next(ProgressType.ExtractZip, PROGRESS_NOT_SPECIFIED)
+    ZipStream.create(extractDir, spillFile).use { stream ->
+        // The stream is closed only after the native extraction has returned.
+        coroutineScope {
+            val chunks = Channel<StreamChunk>(STREAM_QUEUED_CHUNKS)
+            launch(Dispatchers.IO) {
+                var failure: Throwable? = null
+                try {
+                    while (true) {
+                        val buffer = ByteArray(STREAM_CHUNK_SIZE)
+                        val bytes = input.read(buffer)
+                        if (bytes < 0) {
+                            break
+                        }
+                        downloadProgress.reportAdvance(bytes.toLong())
+                        chunks.send(StreamChunk(buffer, bytes))
+                    }
+                    downloadProgress.finish()
+                } catch (e: Throwable) {
+                    failure = e
+                    throw e
+                } finally {
+                    chunks.close(failure)
+                }
+            }
+            val task = launch(Dispatchers.IO) {
+                for (chunk in chunks) {
+                    stream.write(chunk.buffer, 0, chunk.size)
+                }
+                stream.finish(parallelLevel.coerceAtLeast(1))
+            }
+            try {
+                while (withTimeoutOrNull(EXTRACT_PROGRESS_POLL_INTERVAL_MILLIS) { task.join() } == null) {
+                    extractProgress.report(stream.extractedBytes)
+                }
+            } catch (e: CancellationException) {
+                stream.cancel()
+                throw e
+            }
+        }
+        extractProgress.report(stream.extractedBytes)
+        extractProgress.finish()
+    }
+    if (defaultProgressContext == null) {
+        progressContext.finish()
+    }
+}
+
+/**
+ * Extracts a zip that is only available as a stream. Every worker re-reads the stream up to its
+ * share of the entries, so prefer [extractArchive] when the archive has a file descriptor.
+ */
 suspend fun extractZipAsParallel(
         input: () -> InputStream,
         extractDir: File,
@@ -0,0 +1,83 @@
+package io.github.sh4.zabuton.util;
+
+import android.content.res.AssetFileDescriptor;
+import android.os.ParcelFileDescriptor;
+
+import java.io.File;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * A zip archive extracted natively with random access to its entries.
+ *
+ * The central directory is read once when opening, and {@link #extract(String, int)} inflates
+ * entries on several threads at once. Progress is written into a shared direct buffer polled by
+ * {@link #getExtractedBytes()}.
+ */
+public class ZipArchive implements NativeArchive {
+    // Slot layout shared with ExtractSlot in FileUtil.h.
+    private static final int SLOT_EXTRACTED_BYTES = 0;
+    private static final int SLOT_CANCELLED = 1;
+    private static final int SLOT_COUNT = 2;
+
+    private long archiveHandle;
+    private final ByteBuffer state;
+
+    private ZipArchive(long archiveHandle) {
+        this.archiveHandle = archiveHandle;
+        this.state = ByteBuffer.allocateDirect(SLOT_COUNT * Long.BYTES).order(ByteOrder.nativeOrder());
+    }
+
+    public static ZipArchive open(File file) throws IOException {
+        try (ParcelFileDescriptor fd = ParcelFileDescriptor.open(file, ParcelFileDescriptor.MODE_READ_ONLY)) {
+            return open(fd.getFd(), 0, -1);
+        }
+    }
+
+    /**
+     * Opens an asset stored without compression, see aaptOptions.noCompress in build.gradle.
+     */
+    public static ZipArchive open(AssetFileDescriptor fd) throws IOException {
+        return open(fd.getParcelFileDescriptor().getFd(), fd.getStartOffset(), fd.getDeclaredLength());
+    }
+
+    // The file descriptor is duplicated, so the caller still owns fd.
+    private static native ZipArchive open(int fd, long offset, long length) throws IOException;
+
+    @Override
+    public native int getEntryCount();
+
+    @Override
+    public native long getUncompressedSize();
+
+    public void extract(String extractDir, int threads) throws IOException {
+        extract(extractDir, null, threads);
+    }
+
+    @Override
+    public native void extract(String extractDir, String[] names, int threads) throws IOException;
+
+    @Override
+    public long getExtractedBytes() {
+        return state.getLong(SLOT_EXTRACTED_BYTES * Long.BYTES);
+    }
+
+    @Override
+    public void cancel() {
+        state.putLong(SLOT_CANCELLED * Long.BYTES, 1);
+    }
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
@@ -0,0 +1,71 @@
+package io.github.sh4.zabuton.util;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * A zip archive extracted natively while it is still being received, see ZipStream in
+ * ZipArchive.h.
+ *
+ * Bytes are passed to {@link #write(byte[], int, int)} in archive order and entries are inflated
+ * as soon as their bytes arrive; {@link #finish(int)} is called once the whole archive was
+ * written. Only when a stored entry is followed by a data descriptor is the rest of the archive
+ * kept, in an unlinked spill file, to be extracted through its central directory.
+ */
+public class ZipStream implements Closeable {
+    // Slot layout shared with ExtractSlot in FileUtil.h.
+    private static final int SLOT_EXTRACTED_BYTES = 0;
+    private static final int SLOT_CANCELLED = 1;
+    private static final int SLOT_COUNT = 2;
+
+    private long streamHandle;
+    private final ByteBuffer state;
+
+    private ZipStream(long streamHandle) {
+        this.streamHandle = streamHandle;
+        this.state = ByteBuffer.allocateDirect(SLOT_COUNT * Long.BYTES).order(ByteOrder.nativeOrder());
+    }
+
+    public static ZipStream create(File extractDir, File spillFile) {
+        return create(extractDir.getAbsolutePath(), spillFile.getAbsolutePath());
+    }
+
+    private static native ZipStream create(String extractDir, String spillPath);
+
+    /**
+     * Extracts what these bytes complete.
+     *
+     * @throws java.util.concurrent.CancellationException when {@link #cancel()} was called.
+     */
+    public native void write(byte[] b, int off, int len) throws IOException;
+
+    /**
+     * Ends the archive: extracts the spilled entries, if any, using up to the given number of
+     * threads, checks the entries against the central directory and applies their permissions.
+     */
+    public native void finish(int threads) throws IOException;
+
+    public long getExtractedBytes() {
+        return state.getLong(SLOT_EXTRACTED_BYTES * Long.BYTES);
+    }
+
+    public void cancel() {
+        state.putLong(SLOT_CANCELLED * Long.BYTES, 1);
+    }
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
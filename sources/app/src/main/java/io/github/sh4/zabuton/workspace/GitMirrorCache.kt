@@ -0,0 +1,75 @@
+package io.github.sh4.zabuton.workspace
+
+import android.content.Context
+import io.github.sh4.zabuton.git.Repository
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.withContext
+import java.io.File
+import java.security.MessageDigest
+import java.util.concurrent.ConcurrentHashMap
+
+const val GIT_MIRROR_DIRECTORY = "git-mirrors"
+
+/**
+ * Bare mirrors of remote repositories under [root], one per URL, shared by the Git worktrees of
+ * every workspace. A worktree created through the cache is cloned from the mirror with its packs
+ * hard-linked, and fetching it fetches the mirror from the network and then the worktree from the
+ * mirror. The objects of a remote thus cross the network and take disk space once, however many
+ * workspaces check it out.
+ */
+class GitMirrorCache(val root: File) {
+    constructor(context: Context) : this(File(context.filesDir, GIT_MIRROR_DIRECTORY))
+
+    private val locks = ConcurrentHashMap<File, Mutex>()
+
+    /**
+     * Where the mirror of [url] is kept, e.g. qmk_firmware-1a2b3c4d5e6f.git. It exists once a
+     * worktree of the url has been created through the cache.
+     */
+    fun mirrorOf(url: String): File {
+        val name = url.trimEnd('/').substringAfterLast('/').removeSuffix(".git")
+                .replace(Regex("[^A-Za-z0-9._-]"), "_")
+        val digest = MessageDigest.getInstance("SHA-1").digest(url.toByteArray())
+        return File(root, "$name-${digest.take(6).joinToString("") { "%02x".format(it) }}.git")
+    }
+
+    /**
+     * Runs [block] with the mirror of [url] locked. Updates, clones and fetches from one mirror
+     * take turns, so a repack never deletes a pack a clone is linking.
+     */
+    suspend fun <T> withMirror(url: String, block: suspend (mirror: File) -> T): T {
+        val mirror = mirrorOf(url)
+        return locks.getOrPut(mirror) { Mutex() }.withLock {
+            root.mkdirs()
+            block(mirror)
+        }
+    }
+
+    /**
+     * Packs the mirror of [url] into a single pack, dropping objects no ref reaches any more.
+     * Worktrees keep their links to the previous packs until they are deleted.
+     */
+    suspend fun repack(url: String) = withMirror(url) { mirror ->
+        if (mirror.exists()) {
+            withContext(Dispatchers.IO) {
+                Repository.open(mirror.absolutePath).use { it.repack() }
+            }
+        }
+    }
+
+    /** Repacks every mirror in the cache. */
+    suspend fun repackAll() {
+        val urls = withContext(Dispatchers.IO) {
+            root.listFiles().orEmpty().filter { it.name.endsWith(".git") }.mapNotNull { mirror ->
+                Repository.open(mirror.absolutePath).use { repository ->
+                    repository.remotes.find { it.name == "origin" }?.fetchUrl
+                }
+            }
+        }
+        for (url in urls) {
+            repack(url)
+        }
+    }
+}
@@ -7,13 +7,15 @@ import io.github.sh4.zabuton.util.ProgressContext
 import io.github.sh4.zabuton.util.ProgressType
 import kotlinx.coroutines.*
 import kotlinx.coroutines.channels.Channel
-import kotlinx.coroutines.channels.ClosedReceiveChannelException
+import kotlinx.coroutines.channels.ClosedSendChannelException
 import kotlinx.coroutines.channels.ReceiveChannel
 import java.io.File
 import java.net.URL
 import java.util.concurrent.atomic.AtomicBoolean
 
 const val GIT_PROGRESS_RATIO = 10000L
+const val LOG_PAGE_SIZE = 256
+const val GIT_PROGRESS_POLL_INTERVAL_MILLIS = 100L
 const val LIBGIT2_ROOT_CERTIFICATE_IN_ASSETS = "build/cacert.pem"
 const val LIBGIT2_ROOT_CERTIFICATE = "root-cacert.pem"
 
@@ -28,38 +30,133 @@ fun initializeLibGit2(context: Context) {
     LibGit2.init(sslCertificatesFile.absolutePath)
 }
 
+// Receiving objects, indexing objects and resolving deltas, each scaled to GIT_PROGRESS_RATIO.
+private const val FETCH_PROGRESS_PHASES = 3L
+
+private fun fetchProgressOf(p: IFetchProgress): Long {
+    val network = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.receivedObjects) / p.totalObjects else 0L
+    val index = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.indexedObjects) / p.totalObjects else 0L
+    val resolvingDelta = if (p.totalObjects > 0L && p.receivedObjects == p.totalObjects) {
+        if (p.totalDeltas > 0L) (GIT_PROGRESS_RATIO * p.indexedDeltas ) / p.totalDeltas else GIT_PROGRESS_RATIO
+    } else 0L
+    return network + index + resolvingDelta
+}
+
+private fun checkoutProgressOf(p: ICheckoutProgress): Long =
+        if (p.totalSteps > 0) (GIT_PROGRESS_RATIO * p.completedSteps) / p.totalSteps else 0L
+
+// Branches per stage of a fetch; what a dropped connection loses at most, while every stage
+// costs a negotiation round trip and leaves a pack of its own.
+const val FETCH_REFS_PER_STAGE = 4
+// Attempts after a network failure, each resuming at the first stage not yet fetched.
+const val FETCH_RETRIES = 3
+const val FETCH_RETRY_DELAY_MILLIS = 2000L
+
+// The stages of a staged fetch are counted in the steps of its monitor.
+private fun stagedFetchProgressOf(p: ProgressMonitor): Long {
+    val stage = fetchProgressOf(p) / FETCH_PROGRESS_PHASES
+    return if (p.totalSteps > 0) (GIT_PROGRESS_RATIO * p.completedSteps + stage) / p.totalSteps else stage
+}
+
+// Queues a libgit2 operation as a GitJob and suspends until it completes, polling its
+// ProgressMonitor meanwhile; no thread is held while it waits for a worker or runs. Cancelling
+// the calling coroutine cancels the job and still waits for it to end, so the repository is not
+// touched after this returns. Returns what the operation returned.
+private suspend fun runGitOperation(
+        monitor: ProgressMonitor,
+        poll: (ProgressMonitor) -> Unit,
+        submit: (ProgressMonitor, GitJob.Callback) -> GitJob
+): Any? {
+    val done = CompletableDeferred<Any?>()
+    submit(monitor, GitJob.Callback { result, error ->
+        if (error == null) done.complete(result) else done.completeExceptionally(error)
+    }).use { job ->
+        try {
+            while (withTimeoutOrNull(GIT_PROGRESS_POLL_INTERVAL_MILLIS) { done.join() } == null) {
+                poll(monitor)
+            }
+        } catch (e: CancellationException) {
+            job.cancel()
+            withContext(NonCancellable) { done.join() }
+            throw e
+        }
+    }
+    poll(monitor)
+    return done.await()
+}
+
+private fun pollSidebandMessage(progress: Progress<String>, monitor: ProgressMonitor) {
+    val message = monitor.sidebandMessage ?: ""
+    if (progress.additionalData != message) {
+        progress.additionalData = message
+    }
+}
+
+// Top-level paths outside keyboards/ that a QMK build of a single keyboard reads.
+val QMK_SHARED_SPARSE_PATHS = listOf("Makefile", "*.mk", "quantum", "tmk_core", "lib", "drivers")
+
+/**
+ * Sparse checkout paths for building the keyboards under keyboards/[keyboard] of QMK firmware.
+ */
+fun qmkSparsePaths(keyboard: String): List<String> = listOf("keyboards/$keyboard") + QMK_SHARED_SPARSE_PATHS
+
+// Brings a mirror up to date from the network, reported as a fetch.
+private suspend fun updateMirror(progressContext: ProgressContext<String>, url: String, mirror: File) {
+    val progress = progressContext.next(ProgressType.FetchGitRepository, GIT_PROGRESS_RATIO)
+    runGitOperation(ProgressMonitor(GIT_PROGRESS_POLL_INTERVAL_MILLIS), { p ->
+        pollSidebandMessage(progress, p)
+        progress.report(fetchProgressOf(p) / FETCH_PROGRESS_PHASES)
+    }) { monitor, callback ->
+        GitJob.updateMirror(url, mirror.absolutePath, monitor, GitJob.PRIORITY_BACKGROUND, callback)
+    }
+    progress.finish()
+}
+
+/**
+ * Clones [url] into [root]. With [mirrors], the remote is fetched into its shared mirror first
+ * (reported as a fetch before the clone) and the worktree is cloned from the mirror.
+ */
 suspend fun createGitRepositoryWorktree(
         workspace: Workspace,
         root: File,
         url: URL,
+        options: CloneOptions? = null,
+        mirrors: GitMirrorCache? = null,
         block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<String>>) -> Unit
 ): GitRepositoryWorktree = coroutineScope {
     val progressContext = ProgressContext(this, block)
-    launch(Dispatchers.IO) {
+    suspend fun clone(options: CloneOptions?) {
         val progress = progressContext.next(ProgressType.CloneGitRepository, GIT_PROGRESS_RATIO)
-        var sidebandMessage = ""
-        Repository.clone(url.toString(), root.absolutePath) { p ->
-            val network = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.receivedObjects) / p.totalObjects else 0L
-            val index = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.indexedObjects) / p.totalObjects else 0L
-            val checkout = if (p.totalSteps > 0L) (GIT_PROGRESS_RATIO * p.completedSteps) / p.totalSteps else 0L
-            val resolvingDelta = if (p.totalObjects > 0L && p.receivedObjects == p.totalObjects) {
-                if (p.totalDeltas > 0L) (GIT_PROGRESS_RATIO * p.indexedDeltas ) / p.totalDeltas else GIT_PROGRESS_RATIO
-            } else 0L
-            val message = p.sidebandMessage ?: ""
-            if (sidebandMessage != message) {
-                sidebandMessage = message
-                progress.additionalData = sidebandMessage
-            }
-            progress.report((network + index + checkout + resolvingDelta) / 4L)
-        }
+        runGitOperation(ProgressMonitor(GIT_PROGRESS_POLL_INTERVAL_MILLIS), { p ->
+            pollSidebandMessage(progress, p)
+            progress.report((fetchProgressOf(p) + checkoutProgressOf(p)) / (FETCH_PROGRESS_PHASES + 1L))
+        }) { monitor, callback ->
+            GitJob.clone(url.toString(), root.absolutePath, options, monitor, GitJob.PRIORITY_NORMAL, callback)
+        }.let { (it as Repository).close() }
         progress.finish()
-    }.join()
+    }
+    if (mirrors == null) {
+        clone(options)
+    } else {
+        mirrors.withMirror(url.toString()) { mirror ->
+            updateMirror(progressContext, url.toString(), mirror)
+            clone(CloneOptions()
+                    .setSingleBranch(options?.singleBranch)
+                    .setSparsePaths(options?.sparsePaths?.toList())
+                    .setMirror(mirror.absolutePath))
+        }
+    }
     progressContext.finish()
-    return@coroutineScope GitRepositoryWorktree(workspace, root)
+    return@coroutineScope GitRepositoryWorktree(workspace, root, mirrors)
 }
 
+/**
+ * A Git working tree. With [mirrors], fetching a remote that has a mirror there fetches the
+ * mirror and then the worktree from it.
+ */
 class GitRepositoryWorktree(override val workspace: Workspace,
-                            override val root: File) : Worktree {
+                            override val root: File,
+                            private val mirrors: GitMirrorCache? = null) : Worktree, AutoCloseable {
     private val repository = Repository.open(root.canonicalPath)
 
     val headName: String
@@ -73,82 +170,144 @@ class GitRepositoryWorktree(override val workspace: Workspace,
     val remotes: Array<Remote>
         get() = repository.remotes
 
+    /** A checkout is queued ahead of background fetches, as the user is usually waiting on it. */
     suspend fun checkout(
             refspec: String,
+            priority: Int = GitJob.PRIORITY_INTERACTIVE,
             block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit
     ) = coroutineScope {
         val progressContext = ProgressContext(this, block)
-        launch(Dispatchers.IO) {
-            val progress = progressContext.next(ProgressType.CheckoutGitRepository, GIT_PROGRESS_RATIO)
-            repository.checkout(refspec) { p ->
-                val checkout = if (p.totalSteps > 0) (GIT_PROGRESS_RATIO * p.completedSteps) / p.totalSteps else 0L
-                progress.report(checkout)
-            }
-            progress.finish()
-        }.join()
+        val progress = progressContext.next(ProgressType.CheckoutGitRepository, GIT_PROGRESS_RATIO)
+        runGitOperation(ProgressMonitor(GIT_PROGRESS_POLL_INTERVAL_MILLIS), { p ->
+            progress.report(checkoutProgressOf(p))
+        }) { monitor, callback ->
+            GitJob.checkout(repository, refspec, monitor, priority, callback)
+        }
+        progress.finish()
         progressContext.finish()
     }
 
+    /**
+     * Fetches [remote] in stages of [FETCH_REFS_PER_STAGE] branches and retries after a network
+     * failure, keeping the stages already fetched. Returns what the worktree's own fetch
+     * transferred; with a mirror, that is what it took from the mirror.
+     */
     suspend fun fetch(
             remote: String,
+            priority: Int = GitJob.PRIORITY_BACKGROUND,
             block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<String>>) -> Unit
-    ) = coroutineScope {
+    ): FetchStats = coroutineScope {
         val progressContext = ProgressContext(this, block)
-        launch(Dispatchers.IO) {
+        suspend fun fetchFrom(mirror: File?): FetchStats {
             val progress = progressContext.next(ProgressType.FetchGitRepository, GIT_PROGRESS_RATIO)
-            var sidebandMessage = ""
-            repository.fetch(remote) { p ->
-                val network = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.receivedObjects) / p.totalObjects else 0L
-                val index = if (p.totalObjects > 0L) (GIT_PROGRESS_RATIO * p.indexedObjects) / p.totalObjects else 0L
-                val resolvingDelta = if (p.totalObjects > 0L && p.receivedObjects == p.totalObjects) {
-                    if (p.totalDeltas > 0L) (GIT_PROGRESS_RATIO * p.indexedDeltas ) / p.totalDeltas else GIT_PROGRESS_RATIO
-                } else 0L
-                val message = p.sidebandMessage ?: ""
-                if (sidebandMessage != message) {
-                    sidebandMessage = message
-                    progress.additionalData = sidebandMessage
+            var attempt = 0
+            while (true) {
+                try {
+                    val stats = runGitOperation(ProgressMonitor(GIT_PROGRESS_POLL_INTERVAL_MILLIS), { p ->
+                        pollSidebandMessage(progress, p)
+                        progress.report(stagedFetchProgressOf(p))
+                    }) { monitor, callback ->
+                        GitJob.fetchStaged(repository, remote, mirror?.absolutePath, FETCH_REFS_PER_STAGE,
+                                monitor, priority, callback)
+                    } as FetchStats
+                    progress.finish()
+                    return stats
+                } catch (e: LibGit2Exception) {
+                    if (!e.isNetworkError || ++attempt > FETCH_RETRIES) {
+                        throw e
+                    }
+                    delay(FETCH_RETRY_DELAY_MILLIS * attempt)
                 }
-                progress.report((network + index + resolvingDelta) / 3L)
             }
-            progress.finish()
-        }.join()
+        }
+        val url = repository.remotes.find { it.name == remote }?.fetchUrl
+        val stats = if (mirrors != null && url != null && mirrors.mirrorOf(url).exists()) {
+            mirrors.withMirror(url) { mirror ->
+                updateMirror(progressContext, url, mirror)
+                fetchFrom(mirror)
+            }
+        } else {
+            fetchFrom(null)
+        }
         progressContext.finish()
+        stats
     }
 
     suspend fun reset(
             kind: ResetKind,
+            priority: Int = GitJob.PRIORITY_INTERACTIVE,
             block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit
     ) = coroutineScope {
         val progressContext = ProgressContext(this, block)
-        launch(Dispatchers.IO) {
-            val progress = progressContext.next(ProgressType.ResetGitRepository, GIT_PROGRESS_RATIO)
-            repository.reset(kind) { p ->
-                val checkout = if (p.totalSteps > 0) (GIT_PROGRESS_RATIO * p.completedSteps) / p.totalSteps else 0L
-                progress.report(checkout)
-            }
-            progress.finish()
-        }.join()
+        val progress = progressContext.next(ProgressType.ResetGitRepository, GIT_PROGRESS_RATIO)
+        runGitOperation(ProgressMonitor(GIT_PROGRESS_POLL_INTERVAL_MILLIS), { p ->
+            progress.report(checkoutProgressOf(p))
+        }) { monitor, callback ->
+            GitJob.reset(repository, kind, monitor, priority, callback)
+        }
+        progress.finish()
         progressContext.finish()
     }
 
     suspend fun log(
-            block: suspend CoroutineScope.(commit: ReceiveChannel<ICommitObject>) -> Unit
+            pageSize: Int = LOG_PAGE_SIZE,
+            fields: Int = CommitLogBatch.FIELD_ALL,
+            block: suspend CoroutineScope.(pages: ReceiveChannel<CommitLogBatch>) -> Unit
     ) = coroutineScope {
-        val channel = Channel<ICommitObject>()
+        val channel = Channel<CommitLogBatch>()
         val receiver = launch { block(this, channel) }
-        repository.log(fun (commit:ICommitObject):Boolean {
-            try {
-                launch(Dispatchers.Default) { channel.send(commit) }
-            } catch (_: ClosedReceiveChannelException) {
-                return false
+        // A block that returns without reading every page must not leave the walker waiting in send.
+        receiver.invokeOnCompletion { channel.cancel() }
+        launch(Dispatchers.IO) {
+            repository.logWalker(null).use { walker ->
+                while (!channel.isClosedForSend) {
+                    val batch = walker.next(pageSize, fields)
+                    if (batch.count > 0) {
+                        try {
+                            channel.send(batch)
+                        } catch (_: ClosedSendChannelException) {
+                            break
+                        }
+                    }
+                    if (batch.count < pageSize) {
+                        break
+                    }
+                }
             }
-            return true
-        })
-        channel.close()
+            channel.close()
+        }
         receiver.join()
     }
 
+    suspend fun status(
+            options: Int = StatusList.INCLUDE_UNTRACKED,
+            pathspecs: Array<String>? = null
+    ): StatusList = withContext(Dispatchers.IO) {
+        repository.status(options, pathspecs)
+    }
+
+    /** Commits of HEAD that changed path, a file or directory relative to the worktree root. */
+    suspend fun logForPath(path: String, limit: Int = LOG_PAGE_SIZE, fields: Int = CommitLogBatch.FIELD_ALL): CommitLogBatch =
+            withContext(Dispatchers.IO) {
+                repository.logForPath(null, path, limit, fields)
+            }
+
+    suspend fun blame(path: String, fields: Int = CommitLogBatch.FIELD_ALL): Blame = withContext(Dispatchers.IO) {
+        repository.blame(null, path, fields)
+    }
+
+    /** Commits of local missing from upstream (first) and of upstream missing from local (second). */
+    suspend fun aheadBehind(local: String, upstream: String): Pair<Int, Int> = withContext(Dispatchers.IO) {
+        val counts = repository.aheadBehind(local, upstream)
+        counts[0] to counts[1]
+    }
+
+    override fun close() {
+        repository.close()
+    }
+
     override fun deletePermanently() {
+        close()
         root.deleteRecursively()
     }
 }
\ No newline at end of file
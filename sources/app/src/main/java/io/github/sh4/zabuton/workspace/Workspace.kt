@@ -19,6 +19,22 @@ data class WorkspaceFindRequest(val id: WorkspaceId? = null,
                                 val deleted: Boolean? = null,
                                 val comment: String? = null)
 
+fun WorkspaceFindRequest.matches(workspace: Workspace): Boolean {
+    if (id != null && id != workspace.id) {
+        return false
+    }
+    if (name != null && name != workspace.name) {
+        return false
+    }
+    if (deleted != null && deleted != workspace.deleted) {
+        return false
+    }
+    if (comment != null && !workspace.comment.contains(comment)) {
+        return false
+    }
+    return true
+}
+
 interface WorkspaceRepository {
     fun find(id: WorkspaceId): Workspace?
     fun find(request: WorkspaceFindRequest): Collection<Workspace>
@@ -56,21 +72,7 @@ class OnMemoryWorkspaceRepository : WorkspaceRepository {
     override fun find(id: WorkspaceId): Workspace? = repository.get(id)
 
     override fun find(request: WorkspaceFindRequest): Collection<Workspace> {
-        return repository.filter {
-            if (request.id != null && request.id != it.key) {
-                return@filter false
-            }
-            if (request.name != null && request.name != it.value.name) {
-                return@filter false
-            }
-            if (request.deleted != null && request.deleted != it.value.deleted) {
-                return@filter false
-            }
-            if (request.comment != null && !it.value.comment.contains(request.comment)) {
-                return@filter false
-            }
-            return@filter true
-        }.map { x -> x.value }
+        return repository.values.filter { request.matches(it) }
     }
 
     override fun save(workspace: Workspace) {
@@ -80,4 +82,35 @@ class OnMemoryWorkspaceRepository : WorkspaceRepository {
     override fun delete(id: WorkspaceId) {
         repository.remove(id)
     }
+}
+
+internal fun workspaceOf(record: WorkspaceRecord) =
+        Workspace(WorkspaceId(record.id), WorkspaceName(record.name), record.comment, record.isDeleted)
+
+/**
+ * Workspaces kept in a [WorkspaceRegistry]. Finding by name, deleted and comment is a scan of the
+ * registry in place; only the matching workspaces are created.
+ */
+class RegistryWorkspaceRepository(private val registry: WorkspaceRegistry) : WorkspaceRepository {
+    override fun find(id: WorkspaceId): Workspace? = registry.get(id.id)?.let(::workspaceOf)
+
+    override fun find(request: WorkspaceFindRequest): Collection<Workspace> {
+        if (request.id != null) {
+            return listOfNotNull(find(request.id)?.takeIf { request.matches(it) })
+        }
+        val deleted = when (request.deleted) {
+            null -> WorkspaceRegistry.DELETED_ANY
+            true -> 1
+            false -> 0
+        }
+        return registry.scan(request.name?.name, deleted, request.comment).map(::workspaceOf)
+    }
+
+    override fun save(workspace: Workspace) {
+        registry.putWorkspace(workspace.id.id, workspace.name.name, workspace.comment, workspace.deleted)
+    }
+
+    override fun delete(id: WorkspaceId) {
+        registry.remove(id.id)
+    }
 }
\ No newline at end of file
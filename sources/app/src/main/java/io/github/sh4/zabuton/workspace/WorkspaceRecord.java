@@ -0,0 +1,53 @@
+package io.github.sh4.zabuton.workspace;
+
+import java.util.UUID;
+
+/**
+ * A workspace as a {@link WorkspaceRegistry} keeps it.
+ */
+public final class WorkspaceRecord {
+    private final long idMost;
+    private final long idLeast;
+    private final String name;
+    private final String comment;
+    private final boolean deleted;
+    private final String worktreeKind;
+    private final String worktreeRoot;
+
+    private WorkspaceRecord(long idMost, long idLeast, String name, String comment, boolean deleted,
+                            String worktreeKind, String worktreeRoot) {
+        this.idMost = idMost;
+        this.idLeast = idLeast;
+        this.name = name;
+        this.comment = comment;
+        this.deleted = deleted;
+        this.worktreeKind = worktreeKind;
+        this.worktreeRoot = worktreeRoot;
+    }
+
+    public UUID getId() {
+        return new UUID(idMost, idLeast);
+    }
+
+    public String getName() {
+        return name;
+    }
+
+    public String getComment() {
+        return comment;
+    }
+
+    public boolean isDeleted() {
+        return deleted;
+    }
+
+    /** The kind given to {@link WorkspaceRegistry#setWorktree}, or null without a worktree. */
+    public String getWorktreeKind() {
+        return worktreeKind;
+    }
+
+    /** Null without a worktree. */
+    public String getWorktreeRoot() {
+        return worktreeRoot;
+    }
+}
@@ -0,0 +1,85 @@
+package io.github.sh4.zabuton.workspace;
+
+import java.io.IOException;
+import java.util.UUID;
+
+/**
+ * The workspaces and the worktrees they have, kept natively in one file (see
+ * WorkspaceRegistry.h). Opening it maps the file instead of reading every workspace, lookups by
+ * id binary search it, and {@link #scan} filters in place, creating records for the matches only.
+ * Each change is appended and synced before the call returns.
+ *
+ * The methods may be called from any thread; {@link #close()} must not race with them.
+ */
+public class WorkspaceRegistry implements AutoCloseable {
+    /** For {@link #scan}: workspaces in the trash and out of it alike. */
+    public static final int DELETED_ANY = -1;
+
+    private long registryHandle;
+
+    private WorkspaceRegistry(long registryHandle) {
+        this.registryHandle = registryHandle;
+    }
+
+    /** Opens the registry file at path, creating an empty one if there is none. */
+    public static native WorkspaceRegistry open(String path) throws IOException;
+
+    public WorkspaceRecord get(UUID id) {
+        return get(id.getMostSignificantBits(), id.getLeastSignificantBits());
+    }
+
+    private native WorkspaceRecord get(long idMost, long idLeast);
+
+    /**
+     * The workspaces named name (any name when null), in the trash (deleted 1), out of it (0) or
+     * either ({@link #DELETED_ANY}), whose comment contains comment (any comment when null).
+     */
+    public native WorkspaceRecord[] scan(String name, int deleted, String comment);
+
+    /** Adds or replaces a workspace. Its worktree, if any, is kept. */
+    public void putWorkspace(UUID id, String name, String comment, boolean deleted) throws IOException {
+        putWorkspace(id.getMostSignificantBits(), id.getLeastSignificantBits(), name, comment, deleted);
+    }
+
+    private native void putWorkspace(long idMost, long idLeast, String name, String comment, boolean deleted)
+            throws IOException;
+
+    /**
+     * Records the worktree of a workspace, e.g. "git" and its root directory, or that it has none
+     * with a null kind. Returns false when there is no such workspace.
+     */
+    public boolean setWorktree(UUID id, String kind, String root) throws IOException {
+        return setWorktree(id.getMostSignificantBits(), id.getLeastSignificantBits(), kind, root);
+    }
+
+    private native boolean setWorktree(long idMost, long idLeast, String kind, String root) throws IOException;
+
+    /** Returns false when there is no such workspace. */
+    public boolean remove(UUID id) throws IOException {
+        return remove(id.getMostSignificantBits(), id.getLeastSignificantBits());
+    }
+
+    private native boolean remove(long idMost, long idLeast) throws IOException;
+
+    /**
+     * Rewrites the file without the changes log. This happens by itself as the log grows, so
+     * calling it is only worth it before the registry is opened often, e.g. at shutdown.
+     */
+    public native void compact() throws IOException;
+
+    /** The changes appended since the last compaction. */
+    public native int getLogSize();
+
+    @Override
+    public void close() {
+        destroy();
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        destroy();
+        super.finalize();
+    }
+
+    private native void destroy();
+}
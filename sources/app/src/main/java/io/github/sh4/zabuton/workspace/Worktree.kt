@@ -3,6 +3,7 @@ package io.github.sh4.zabuton.workspace
 import com.squareup.moshi.Json
 import com.squareup.moshi.JsonClass
 import java.io.File
+import java.util.concurrent.ConcurrentHashMap
 import kotlin.collections.HashMap
 
 interface Worktree {
@@ -36,6 +37,71 @@ class OnMemoryWorktreeRepository : WorktreeRepository {
     }
 }
 
+/** How a [RegistryWorktreeRepository] records the kind of [worktree]. */
+fun worktreeKindOf(worktree: Worktree): String = when (worktree) {
+    is GitRepositoryWorktree -> "git"
+    is ZipFileWorktree -> "zip"
+    is DirectoryWorktree -> "directory"
+    else -> throw IllegalArgumentException("${worktree.javaClass.name} cannot be registered.")
+}
+
+/**
+ * Opens the worktrees of the kinds [worktreeKindOf] names, Git ones fetching through [mirrors].
+ * A worktree whose root is gone opens as null.
+ */
+fun worktreeOpener(mirrors: GitMirrorCache? = null): (Workspace, String, File) -> Worktree? =
+        { workspace, kind, root ->
+            when {
+                !root.isDirectory -> null
+                kind == "git" -> GitRepositoryWorktree(workspace, root, mirrors)
+                kind == "zip" -> ZipFileWorktree(workspace, root)
+                kind == "directory" -> DirectoryWorktree(workspace, root)
+                else -> null
+            }
+        }
+
+/**
+ * Worktrees recorded in a [WorkspaceRegistry] by kind and root. A worktree is opened with [open]
+ * the first time it is found, not when the registry is, and stays open until it is deleted.
+ */
+class RegistryWorktreeRepository(
+        private val registry: WorkspaceRegistry,
+        private val open: (workspace: Workspace, kind: String, root: File) -> Worktree? = worktreeOpener()
+) : WorktreeRepository {
+    private val worktrees = ConcurrentHashMap<WorkspaceId, Worktree>()
+
+    override fun find(id: WorkspaceId): Worktree? {
+        worktrees[id]?.let { return it }
+        val record = registry.get(id.id) ?: return null
+        val kind = record.worktreeKind ?: return null
+        val worktree = open(workspaceOf(record), kind, File(record.worktreeRoot)) ?: return null
+        // Another thread may have opened it meanwhile.
+        val found = worktrees.putIfAbsent(id, worktree) ?: return worktree
+        (worktree as? AutoCloseable)?.close()
+        return found
+    }
+
+    /** The workspace of [worktree] must have been saved to the registry first. */
+    override fun save(worktree: Worktree) {
+        val id = worktree.workspace.id
+        check(registry.setWorktree(id.id, worktreeKindOf(worktree), worktree.root.path)) {
+            "Workspace $id is not in the registry."
+        }
+        val replaced = worktrees.put(id, worktree)
+        if (replaced !== worktree) {
+            (replaced as? AutoCloseable)?.close()
+        }
+    }
+
+    override fun deletePermanently(id: WorkspaceId) {
+        // A worktree whose root is already gone is not found, but its record must go all the same.
+        val worktree = find(id)
+        worktrees.remove(id)
+        registry.setWorktree(id.id, null, null)
+        worktree?.deletePermanently()
+    }
+}
+
 
 // ビルド
 // * QMK ファームウェアのビルド
@@ -0,0 +1,36 @@
+package io.github.sh4.zabuton.workspace
+
+import io.github.sh4.zabuton.util.FileSnapshot
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.io.File
+
+val DEFAULT_SNAPSHOT_EXCLUDED_NAMES = arrayOf(".git", ".build")
+
+// Tells which files of a worktree changed since the last successful build. changes() compares
+// the tree with the snapshot saved in file and keeps the new one pending; commit() saves it once
+// the build succeeded, so a failed build is retried with the same changes.
+class WorktreeSnapshot(val worktree: Worktree,
+                       val file: File,
+                       private val excludedNames: Array<String> = DEFAULT_SNAPSHOT_EXCLUDED_NAMES) {
+    private var pending: FileSnapshot? = null
+
+    suspend fun changes(): FileSnapshot.Changes = withContext(Dispatchers.IO) {
+        val current = FileSnapshot.take(worktree.root, *excludedNames)
+        val changes = FileSnapshot.load(file.absolutePath).use { current.changesSince(it) }
+        synchronized(this@WorktreeSnapshot) {
+            pending?.close()
+            pending = current
+        }
+        changes
+    }
+
+    suspend fun commit() = withContext(Dispatchers.IO) {
+        val snapshot = synchronized(this@WorktreeSnapshot) {
+            pending.also { pending = null }
+        } ?: return@withContext
+        snapshot.use { it.save(file.absolutePath) }
+    }
+}
+
+fun Worktree.snapshot(name: String) = WorktreeSnapshot(this, File(root.parentFile, "${root.name}.$name.snapshot"))
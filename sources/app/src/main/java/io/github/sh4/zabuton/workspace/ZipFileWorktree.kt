@@ -6,7 +6,7 @@ import kotlinx.coroutines.channels.ReceiveChannel
 import okhttp3.OkHttpClient
 import okhttp3.Request
 import java.io.File
-import java.io.InputStream
+import java.io.IOException
 import java.net.URL
 import java.util.*
 
@@ -33,52 +33,36 @@ private suspend fun expandZipFile(
         defaultProgressContext: ProgressContext<Unit>? = null
 ) {
     canonicalRoot.mkdirs()
-    extractZipAsParallel({ zipFile.inputStream() }, canonicalRoot,
+    extractArchive({ ZipArchive.open(zipFile) }, canonicalRoot,
             block = block,
             defaultProgressContext = defaultProgressContext)
 }
 
+// Extracts the response body as it is received; the archive is never written to cacheRoot
+// unless it needs spilling, see extractZipStream.
 private suspend fun downloadZipFile(
         canonicalRoot: File,
         cacheRoot: File,
         url: URL,
-        block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit,
-        defaultProgressContext: ProgressContext<Unit>? = null
-) = coroutineScope {
+        block: suspend CoroutineScope.(channel: ReceiveChannel<Progress<Unit>>) -> Unit
+) {
     val client = OkHttpClient()
     val request = Request.Builder().url(url).build()
-    val response = async(Dispatchers.IO) { client.newCall(request).execute() }
-
-    val progressContext = defaultProgressContext ?: ProgressContext(this, block)
-    val zipFile = async(Dispatchers.IO) {
-        val zipFile = File.createTempFile(ZipFileWorktree::class.java.simpleName,".zip", cacheRoot)
-        val responseBody = response.await().body()
-        val downloadProgress = progressContext.next(
-                type = ProgressType.DownloadFile,
-                total = responseBody?.contentLength()?.coerceAtLeast(PROGRESS_NOT_SPECIFIED) ?: PROGRESS_NOT_SPECIFIED)
-        val inputStream = responseBody?.byteStream() ?: EmptyInputStream()
-        zipFile.outputStream().use { outputStream ->
-            val buffer = ByteArray(DEFAULT_BUFFER_SIZE)
-            var bytes = inputStream.read(buffer)
-            while (bytes >= 0) {
-                outputStream.write(buffer, 0, bytes)
-                downloadProgress.reportAdvance(bytes.toLong())
-                bytes = inputStream.read(buffer)
-            }
+    val response = withContext(Dispatchers.IO) { client.newCall(request).execute() }
+    response.use {
+        if (!it.isSuccessful) {
+            throw IOException("Cannot download $url: HTTP ${it.code()}")
         }
-        downloadProgress.finish()
-        return@async zipFile
-    }.await()
-    expandZipFile(canonicalRoot, zipFile, block = block, defaultProgressContext = progressContext)
-    if (defaultProgressContext == null) {
-        progressContext.finish()
+        val body = it.body() ?: throw IOException("Cannot download $url: no response body")
+        canonicalRoot.mkdirs()
+        extractZipStream(body.byteStream(),
+                body.contentLength().coerceAtLeast(PROGRESS_NOT_SPECIFIED),
+                canonicalRoot,
+                File(cacheRoot, "${canonicalRoot.name}.zip-spill"),
+                block = block)
     }
 }
 
-private class EmptyInputStream : InputStream() {
-    override fun read(): Int = -1
-}
-
 class ZipFileWorktree(override val workspace: Workspace,
                       override val root: File) : Worktree {
     override fun deletePermanently() {
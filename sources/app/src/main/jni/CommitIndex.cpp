@@ -0,0 +1,555 @@
+#include "CommitIndex.h"
+#include "FileUtil.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+using zabuton::util::ReadFully;
+using zabuton::util::ReplacingFile;
+
+constexpr uint32_t IndexMagic = 0x5A434958; // "ZCIX"
+constexpr uint32_t IndexVersion = 1;
+constexpr const char *IndexFileName = "zabuton-commit-index";
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t commits;
+    uint32_t parents;
+    uint32_t authors;
+    uint32_t textSize;
+};
+
+bool OidLess(const git_oid& a, const git_oid& b)
+{
+    return git_oid_cmp(&a, &b) < 0;
+}
+
+std::string IndexPath(git_repository *repo)
+{
+    return std::string(git_repository_path(repo)) + IndexFileName;
+}
+
+template <typename T>
+void Put(std::string *out, const std::vector<T>& values)
+{
+    out->append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+// Reads count elements at *cursor, failing if the buffer ends first.
+template <typename T>
+bool Take(const std::string& in, size_t *cursor, size_t count, std::vector<T> *values)
+{
+    if (count > (in.size() - *cursor) / sizeof(T)) {
+        return false;
+    }
+    values->resize(count);
+    memcpy(values->data(), in.data() + *cursor, count * sizeof(T));
+    *cursor += count * sizeof(T);
+    return true;
+}
+
+} // anonymous namespace
+
+CommitGraph::CommitGraph() :
+    parentOffsets_(1, 0),
+    textOffsets_(1, 0),
+    fanout_()
+{
+}
+
+void CommitGraph::BuildFanout()
+{
+    // fanout_[b] is the number of commits whose first byte is at most b.
+    uint32_t pos = 0;
+    for (uint32_t b = 0; b < 256; b++) {
+        while (pos < ids_.size() && ids_[pos].id[0] <= b) {
+            pos++;
+        }
+        fanout_[b] = pos;
+    }
+}
+
+uint32_t CommitGraph::Find(const git_oid& id) const
+{
+    uint8_t first = id.id[0];
+    auto begin = ids_.begin() + (first == 0 ? 0 : fanout_[first - 1]);
+    auto end = ids_.begin() + fanout_[first];
+    auto it = std::lower_bound(begin, end, id, OidLess);
+    if (it == end || git_oid_cmp(&*it, &id) != 0) {
+        return NoPosition;
+    }
+    return static_cast<uint32_t>(it - ids_.begin());
+}
+
+std::string_view CommitGraph::AuthorName(uint32_t pos) const
+{
+    size_t author = authorIds_[pos];
+    return std::string_view(text_).substr(textOffsets_[author * 2],
+            textOffsets_[author * 2 + 1] - textOffsets_[author * 2]);
+}
+
+std::string_view CommitGraph::AuthorEmail(uint32_t pos) const
+{
+    size_t author = authorIds_[pos];
+    return std::string_view(text_).substr(textOffsets_[author * 2 + 1],
+            textOffsets_[author * 2 + 2] - textOffsets_[author * 2 + 1]);
+}
+
+std::shared_ptr<const CommitGraph> CommitGraph::Merge(const CommitGraph *base, std::vector<Commit> added,
+                                                      std::string *error)
+{
+    auto byId = [](const Commit& a, const Commit& b) { return OidLess(a.id, b.id); };
+    std::sort(added.begin(), added.end(), byId);
+    added.erase(std::unique(added.begin(), added.end(),
+            [](const Commit& a, const Commit& b) { return git_oid_cmp(&a.id, &b.id) == 0; }), added.end());
+    if (base != nullptr) {
+        added.erase(std::remove_if(added.begin(), added.end(),
+                [&](const Commit& c) { return base->Find(c.id) != NoPosition; }), added.end());
+    }
+
+    const uint32_t baseSize = base ? base->Size() : 0;
+    const uint64_t size = static_cast<uint64_t>(baseSize) + added.size();
+    if (size >= NoPosition) {
+        *error = "Too many commits to index.";
+        return nullptr;
+    }
+    const auto n = static_cast<uint32_t>(size);
+
+    // New positions of the commits of both inputs, merged in oid order.
+    std::vector<uint32_t> basePositions(baseSize);
+    std::vector<uint32_t> addedPositions(added.size());
+    for (uint32_t b = 0, a = 0, pos = 0; pos < n; pos++) {
+        if (a == added.size() || (b < baseSize && OidLess(base->ids_[b], added[a].id))) {
+            basePositions[b++] = pos;
+        } else {
+            addedPositions[a++] = pos;
+        }
+    }
+    auto positionOf = [&](const git_oid& id) {
+        uint32_t pos = base ? base->Find(id) : NoPosition;
+        if (pos != NoPosition) {
+            return basePositions[pos];
+        }
+        auto it = std::lower_bound(added.begin(), added.end(), id,
+                [](const Commit& c, const git_oid& id) { return OidLess(c.id, id); });
+        if (it == added.end() || git_oid_cmp(&it->id, &id) != 0) {
+            return NoPosition;
+        }
+        return addedPositions[it - added.begin()];
+    };
+
+    auto graph = std::make_shared<CommitGraph>();
+    graph->ids_.resize(n);
+    graph->trees_.resize(n);
+    graph->generations_.resize(n, 0);
+    graph->commitTimes_.resize(n);
+    graph->authorTimes_.resize(n);
+    graph->authorTimeOffsets_.resize(n);
+    graph->authorIds_.resize(n);
+    std::vector<std::vector<uint32_t>> parents(n);
+
+    for (uint32_t b = 0; b < baseSize; b++) {
+        uint32_t pos = basePositions[b];
+        graph->ids_[pos] = base->ids_[b];
+        graph->trees_[pos] = base->trees_[b];
+        graph->generations_[pos] = base->generations_[b];
+        graph->commitTimes_[pos] = base->commitTimes_[b];
+        graph->authorTimes_[pos] = base->authorTimes_[b];
+        graph->authorTimeOffsets_[pos] = base->authorTimeOffsets_[b];
+        graph->authorIds_[pos] = base->authorIds_[b];
+        for (auto p = base->ParentsBegin(b); p != base->ParentsEnd(b); ++p) {
+            parents[pos].push_back(basePositions[*p]);
+        }
+    }
+    if (base != nullptr) {
+        graph->textOffsets_ = base->textOffsets_;
+        graph->text_ = base->text_;
+    }
+
+    // Authors repeat across commits, so each name and email pair is stored once.
+    std::unordered_map<std::string, uint32_t> authors;
+    const auto baseAuthors = static_cast<uint32_t>(graph->textOffsets_.size() / 2);
+    for (uint32_t author = 0; author < baseAuthors && !added.empty(); author++) {
+        const auto& offsets = graph->textOffsets_;
+        authors.emplace(graph->text_.substr(offsets[author * 2], offsets[author * 2 + 2] - offsets[author * 2])
+                + '\n' + std::to_string(offsets[author * 2 + 1] - offsets[author * 2]), author);
+    }
+    for (size_t a = 0; a < added.size(); a++) {
+        Commit& commit = added[a];
+        uint32_t pos = addedPositions[a];
+        graph->ids_[pos] = commit.id;
+        graph->trees_[pos] = commit.tree;
+        graph->commitTimes_[pos] = commit.commitTime;
+        graph->authorTimes_[pos] = commit.authorTime;
+        graph->authorTimeOffsets_[pos] = commit.authorTimeOffset;
+        std::string key = commit.authorName + commit.authorEmail + '\n' + std::to_string(commit.authorName.size());
+        auto author = authors.emplace(std::move(key), static_cast<uint32_t>(authors.size()));
+        if (author.second) {
+            graph->text_ += commit.authorName;
+            graph->textOffsets_.push_back(static_cast<uint32_t>(graph->text_.size()));
+            graph->text_ += commit.authorEmail;
+            graph->textOffsets_.push_back(static_cast<uint32_t>(graph->text_.size()));
+        }
+        graph->authorIds_[pos] = author.first->second;
+        for (const auto& parent : commit.parents) {
+            uint32_t parentPos = positionOf(parent);
+            if (parentPos == NoPosition) {
+                char hex[GIT_OID_HEXSZ + 1];
+                git_oid_tostr(hex, sizeof(hex), &parent);
+                *error = std::string("Parent commit ") + hex + " is not indexed.";
+                return nullptr;
+            }
+            parents[pos].push_back(parentPos);
+        }
+    }
+    if (graph->text_.size() >= UINT32_MAX) {
+        *error = "Too many authors to index.";
+        return nullptr;
+    }
+
+    graph->parentOffsets_.clear();
+    graph->parentOffsets_.reserve(n + 1);
+    graph->parentOffsets_.push_back(0);
+    for (const auto& p : parents) {
+        graph->parents_.insert(graph->parents_.end(), p.begin(), p.end());
+        graph->parentOffsets_.push_back(static_cast<uint32_t>(graph->parents_.size()));
+    }
+
+    // Generations of the added commits, parents first. History can be deeper than the native
+    // stack, so the depth-first walk keeps its own.
+    auto& generations = graph->generations_;
+    std::vector<uint32_t> stack;
+    for (uint32_t start : addedPositions) {
+        stack.push_back(start);
+        while (!stack.empty()) {
+            uint32_t pos = stack.back();
+            if (generations[pos] != 0) {
+                stack.pop_back();
+                continue;
+            }
+            uint32_t generation = 1;
+            bool ready = true;
+            for (auto p = graph->ParentsBegin(pos); p != graph->ParentsEnd(pos); ++p) {
+                if (generations[*p] == 0) {
+                    stack.push_back(*p);
+                    ready = false;
+                } else {
+                    generation = std::max(generation, generations[*p] + 1);
+                }
+            }
+            if (ready) {
+                generations[pos] = generation;
+                stack.pop_back();
+            }
+        }
+    }
+
+    graph->BuildFanout();
+    return graph;
+}
+
+bool CommitGraph::Save(const std::string& path, std::string *error) const
+{
+    IndexHeader header = { IndexMagic, IndexVersion, Size(), static_cast<uint32_t>(parents_.size()),
+                           static_cast<uint32_t>(textOffsets_.size() / 2), static_cast<uint32_t>(text_.size()) };
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    Put(&data, ids_);
+    Put(&data, trees_);
+    Put(&data, parentOffsets_);
+    Put(&data, parents_);
+    Put(&data, generations_);
+    Put(&data, commitTimes_);
+    Put(&data, authorTimes_);
+    Put(&data, authorTimeOffsets_);
+    Put(&data, authorIds_);
+    Put(&data, textOffsets_);
+    data += text_;
+
+    ReplacingFile file;
+    return file.Open(path, 0644, data.size(), error)
+            && file.Write(data.data(), data.size(), error)
+            && file.Commit(error);
+}
+
+std::shared_ptr<const CommitGraph> CommitGraph::Load(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { close(fd); });
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IndexHeader)) {
+        return nullptr;
+    }
+    std::string data(static_cast<size_t>(st.st_size), '\0');
+    if (!ReadFully(fd, &data[0], data.size(), 0)) {
+        return nullptr;
+    }
+
+    IndexHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != IndexMagic || header.version != IndexVersion || header.commits >= NoPosition) {
+        return nullptr;
+    }
+    auto graph = std::make_shared<CommitGraph>();
+    size_t cursor = sizeof(header);
+    const size_t n = header.commits;
+    if (!Take(data, &cursor, n, &graph->ids_)
+            || !Take(data, &cursor, n, &graph->trees_)
+            || !Take(data, &cursor, n + 1, &graph->parentOffsets_)
+            || !Take(data, &cursor, header.parents, &graph->parents_)
+            || !Take(data, &cursor, n, &graph->generations_)
+            || !Take(data, &cursor, n, &graph->commitTimes_)
+            || !Take(data, &cursor, n, &graph->authorTimes_)
+            || !Take(data, &cursor, n, &graph->authorTimeOffsets_)
+            || !Take(data, &cursor, n, &graph->authorIds_)
+            || !Take(data, &cursor, static_cast<size_t>(header.authors) * 2 + 1, &graph->textOffsets_)
+            || data.size() - cursor != header.textSize) {
+        return nullptr;
+    }
+    graph->text_ = data.substr(cursor);
+    if (!graph->Validate()) {
+        return nullptr;
+    }
+    graph->BuildFanout();
+    return graph;
+}
+
+// Checks what the accessors and walks rely on, so a damaged file is rebuilt instead of read out
+// of bounds.
+bool CommitGraph::Validate() const
+{
+    const auto n = Size();
+    for (uint32_t pos = 1; pos < n; pos++) {
+        if (!OidLess(ids_[pos - 1], ids_[pos])) {
+            return false;
+        }
+    }
+    if (parentOffsets_.front() != 0 || parentOffsets_.back() != parents_.size()
+            || !std::is_sorted(parentOffsets_.begin(), parentOffsets_.end())) {
+        return false;
+    }
+    for (uint32_t pos = 0; pos < n; pos++) {
+        if (generations_[pos] == 0) {
+            return false;
+        }
+        for (auto p = ParentsBegin(pos); p != ParentsEnd(pos); ++p) {
+            if (*p >= n || generations_[*p] >= generations_[pos]) {
+                return false;
+            }
+        }
+    }
+    const size_t authors = textOffsets_.size() / 2;
+    if (textOffsets_.front() != 0 || textOffsets_.back() != text_.size()
+            || !std::is_sorted(textOffsets_.begin(), textOffsets_.end())) {
+        return false;
+    }
+    return std::all_of(authorIds_.begin(), authorIds_.end(), [&](uint32_t id) { return id < authors; });
+}
+
+void CommitGraph::AheadBehind(uint32_t local, uint32_t upstream, size_t *ahead, size_t *behind) const
+{
+    *ahead = 0;
+    *behind = 0;
+    if (local == upstream) {
+        return;
+    }
+    // Commits are taken highest generation first, so a commit's flags are final once it is taken:
+    // every child has a higher generation and was taken before. The walk ends when everything
+    // left is reachable from both sides.
+    constexpr uint8_t FromLocal = 1;
+    constexpr uint8_t FromUpstream = 2;
+    constexpr uint8_t FromBoth = FromLocal | FromUpstream;
+    std::vector<uint8_t> flags(Size(), 0);
+    std::vector<uint32_t> queue;
+    size_t pending = 0;
+    auto lower = [&](uint32_t a, uint32_t b) { return generations_[a] < generations_[b]; };
+    auto mark = [&](uint32_t pos, uint8_t flag) {
+        uint8_t old = flags[pos];
+        flags[pos] |= flag;
+        if (old == 0) {
+            queue.push_back(pos);
+            std::push_heap(queue.begin(), queue.end(), lower);
+            pending += flags[pos] != FromBoth;
+        } else if (old != FromBoth && flags[pos] == FromBoth) {
+            pending--;
+        }
+    };
+    mark(local, FromLocal);
+    mark(upstream, FromUpstream);
+    while (pending > 0) {
+        std::pop_heap(queue.begin(), queue.end(), lower);
+        uint32_t pos = queue.back();
+        queue.pop_back();
+        uint8_t flag = flags[pos];
+        if (flag != FromBoth) {
+            pending--;
+            (flag == FromLocal ? *ahead : *behind) += 1;
+        }
+        for (auto p = ParentsBegin(pos); p != ParentsEnd(pos); ++p) {
+            mark(*p, flag);
+        }
+    }
+}
+
+CommitGraphWalk::CommitGraphWalk(std::shared_ptr<const CommitGraph> graph) :
+    graph_(std::move(graph)),
+    seen_(graph_->Size(), false)
+{
+}
+
+bool CommitGraphWalk::Before(uint32_t a, uint32_t b) const
+{
+    if (graph_->CommitTime(a) != graph_->CommitTime(b)) {
+        return graph_->CommitTime(a) > graph_->CommitTime(b);
+    }
+    if (graph_->Generation(a) != graph_->Generation(b)) {
+        return graph_->Generation(a) > graph_->Generation(b);
+    }
+    return a < b;
+}
+
+void CommitGraphWalk::Push(uint32_t pos)
+{
+    if (seen_[pos]) {
+        return;
+    }
+    seen_[pos] = true;
+    queue_.push_back(pos);
+    std::push_heap(queue_.begin(), queue_.end(), [this](uint32_t a, uint32_t b) { return Before(b, a); });
+}
+
+bool CommitGraphWalk::Next(uint32_t *pos)
+{
+    if (queue_.empty()) {
+        return false;
+    }
+    std::pop_heap(queue_.begin(), queue_.end(), [this](uint32_t a, uint32_t b) { return Before(b, a); });
+    *pos = queue_.back();
+    queue_.pop_back();
+    for (auto p = graph_->ParentsBegin(*pos); p != graph_->ParentsEnd(*pos); ++p) {
+        Push(*p);
+    }
+    return true;
+}
+
+CommitIndex::CommitIndex() :
+    loaded_(false)
+{
+}
+
+void CommitIndex::LoadLocked(git_repository *repo)
+{
+    if (!loaded_) {
+        graph_ = CommitGraph::Load(IndexPath(repo));
+        loaded_ = true;
+    }
+}
+
+std::shared_ptr<const CommitGraph> CommitIndex::Snapshot(git_repository *repo)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    LoadLocked(repo);
+    return graph_;
+}
+
+int CommitIndex::Update(git_repository *repo)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    LoadLocked(repo);
+    const CommitGraph *base = graph_.get();
+
+    std::vector<git_oid> pending;
+    git_reference_iterator *refs = nullptr;
+    int r = git_reference_iterator_new(&refs, repo);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_reference_iterator_free(refs); });
+    git_reference *ref = nullptr;
+    while ((r = git_reference_next(&ref, refs)) == 0) {
+        git_object *target = nullptr;
+        // References to trees, blobs or missing objects have no history to index.
+        if (git_reference_peel(&target, ref, GIT_OBJECT_COMMIT) == 0) {
+            pending.push_back(*git_object_id(target));
+            git_object_free(target);
+        } else {
+            git_error_clear();
+        }
+        git_reference_free(ref);
+    }
+    if (r != GIT_ITEROVER) {
+        return r;
+    }
+    git_oid head;
+    if (git_reference_name_to_id(&head, repo, "HEAD") == 0) {
+        pending.push_back(head);
+    } else {
+        git_error_clear();
+    }
+
+    std::vector<CommitGraph::Commit> added;
+    std::unordered_set<git_oid, OidHash, OidEqual> visited;
+    while (!pending.empty()) {
+        git_oid id = pending.back();
+        pending.pop_back();
+        if ((base != nullptr && base->Find(id) != CommitGraph::NoPosition) || !visited.insert(id).second) {
+            continue;
+        }
+        git_commit *commit = nullptr;
+        r = git_commit_lookup(&commit, repo, &id);
+        if (r < 0) {
+            return r;
+        }
+        const git_signature *author = git_commit_author(commit);
+        CommitGraph::Commit c;
+        c.id = id;
+        c.tree = *git_commit_tree_id(commit);
+        c.commitTime = git_commit_time(commit);
+        c.authorTime = author->when.time;
+        c.authorTimeOffset = author->when.offset;
+        c.authorName = author->name;
+        c.authorEmail = author->email;
+        unsigned int parents = git_commit_parentcount(commit);
+        for (unsigned int i = 0; i < parents; i++) {
+            c.parents.push_back(*git_commit_parent_id(commit, i));
+            pending.push_back(c.parents.back());
+        }
+        git_commit_free(commit);
+        added.push_back(std::move(c));
+    }
+    if (added.empty()) {
+        return 0;
+    }
+
+    std::string error;
+    auto graph = CommitGraph::Merge(base, std::move(added), &error);
+    if (!graph) {
+        git_error_set_str(GIT_ERROR_INVALID, error.c_str());
+        return -1;
+    }
+    graph_ = graph;
+    // The graph in memory is complete even if it could not be persisted.
+    if (!graph->Save(IndexPath(repo), &error)) {
+        git_error_set_str(GIT_ERROR_OS, error.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+}}
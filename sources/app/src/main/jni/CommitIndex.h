@@ -0,0 +1,145 @@
+#pragma once
+
+#include <git2.h>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+// For unordered containers of git_oid; the leading bytes of a SHA-1 are as good as any hash.
+struct OidHash
+{
+    size_t operator()(const git_oid& id) const {
+        size_t h;
+        memcpy(&h, id.id, sizeof(h));
+        return h;
+    }
+};
+
+struct OidEqual
+{
+    bool operator()(const git_oid& a, const git_oid& b) const { return git_oid_cmp(&a, &b) == 0; }
+};
+
+// The commits of a repository in flat arrays sorted by oid. A commit is addressed by its position
+// and its parents are positions too, so walking history never touches the object database.
+// Generation numbers (1 for a root commit, otherwise one more than the highest parent) let a
+// walk stop as soon as nothing below a generation can matter. A graph is immutable once built;
+// adding commits builds a new one.
+class CommitGraph
+{
+    std::vector<git_oid> ids_;
+    std::vector<git_oid> trees_;
+    std::vector<uint32_t> parentOffsets_;
+    std::vector<uint32_t> parents_;
+    std::vector<uint32_t> generations_;
+    std::vector<int64_t> commitTimes_;
+    std::vector<int64_t> authorTimes_;
+    std::vector<int32_t> authorTimeOffsets_;
+    std::vector<uint32_t> authorIds_;
+    // Author names and emails are interned: author i is the name text_[textOffsets_[2i],
+    // textOffsets_[2i+1]) and the email up to textOffsets_[2i+2].
+    std::vector<uint32_t> textOffsets_;
+    std::string text_;
+    uint32_t fanout_[256];
+
+    void BuildFanout();
+    bool Validate() const;
+public:
+    static constexpr uint32_t NoPosition = UINT32_MAX;
+
+    // A commit to add, as read from its object.
+    struct Commit
+    {
+        git_oid id;
+        git_oid tree;
+        std::vector<git_oid> parents;
+        int64_t commitTime;
+        int64_t authorTime;
+        int32_t authorTimeOffset;
+        std::string authorName;
+        std::string authorEmail;
+    };
+
+    CommitGraph();
+
+    uint32_t Size() const { return static_cast<uint32_t>(ids_.size()); }
+    // Position of id, or NoPosition if the graph lacks it.
+    uint32_t Find(const git_oid& id) const;
+
+    const git_oid& Id(uint32_t pos) const { return ids_[pos]; }
+    const git_oid& Tree(uint32_t pos) const { return trees_[pos]; }
+    const uint32_t* ParentsBegin(uint32_t pos) const { return parents_.data() + parentOffsets_[pos]; }
+    const uint32_t* ParentsEnd(uint32_t pos) const { return parents_.data() + parentOffsets_[pos + 1]; }
+    uint32_t Generation(uint32_t pos) const { return generations_[pos]; }
+    // Committer time in seconds, which orders a walk like GIT_SORT_TIME.
+    int64_t CommitTime(uint32_t pos) const { return commitTimes_[pos]; }
+    int64_t AuthorTime(uint32_t pos) const { return authorTimes_[pos]; }
+    // Minutes from UTC, as git_time.offset.
+    int32_t AuthorTimeOffset(uint32_t pos) const { return authorTimeOffsets_[pos]; }
+    std::string_view AuthorName(uint32_t pos) const;
+    std::string_view AuthorEmail(uint32_t pos) const;
+
+    // A graph of the commits of base (nullptr for none) and added. Every parent of an added
+    // commit must be in one or the other.
+    static std::shared_ptr<const CommitGraph> Merge(const CommitGraph *base, std::vector<Commit> added,
+                                                    std::string *error);
+
+    // The file format is a header (magic, version, counts) followed by the arrays as they are in
+    // memory. Load returns nullptr for a missing, foreign or inconsistent file.
+    bool Save(const std::string& path, std::string *error) const;
+    static std::shared_ptr<const CommitGraph> Load(const std::string& path);
+
+    // Counts the commits reachable from local but not from upstream (ahead) and the reverse
+    // (behind), as git_graph_ahead_behind does.
+    void AheadBehind(uint32_t local, uint32_t upstream, size_t *ahead, size_t *behind) const;
+};
+
+// Walks a graph from the pushed commits, newest committer time first (children before parents on
+// ties), in the order of a revwalk sorted by GIT_SORT_TIME.
+class CommitGraphWalk
+{
+    std::shared_ptr<const CommitGraph> graph_;
+    std::vector<bool> seen_;
+    std::vector<uint32_t> queue_;
+
+    bool Before(uint32_t a, uint32_t b) const;
+public:
+    explicit CommitGraphWalk(std::shared_ptr<const CommitGraph> graph);
+
+    const CommitGraph& Graph() const { return *graph_; }
+    void Push(uint32_t pos);
+    // The next commit, or false when the walk is over.
+    bool Next(uint32_t *pos);
+};
+
+// The commit graph of one repository, persisted in its git directory so that history queries
+// after a restart do not parse every commit again. Kept by the repository's session and shared
+// by its handles; snapshots handed out stay valid while an update replaces the graph.
+class CommitIndex
+{
+    std::mutex mutex_;
+    bool loaded_;
+    std::shared_ptr<const CommitGraph> graph_;
+
+    void LoadLocked(git_repository *repo);
+public:
+    CommitIndex();
+    CommitIndex(const CommitIndex&) = delete;
+    CommitIndex& operator=(const CommitIndex&) = delete;
+
+    // The indexed graph, read from disk on first use; nullptr when the repository has none yet.
+    // Commits made since the last Update are missing from it.
+    std::shared_ptr<const CommitGraph> Snapshot(git_repository *repo);
+
+    // Indexes the commits reachable from the references and HEAD that the graph lacks, reading only
+    // those, and saves the result.
+    int Update(git_repository *repo);
+};
+
+}}
@@ -0,0 +1,98 @@
+#include <jni.h>
+#include <cerrno>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "JniUtil.h"
+
+using zabuton::jni::GetRegistry;
+using zabuton::jni::GetStrings;
+using zabuton::util::SystemError;
+
+namespace
+{
+
+bool MakeParentDirectories(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos || slash == 0) {
+        return true;
+    }
+    std::string parent = path.substr(0, slash);
+    struct stat st = {};
+    if (stat(parent.c_str(), &st) == 0) {
+        return S_ISDIR(st.st_mode);
+    }
+    return MakeParentDirectories(parent) && (mkdir(parent.c_str(), 0700) == 0 || errno == EEXIST);
+}
+
+// Points path at target. A symlink pointing elsewhere is replaced, while a regular file of the
+// same name is kept, since it is the real tool.
+bool Link(const std::string& target, const std::string& path)
+{
+    struct stat st = {};
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISLNK(st.st_mode)) {
+            return true;
+        }
+        std::vector<char> current(target.size() + 1);
+        ssize_t n = readlink(path.c_str(), current.data(), current.size());
+        if (n == static_cast<ssize_t>(target.size()) && target.compare(0, target.size(), current.data(), n) == 0) {
+            return true;
+        }
+        if (unlink(path.c_str()) != 0) {
+            return false;
+        }
+    }
+    return MakeParentDirectories(path) && symlink(target.c_str(), path.c_str()) == 0;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_FileLayout_apply(JNIEnv *env, jclass /*type*/, jstring root_,
+        jobjectArray paths_, jintArray modes_, jobjectArray linkPaths_, jobjectArray linkTargets_)
+{
+    const char *rootChars = env->GetStringUTFChars(root_, nullptr);
+    if (rootChars == nullptr) {
+        return;
+    }
+    std::string root = rootChars;
+    env->ReleaseStringUTFChars(root_, rootChars);
+    root += '/';
+
+    std::vector<std::string> paths;
+    std::vector<std::string> linkPaths;
+    std::vector<std::string> linkTargets;
+    if (!GetStrings(env, paths_, &paths) || !GetStrings(env, linkPaths_, &linkPaths)
+            || !GetStrings(env, linkTargets_, &linkTargets)) {
+        return;
+    }
+    if (env->GetArrayLength(modes_) != static_cast<jsize>(paths.size()) || linkPaths.size() != linkTargets.size()) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Array lengths do not match.");
+        return;
+    }
+    std::vector<jint> modes(paths.size());
+    env->GetIntArrayRegion(modes_, 0, static_cast<jsize>(modes.size()), modes.data());
+
+    std::string path;
+    for (size_t i = 0; i < paths.size(); i++) {
+        path = root + paths[i];
+        if (chmod(path.c_str(), static_cast<mode_t>(modes[i])) != 0) {
+            env->ThrowNew(GetRegistry().ioException.clazz, SystemError("Cannot chmod", path).c_str());
+            return;
+        }
+    }
+    for (size_t i = 0; i < linkPaths.size(); i++) {
+        path = root + linkPaths[i];
+        if (!Link(linkTargets[i], path)) {
+            env->ThrowNew(GetRegistry().ioException.clazz, SystemError("Cannot link", path).c_str());
+            return;
+        }
+    }
+}
@@ -0,0 +1,474 @@
+#include "FileSnapshot.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "util.h"
+
+#include <jni.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace zabuton { namespace util {
+
+namespace
+{
+
+constexpr uint32_t SnapshotMagic = 0x5A465353; // "ZFSS"
+constexpr uint32_t SnapshotVersion = 1;
+constexpr unsigned int MaxSnapshotThreads = 8;
+constexpr size_t DirentBufferSize = 32 * 1024;
+
+struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+};
+
+struct SnapshotRecord
+{
+    uint64_t size;
+    int64_t mtime;
+    uint64_t inode;
+    uint32_t mode;
+    uint16_t sharedPrefix;
+    uint16_t suffixLength;
+};
+
+// The record getdents64 fills in, which libc does not declare everywhere.
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Directories waiting to be read and the files found so far. Workers take a directory at a time
+// and queue its subdirectories; the walk is over when the queue is empty and nobody is reading.
+struct Walk
+{
+    const std::string& root;
+    const std::vector<std::string>& excludedNames;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::string> directories;
+    size_t reading;
+    bool failed;
+    std::string error;
+
+    Walk(const std::string& root, const std::vector<std::string>& excludedNames) :
+        root(root), excludedNames(excludedNames), reading(0), failed(false) {}
+
+    bool Excluded(const char *name) const {
+        return std::find(excludedNames.begin(), excludedNames.end(), name) != excludedNames.end();
+    }
+};
+
+// Reads the directory dir (relative to the root), appending its files to entries and its
+// subdirectories to subdirectories. A directory or file removed while walking is skipped.
+bool ReadDirectory(const Walk& walk, const std::string& dir, std::vector<SnapshotEntry> *entries,
+                   std::vector<std::string> *subdirectories, std::string *error)
+{
+    const std::string path = dir.empty() ? walk.root : walk.root + "/" + dir;
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return true;
+        }
+        *error = SystemError("Cannot open", path);
+        return false;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { close(fd); });
+
+    alignas(LinuxDirent64) char buffer[DirentBufferSize];
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *error = SystemError("Cannot read", path);
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        for (long offset = 0; offset < n;) {
+            auto dirent = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+            offset += dirent->d_reclen;
+            const char *name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            std::string relative = dir.empty() ? std::string(name) : dir + "/" + name;
+            if (dirent->d_type == DT_DIR) {
+                if (!walk.Excluded(name)) {
+                    subdirectories->push_back(std::move(relative));
+                }
+                continue;
+            }
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                if (errno == ENOENT) {
+                    continue;
+                }
+                *error = SystemError("Cannot stat", walk.root + "/" + relative);
+                return false;
+            }
+            // File systems that do not fill in d_type report DT_UNKNOWN.
+            if (S_ISDIR(st.st_mode)) {
+                if (!walk.Excluded(name)) {
+                    subdirectories->push_back(std::move(relative));
+                }
+                continue;
+            }
+            entries->push_back(SnapshotEntry {
+                    std::move(relative),
+                    static_cast<uint64_t>(st.st_size),
+                    static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec,
+                    static_cast<uint64_t>(st.st_ino),
+                    static_cast<uint32_t>(st.st_mode) });
+        }
+    }
+}
+
+void WalkDirectories(Walk *walk, std::vector<SnapshotEntry> *entries)
+{
+    std::vector<std::string> subdirectories;
+    std::string error;
+    std::unique_lock<std::mutex> lock(walk->mutex);
+    for (;;) {
+        walk->changed.wait(lock, [&]() {
+            return walk->failed || !walk->directories.empty() || walk->reading == 0;
+        });
+        if (walk->failed || walk->directories.empty()) {
+            return;
+        }
+        std::string dir = std::move(walk->directories.back());
+        walk->directories.pop_back();
+        walk->reading++;
+        lock.unlock();
+
+        subdirectories.clear();
+        bool read = ReadDirectory(*walk, dir, entries, &subdirectories, &error);
+
+        lock.lock();
+        walk->reading--;
+        if (!read && !walk->failed) {
+            walk->failed = true;
+            walk->error = error;
+        }
+        for (auto& subdirectory : subdirectories) {
+            walk->directories.push_back(std::move(subdirectory));
+        }
+        walk->changed.notify_all();
+    }
+}
+
+bool SameStat(const SnapshotEntry& a, const SnapshotEntry& b)
+{
+    return a.size == b.size && a.mtime == b.mtime && a.inode == b.inode && a.mode == b.mode;
+}
+
+} // anonymous namespace
+
+std::unique_ptr<FileSnapshot> FileSnapshot::Take(const std::string& root, const std::vector<std::string>& excludedNames,
+                                                 unsigned int threads, std::string *error)
+{
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = static_cast<unsigned int>(std::max(1L, std::min<long>(cores, MaxSnapshotThreads)));
+    }
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0) {
+        *error = SystemError("Cannot walk", root);
+        return nullptr;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        *error = SystemError("Cannot walk", root);
+        return nullptr;
+    }
+
+    Walk walk(root, excludedNames);
+    walk.directories.emplace_back();
+    std::vector<std::vector<SnapshotEntry>> found(threads);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) {
+        workers.emplace_back(WalkDirectories, &walk, &found[i]);
+    }
+    WalkDirectories(&walk, &found[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (walk.failed) {
+        *error = walk.error;
+        return nullptr;
+    }
+
+    auto snapshot = std::make_unique<FileSnapshot>();
+    size_t count = 0;
+    for (const auto& entries : found) {
+        count += entries.size();
+    }
+    snapshot->entries_.reserve(count);
+    for (auto& entries : found) {
+        std::move(entries.begin(), entries.end(), std::back_inserter(snapshot->entries_));
+    }
+    std::sort(snapshot->entries_.begin(), snapshot->entries_.end(),
+            [](const SnapshotEntry& a, const SnapshotEntry& b) { return a.path < b.path; });
+    return snapshot;
+}
+
+bool FileSnapshot::Save(const std::string& path, std::string *error) const
+{
+    SnapshotHeader header = { SnapshotMagic, SnapshotVersion, entries_.size() };
+    std::vector<SnapshotRecord> records;
+    records.reserve(entries_.size());
+    std::string paths;
+    const std::string *previous = nullptr;
+    for (const auto& entry : entries_) {
+        size_t shared = 0;
+        if (previous != nullptr) {
+            size_t limit = std::min({ previous->size(), entry.path.size(), static_cast<size_t>(UINT16_MAX) });
+            while (shared < limit && (*previous)[shared] == entry.path[shared]) {
+                shared++;
+            }
+        }
+        size_t suffix = entry.path.size() - shared;
+        if (suffix > UINT16_MAX) {
+            *error = "Path too long for a snapshot: " + entry.path;
+            return false;
+        }
+        records.push_back(SnapshotRecord { entry.size, entry.mtime, entry.inode, entry.mode,
+                                           static_cast<uint16_t>(shared), static_cast<uint16_t>(suffix) });
+        paths.append(entry.path, shared, suffix);
+        previous = &entry.path;
+    }
+
+    ReplacingFile file;
+    size_t recordBytes = records.size() * sizeof(SnapshotRecord);
+    return file.Open(path, 0644, sizeof(header) + recordBytes + paths.size(), error)
+            && file.Write(&header, sizeof(header), error)
+            && file.Write(records.data(), recordBytes, error)
+            && file.Write(paths.data(), paths.size(), error)
+            && file.Commit(error);
+}
+
+std::unique_ptr<FileSnapshot> FileSnapshot::Load(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { close(fd); });
+    struct stat st;
+    SnapshotHeader header;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header)
+            || !ReadFully(fd, &header, sizeof(header), 0)
+            || header.magic != SnapshotMagic || header.version != SnapshotVersion
+            || header.count > (static_cast<uint64_t>(st.st_size) - sizeof(header)) / sizeof(SnapshotRecord)) {
+        return nullptr;
+    }
+    std::vector<SnapshotRecord> records(static_cast<size_t>(header.count));
+    const size_t recordBytes = records.size() * sizeof(SnapshotRecord);
+    std::string paths(static_cast<size_t>(st.st_size) - sizeof(header) - recordBytes, '\0');
+    if (!ReadFully(fd, records.data(), recordBytes, sizeof(header))
+            || !ReadFully(fd, &paths[0], paths.size(), sizeof(header) + recordBytes)) {
+        return nullptr;
+    }
+
+    auto snapshot = std::make_unique<FileSnapshot>();
+    snapshot->entries_.reserve(records.size());
+    size_t offset = 0;
+    const std::string empty;
+    for (const auto& record : records) {
+        const std::string& previous = snapshot->entries_.empty() ? empty : snapshot->entries_.back().path;
+        if (record.sharedPrefix > previous.size() || record.suffixLength > paths.size() - offset) {
+            return nullptr;
+        }
+        std::string entryPath = previous.substr(0, record.sharedPrefix);
+        entryPath.append(paths, offset, record.suffixLength);
+        offset += record.suffixLength;
+        if (!snapshot->entries_.empty() && !(previous < entryPath)) {
+            return nullptr;
+        }
+        snapshot->entries_.push_back(SnapshotEntry { std::move(entryPath), record.size, record.mtime,
+                                                     record.inode, record.mode });
+    }
+    return offset == paths.size() ? std::move(snapshot) : nullptr;
+}
+
+void FileSnapshot::ChangesSince(const FileSnapshot *previous, Changes *out) const
+{
+    static const std::vector<SnapshotEntry> none;
+    const auto& before = previous ? previous->entries_ : none;
+    const auto& after = entries_;
+    size_t i = 0, j = 0;
+    while (i < before.size() || j < after.size()) {
+        if (j == after.size() || (i < before.size() && before[i].path < after[j].path)) {
+            out->removed.push_back(before[i++].path);
+        } else if (i == before.size() || after[j].path < before[i].path) {
+            out->added.push_back(after[j++].path);
+        } else {
+            if (!SameStat(before[i], after[j])) {
+                out->modified.push_back(after[j].path);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+}}
+
+using zabuton::jni::GetRegistry;
+using zabuton::util::FileSnapshot;
+
+namespace
+{
+
+FileSnapshot* GetFileSnapshot(JNIEnv *env, jobject this_)
+{
+    auto snapshot = reinterpret_cast<FileSnapshot*>(env->GetLongField(this_, GetRegistry().fileSnapshot.handle));
+    if (snapshot == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "FileSnapshot is already closed.");
+    }
+    return snapshot;
+}
+
+jobject NewFileSnapshot(JNIEnv *env, std::unique_ptr<FileSnapshot> snapshot)
+{
+    const auto& fileSnapshot = GetRegistry().fileSnapshot;
+    jobject object = env->NewObject(fileSnapshot.clazz, fileSnapshot.ctor, reinterpret_cast<jlong>(snapshot.get()));
+    if (object != nullptr) {
+        snapshot.release();
+    }
+    return object;
+}
+
+jobjectArray NewStringArray(JNIEnv *env, const std::vector<std::string>& values)
+{
+    jobjectArray array = env->NewObjectArray(static_cast<jsize>(values.size()), GetRegistry().string.clazz, nullptr);
+    for (jsize i = 0; array != nullptr && i < static_cast<jsize>(values.size()); i++) {
+        jstring value = env->NewStringUTF(values[i].c_str());
+        if (value == nullptr) {
+            return nullptr;
+        }
+        env->SetObjectArrayElement(array, i, value);
+        env->DeleteLocalRef(value);
+    }
+    return array;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_take(JNIEnv *env, jclass /*type*/, jstring root_,
+                                                 jobjectArray excludedNames_, jint threads)
+{
+    std::vector<std::string> excludedNames;
+    jsize n = excludedNames_ != nullptr ? env->GetArrayLength(excludedNames_) : 0;
+    for (jsize i = 0; i < n; i++) {
+        auto name_ = static_cast<jstring>(env->GetObjectArrayElement(excludedNames_, i));
+        if (name_ == nullptr) {
+            continue;
+        }
+        const char *name = env->GetStringUTFChars(name_, nullptr);
+        excludedNames.emplace_back(name);
+        env->ReleaseStringUTFChars(name_, name);
+        env->DeleteLocalRef(name_);
+    }
+    const char *root = env->GetStringUTFChars(root_, nullptr);
+    std::string error;
+    auto snapshot = FileSnapshot::Take(root, excludedNames, static_cast<unsigned int>(std::max(threads, 0)), &error);
+    env->ReleaseStringUTFChars(root_, root);
+    if (!snapshot) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    return NewFileSnapshot(env, std::move(snapshot));
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_load(JNIEnv *env, jclass /*type*/, jstring path_)
+{
+    const char *path = env->GetStringUTFChars(path_, nullptr);
+    auto snapshot = FileSnapshot::Load(path);
+    env->ReleaseStringUTFChars(path_, path);
+    return snapshot ? NewFileSnapshot(env, std::move(snapshot)) : nullptr;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_save(JNIEnv *env, jobject this_, jstring path_)
+{
+    FileSnapshot *snapshot = GetFileSnapshot(env, this_);
+    if (snapshot == nullptr) {
+        return;
+    }
+    const char *path = env->GetStringUTFChars(path_, nullptr);
+    std::string error;
+    bool saved = snapshot->Save(path, &error);
+    env->ReleaseStringUTFChars(path_, path);
+    if (!saved) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+    }
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_getFileCount(JNIEnv *env, jobject this_)
+{
+    FileSnapshot *snapshot = GetFileSnapshot(env, this_);
+    return snapshot != nullptr ? static_cast<jint>(snapshot->Size()) : 0;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_changesSince(JNIEnv *env, jobject this_, jobject previous_)
+{
+    FileSnapshot *snapshot = GetFileSnapshot(env, this_);
+    if (snapshot == nullptr) {
+        return nullptr;
+    }
+    FileSnapshot *previous = nullptr;
+    if (previous_ != nullptr && (previous = GetFileSnapshot(env, previous_)) == nullptr) {
+        return nullptr;
+    }
+    FileSnapshot::Changes changes;
+    snapshot->ChangesSince(previous, &changes);
+    jobjectArray added = NewStringArray(env, changes.added);
+    jobjectArray removed = added ? NewStringArray(env, changes.removed) : nullptr;
+    jobjectArray modified = removed ? NewStringArray(env, changes.modified) : nullptr;
+    if (modified == nullptr) {
+        return nullptr;
+    }
+    const auto& changesClass = GetRegistry().fileSnapshotChanges;
+    return env->NewObject(changesClass.clazz, changesClass.ctor, added, removed, modified);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_FileSnapshot_destroy(JNIEnv *env, jobject this_)
+{
+    auto snapshot = reinterpret_cast<FileSnapshot*>(env->GetLongField(this_, GetRegistry().fileSnapshot.handle));
+    if (snapshot != nullptr) {
+        delete snapshot;
+        env->SetLongField(this_, GetRegistry().fileSnapshot.handle, 0);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zabuton { namespace util {
+
+// A file of a snapshot. Directories are not recorded, only what they hold.
+struct SnapshotEntry
+{
+    std::string path; // relative to the root, '/' separated
+    uint64_t size;
+    int64_t mtime; // nanoseconds
+    uint64_t inode;
+    uint32_t mode;
+};
+
+// The stat data of every file below a directory, sorted by path. Comparing two snapshots tells
+// which files changed without reading any of them, as make's own timestamp checks would after
+// re-statting the whole tree.
+class FileSnapshot
+{
+    std::vector<SnapshotEntry> entries_;
+public:
+    struct Changes
+    {
+        std::vector<std::string> added;
+        std::vector<std::string> removed;
+        std::vector<std::string> modified;
+    };
+
+    // Walks root with getdents64 and fstatat on up to threads threads (0 for one per core),
+    // skipping the directories named as one of excludedNames, such as ".git", wherever they are.
+    static std::unique_ptr<FileSnapshot> Take(const std::string& root, const std::vector<std::string>& excludedNames,
+                                              unsigned int threads, std::string *error);
+
+    // The file format is a header (magic, version, count) followed by fixed size records and
+    // the paths, each stored as the length of the prefix it shares with the previous path and
+    // the rest. Load returns nullptr for a missing, foreign or inconsistent file.
+    static std::unique_ptr<FileSnapshot> Load(const std::string& path);
+    bool Save(const std::string& path, std::string *error) const;
+
+    size_t Size() const { return entries_.size(); }
+    const std::vector<SnapshotEntry>& Entries() const { return entries_; }
+
+    // Files only in this snapshot, only in previous (nullptr for an empty one), and in both with
+    // different size, mtime, inode or mode.
+    void ChangesSince(const FileSnapshot *previous, Changes *out) const;
+};
+
+}}
@@ -0,0 +1,177 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FileUtil.h"
+
+namespace zabuton { namespace util {
+
+namespace
+{
+
+// Suffix of a file being written before it is renamed over its destination.
+constexpr const char* PartialFileSuffix = ".zabuton-partial";
+
+} // anonymous namespace
+
+bool ReadFully(int fd, void *buffer, size_t size, uint64_t offset)
+{
+    auto p = static_cast<uint8_t*>(buffer);
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool WriteFully(int fd, const void *buffer, size_t size)
+{
+    auto p = static_cast<const uint8_t*>(buffer);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+std::string SystemError(const char *what, const std::string& path)
+{
+    return std::string(what) + " " + path + ": " + strerror(errno);
+}
+
+void AddExtractedBytes(int64_t *slots, size_t bytes)
+{
+    __atomic_fetch_add(&slots[ExtractSlotExtractedBytes], static_cast<int64_t>(bytes), __ATOMIC_RELAXED);
+}
+
+bool ExtractCancelled(const int64_t *slots)
+{
+    return __atomic_load_n(&slots[ExtractSlotCancelled], __ATOMIC_RELAXED) != 0;
+}
+
+bool IsSafeName(const std::string& name)
+{
+    if (name.empty() || name.front() == '/') {
+        return false;
+    }
+    size_t begin = 0;
+    while (begin <= name.size()) {
+        size_t end = name.find('/', begin);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        if (name.compare(begin, end - begin, "..") == 0) {
+            return false;
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+bool CreateDirectories(const std::string& dir, const std::vector<const std::string*>& names,
+                       std::string *error)
+{
+    std::set<std::string> directories;
+    for (const std::string *name : names) {
+        size_t slash = !name->empty() && name->back() == '/' ? name->size() - 1 : name->rfind('/');
+        while (slash != std::string::npos && slash > 0 && directories.insert(name->substr(0, slash)).second) {
+            slash = name->rfind('/', slash - 1);
+        }
+    }
+    for (const auto& directory : directories) {
+        std::string path = dir + '/' + directory;
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            *error = SystemError("Cannot create", path);
+            return false;
+        }
+    }
+    return true;
+}
+
+ReplacingFile::ReplacingFile() :
+    fd_(-1)
+{
+}
+
+ReplacingFile::~ReplacingFile()
+{
+    Discard();
+}
+
+void ReplacingFile::Discard()
+{
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+        unlink(partialPath_.c_str());
+    }
+}
+
+bool ReplacingFile::Open(const std::string& path, mode_t mode, uint64_t size, std::string *error)
+{
+    Discard();
+    path_ = path;
+    partialPath_ = path + PartialFileSuffix;
+    fd_ = open(partialPath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd_ < 0) {
+        *error = SystemError("Cannot create", path);
+        return false;
+    }
+    // Reserving the whole file up front avoids repeated block allocation and fragmentation.
+    if (size > 0) {
+        int r = posix_fallocate(fd_, 0, static_cast<off_t>(size));
+        if (r == ENOSPC) {
+            errno = r;
+            *error = SystemError("Cannot allocate", path);
+            Discard();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ReplacingFile::Write(const void *data, size_t size, std::string *error)
+{
+    if (!WriteFully(fd_, data, size)) {
+        *error = SystemError("Cannot write", path_);
+        return false;
+    }
+    return true;
+}
+
+bool ReplacingFile::Commit(std::string *error)
+{
+    int fd = fd_;
+    fd_ = -1;
+    if (close(fd) != 0) {
+        *error = SystemError("Cannot write", path_);
+        unlink(partialPath_.c_str());
+        return false;
+    }
+    if (rename(partialPath_.c_str(), path_.c_str()) != 0) {
+        *error = SystemError("Cannot replace", path_);
+        unlink(partialPath_.c_str());
+        return false;
+    }
+    return true;
+}
+
+}}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace zabuton { namespace util {
+
+// pread/write until every byte is transferred, retrying on EINTR.
+bool ReadFully(int fd, void *buffer, size_t size, uint64_t offset);
+bool WriteFully(int fd, const void *buffer, size_t size);
+
+// "<what> <path>: <strerror(errno)>"
+std::string SystemError(const char *what, const std::string& path);
+
+// Little-endian fields of archive headers.
+inline uint16_t Le16(const uint8_t *p) { return static_cast<uint16_t>(p[0] | p[1] << 8); }
+inline uint32_t Le32(const uint8_t *p) { return Le16(p) | static_cast<uint32_t>(Le16(p + 2)) << 16; }
+inline uint64_t Le64(const uint8_t *p) { return Le32(p) | static_cast<uint64_t>(Le32(p + 4)) << 32; }
+
+// Slot layout of an archive extraction, shared with ZipArchive.java, ZipStream.java and
+// ZstdArchive.java. The slots live in a direct buffer that Java polls.
+enum ExtractSlot
+{
+    ExtractSlotExtractedBytes,
+    ExtractSlotCancelled,
+    ExtractSlotCount,
+};
+
+void AddExtractedBytes(int64_t *slots, size_t bytes);
+bool ExtractCancelled(const int64_t *slots);
+
+// Rejects archive entry names that would be written outside the extraction directory.
+bool IsSafeName(const std::string& name);
+
+// Creates every directory leading to the archive entries names below dir, and the directory
+// entries (names ending with '/') themselves. They are created up front in sorted order, parents
+// first, so that extraction workers never race on mkdir.
+bool CreateDirectories(const std::string& dir, const std::vector<const std::string*>& names,
+                       std::string *error);
+
+// Runs tasks 0 to count - 1 of an archive extraction on up to threads threads, the calling one
+// included, in order of their index. Each thread gets its own worker from makeWorker(), called
+// as worker(index, &error) and returning false with error set when the task fails. The first
+// failure stops every thread and its error is returned. A cancellation seen in slots returns
+// false with an empty error.
+template <typename MakeWorker>
+bool ExtractInParallel(size_t count, unsigned int threads, const int64_t *slots, std::string *error,
+                       const MakeWorker& makeWorker)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::mutex errorMutex;
+    auto run = [&]() {
+        auto worker = makeWorker();
+        std::string taskError;
+        for (size_t i = next++; i < count; i = next++) {
+            if (failed.load(std::memory_order_relaxed) || ExtractCancelled(slots)) {
+                return;
+            }
+            if (!worker(i, &taskError)) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!failed.exchange(true) && !ExtractCancelled(slots)) {
+                    *error = std::move(taskError);
+                }
+                return;
+            }
+        }
+    };
+
+    unsigned int workerCount = std::max(1u, std::min<unsigned int>(threads, static_cast<unsigned int>(count)));
+    std::vector<std::thread> workers;
+    workers.reserve(workerCount - 1);
+    for (unsigned int i = 1; i < workerCount; i++) {
+        workers.emplace_back(run);
+    }
+    run();
+    for (auto& t : workers) {
+        t.join();
+    }
+    if (ExtractCancelled(slots)) {
+        error->clear();
+        return false;
+    }
+    return !failed.load();
+}
+
+// A file written next to its destination and renamed over it once complete, so a file of a tree
+// in use is replaced, never truncated. The partial file is removed unless Commit() succeeds.
+class ReplacingFile
+{
+    std::string path_;
+    std::string partialPath_;
+    int fd_;
+
+    void Discard();
+public:
+    ReplacingFile();
+    ReplacingFile(const ReplacingFile&) = delete;
+    ReplacingFile& operator=(const ReplacingFile&) = delete;
+    ~ReplacingFile();
+
+    // Creates the partial file of path and reserves size bytes for it. A file still open from a
+    // previous Open() is discarded.
+    bool Open(const std::string& path, mode_t mode, uint64_t size, std::string *error);
+    bool Write(const void *data, size_t size, std::string *error);
+    bool Commit(std::string *error);
+};
+
+}}
@@ -0,0 +1,364 @@
+#include <jni.h>
+#include <algorithm>
+#include <thread>
+#include "GitJobQueue.h"
+#include "JniRegistry.h"
+
+using zabuton::git::GitJob;
+using zabuton::git::GitJobPriority;
+using zabuton::git::GitJobPriorityBackground;
+using zabuton::git::GitJobPriorityCount;
+using zabuton::git::GitJobQueue;
+using zabuton::jni::GetRegistry;
+
+// The blocking operations of LibGit2.cpp that jobs run.
+extern "C" {
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_clone(JNIEnv *env, jclass type, jstring url_, jstring clonePath_,
+        jobject options, jobject progressConsumer, jobject monitor);
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_updateMirror(JNIEnv *env, jclass type, jstring url_, jstring mirrorPath_,
+        jobject progressConsumer, jobject monitor);
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_fetchFrom(JNIEnv *env, jobject this_, jstring remoteName_,
+        jstring url_, jobject progressConsumer, jobject monitor);
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_fetchStaged(JNIEnv *env, jobject this_, jstring remoteName_,
+        jstring url_, jint refsPerStage, jobject monitor);
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_checkout(JNIEnv *env, jobject this_, jstring refspec_,
+        jobject progressConsumer, jobject monitor);
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_reset(JNIEnv *env, jobject this_, jobject resetKind_,
+        jobject progressConsumer, jobject monitor);
+}
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+// Local references an operation may hold at once before the JVM grows the frame.
+constexpr jint LocalFrameCapacity = 16;
+
+} // anonymous namespace
+
+GitJob::GitJob(JNIEnv *env, GitJobPriority priority, Operation operation, const std::vector<jobject>& args,
+               jobject callback) :
+    priority_(priority),
+    operation_(std::move(operation)),
+    callback_(env->NewGlobalRef(callback))
+{
+    args_.reserve(args.size());
+    for (jobject arg : args) {
+        args_.push_back(arg != nullptr ? env->NewGlobalRef(arg) : nullptr);
+    }
+}
+
+void GitJob::Run(JNIEnv *env)
+{
+    jobject result = nullptr;
+    bool framed = env->PushLocalFrame(LocalFrameCapacity) == 0;
+    if (framed) {
+        result = operation_(env, args_);
+    }
+    jthrowable error = env->ExceptionOccurred();
+    if (error != nullptr) {
+        env->ExceptionClear();
+        result = nullptr;
+    }
+    Complete(env, result, error);
+    if (framed) {
+        env->PopLocalFrame(nullptr);
+    }
+}
+
+void GitJob::Complete(JNIEnv *env, jobject result, jthrowable error)
+{
+    env->CallVoidMethod(callback_, GetRegistry().gitJobCallback.onComplete, result, error);
+    if (env->ExceptionCheck()) {
+        // Nothing up the stack of a worker could take it.
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+    for (jobject arg : args_) {
+        if (arg != nullptr) {
+            env->DeleteGlobalRef(arg);
+        }
+    }
+    args_.clear();
+    env->DeleteGlobalRef(callback_);
+    callback_ = nullptr;
+}
+
+GitJobQueue::GitJobQueue() :
+    maxConcurrency_(DefaultConcurrency),
+    workers_(0),
+    running_(0),
+    runningBackground_(0)
+{
+}
+
+GitJobQueue& GitJobQueue::Get()
+{
+    // Never destroyed: its workers are detached and may outlive static destruction.
+    static GitJobQueue *queue = new GitJobQueue();
+    return *queue;
+}
+
+// The first queued job of the highest priority that may start now, removed from the queue.
+std::shared_ptr<GitJob> GitJobQueue::TakeLocked()
+{
+    if (running_ >= maxConcurrency_) {
+        return nullptr;
+    }
+    const unsigned int backgroundLimit = maxConcurrency_ > 1 ? maxConcurrency_ - 1 : 1;
+    auto next = queue_.end();
+    for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+        if ((*it)->priority_ == GitJobPriorityBackground && runningBackground_ >= backgroundLimit) {
+            continue;
+        }
+        if (next == queue_.end() || (*it)->priority_ > (*next)->priority_) {
+            next = it;
+        }
+    }
+    if (next == queue_.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<GitJob> job = *next;
+    queue_.erase(next);
+    running_++;
+    if (job->priority_ == GitJobPriorityBackground) {
+        runningBackground_++;
+    }
+    return job;
+}
+
+void GitJobQueue::StartWorkersLocked()
+{
+    size_t wanted = std::min<size_t>(maxConcurrency_, running_ + queue_.size());
+    while (workers_ < wanted) {
+        workers_++;
+        std::thread([this]() { Work(); }).detach();
+    }
+}
+
+void GitJobQueue::Work()
+{
+    JNIEnv *env = nullptr;
+    JavaVMAttachArgs attachArgs = {JNI_VERSION_1_6, "GitJob", nullptr};
+    bool attached = GetRegistry().vm->AttachCurrentThreadAsDaemon(&env, &attachArgs) == JNI_OK;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (attached) {
+        std::shared_ptr<GitJob> job;
+        ready_.wait(lock, [&]() { return workers_ > maxConcurrency_ || (job = TakeLocked()) != nullptr; });
+        if (job == nullptr) {
+            break;
+        }
+        lock.unlock();
+        job->Run(env);
+        lock.lock();
+        running_--;
+        if (job->priority_ == GitJobPriorityBackground) {
+            runningBackground_--;
+        }
+    }
+    workers_--;
+    lock.unlock();
+    if (attached) {
+        GetRegistry().vm->DetachCurrentThread();
+    }
+}
+
+void GitJobQueue::Submit(const std::shared_ptr<GitJob>& job)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(job);
+    StartWorkersLocked();
+    ready_.notify_one();
+}
+
+bool GitJobQueue::Cancel(JNIEnv *env, const std::shared_ptr<GitJob>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find(queue_.begin(), queue_.end(), job);
+        if (it == queue_.end()) {
+            return false;
+        }
+        queue_.erase(it);
+    }
+    env->ThrowNew(GetRegistry().cancellationException.clazz, "The git job was cancelled before it started.");
+    jthrowable error = env->ExceptionOccurred();
+    env->ExceptionClear();
+    job->Complete(env, nullptr, error);
+    env->DeleteLocalRef(error);
+    return true;
+}
+
+void GitJobQueue::SetMaxConcurrency(unsigned int concurrency)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    maxConcurrency_ = concurrency;
+    StartWorkersLocked();
+    ready_.notify_all();
+}
+
+unsigned int GitJobQueue::MaxConcurrency()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return maxConcurrency_;
+}
+
+}}
+
+namespace
+{
+
+std::shared_ptr<GitJob>* GetGitJob(JNIEnv *env, jobject this_)
+{
+    auto job = reinterpret_cast<std::shared_ptr<GitJob>*>(env->GetLongField(this_, GetRegistry().gitJob.handle));
+    if (job == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "GitJob is already closed.");
+    }
+    return job;
+}
+
+// Queues operation on args, of which the first required must not be null, and returns the
+// GitJob for it, or nullptr with a Java exception pending.
+jobject SubmitJob(JNIEnv *env, jint priority, jobject monitor, jobject callback, GitJob::Operation operation,
+                  const std::vector<jobject>& args, size_t required)
+{
+    if (priority < 0 || priority >= GitJobPriorityCount) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Unknown git job priority.");
+        return nullptr;
+    }
+    bool missing = monitor == nullptr || callback == nullptr ||
+                   std::any_of(args.begin(), args.begin() + required, [](jobject arg) { return arg == nullptr; });
+    if (missing) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Argument must not be null.");
+        return nullptr;
+    }
+    auto handle = new std::shared_ptr<GitJob>();
+    const auto& gitJob = GetRegistry().gitJob;
+    jobject object = env->NewObject(gitJob.clazz, gitJob.ctor, reinterpret_cast<jlong>(handle), monitor);
+    if (object == nullptr) {
+        delete handle;
+        return nullptr;
+    }
+    *handle = std::make_shared<GitJob>(env, static_cast<GitJobPriority>(priority), std::move(operation), args,
+                                       callback);
+    GitJobQueue::Get().Submit(*handle);
+    return object;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_clone(JNIEnv *env, jclass /*type*/, jstring url_, jstring cloneRepoPath_,
+        jobject options, jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [](JNIEnv *env, const std::vector<jobject>& a) {
+        return Java_io_github_sh4_zabuton_git_Repository_clone(env, GetRegistry().repository.clazz,
+                static_cast<jstring>(a[0]), static_cast<jstring>(a[1]), a[2], nullptr, a[3]);
+    }, {url_, cloneRepoPath_, options, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_updateMirror(JNIEnv *env, jclass /*type*/, jstring url_, jstring mirrorPath_,
+        jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [](JNIEnv *env, const std::vector<jobject>& a) -> jobject {
+        Java_io_github_sh4_zabuton_git_Repository_updateMirror(env, GetRegistry().repository.clazz,
+                static_cast<jstring>(a[0]), static_cast<jstring>(a[1]), nullptr, a[2]);
+        return nullptr;
+    }, {url_, mirrorPath_, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_fetch(JNIEnv *env, jclass /*type*/, jobject repository, jstring remoteName_,
+        jstring url_, jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [](JNIEnv *env, const std::vector<jobject>& a) -> jobject {
+        Java_io_github_sh4_zabuton_git_Repository_fetchFrom(env, a[0],
+                static_cast<jstring>(a[1]), static_cast<jstring>(a[2]), nullptr, a[3]);
+        return nullptr;
+    }, {repository, remoteName_, url_, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_fetchStaged(JNIEnv *env, jclass /*type*/, jobject repository,
+        jstring remoteName_, jstring url_, jint refsPerStage, jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [refsPerStage](JNIEnv *env, const std::vector<jobject>& a) {
+        return Java_io_github_sh4_zabuton_git_Repository_fetchStaged(env, a[0],
+                static_cast<jstring>(a[1]), static_cast<jstring>(a[2]), refsPerStage, a[3]);
+    }, {repository, remoteName_, url_, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_checkout(JNIEnv *env, jclass /*type*/, jobject repository, jstring refspec_,
+        jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [](JNIEnv *env, const std::vector<jobject>& a) -> jobject {
+        Java_io_github_sh4_zabuton_git_Repository_checkout(env, a[0], static_cast<jstring>(a[1]), nullptr, a[2]);
+        return nullptr;
+    }, {repository, refspec_, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_reset(JNIEnv *env, jclass /*type*/, jobject repository, jobject resetKind,
+        jobject monitor, jint priority, jobject callback)
+{
+    return SubmitJob(env, priority, monitor, callback, [](JNIEnv *env, const std::vector<jobject>& a) -> jobject {
+        Java_io_github_sh4_zabuton_git_Repository_reset(env, a[0], a[1], nullptr, a[2]);
+        return nullptr;
+    }, {repository, resetKind, monitor}, 2);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_cancelQueued(JNIEnv *env, jobject this_)
+{
+    std::shared_ptr<GitJob> *job = GetGitJob(env, this_);
+    if (job == nullptr) {
+        return JNI_FALSE;
+    }
+    return GitJobQueue::Get().Cancel(env, *job) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_setMaxConcurrency(JNIEnv *env, jclass /*type*/, jint concurrency)
+{
+    if (concurrency < 0) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Concurrency must not be negative.");
+        return;
+    }
+    GitJobQueue::Get().SetMaxConcurrency(static_cast<unsigned int>(concurrency));
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_getMaxConcurrency(JNIEnv */*env*/, jclass /*type*/)
+{
+    return static_cast<jint>(GitJobQueue::Get().MaxConcurrency());
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_GitJob_destroy(JNIEnv *env, jobject this_)
+{
+    auto job = reinterpret_cast<std::shared_ptr<GitJob>*>(env->GetLongField(this_, GetRegistry().gitJob.handle));
+    if (job != nullptr) {
+        delete job;
+        env->SetLongField(this_, GetRegistry().gitJob.handle, 0);
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <jni.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+// Priorities shared with GitJob.java; a queued job of a higher priority starts first.
+enum GitJobPriority
+{
+    GitJobPriorityBackground,
+    GitJobPriorityNormal,
+    GitJobPriorityInteractive,
+    GitJobPriorityCount,
+};
+
+// A clone, fetch, checkout or reset waiting for or running on a worker of the GitJobQueue. The
+// operation is one of the blocking natives of LibGit2.cpp, called on the worker with the
+// arguments it was submitted with; what it returns or throws goes to the callback, which is
+// called exactly once: by the worker when the operation ends, or by Cancel() when it had not
+// started yet.
+class GitJob
+{
+public:
+    using Operation = std::function<jobject(JNIEnv *env, const std::vector<jobject>& args)>;
+
+private:
+    friend class GitJobQueue;
+
+    GitJobPriority priority_;
+    Operation operation_;
+    // Global references, released once the callback has been called.
+    std::vector<jobject> args_;
+    jobject callback_;
+
+    void Run(JNIEnv *env);
+    void Complete(JNIEnv *env, jobject result, jthrowable error);
+
+public:
+    // Takes global references to args and callback.
+    GitJob(JNIEnv *env, GitJobPriority priority, Operation operation, const std::vector<jobject>& args,
+           jobject callback);
+    GitJob(const GitJob&) = delete;
+    GitJob& operator=(const GitJob&) = delete;
+
+    GitJobPriority Priority() const { return priority_; }
+};
+
+// The native threads that run GitJobs, at most MaxConcurrency() of them at a time. The threads
+// are attached to the JVM once and started as jobs arrive, so waiting for a clone or fetch holds
+// no Java thread: ten workspaces fetching at once take a few workers and a queue. Background jobs
+// may occupy all workers but one, which stays free for a checkout the user is waiting on.
+class GitJobQueue
+{
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::vector<std::shared_ptr<GitJob>> queue_;
+    unsigned int maxConcurrency_;
+    unsigned int workers_;
+    unsigned int running_;
+    unsigned int runningBackground_;
+
+    GitJobQueue();
+    std::shared_ptr<GitJob> TakeLocked();
+    void StartWorkersLocked();
+    void Work();
+public:
+    static constexpr unsigned int DefaultConcurrency = 4;
+
+    static GitJobQueue& Get();
+
+    void Submit(const std::shared_ptr<GitJob>& job);
+
+    // Completes a job that has not started with a CancellationException and returns true; a
+    // running job is stopped through its ProgressMonitor instead.
+    bool Cancel(JNIEnv *env, const std::shared_ptr<GitJob>& job);
+
+    // 0 holds every queued job until the concurrency is raised again. Running jobs finish.
+    void SetMaxConcurrency(unsigned int concurrency);
+    unsigned int MaxConcurrency();
+};
+
+}}
@@ -0,0 +1,253 @@
+#include "JniRegistry.h"
+
+namespace zabuton { namespace jni {
+
+namespace
+{
+
+Registry registry;
+
+class RegistryLoader
+{
+    JNIEnv *env_;
+    bool failed_;
+public:
+    explicit RegistryLoader(JNIEnv *env) : env_(env), failed_(false) {
+    }
+
+    bool Failed() const { return failed_; }
+
+    jclass Class(const char *name) {
+        if (failed_) {
+            return nullptr;
+        }
+        jclass localClass = env_->FindClass(name);
+        if (localClass == nullptr) {
+            failed_ = true;
+            return nullptr;
+        }
+        auto globalClass = static_cast<jclass>(env_->NewGlobalRef(localClass));
+        env_->DeleteLocalRef(localClass);
+        return globalClass;
+    }
+
+    jmethodID Method(jclass clazz, const char *name, const char *signature) {
+        if (failed_) {
+            return nullptr;
+        }
+        jmethodID method = env_->GetMethodID(clazz, name, signature);
+        failed_ = method == nullptr;
+        return method;
+    }
+
+    jmethodID StaticMethod(jclass clazz, const char *name, const char *signature) {
+        if (failed_) {
+            return nullptr;
+        }
+        jmethodID method = env_->GetStaticMethodID(clazz, name, signature);
+        failed_ = method == nullptr;
+        return method;
+    }
+
+    jfieldID Field(jclass clazz, const char *name, const char *signature) {
+        if (failed_) {
+            return nullptr;
+        }
+        jfieldID field = env_->GetFieldID(clazz, name, signature);
+        failed_ = field == nullptr;
+        return field;
+    }
+
+    template <size_t N>
+    void ProgressFields(jclass clazz, const ProgressField (&table)[N], jfieldID (&ids)[N]) {
+        for (size_t i = 0; i < N; i++) {
+            ids[i] = Field(clazz, table[i].name, "J");
+        }
+    }
+
+    CheckoutProgressFields CheckoutFields(jclass clazz) {
+        CheckoutProgressFields fields = {};
+        ProgressFields(clazz, CheckoutProgressFieldTable, fields.ids);
+        return fields;
+    }
+
+    FetchProgressFields FetchFields(jclass clazz) {
+        FetchProgressFields fields = {};
+        ProgressFields(clazz, FetchProgressFieldTable, fields.ids);
+        fields.sidebandMessage = Field(clazz, "sidebandMessage", "Ljava/lang/String;");
+        return fields;
+    }
+
+    CheckoutProgressClass CheckoutProgress(const char *name) {
+        CheckoutProgressClass c = {};
+        c.clazz = Class(name);
+        c.ctor = Method(c.clazz, "<init>", "()V");
+        c.checkout = CheckoutFields(c.clazz);
+        return c;
+    }
+};
+
+bool LoadRegistry(JNIEnv *env, Registry *r)
+{
+    RegistryLoader l(env);
+
+    r->string.clazz = l.Class("java/lang/String");
+
+    r->boolean.clazz = l.Class("java/lang/Boolean");
+    r->boolean.booleanValue = l.Method(r->boolean.clazz, "booleanValue", "()Z");
+
+    r->date.clazz = l.Class("java/util/Date");
+    r->date.ctor = l.Method(r->date.clazz, "<init>", "(J)V");
+
+    r->arrays.clazz = l.Class("java/util/Arrays");
+    r->arrays.asList = l.StaticMethod(r->arrays.clazz, "asList", "([Ljava/lang/Object;)Ljava/util/List;");
+
+    r->function.clazz = l.Class("java/util/function/Function");
+    r->function.apply = l.Method(r->function.clazz, "apply", "(Ljava/lang/Object;)Ljava/lang/Object;");
+
+    r->consumer.clazz = l.Class("java/util/function/Consumer");
+    r->consumer.accept = l.Method(r->consumer.clazz, "accept", "(Ljava/lang/Object;)V");
+
+    r->illegalArgumentException.clazz = l.Class("java/lang/IllegalArgumentException");
+    r->illegalStateException.clazz = l.Class("java/lang/IllegalStateException");
+    r->cancellationException.clazz = l.Class("java/util/concurrent/CancellationException");
+    r->ioException.clazz = l.Class("java/io/IOException");
+
+    r->libGit2Exception.clazz = l.Class("io/github/sh4/zabuton/git/LibGit2Exception");
+    r->libGit2Exception.ctor = l.Method(r->libGit2Exception.clazz, "<init>", "(IILjava/lang/String;)V");
+
+    r->repository.clazz = l.Class("io/github/sh4/zabuton/git/Repository");
+    r->repository.ctor = l.Method(r->repository.clazz, "<init>", "(J)V");
+    r->repository.handle = l.Field(r->repository.clazz, "repositoryHandle", "J");
+
+    r->gitJob.clazz = l.Class("io/github/sh4/zabuton/git/GitJob");
+    r->gitJob.ctor = l.Method(r->gitJob.clazz, "<init>", "(JLio/github/sh4/zabuton/git/ProgressMonitor;)V");
+    r->gitJob.handle = l.Field(r->gitJob.clazz, "jobHandle", "J");
+
+    r->gitJobCallback.clazz = l.Class("io/github/sh4/zabuton/git/GitJob$Callback");
+    r->gitJobCallback.onComplete = l.Method(r->gitJobCallback.clazz, "onComplete",
+            "(Ljava/lang/Object;Ljava/lang/Throwable;)V");
+
+    r->fetchStats.clazz = l.Class("io/github/sh4/zabuton/git/FetchStats");
+    r->fetchStats.ctor = l.Method(r->fetchStats.clazz, "<init>", "(IIJJJJJ)V");
+
+    r->user.clazz = l.Class("io/github/sh4/zabuton/git/User");
+    r->user.ctor = l.Method(r->user.clazz, "<init>",
+            "(Ljava/lang/String;Ljava/lang/String;Ljava/util/Date;)V");
+
+    r->commitObject.clazz = l.Class("io/github/sh4/zabuton/git/CommitObject");
+    r->commitObject.ctor = l.Method(r->commitObject.clazz, "<init>",
+            "(Ljava/util/List;Lio/github/sh4/zabuton/git/User;Lio/github/sh4/zabuton/git/User;Ljava/lang/String;)V");
+
+    r->commitLogBatch.clazz = l.Class("io/github/sh4/zabuton/git/CommitLogBatch");
+    r->commitLogBatch.ctor = l.Method(r->commitLogBatch.clazz, "<init>", "(II[B[I[B[J[I[J[I[B[I)V");
+
+    r->blame.clazz = l.Class("io/github/sh4/zabuton/git/Blame");
+    r->blame.ctor = l.Method(r->blame.clazz, "<init>", "(I[I[I[ILio/github/sh4/zabuton/git/CommitLogBatch;)V");
+
+    r->commitLogWalker.clazz = l.Class("io/github/sh4/zabuton/git/CommitLogWalker");
+    r->commitLogWalker.ctor = l.Method(r->commitLogWalker.clazz, "<init>",
+            "(Lio/github/sh4/zabuton/git/Repository;J)V");
+    r->commitLogWalker.handle = l.Field(r->commitLogWalker.clazz, "walkerHandle", "J");
+
+    r->statusList.clazz = l.Class("io/github/sh4/zabuton/git/StatusList");
+    r->statusList.ctor = l.Method(r->statusList.clazz, "<init>", "(I[I[B[I)V");
+
+    r->zipArchive.clazz = l.Class("io/github/sh4/zabuton/util/ZipArchive");
+    r->zipArchive.ctor = l.Method(r->zipArchive.clazz, "<init>", "(J)V");
+    r->zipArchive.handle = l.Field(r->zipArchive.clazz, "archiveHandle", "J");
+    r->zipArchive.state = l.Field(r->zipArchive.clazz, "state", "Ljava/nio/ByteBuffer;");
+
+    r->zipStream.clazz = l.Class("io/github/sh4/zabuton/util/ZipStream");
+    r->zipStream.ctor = l.Method(r->zipStream.clazz, "<init>", "(J)V");
+    r->zipStream.handle = l.Field(r->zipStream.clazz, "streamHandle", "J");
+    r->zipStream.state = l.Field(r->zipStream.clazz, "state", "Ljava/nio/ByteBuffer;");
+
+    r->zstdArchive.clazz = l.Class("io/github/sh4/zabuton/util/ZstdArchive");
+    r->zstdArchive.ctor = l.Method(r->zstdArchive.clazz, "<init>", "(J)V");
+    r->zstdArchive.handle = l.Field(r->zstdArchive.clazz, "archiveHandle", "J");
+    r->zstdArchive.state = l.Field(r->zstdArchive.clazz, "state", "Ljava/nio/ByteBuffer;");
+
+    r->sharedMemoryTransport.clazz = l.Class("io/github/sh4/zabuton/programmer/SharedMemoryTransport");
+    r->sharedMemoryTransport.ctor = l.Method(r->sharedMemoryTransport.clazz, "<init>", "(J)V");
+    r->sharedMemoryTransport.handle = l.Field(r->sharedMemoryTransport.clazz, "transportHandle", "J");
+
+    r->fileSnapshot.clazz = l.Class("io/github/sh4/zabuton/util/FileSnapshot");
+    r->fileSnapshot.ctor = l.Method(r->fileSnapshot.clazz, "<init>", "(J)V");
+    r->fileSnapshot.handle = l.Field(r->fileSnapshot.clazz, "snapshotHandle", "J");
+
+    r->fileSnapshotChanges.clazz = l.Class("io/github/sh4/zabuton/util/FileSnapshot$Changes");
+    r->fileSnapshotChanges.ctor = l.Method(r->fileSnapshotChanges.clazz, "<init>",
+            "([Ljava/lang/String;[Ljava/lang/String;[Ljava/lang/String;)V");
+
+    r->makeProcess.clazz = l.Class("io/github/sh4/zabuton/build/MakeProcess");
+    r->makeProcess.ctor = l.Method(r->makeProcess.clazz, "<init>", "(J)V");
+    r->makeProcess.handle = l.Field(r->makeProcess.clazz, "processHandle", "J");
+
+    r->makeEventBatch.clazz = l.Class("io/github/sh4/zabuton/build/MakeEventBatch");
+    r->makeEventBatch.ctor = l.Method(r->makeEventBatch.clazz, "<init>", "(I[I[Ljava/lang/String;[J)V");
+
+    r->workspaceRegistry.clazz = l.Class("io/github/sh4/zabuton/workspace/WorkspaceRegistry");
+    r->workspaceRegistry.ctor = l.Method(r->workspaceRegistry.clazz, "<init>", "(J)V");
+    r->workspaceRegistry.handle = l.Field(r->workspaceRegistry.clazz, "registryHandle", "J");
+
+    r->workspaceRecord.clazz = l.Class("io/github/sh4/zabuton/workspace/WorkspaceRecord");
+    r->workspaceRecord.ctor = l.Method(r->workspaceRecord.clazz, "<init>",
+            "(JJLjava/lang/String;Ljava/lang/String;ZLjava/lang/String;Ljava/lang/String;)V");
+
+    r->remote.clazz = l.Class("io/github/sh4/zabuton/git/Remote");
+    r->remote.ctor = l.Method(r->remote.clazz, "<init>",
+            "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
+
+    r->resetKind.clazz = l.Class("io/github/sh4/zabuton/git/ResetKind");
+    r->resetKind.ordinal = l.Method(r->resetKind.clazz, "ordinal", "()I");
+
+    r->cloneOptions.clazz = l.Class("io/github/sh4/zabuton/git/CloneOptions");
+    r->cloneOptions.branch = l.Field(r->cloneOptions.clazz, "branch", "Ljava/lang/String;");
+    r->cloneOptions.sparsePaths = l.Field(r->cloneOptions.clazz, "sparsePaths", "[Ljava/lang/String;");
+    r->cloneOptions.mirror = l.Field(r->cloneOptions.clazz, "mirror", "Ljava/lang/String;");
+
+    r->progressMonitor.clazz = l.Class("io/github/sh4/zabuton/git/ProgressMonitor");
+    r->progressMonitor.state = l.Field(r->progressMonitor.clazz, "state", "Ljava/nio/ByteBuffer;");
+    r->progressMonitor.intervalNanos = l.Field(r->progressMonitor.clazz, "intervalNanos", "J");
+    r->progressMonitor.sidebandMessage = l.Field(r->progressMonitor.clazz, "sidebandMessage", "Ljava/lang/String;");
+
+    r->checkoutProgress = l.CheckoutProgress("io/github/sh4/zabuton/git/CheckoutProgress");
+    r->resetProgress = l.CheckoutProgress("io/github/sh4/zabuton/git/ResetProgress");
+
+    r->fetchProgress.clazz = l.Class("io/github/sh4/zabuton/git/FetchProgress");
+    r->fetchProgress.ctor = l.Method(r->fetchProgress.clazz, "<init>", "()V");
+    r->fetchProgress.fetch = l.FetchFields(r->fetchProgress.clazz);
+
+    r->cloneProgress.clazz = l.Class("io/github/sh4/zabuton/git/CloneProgress");
+    r->cloneProgress.ctor = l.Method(r->cloneProgress.clazz, "<init>", "()V");
+    r->cloneProgress.checkout = l.CheckoutFields(r->cloneProgress.clazz);
+    r->cloneProgress.fetch = l.FetchFields(r->cloneProgress.clazz);
+
+    return !l.Failed();
+}
+
+} // anonymous namespace
+
+const Registry& GetRegistry()
+{
+    return registry;
+}
+
+}}
+
+extern "C"
+JNIEXPORT jint JNICALL
+JNI_OnLoad(JavaVM *vm, void * /*reserved*/)
+{
+    JNIEnv *env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    zabuton::jni::registry.vm = vm;
+    if (!zabuton::jni::LoadRegistry(env, &zabuton::jni::registry)) {
+        // Leave the pending NoClassDefFoundError/NoSuchMethodError to System.loadLibrary().
+        return JNI_ERR;
+    }
+    return JNI_VERSION_1_6;
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <jni.h>
+#include "ProgressFields.h"
+
+namespace zabuton { namespace jni {
+
+// IDs of the fields in CheckoutProgressFieldTable, in table order.
+struct CheckoutProgressFields
+{
+    jfieldID ids[CheckoutProgressFieldCount];
+};
+
+// IDs of the fields in FetchProgressFieldTable, in table order.
+struct FetchProgressFields
+{
+    jfieldID ids[FetchProgressFieldCount];
+    jfieldID sidebandMessage;
+};
+
+struct CheckoutProgressClass
+{
+    jclass clazz;
+    jmethodID ctor;
+    CheckoutProgressFields checkout;
+};
+
+struct FetchProgressClass
+{
+    jclass clazz;
+    jmethodID ctor;
+    FetchProgressFields fetch;
+};
+
+struct CloneProgressClass
+{
+    jclass clazz;
+    jmethodID ctor;
+    CheckoutProgressFields checkout;
+    FetchProgressFields fetch;
+};
+
+// Global class references and member IDs used by the native bindings.
+// Filled once in JNI_OnLoad and read-only afterwards, so it can be shared by every thread.
+struct Registry
+{
+    JavaVM *vm;
+
+    struct {
+        jclass clazz;
+    } string;
+
+    struct {
+        jclass clazz;
+        jmethodID booleanValue;
+    } boolean;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } date;
+
+    struct {
+        jclass clazz;
+        jmethodID asList;
+    } arrays;
+
+    struct {
+        jclass clazz;
+        jmethodID apply;
+    } function;
+
+    struct {
+        jclass clazz;
+        jmethodID accept;
+    } consumer;
+
+    struct {
+        jclass clazz;
+    } illegalArgumentException;
+
+    struct {
+        jclass clazz;
+    } illegalStateException;
+
+    struct {
+        jclass clazz;
+    } cancellationException;
+
+    struct {
+        jclass clazz;
+    } ioException;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } libGit2Exception;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } repository;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } gitJob;
+
+    struct {
+        jclass clazz;
+        jmethodID onComplete;
+    } gitJobCallback;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } fetchStats;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } user;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } commitObject;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } commitLogBatch;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } blame;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } commitLogWalker;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } statusList;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+        jfieldID state;
+    } zipArchive;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+        jfieldID state;
+    } zipStream;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+        jfieldID state;
+    } zstdArchive;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } sharedMemoryTransport;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } fileSnapshot;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } fileSnapshotChanges;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } makeProcess;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } makeEventBatch;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+        jfieldID handle;
+    } workspaceRegistry;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } workspaceRecord;
+
+    struct {
+        jclass clazz;
+        jmethodID ctor;
+    } remote;
+
+    struct {
+        jclass clazz;
+        jmethodID ordinal;
+    } resetKind;
+
+    struct {
+        jclass clazz;
+        jfieldID branch;
+        jfieldID sparsePaths;
+        jfieldID mirror;
+    } cloneOptions;
+
+    struct {
+        jclass clazz;
+        jfieldID state;
+        jfieldID intervalNanos;
+        jfieldID sidebandMessage;
+    } progressMonitor;
+
+    CheckoutProgressClass checkoutProgress;
+    CheckoutProgressClass resetProgress;
+    FetchProgressClass fetchProgress;
+    CloneProgressClass cloneProgress;
+};
+
+const Registry& GetRegistry();
+
+}}
@@ -0,0 +1,59 @@
+#include <iterator>
+#include "JniUtil.h"
+#include "JniRegistry.h"
+#include "util.h"
+
+namespace zabuton { namespace jni {
+
+bool GetStrings(JNIEnv *env, jobjectArray array, std::vector<std::string> *out)
+{
+    jsize n = env->GetArrayLength(array);
+    out->reserve(out->size() + static_cast<size_t>(n));
+    for (jsize i = 0; i < n; i++) {
+        auto value_ = static_cast<jstring>(env->GetObjectArrayElement(array, i));
+        if (value_ == nullptr) {
+            env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Array element must not be null.");
+            return false;
+        }
+        const char *value = env->GetStringUTFChars(value_, nullptr);
+        if (value == nullptr) {
+            return false;
+        }
+        out->emplace_back(value);
+        env->ReleaseStringUTFChars(value_, value);
+        env->DeleteLocalRef(value_);
+    }
+    return true;
+}
+
+void ExtractArchive(JNIEnv *env, jobject this_, jfieldID stateField, jstring extractDir_, jobjectArray names_,
+                    const char *cancelledMessage, const ArchiveExtract& extract)
+{
+    jobject state = env->GetObjectField(this_, stateField);
+    auto slots = static_cast<int64_t*>(env->GetDirectBufferAddress(state));
+    env->DeleteLocalRef(state);
+    const char *extractDir = env->GetStringUTFChars(extractDir_, nullptr);
+    if (extractDir == nullptr) {
+        return;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { env->ReleaseStringUTFChars(extractDir_, extractDir); });
+    std::unordered_set<std::string> names;
+    if (names_ != nullptr) {
+        std::vector<std::string> nameList;
+        if (!GetStrings(env, names_, &nameList)) {
+            return;
+        }
+        names.insert(std::make_move_iterator(nameList.begin()), std::make_move_iterator(nameList.end()));
+    }
+
+    std::string error;
+    if (!extract(extractDir, names_ != nullptr ? &names : nullptr, slots, &error)) {
+        if (error.empty()) {
+            env->ThrowNew(GetRegistry().cancellationException.clazz, cancelledMessage);
+        } else {
+            env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        }
+    }
+}
+
+}}
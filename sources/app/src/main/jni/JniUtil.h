@@ -0,0 +1,28 @@
+#pragma once
+
+#include <jni.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace zabuton { namespace jni {
+
+// Copies a java.lang.String[], throwing IllegalArgumentException for a null element. Returns
+// false when a Java exception is pending.
+bool GetStrings(JNIEnv *env, jobjectArray array, std::vector<std::string> *out);
+
+// Extracts the entries named in names, or every entry when names is null, below dir with the
+// slots of util::ExtractSlot. Returns false with error set on failure, or with an empty error
+// when cancelled.
+using ArchiveExtract = std::function<bool(const std::string& dir, const std::unordered_set<std::string> *names,
+                                          int64_t *slots, std::string *error)>;
+
+// The extract method of ZipArchive and ZstdArchive: runs extract with the arguments read from
+// Java and the slots in the direct buffer held by stateField of this_. A failure throws
+// IOException, and a cancellation CancellationException with cancelledMessage.
+void ExtractArchive(JNIEnv *env, jobject this_, jfieldID stateField, jstring extractDir_, jobjectArray names_,
+                    const char *cancelledMessage, const ArchiveExtract& extract);
+
+}}
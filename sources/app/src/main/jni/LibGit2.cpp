@@ -1,31 +1,106 @@
+#include <algorithm>
 #include <string>
 #include <jni.h>
 #include <git2.h>
 #include <memory>
+#include <tuple>
+#include <ctime>
 #include <cstdint>
 #include <cerrno>
+#include <cctype>
+#include <dirent.h>
+#include <unistd.h>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "util.h"
+#include "JniRegistry.h"
+#include "ParallelCheckout.h"
+#include "PathHistory.h"
+#include "RepositorySession.h"
 
 #define ZABUTON_ENSURE_LIBGIT2_NOERROR(env, op) if (ensureNoErrorLibGit2(env, (op)) < 0) { return; }
 #define ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, op, ret) if (ensureNoErrorLibGit2(env, (op)) < 0) { return (ret); }
+#define ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, op) if (ensureNoErrorProgress(env, (reporter).GetAggregator(), (op)) < 0) { return; }
+#define ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, op, ret) if (ensureNoErrorProgress(env, (reporter).GetAggregator(), (op)) < 0) { return (ret); }
 
 namespace
 {
 
+using zabuton::jni::GetRegistry;
+using zabuton::jni::Registry;
+using zabuton::jni::CheckoutProgressClass;
+using zabuton::jni::FetchProgressClass;
+using zabuton::jni::CloneProgressClass;
+using zabuton::jni::CheckoutProgressFieldTable;
+using zabuton::jni::FetchProgressFieldTable;
+using zabuton::jni::ProgressField;
+using zabuton::jni::ProgressSlot;
+using zabuton::jni::ProgressSlotCancelled;
+using zabuton::jni::ProgressSlotCompletedSteps;
+using zabuton::jni::ProgressSlotCount;
+using zabuton::jni::ProgressSlotIndexedDeltas;
+using zabuton::jni::ProgressSlotIndexedObjects;
+using zabuton::jni::ProgressSlotLocalObjects;
+using zabuton::jni::ProgressSlotReceivedBytes;
+using zabuton::jni::ProgressSlotReceivedObjects;
+using zabuton::jni::ProgressSlotTotalDeltas;
+using zabuton::jni::ProgressSlotTotalObjects;
+using zabuton::jni::ProgressSlotTotalSteps;
+using zabuton::git::BlameRange;
+using zabuton::git::CommitGraph;
+using zabuton::git::CommitGraphWalk;
+using zabuton::git::OidEqual;
+using zabuton::git::OidHash;
+using zabuton::git::RepositoryLease;
+using zabuton::git::RepositorySession;
+using zabuton::git::StatusEntry;
+using zabuton::util::MonotonicNanos;
+
+// Throws a LibGit2Exception carrying the error libgit2 recorded for the failure, captured here
+// rather than read back from Java, in a single constructor call. libgit2 leaves no error behind
+// for some failures, such as a callback's own return code.
 int ensureNoErrorLibGit2(JNIEnv *env, int returnCode)
 {
     if (returnCode >= 0) {
         return returnCode;
     }
-    const char *exceptionClassName = "io/github/sh4/zabuton/git/LibGit2Exception";
-    jclass exceptionClass = env->FindClass(exceptionClassName);
-    jmethodID ctor = env->GetMethodID(exceptionClass, "<init>", "(I)V");
-    env->Throw(static_cast<jthrowable>(env->NewObject(exceptionClass, ctor, returnCode)));
+    const git_error *e = git_error_last();
+    const bool hasError = e != nullptr && e->message != nullptr;
+    jstring message = env->NewStringUTF(hasError ? e->message : "");
+    if (message == nullptr) {
+        return returnCode;
+    }
+    const auto& exception = GetRegistry().libGit2Exception;
+    env->Throw(static_cast<jthrowable>(env->NewObject(exception.clazz, exception.ctor, returnCode,
+            hasError ? e->klass : GIT_ERROR_NONE, message)));
+    env->DeleteLocalRef(message);
     return returnCode;
 }
 
+// For lookups where a miss is an answer rather than a failure: GIT_ENOTFOUND is returned as is,
+// without an exception and with libgit2's error discarded, anything else as ensureNoErrorLibGit2.
+int probeLibGit2(JNIEnv *env, int returnCode)
+{
+    if (returnCode == GIT_ENOTFOUND) {
+        git_error_clear();
+        return returnCode;
+    }
+    return ensureNoErrorLibGit2(env, returnCode);
+}
+
+// Whether refspec is a full hex object id, which names a commit without a reference lookup.
+bool IsFullObjectId(const char *refspec)
+{
+    size_t i = 0;
+    for (; refspec[i] != '\0'; i++) {
+        if (i == GIT_OID_HEXSZ || !isxdigit(static_cast<unsigned char>(refspec[i]))) {
+            return false;
+        }
+    }
+    return i == GIT_OID_HEXSZ;
+}
+
 class GitBuf
 {
     git_buf buf_;
@@ -44,163 +119,362 @@ public:
     }
 };
 
-class CheckoutProgressContext
+// Used for progress consumers passed without a ProgressMonitor (ProgressMonitor.DEFAULT_INTERVAL_MILLIS).
+constexpr int64_t DefaultProgressIntervalNanos = 100LL * 1000 * 1000;
+// Room reserved up front for sideband lines ("Counting objects:  42% (21/50)" and the like).
+constexpr size_t SidebandMessageCapacity = 256;
+
+// Collects libgit2 progress without calling into Java. Counters are stored straight into the
+// ProgressMonitor buffer (or a private one when there is no monitor), and Due() rate-limits
+// the progress consumer upcalls.
+class ProgressAggregator
 {
     JNIEnv *env_;
-    jobject progress_;
-    jfieldID completedSteps_;
-    jfieldID totalSteps_;
+    jobject monitor_;
+    jlong ownSlots_[ProgressSlotCount];
+    jlong *slots_;
+    int64_t intervalNanos_;
+    int64_t nextUpcallNanos_;
+    std::string sidebandMessage_;
+    bool sidebandChanged_;
 public:
-    CheckoutProgressContext(JNIEnv *env, jclass type, jobject progress) :
+    ProgressAggregator(JNIEnv *env, jobject monitor) :
         env_(env),
-        progress_(progress)
+        monitor_(monitor),
+        ownSlots_(),
+        slots_(ownSlots_),
+        intervalNanos_(DefaultProgressIntervalNanos),
+        nextUpcallNanos_(0),
+        sidebandChanged_(false)
     {
-        completedSteps_ = env->GetFieldID(type, "completedSteps", "J");
-        totalSteps_ = env->GetFieldID(type, "totalSteps", "J");
+        sidebandMessage_.reserve(SidebandMessageCapacity);
+        if (monitor != nullptr) {
+            const auto& monitorClass = GetRegistry().progressMonitor;
+            jobject state = env->GetObjectField(monitor, monitorClass.state);
+            slots_ = static_cast<jlong*>(env->GetDirectBufferAddress(state));
+            env->DeleteLocalRef(state);
+            intervalNanos_ = env->GetLongField(monitor, monitorClass.intervalNanos);
+        }
     }
 
-    void SetCompletedSteps(long value) { env_->SetLongField(progress_, completedSteps_, value); }
-    void SetTotalSteps(long value) { env_->SetLongField(progress_, totalSteps_, value); }
+    ProgressAggregator(const ProgressAggregator&) = delete;
+    ProgressAggregator& operator=(const ProgressAggregator&) = delete;
+
+    jlong Get(ProgressSlot slot) const { return __atomic_load_n(&slots_[slot], __ATOMIC_RELAXED); }
+    void Set(ProgressSlot slot, jlong value) { __atomic_store_n(&slots_[slot], value, __ATOMIC_RELAXED); }
+
+    bool Cancelled() const { return Get(ProgressSlotCancelled) != 0; }
+
+    // Result for the libgit2 callbacks; a negative value aborts the running operation.
+    int CallbackResult() const { return Cancelled() || env_->ExceptionCheck() ? GIT_EUSER : 0; }
+
+    void SetCheckout(size_t completedSteps, size_t totalSteps) {
+        Set(ProgressSlotCompletedSteps, static_cast<jlong>(completedSteps));
+        Set(ProgressSlotTotalSteps, static_cast<jlong>(totalSteps));
+    }
+
+    void SetTransfer(const git_transfer_progress *stats) {
+        Set(ProgressSlotTotalObjects, stats->total_objects);
+        Set(ProgressSlotIndexedObjects, stats->indexed_objects);
+        Set(ProgressSlotReceivedObjects, stats->received_objects);
+        Set(ProgressSlotLocalObjects, stats->local_objects);
+        Set(ProgressSlotTotalDeltas, stats->total_deltas);
+        Set(ProgressSlotIndexedDeltas, stats->indexed_deltas);
+        Set(ProgressSlotReceivedBytes, static_cast<jlong>(stats->received_bytes));
+    }
+
+    void SetSidebandMessage(const char *str, int len) {
+        if (len <= 0 || sidebandMessage_.compare(0, std::string::npos, str, static_cast<size_t>(len)) == 0) {
+            return;
+        }
+        sidebandMessage_.assign(str, static_cast<size_t>(len));
+        sidebandChanged_ = true;
+    }
+
+    // True once the interval has passed since the last upcall, or always when forced.
+    bool Due(bool force) {
+        int64_t now = MonotonicNanos();
+        if (!force && now < nextUpcallNanos_) {
+            return false;
+        }
+        nextUpcallNanos_ = now + intervalNanos_;
+        return true;
+    }
+
+    // Publishes a changed sideband message to the monitor and returns it as a local reference,
+    // or nullptr when it has not changed since the last call. No Java string is created when
+    // neither the monitor nor a consumer would see it.
+    jstring TakeSidebandMessage(bool hasConsumer) {
+        if (!sidebandChanged_) {
+            return nullptr;
+        }
+        sidebandChanged_ = false;
+        if (monitor_ == nullptr && !hasConsumer) {
+            return nullptr;
+        }
+        jstring message = env_->NewStringUTF(sidebandMessage_.c_str());
+        if (monitor_ != nullptr) {
+            env_->SetObjectField(monitor_, GetRegistry().progressMonitor.sidebandMessage, message);
+        }
+        return message;
+    }
 };
 
-class FetchProgressContext
+// Stores the slots of a field table into the fields of a progress object.
+template <size_t N>
+void StoreProgressFields(JNIEnv *env, jobject progress, const ProgressField (&table)[N], const jfieldID (&ids)[N],
+                         const ProgressAggregator& a)
 {
-    JNIEnv *env_;
-    jobject progress_;
-    jfieldID totalObjects_;
-    jfieldID indexedObjects_;
-    jfieldID receivedObjects_;
-    jfieldID localObjects_;
-    jfieldID totalDeltas_;
-    jfieldID indexedDeltas_;
-    jfieldID receivedBytes_;
-    jfieldID sidebandMessage_;
-public:
-    FetchProgressContext(JNIEnv *env, jclass type, jobject progress) :
-        env_(env),
-        progress_(progress)
-    {
-        totalObjects_ = env->GetFieldID(type, "totalObjects", "J");
-        indexedObjects_ = env->GetFieldID(type, "indexedObjects", "J");
-        receivedObjects_ = env->GetFieldID(type, "receivedObjects", "J");
-        localObjects_ = env->GetFieldID(type, "localObjects", "J");
-        totalDeltas_ = env->GetFieldID(type, "totalDeltas", "J");
-        indexedDeltas_ = env->GetFieldID(type, "indexedDeltas", "J");
-        receivedBytes_ = env->GetFieldID(type, "receivedBytes", "J");
-        sidebandMessage_ = env->GetFieldID(type, "sidebandMessage", "Ljava/lang/String;");
-    }
-
-    void SetTotalObjects(long value) { env_->SetLongField(progress_, totalObjects_, value); }
-    void SetIndexedObjects(long value) { env_->SetLongField(progress_, indexedObjects_, value); }
-    void SetReceivedObjects(long value) { env_->SetLongField(progress_, receivedObjects_, value); }
-    void SetLocalObjects(long value) { env_->SetLongField(progress_, localObjects_, value); }
-    void SetTotalDeltas(long value) { env_->SetLongField(progress_, totalDeltas_, value); }
-    void SetIndexedDeltas(long value) { env_->SetLongField(progress_, indexedDeltas_, value); }
-    void SetReceivedBytes(long value) { env_->SetLongField(progress_, receivedBytes_, value); }
-    void SetSideBandMessage(const std::string& str) { env_->SetObjectField(progress_, sidebandMessage_, env_->NewStringUTF(str.c_str())); }
-};
+    for (size_t i = 0; i < N; i++) {
+        env->SetLongField(progress, ids[i], a.Get(table[i].slot));
+    }
+}
 
-class Consumer
+// The contexts pick the field tables a progress class carries; they hold no state, so a
+// reporter's set of contexts is fixed at compile time and costs nothing per operation.
+struct CheckoutProgressContext
 {
-    JNIEnv *env_;
-    jobject consumerObject_;
-    jmethodID acceptMethod_;
-public:
-    Consumer(JNIEnv *env, jobject consumer) :
-        env_(env),
-        consumerObject_(consumer)
-    {
-        acceptMethod_ = env->GetMethodID(env->GetObjectClass(consumer), "accept", "(Ljava/lang/Object;)V");
+    template <typename TProgressClass>
+    static void Store(JNIEnv *env, jobject progress, const TProgressClass& c, const ProgressAggregator& a,
+                      jstring /*sidebandMessage*/) {
+        StoreProgressFields(env, progress, CheckoutProgressFieldTable, c.checkout.ids, a);
     }
+};
 
-    void Accept(jobject obj) { env_->CallVoidMethod(consumerObject_, acceptMethod_, obj);  }
+struct FetchProgressContext
+{
+    template <typename TProgressClass>
+    static void Store(JNIEnv *env, jobject progress, const TProgressClass& c, const ProgressAggregator& a,
+                      jstring sidebandMessage) {
+        StoreProgressFields(env, progress, FetchProgressFieldTable, c.fetch.ids, a);
+        if (sidebandMessage != nullptr) {
+            env->SetObjectField(progress, c.fetch.sidebandMessage, sidebandMessage);
+        }
+    }
 };
 
-template <typename TContext, const char* ProgressClassName>
+// Feeds the aggregated progress to an optional java.util.function.Consumer. The progress object
+// handed to the consumer is only allocated and updated when there is a consumer to receive it.
+// Lives on the stack of the native method for the duration of the operation.
+template <typename TProgressClass, const TProgressClass Registry::* ProgressClass, typename... TContexts>
 class ProgressReporter
 {
+    JNIEnv *env_;
+    ProgressAggregator aggregator_;
+    jobject progressConsumer_;
     jobject progressObject_;
-    std::unique_ptr<TContext> context_;
-    std::unique_ptr<Consumer> consumer_;
 public:
-    ProgressReporter(JNIEnv *env, jobject progressConsumer) :
-            consumer_(std::make_unique<Consumer>(env, progressConsumer))
+    ProgressReporter(JNIEnv *env, jobject progressConsumer, jobject monitor) :
+            env_(env),
+            aggregator_(env, monitor),
+            progressConsumer_(progressConsumer),
+            progressObject_(nullptr)
     {
-        //"io/github/sh4/zabuton/git/FetchProgress"
-        jclass progressClass = env->FindClass(ProgressClassName);
-        jmethodID ctor = env->GetMethodID(progressClass, "<init>", "()V");
-        progressObject_ = env->NewObject(progressClass, ctor, nullptr);
-        context_ = std::make_unique<TContext>(env, progressClass, progressObject_);
+        if (progressConsumer != nullptr) {
+            const TProgressClass& progressClass = GetRegistry().*ProgressClass;
+            progressObject_ = env->NewObject(progressClass.clazz, progressClass.ctor);
+        }
     }
 
-    TContext* GetContext() const { return context_.get(); }
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    ProgressAggregator& GetAggregator() { return aggregator_; }
 
-    void Accept() { consumer_->Accept(progressObject_); }
+    void Notify(bool force) {
+        if (env_->ExceptionCheck() || !aggregator_.Due(force)) {
+            return;
+        }
+        jstring sidebandMessage = aggregator_.TakeSidebandMessage(progressObject_ != nullptr);
+        if (progressObject_ != nullptr) {
+            const TProgressClass& progressClass = GetRegistry().*ProgressClass;
+            (TContexts::Store(env_, progressObject_, progressClass, aggregator_, sidebandMessage), ...);
+            env_->CallVoidMethod(progressConsumer_, GetRegistry().consumer.accept, progressObject_);
+        }
+        if (sidebandMessage != nullptr) {
+            env_->DeleteLocalRef(sidebandMessage);
+        }
+    }
 };
 
+using CheckoutProgressReporter = ProgressReporter<CheckoutProgressClass, &Registry::checkoutProgress, CheckoutProgressContext>;
+using FetchProgressReporter = ProgressReporter<FetchProgressClass, &Registry::fetchProgress, FetchProgressContext>;
+using ResetProgressReporter = ProgressReporter<CheckoutProgressClass, &Registry::resetProgress, CheckoutProgressContext>;
+using CloneProgressReporter = ProgressReporter<CloneProgressClass, &Registry::cloneProgress,
+        FetchProgressContext, CheckoutProgressContext>;
+
 template <typename T>
-void CheckoutProgressHandler(const char *path, size_t completed_steps, size_t total_steps, void *payload)
+void CheckoutProgressHandler(const char* /*path*/, size_t completed_steps, size_t total_steps, void *payload)
 {
     auto p = reinterpret_cast<T*>(payload);
     assert(p != nullptr);
-    p->GetContext()->SetCompletedSteps(completed_steps);
-    p->GetContext()->SetTotalSteps(total_steps);
-    p->Accept();
+    p->GetAggregator().SetCheckout(completed_steps, total_steps);
+    p->Notify(false);
 }
 
-char CheckoutProgressName[] = "io/github/sh4/zabuton/git/CheckoutProgress";
-char FetchProgressName[] = "io/github/sh4/zabuton/git/FetchProgress";
-char ResetProgressName[] = "io/github/sh4/zabuton/git/ResetProgress";
+template <typename T>
+int CheckoutNotifyHandler(git_checkout_notify_t /*why*/, const char* /*path*/, const git_diff_file* /*baseline*/,
+                          const git_diff_file* /*target*/, const git_diff_file* /*workdir*/, void *payload)
+{
+    auto p = reinterpret_cast<T*>(payload);
+    assert(p != nullptr);
+    return p->GetAggregator().CallbackResult();
+}
 
-using CheckoutProgressReporter = ProgressReporter<CheckoutProgressContext, CheckoutProgressName>;
-using FetchProgressReporter = ProgressReporter<FetchProgressContext, FetchProgressName>;
-using ResetProgressReporter = ProgressReporter<CheckoutProgressContext, ResetProgressName>;
+template <typename T>
+int TransferProgressHandler(const git_transfer_progress *stats, void *payload)
+{
+    auto p = reinterpret_cast<T*>(payload);
+    assert(p != nullptr);
+    p->GetAggregator().SetTransfer(stats);
+    p->Notify(false);
+    return p->GetAggregator().CallbackResult();
+}
 
-class CloneProgressReporter
+template <typename T>
+int SidebandProgressHandler(const char *str, int len, void *payload)
 {
-    jobject cloneProgress_;
-    std::unique_ptr<FetchProgressContext> fetchProgress_;
-    std::unique_ptr<CheckoutProgressContext> checkoutProgress_;
-    std::unique_ptr<Consumer> consumer_;
-public:
-    CloneProgressReporter(JNIEnv *env, jobject progressConsumer) :
-        consumer_(std::make_unique<Consumer>(env, progressConsumer))
-    {
-        jclass cloneProgressClass = env->FindClass("io/github/sh4/zabuton/git/CloneProgress");
-        jmethodID ctor = env->GetMethodID(cloneProgressClass, "<init>", "()V");
-        cloneProgress_ = env->NewObject(cloneProgressClass, ctor, nullptr);
-        fetchProgress_ = std::make_unique<FetchProgressContext>(env, cloneProgressClass, cloneProgress_);
-        checkoutProgress_ = std::make_unique<CheckoutProgressContext>(env, cloneProgressClass, cloneProgress_);
+    auto p = reinterpret_cast<T*>(payload);
+    assert(p != nullptr);
+    p->GetAggregator().SetSidebandMessage(str, len);
+    return p->GetAggregator().CallbackResult();
+}
+
+template <typename T>
+void SetCheckoutProgressCallbacks(git_checkout_options *opts, T *reporter)
+{
+    opts->progress_cb = CheckoutProgressHandler<T>;
+    opts->progress_payload = reporter;
+    // progress_cb cannot abort a checkout, so cancellation is polled per updated file while
+    // the checkout is being planned, before anything is written to the working directory.
+    opts->notify_flags = GIT_CHECKOUT_NOTIFY_UPDATED;
+    opts->notify_cb = CheckoutNotifyHandler<T>;
+    opts->notify_payload = reporter;
+}
+
+template <typename T>
+void SetRemoteProgressCallbacks(git_remote_callbacks *callbacks, T *reporter)
+{
+    callbacks->transfer_progress = TransferProgressHandler<T>;
+    callbacks->sideband_progress = SidebandProgressHandler<T>;
+    callbacks->payload = reporter;
+}
+
+// Checks out tree from HEAD's tree, or with fresh into the empty working tree of a new clone.
+// ParallelCheckout takes the change when it can; git_checkout_tree with opts does otherwise.
+template <typename T>
+int CheckoutTree(git_repository *repo, git_tree *tree, bool fresh, const git_checkout_options *opts, T *reporter)
+{
+    int r = GIT_PASSTHROUGH;
+    git_object *baseline = nullptr;
+    // Without a HEAD there is no baseline to tell local changes by, which libgit2 copes with.
+    if (fresh || git_revparse_single(&baseline, repo, "HEAD^{tree}") == 0) {
+        r = zabuton::git::ParallelCheckout(repo, reinterpret_cast<git_tree*>(baseline), tree, opts->paths,
+                [reporter](size_t completedSteps, size_t totalSteps) {
+                    CheckoutProgressHandler<T>(nullptr, completedSteps, totalSteps, reporter);
+                    return reporter->GetAggregator().CallbackResult();
+                });
     }
+    git_object_free(baseline);
+    return r == GIT_PASSTHROUGH ? git_checkout_tree(repo, reinterpret_cast<const git_object*>(tree), opts) : r;
+}
 
-    FetchProgressContext* GetFetchProgress() const { return fetchProgress_.get(); }
-    CheckoutProgressContext* GetCheckoutProgress() const { return checkoutProgress_.get(); }
+// Like ensureNoErrorLibGit2(), but reports a failure caused by ProgressMonitor.cancel() as a
+// CancellationException and keeps an exception thrown by the progress consumer.
+int ensureNoErrorProgress(JNIEnv *env, const ProgressAggregator& aggregator, int returnCode)
+{
+    if (env->ExceptionCheck()) {
+        return returnCode < 0 ? returnCode : GIT_EUSER;
+    }
+    if (returnCode >= 0) {
+        return returnCode;
+    }
+    if (aggregator.Cancelled()) {
+        env->ThrowNew(GetRegistry().cancellationException.clazz, "The git operation was cancelled.");
+        return returnCode;
+    }
+    return ensureNoErrorLibGit2(env, returnCode);
+}
 
-    void Accept() { consumer_->Accept(cloneProgress_); }
-};
+std::shared_ptr<RepositorySession> GetRepositorySession(JNIEnv *env, jobject this_)
+{
+    auto session = zabuton::git::FindSession(env->GetLongField(this_, GetRegistry().repository.handle));
+    if (!session) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "Repository is already closed.");
+    }
+    return session;
+}
+
+// Borrows a pooled handle for a read-only query. Returns false with a pending Java exception on failure.
+bool AcquireReader(JNIEnv *env, jobject this_, RepositoryLease *out)
+{
+    auto session = GetRepositorySession(env, this_);
+    return session && ensureNoErrorLibGit2(env, session->AcquireReader(out)) >= 0;
+}
 
-git_repository* GetGitRepository(JNIEnv *env, jobject this_)
+// Borrows the writer handle, waiting until no other mutating operation runs on the repository.
+bool AcquireWriter(JNIEnv *env, jobject this_, RepositoryLease *out)
 {
-    jfieldID handleField = env->GetFieldID(env->GetObjectClass(this_), "repositoryHandle", "J");
-    git_repository *repo = reinterpret_cast<git_repository*>(env->GetLongField(this_, handleField));
-    return repo;
+    auto session = GetRepositorySession(env, this_);
+    if (!session) {
+        return false;
+    }
+    *out = session->AcquireWriter();
+    return true;
+}
+
+// Indexes the commits that repo, a handle of session, gained. The index only speeds up history
+// queries, so a failure leaves them on the slower revwalk instead of failing the operation.
+void UpdateCommitIndex(const std::shared_ptr<RepositorySession>& session, git_repository *repo)
+{
+    if (session && session->GetCommitIndex().Update(repo) < 0) {
+        git_error_clear();
+    }
+}
+
+// Resolves a revision to the commit it names.
+int ResolveCommit(git_oid *out, git_repository *repo, const char *revision)
+{
+    git_object *obj = nullptr;
+    int r = git_revparse_single(&obj, repo, revision);
+    if (r < 0) {
+        return r;
+    }
+    git_object *commit = nullptr;
+    r = git_object_peel(&commit, obj, GIT_OBJECT_COMMIT);
+    git_object_free(obj);
+    if (r < 0) {
+        return r;
+    }
+    *out = *git_object_id(commit);
+    git_object_free(commit);
+    return 0;
+}
+
+// Resolves the start revision of a history query; HEAD when start_ is null.
+int ResolveStart(JNIEnv *env, git_repository *repo, jstring start_, git_oid *out)
+{
+    if (start_ == nullptr) {
+        return git_reference_name_to_id(out, repo, "HEAD");
+    }
+    const char *start = env->GetStringUTFChars(start_, nullptr);
+    int r = ResolveCommit(out, repo, start);
+    env->ReleaseStringUTFChars(start_, start);
+    return r;
 }
 
 bool EnsureParseGitRestType(git_reset_t *outResetType, JNIEnv *env, jobject resetKind_)
 {
-    jclass resetKindClass = env->GetObjectClass(resetKind_);
-    const char* resetTypeStrings[] = { "SOFT", "MIXED", "HARD", nullptr };
-    for (const char** p = resetTypeStrings; *p; p++) {
-        jobject resetTypeObject = env->GetStaticObjectField(
-                resetKindClass,
-                env->GetStaticFieldID(resetKindClass, *p, "Lio/github/sh4/zabuton/git/ResetKind;"));
-        if (env->IsSameObject(resetKind_, resetTypeObject))
-        {
-            *outResetType = static_cast<git_reset_t>(p - resetTypeStrings + 1);
+    // ResetKind is declared in the same order as git_reset_t (SOFT, MIXED, HARD).
+    const git_reset_t resetTypes[] = { GIT_RESET_SOFT, GIT_RESET_MIXED, GIT_RESET_HARD };
+    if (resetKind_ != nullptr) {
+        jint ordinal = env->CallIntMethod(resetKind_, GetRegistry().resetKind.ordinal);
+        if (ordinal >= 0 && ordinal < static_cast<jint>(sizeof(resetTypes) / sizeof(resetTypes[0]))) {
+            *outResetType = resetTypes[ordinal];
             return true;
         }
     }
-    env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+    env->ThrowNew(GetRegistry().illegalArgumentException.clazz,
             "Unknown enum object in io.github.sh4.zabuton.git.ResetKind.");
     return false;
 }
@@ -246,7 +520,27 @@ std::string GetLocalReferenceNameFromRemoteName(JNIEnv *env, git_repository *rep
     return buf.String();
 }
 
-int GetBranchReferences(std::vector<git_reference*>* outReferences, git_repository* repo, git_branch_t branchType)
+// Reference names packed into a single buffer, so that listing thousands of refs
+// costs one growing allocation instead of a git_reference or std::string per entry.
+class NameList
+{
+    std::string names_;
+    std::vector<size_t> offsets_;
+public:
+    void Add(const char* name) {
+        offsets_.push_back(names_.size());
+        names_.append(name);
+        names_.push_back('\0');
+    }
+
+    size_t Size() const { return offsets_.size(); }
+    const char* Get(size_t i) const { return names_.data() + offsets_[i]; }
+};
+
+// Streams branch names through callback(const char*) and releases every reference as soon as
+// it has been visited. A non-zero callback result stops the iteration and is returned.
+template <typename TCallback>
+int ForEachBranchName(git_repository* repo, git_branch_t branchType, TCallback&& callback)
 {
     assert(repo != nullptr);
 
@@ -259,66 +553,342 @@ int GetBranchReferences(std::vector<git_reference*>* outReferences, git_reposito
     }
     ZABUTON_MAKE_SCOPE([&]() { git_branch_iterator_free(iter); });
     for (;;) {
-        git_branch_t branchType;
-        git_reference* branchRef;
-        int r = git_branch_next(&branchRef, &branchType, iter);
+        git_branch_t type;
+        git_reference* branchRef = nullptr;
+        int r = git_branch_next(&branchRef, &type, iter);
         if (r == GIT_ITEROVER) {
-            break;
+            return 0;
         } else if (r != 0) {
             return r;
         }
-        outReferences->push_back(branchRef);
+        const char* name = nullptr;
+        if (git_reference_type(branchRef) == GIT_REFERENCE_DIRECT) {
+            r = git_branch_name(&name, branchRef);
+        } else {
+            name = GetCanonicalReferenceName(branchRef);
+        }
+        if (r == 0 && name != nullptr) {
+            r = callback(name);
+        }
+        git_reference_free(branchRef);
+        if (r != 0) {
+            return r;
+        }
     }
-    return 0;
 }
 
-jobjectArray GetBranchReferenceNameArray(JNIEnv* env, git_repository* repo, git_branch_t branchType)
+jobjectArray NewStringArray(JNIEnv* env, const NameList& names)
 {
-    std::vector<git_reference*> references;
-    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(
-            env,
-            GetBranchReferences(&references, repo, branchType),
-            nullptr);
-
-    jobjectArray refArray =
-            env->NewObjectArray(static_cast<jsize>(references.size()), env->FindClass("java/lang/String"), nullptr);
-
-    int i = 0;
-    for (git_reference* ref : references) {
-        std::string referenceName = GetBranchReferenceName(env, ref);
-        if (referenceName.empty()) {
+    jobjectArray array =
+            env->NewObjectArray(static_cast<jsize>(names.Size()), GetRegistry().string.clazz, nullptr);
+    if (array == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < names.Size(); i++) {
+        jstring name = env->NewStringUTF(names.Get(i));
+        if (name == nullptr) {
             return nullptr;
         }
-        jstring refNameObject = env->NewStringUTF(referenceName.c_str());
-        env->SetObjectArrayElement(refArray, i, refNameObject);
-        i++;
+        env->SetObjectArrayElement(array, static_cast<jsize>(i), name);
+        env->DeleteLocalRef(name);
     }
+    return array;
+}
 
-    return refArray;
+jobjectArray GetBranchReferenceNameArray(JNIEnv* env, git_repository* repo, git_branch_t branchType)
+{
+    NameList names;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(
+            env,
+            ForEachBranchName(repo, branchType, [&](const char* name) {
+                names.Add(name);
+                return 0;
+            }),
+            nullptr);
+    return NewStringArray(env, names);
 }
 
 jobjectArray GetTagReferenceNameArray(JNIEnv* env, git_repository* repo)
 {
-    std::vector<std::string> tags;
-
+    NameList tags;
     ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(
             env,
-            git_tag_foreach(repo, [](const char *name, git_oid *oid, void *payload) {
-                auto t = reinterpret_cast<decltype(tags)*>(payload);
+            git_tag_foreach(repo, [](const char *name, git_oid * /*oid*/, void *payload) {
+                auto t = reinterpret_cast<NameList*>(payload);
                 assert(t != nullptr);
-                t->push_back(std::string(name));
+                t->Add(name);
                 return 0;
             }, &tags),
             nullptr);
+    return NewStringArray(env, tags);
+}
+
+// Repository config key listing the pathspecs of a sparse checkout, one value per path.
+constexpr const char* SparsePathConfigName = "zabuton.sparsepath";
+
+// Pathspecs restricting a checkout to part of the tree. An empty set checks out everything.
+class SparsePaths
+{
+    NameList paths_;
+    std::vector<char*> strings_;
+public:
+    bool Empty() const { return paths_.Size() == 0; }
+
+    // Copies a java.lang.String[]; returns false when a Java exception is pending.
+    bool Add(JNIEnv *env, jobjectArray paths) {
+        jsize n = env->GetArrayLength(paths);
+        for (jsize i = 0; i < n; i++) {
+            auto path = static_cast<jstring>(env->GetObjectArrayElement(paths, i));
+            if (path == nullptr) {
+                env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "Path must not be null.");
+                return false;
+            }
+            const char *chars = env->GetStringUTFChars(path, nullptr);
+            if (chars == nullptr) {
+                return false;
+            }
+            paths_.Add(chars);
+            env->ReleaseStringUTFChars(path, chars);
+            env->DeleteLocalRef(path);
+        }
+        return true;
+    }
+
+    int Load(git_repository *repo) {
+        git_config *cfg = nullptr;
+        int r = git_repository_config_snapshot(&cfg, repo);
+        if (r < 0) {
+            return r;
+        }
+        ZABUTON_MAKE_SCOPE([&]() { git_config_free(cfg); });
+        git_config_iterator *iter = nullptr;
+        r = git_config_multivar_iterator_new(&iter, cfg, SparsePathConfigName, nullptr);
+        if (r < 0) {
+            return r == GIT_ENOTFOUND ? 0 : r;
+        }
+        ZABUTON_MAKE_SCOPE([&]() { git_config_iterator_free(iter); });
+        git_config_entry *entry = nullptr;
+        while ((r = git_config_next(&entry, iter)) == 0) {
+            paths_.Add(entry->value);
+        }
+        return r == GIT_ITEROVER ? 0 : r;
+    }
+
+    int Save(git_repository *repo) const {
+        git_config *cfg = nullptr;
+        int r = git_repository_config(&cfg, repo);
+        if (r < 0) {
+            return r;
+        }
+        ZABUTON_MAKE_SCOPE([&]() { git_config_free(cfg); });
+        for (size_t i = 0; i < paths_.Size() && r >= 0; i++) {
+            // "^$" never matches an existing path, so every call appends a new value.
+            r = git_config_set_multivar(cfg, SparsePathConfigName, "^$", paths_.Get(i));
+        }
+        return r;
+    }
+
+    // The stored pathspecs as a git_strarray, valid until the next call or Add.
+    git_strarray Get() {
+        strings_.clear();
+        for (size_t i = 0; i < paths_.Size(); i++) {
+            strings_.push_back(const_cast<char*>(paths_.Get(i)));
+        }
+        return git_strarray { strings_.data(), strings_.size() };
+    }
+
+    // Points opts->paths at the stored pathspecs, which must outlive the checkout.
+    void Apply(git_checkout_options *opts) {
+        if (Empty()) {
+            return;
+        }
+        opts->paths = Get();
+    }
+};
+
+// remote_cb of a single branch clone: the remote only ever fetches that branch.
+int CreateSingleBranchRemote(git_remote **out, git_repository *repo, const char *name, const char *url, void *payload)
+{
+    auto branch = reinterpret_cast<const char*>(payload);
+    assert(branch != nullptr);
+    std::string refspec = "+refs/heads/";
+    refspec += branch;
+    refspec += ":refs/remotes/";
+    refspec += name;
+    refspec += '/';
+    refspec += branch;
+    return git_remote_create_with_fetchspec(out, repo, name, url, refspec.c_str());
+}
+
+// remote_cb of a mirror: every ref of the remote is kept under its own name, as with
+// `git clone --mirror`, so worktrees cloned from the mirror see the remote's branches and tags.
+int CreateMirrorRemote(git_remote **out, git_repository *repo, const char *name, const char *url, void * /*payload*/)
+{
+    return git_remote_create_with_fetchspec(out, repo, name, url, "+refs/*:refs/*");
+}
+
+// Opens the remote a fetch of remoteName reads from: the remote itself, or with url an anonymous
+// remote of url, such as a local mirror, which is then given the refspecs of the named one.
+int LookupFetchSource(git_repository *repo, const char *remoteName, const char *url, git_remote **remote,
+                      git_remote **anonymous)
+{
+    int r = git_remote_lookup(remote, repo, remoteName);
+    if (r < 0 || url == nullptr) {
+        return r;
+    }
+    return git_remote_create_anonymous(anonymous, repo, url);
+}
+
+// Whether every request to url goes over a connection of its own or a kept-alive one, so that a
+// connected remote can download again: smart HTTP and local repositories. git:// and ssh speak
+// over a single stream, which the server closes after sending a pack.
+bool IsStatelessUrl(const char *url)
+{
+    return strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0 ||
+           strncmp(url, "file://", 7) == 0 || url[0] == '/';
+}
+
+// The branches of a connected source a staged fetch brings in, as "[+]src:dst" refspecs made by
+// the fetch refspecs of specs: the branch HEAD points to first, the others by name. Branches no
+// fetch refspec covers are left out.
+int ListStageRefspecs(git_remote *source, const git_remote *specs, std::vector<std::string> *out)
+{
+    const git_remote_head **heads = nullptr;
+    size_t count = 0;
+    int r = git_remote_ls(&heads, &count, source);
+    if (r < 0) {
+        return r;
+    }
+    std::string headTarget;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(heads[i]->name, "HEAD") == 0) {
+            headTarget = heads[i]->symref_target != nullptr ? heads[i]->symref_target : "";
+        } else {
+            names.emplace_back(heads[i]->name);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    std::stable_partition(names.begin(), names.end(), [&](const std::string& name) { return name == headTarget; });
+    for (const auto& name : names) {
+        for (size_t i = 0; i < git_remote_refspec_count(specs); i++) {
+            const git_refspec *spec = git_remote_get_refspec(specs, i);
+            if (git_refspec_direction(spec) != GIT_DIRECTION_FETCH || !git_refspec_src_matches(spec, name.c_str())) {
+                continue;
+            }
+            GitBuf dst;
+            r = git_refspec_transform(dst.Buffer(), spec, name.c_str());
+            if (r < 0) {
+                return r;
+            }
+            out->push_back((git_refspec_force(spec) ? "+" : "") + name + ":" + dst.String());
+            break;
+        }
+    }
+    return 0;
+}
+
+// Adds everything reachable from the refs and HEAD to pb: the commits with their trees and blobs,
+// and the annotated tags, which the revwalk peels away.
+int InsertReachableObjects(git_repository *repo, git_packbuilder *pb)
+{
+    git_revwalk *walk = nullptr;
+    int r = git_revwalk_new(&walk, repo);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_revwalk_free(walk); });
+    // Refs to trees or blobs are skipped by a glob push.
+    r = git_revwalk_push_glob(walk, "refs/*");
+    if (r < 0) {
+        return r;
+    }
+    r = git_revwalk_push_head(walk);
+    if (r < 0 && r != GIT_ENOTFOUND && r != GIT_EUNBORNBRANCH) {
+        return r;
+    }
+    git_odb *odb = nullptr;
+    r = git_repository_odb(&odb, repo);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_odb_free(odb); });
+    struct TagPayload { git_repository *repo; git_odb *odb; git_packbuilder *pb; } payload { repo, odb, pb };
+    r = git_tag_foreach(repo, [](const char *name, git_oid *oid, void *payload) {
+        auto p = reinterpret_cast<TagPayload*>(payload);
+        git_oid id = *oid;
+        for (;;) {
+            size_t size;
+            git_object_t type;
+            int r = git_odb_read_header(&size, &type, p->odb, &id);
+            if (r < 0 || type != GIT_OBJECT_TAG) {
+                return r < 0 ? r : 0;
+            }
+            r = git_packbuilder_insert(p->pb, &id, name);
+            git_tag *tag = nullptr;
+            if (r < 0 || (r = git_tag_lookup(&tag, p->repo, &id)) < 0) {
+                return r;
+            }
+            // A tag of a tag: keep following the chain.
+            id = *git_tag_target_id(tag);
+            git_tag_free(tag);
+        }
+    }, &payload);
+    if (r < 0) {
+        return r;
+    }
+    return git_packbuilder_insert_walk(pb, walk);
+}
+
+// Calls visit(name) for every entry of a directory but "." and "..".
+template <typename TVisit>
+void ForEachDirectoryEntry(const std::string& path, TVisit&& visit)
+{
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { closedir(dir); });
+    while (dirent *entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name != "." && name != "..") {
+            visit(name);
+        }
+    }
+}
 
-    jobjectArray tagArray =
-            env->NewObjectArray(static_cast<jsize>(tags.size()), env->FindClass("java/lang/String"), nullptr);
-    int i = 0;
-    for (auto& name : tags) {
-        jstring refNameObject = env->NewStringUTF(name.c_str());
-        env->SetObjectArrayElement(tagArray, i++, refNameObject);
+// Deletes the loose objects and the packs other than keptPack ("pack-<hash>") of a repository
+// whose reachable objects were all just written to keptPack. Packs with a .keep file stay, as
+// they do for git gc. What is left behind on failure is only redundant, so errors are ignored.
+void RemoveObjectsOutsidePack(const std::string& objectsDir, const std::string& keptPack)
+{
+    const std::string packDir = objectsDir + "pack/";
+    std::vector<std::string> packs;
+    ForEachDirectoryEntry(packDir, [&](std::string_view name) {
+        constexpr std::string_view suffix = ".pack";
+        if (name.size() > suffix.size() && name.substr(name.size() - suffix.size()) == suffix) {
+            std::string base(name.substr(0, name.size() - suffix.size()));
+            if (base != keptPack && access((packDir + base + ".keep").c_str(), F_OK) != 0) {
+                packs.push_back(std::move(base));
+            }
+        }
+    });
+    for (const auto& base : packs) {
+        // The index goes first, so a pack is never listed without its data.
+        unlink((packDir + base + ".idx").c_str());
+        unlink((packDir + base + ".pack").c_str());
     }
-    return tagArray;
+
+    ForEachDirectoryEntry(objectsDir, [&](std::string_view name) {
+        if (name.size() != 2 || !isxdigit(name[0]) || !isxdigit(name[1])) {
+            return;
+        }
+        std::string fanout = objectsDir + std::string(name) + '/';
+        ForEachDirectoryEntry(fanout, [&](std::string_view object) {
+            unlink((fanout + std::string(object)).c_str());
+        });
+        rmdir(fanout.c_str());
+    });
 }
 
 jobject GetUserObject(JNIEnv *env, const git_signature *sig) {
@@ -329,51 +899,316 @@ jobject GetUserObject(JNIEnv *env, const git_signature *sig) {
     if (sig) {
         name = env->NewStringUTF(sig->name);
         email = env->NewStringUTF(sig->email);
-        jclass dateClass = env->FindClass("java/util/Date");
-        jmethodID dateCtor = env->GetMethodID(dateClass, "<init>", "(J)V");
         const int64_t milliseconds = 1000LL;
         jlong date = sig->when.time + (sig->when.offset * sig->when.sign) * milliseconds;
-        whenSignature = env->NewObject(dateClass, dateCtor, date);
+        whenSignature = env->NewObject(GetRegistry().date.clazz, GetRegistry().date.ctor, date);
     } else {
         name = env->NewStringUTF("");
         email = env->NewStringUTF("");
     }
 
-    jclass userClass = env->FindClass("io/github/sh4/zabuton/git/User");
-    jmethodID userCtor = env->GetMethodID(userClass, "<init>",
-                                          "(Ljava/lang/String;Ljava/lang/String;Ljava/util/Date;)V");
-    return env->NewObject(userClass, userCtor, name, email, whenSignature);
-}
+    const auto& user = GetRegistry().user;
+    return env->NewObject(user.clazz, user.ctor, name, email, whenSignature);
+}
+
+// Upper bound of the local references GetCommitObject() holds at once.
+constexpr jint CommitObjectLocalReferences = 16;
+
+jobject GetCommitObject(JNIEnv *env, git_commit* commit) {
+    jobject parentIdList;
+    {
+        unsigned int parents = git_commit_parentcount(commit);
+        jobjectArray parentsIds =
+                env->NewObjectArray(static_cast<jsize>(parents), GetRegistry().string.clazz, nullptr);
+        if (parents > 0) {
+            char buf[GIT_OID_HEXSZ + 1];
+            for (unsigned int i = 0; i < parents; i++) {
+                git_oid_tostr(buf, GIT_OID_HEXSZ, git_commit_parent_id(commit, i));
+                jstring commitId = env->NewStringUTF(buf);
+                env->SetObjectArrayElement(parentsIds, i, commitId);
+                env->DeleteLocalRef(commitId);
+            }
+        }
+
+        const auto& arrays = GetRegistry().arrays;
+        parentIdList = env->CallStaticObjectMethod(arrays.clazz, arrays.asList, parentsIds);
+    }
+
+    jobject author = GetUserObject(env, git_commit_author(commit));
+    jobject committer = GetUserObject(env, git_commit_committer(commit));
+    jstring message = env->NewStringUTF(git_commit_message(commit));
+
+    const auto& commitObject = GetRegistry().commitObject;
+    return env->NewObject(commitObject.clazz, commitObject.ctor, parentIdList, author, committer, message);
+}
+
+// A walk keeps its reader handle borrowed until the walker is destroyed. History in the commit
+// index is walked on its graph, anything else with a revwalk.
+struct LogWalker
+{
+    RepositoryLease repo;
+    git_revwalk *walk;
+    std::unique_ptr<CommitGraphWalk> graphWalk;
+};
+
+// Field bits of io.github.sh4.zabuton.git.CommitLogBatch
+enum CommitLogField : jint
+{
+    CommitLogFieldId = 1,
+    CommitLogFieldParents = 1 << 1,
+    CommitLogFieldAuthor = 1 << 2,
+    CommitLogFieldCommitter = 1 << 3,
+    CommitLogFieldMessage = 1 << 4,
+};
+
+constexpr jint CommitLogTextFields = CommitLogFieldAuthor | CommitLogFieldCommitter | CommitLogFieldMessage;
+// author name, author email, committer name, committer email, message
+constexpr size_t CommitLogTextColumns = 5;
+
+template <typename TArray, typename TElement>
+struct JavaArrayTraits;
+
+template <>
+struct JavaArrayTraits<jbyteArray, uint8_t>
+{
+    static jbyteArray New(JNIEnv *env, jsize n) { return env->NewByteArray(n); }
+    static void Set(JNIEnv *env, jbyteArray a, jsize n, const uint8_t *p) {
+        env->SetByteArrayRegion(a, 0, n, reinterpret_cast<const jbyte*>(p));
+    }
+};
+
+template <>
+struct JavaArrayTraits<jintArray, jint>
+{
+    static jintArray New(JNIEnv *env, jsize n) { return env->NewIntArray(n); }
+    static void Set(JNIEnv *env, jintArray a, jsize n, const jint *p) { env->SetIntArrayRegion(a, 0, n, p); }
+};
+
+template <>
+struct JavaArrayTraits<jlongArray, jlong>
+{
+    static jlongArray New(JNIEnv *env, jsize n) { return env->NewLongArray(n); }
+    static void Set(JNIEnv *env, jlongArray a, jsize n, const jlong *p) { env->SetLongArrayRegion(a, 0, n, p); }
+};
+
+template <typename TArray, typename TElement>
+TArray NewJavaArray(JNIEnv *env, bool enabled, const std::vector<TElement>& values)
+{
+    if (!enabled) {
+        return nullptr;
+    }
+    using Traits = JavaArrayTraits<TArray, TElement>;
+    auto size = static_cast<jsize>(values.size());
+    TArray array = Traits::New(env, size);
+    if (array != nullptr && size > 0) {
+        Traits::Set(env, array, size, values.data());
+    }
+    return array;
+}
+
+class CommitLogBatchBuilder
+{
+    static constexpr jint MaxReservedCommits = 4096;
+
+    jint fields_;
+    jint count_;
+    std::vector<uint8_t> ids_;
+    std::vector<jint> parentOffsets_;
+    std::vector<uint8_t> parentIds_;
+    std::vector<jlong> authorTimes_;
+    std::vector<jint> authorTimeOffsets_;
+    std::vector<jlong> committerTimes_;
+    std::vector<jint> committerTimeOffsets_;
+    std::vector<uint8_t> text_;
+    std::vector<jint> textOffsets_;
+
+    bool Has(jint field) const { return (fields_ & field) != 0; }
+
+    static void AppendOid(std::vector<uint8_t>* out, const git_oid* oid) {
+        out->insert(out->end(), oid->id, oid->id + GIT_OID_RAWSZ);
+    }
+
+    void AppendText(bool enabled, std::string_view str) {
+        textOffsets_.push_back(static_cast<jint>(text_.size()));
+        if (enabled) {
+            text_.insert(text_.end(), str.begin(), str.end());
+        }
+    }
+
+    void AppendText(bool enabled, const char* str) {
+        AppendText(enabled && str != nullptr, str != nullptr ? std::string_view(str) : std::string_view());
+    }
+
+    static void AppendTime(std::vector<jlong>* times, std::vector<jint>* offsets, const git_signature* sig) {
+        const int64_t milliseconds = 1000LL;
+        times->push_back(sig ? sig->when.time * milliseconds : 0);
+        offsets->push_back(sig ? sig->when.offset : 0);
+    }
+
+public:
+    // capacity is the expected number of commits and must not be negative. Only a page worth is
+    // reserved up front, so a large limit does not allocate for commits that may never come.
+    CommitLogBatchBuilder(jint fields, jint capacity) : fields_(fields), count_(0) {
+        auto n = static_cast<size_t>(std::min(capacity, MaxReservedCommits));
+        if (Has(CommitLogFieldId)) {
+            ids_.reserve(n * GIT_OID_RAWSZ);
+        }
+        if (Has(CommitLogFieldParents)) {
+            parentOffsets_.reserve(n + 1);
+            parentOffsets_.push_back(0);
+            parentIds_.reserve(n * GIT_OID_RAWSZ);
+        }
+        if (Has(CommitLogTextFields)) {
+            textOffsets_.reserve(n * CommitLogTextColumns + 1);
+        }
+    }
+
+    // Only the oid is known without parsing the commit object.
+    bool NeedsCommit() const { return (fields_ & ~CommitLogFieldId) != 0; }
 
-jobject GetCommitObject(JNIEnv *env, git_commit* commit) {
-    jobject parentIdList;
-    {
-        unsigned int parents = git_commit_parentcount(commit);
-        jobjectArray parentsIds =
-                env->NewObjectArray(static_cast<jsize>(parents), env->FindClass("java/lang/String"), nullptr);
-        if (parents > 0) {
-            char buf[GIT_OID_HEXSZ + 1];
+    void Append(const git_oid* oid, const git_commit* commit) {
+        count_++;
+        if (Has(CommitLogFieldId)) {
+            AppendOid(&ids_, oid);
+        }
+        if (Has(CommitLogFieldParents)) {
+            unsigned int parents = git_commit_parentcount(commit);
             for (unsigned int i = 0; i < parents; i++) {
-                git_oid_tostr(buf, GIT_OID_HEXSZ, git_commit_parent_id(commit, i));
-                jstring commitId = env->NewStringUTF(buf);
-                env->SetObjectArrayElement(parentsIds, i, commitId);
+                AppendOid(&parentIds_, git_commit_parent_id(commit, i));
+            }
+            parentOffsets_.push_back(static_cast<jint>(parentIds_.size() / GIT_OID_RAWSZ));
+        }
+        const git_signature* author = Has(CommitLogFieldAuthor) ? git_commit_author(commit) : nullptr;
+        const git_signature* committer = Has(CommitLogFieldCommitter) ? git_commit_committer(commit) : nullptr;
+        if (Has(CommitLogFieldAuthor)) {
+            AppendTime(&authorTimes_, &authorTimeOffsets_, author);
+        }
+        if (Has(CommitLogFieldCommitter)) {
+            AppendTime(&committerTimes_, &committerTimeOffsets_, committer);
+        }
+        if (Has(CommitLogTextFields)) {
+            AppendText(author != nullptr, author ? author->name : nullptr);
+            AppendText(author != nullptr, author ? author->email : nullptr);
+            AppendText(committer != nullptr, committer ? committer->name : nullptr);
+            AppendText(committer != nullptr, committer ? committer->email : nullptr);
+            AppendText(Has(CommitLogFieldMessage), Has(CommitLogFieldMessage) ? git_commit_message(commit) : nullptr);
+        }
+    }
+
+    // Everything but the committer and the message is in the commit index.
+    bool NeedsCommit(const CommitGraph& /*graph*/) const {
+        return Has(CommitLogFieldCommitter | CommitLogFieldMessage);
+    }
+
+    // Appends the commit at pos of graph; commit is only read when NeedsCommit(graph).
+    void Append(const CommitGraph& graph, uint32_t pos, const git_commit* commit) {
+        count_++;
+        if (Has(CommitLogFieldId)) {
+            AppendOid(&ids_, &graph.Id(pos));
+        }
+        if (Has(CommitLogFieldParents)) {
+            for (auto parent = graph.ParentsBegin(pos); parent != graph.ParentsEnd(pos); ++parent) {
+                AppendOid(&parentIds_, &graph.Id(*parent));
             }
+            parentOffsets_.push_back(static_cast<jint>(parentIds_.size() / GIT_OID_RAWSZ));
+        }
+        const git_signature* committer = Has(CommitLogFieldCommitter) ? git_commit_committer(commit) : nullptr;
+        if (Has(CommitLogFieldAuthor)) {
+            const int64_t milliseconds = 1000LL;
+            authorTimes_.push_back(graph.AuthorTime(pos) * milliseconds);
+            authorTimeOffsets_.push_back(graph.AuthorTimeOffset(pos));
+        }
+        if (Has(CommitLogFieldCommitter)) {
+            AppendTime(&committerTimes_, &committerTimeOffsets_, committer);
         }
+        if (Has(CommitLogTextFields)) {
+            AppendText(Has(CommitLogFieldAuthor), graph.AuthorName(pos));
+            AppendText(Has(CommitLogFieldAuthor), graph.AuthorEmail(pos));
+            AppendText(committer != nullptr, committer ? committer->name : nullptr);
+            AppendText(committer != nullptr, committer ? committer->email : nullptr);
+            AppendText(Has(CommitLogFieldMessage), Has(CommitLogFieldMessage) ? git_commit_message(commit) : nullptr);
+        }
+    }
 
-        jclass arraysClass = env->FindClass("java/util/Arrays");
-        jmethodID asListMethod = env->GetStaticMethodID(arraysClass, "asList", "([Ljava/lang/Object;)Ljava/util/List;");
-        parentIdList = env->CallStaticObjectMethod(arraysClass, asListMethod, parentsIds);
+    jobject Build(JNIEnv *env) {
+        if (Has(CommitLogTextFields)) {
+            textOffsets_.push_back(static_cast<jint>(text_.size()));
+        }
+        const auto& batchClass = GetRegistry().commitLogBatch;
+        return env->NewObject(batchClass.clazz, batchClass.ctor,
+                count_,
+                fields_,
+                NewJavaArray<jbyteArray>(env, Has(CommitLogFieldId), ids_),
+                NewJavaArray<jintArray>(env, Has(CommitLogFieldParents), parentOffsets_),
+                NewJavaArray<jbyteArray>(env, Has(CommitLogFieldParents), parentIds_),
+                NewJavaArray<jlongArray>(env, Has(CommitLogFieldAuthor), authorTimes_),
+                NewJavaArray<jintArray>(env, Has(CommitLogFieldAuthor), authorTimeOffsets_),
+                NewJavaArray<jlongArray>(env, Has(CommitLogFieldCommitter), committerTimes_),
+                NewJavaArray<jintArray>(env, Has(CommitLogFieldCommitter), committerTimeOffsets_),
+                NewJavaArray<jbyteArray>(env, Has(CommitLogTextFields), text_),
+                NewJavaArray<jintArray>(env, Has(CommitLogTextFields), textOffsets_));
     }
+};
 
-    jobject author = GetUserObject(env, git_commit_author(commit));
-    jobject committer = GetUserObject(env, git_commit_committer(commit));
-    jstring message = env->NewStringUTF(git_commit_message(commit));
+// Appends the commit id, read from graph when it is indexed there.
+int AppendCommit(CommitLogBatchBuilder *builder, git_repository *repo, const CommitGraph *graph, const git_oid& id)
+{
+    uint32_t pos = graph ? graph->Find(id) : CommitGraph::NoPosition;
+    bool indexed = pos != CommitGraph::NoPosition;
+    git_commit *commit = nullptr;
+    if (indexed ? builder->NeedsCommit(*graph) : builder->NeedsCommit()) {
+        int r = git_commit_lookup(&commit, repo, &id);
+        if (r < 0) {
+            return r;
+        }
+    }
+    if (indexed) {
+        builder->Append(*graph, pos, commit);
+    } else {
+        builder->Append(&id, commit);
+    }
+    git_commit_free(commit);
+    return 0;
+}
 
-    jclass commitObjectClass = env->FindClass("io/github/sh4/zabuton/git/CommitObject");
-    jmethodID commitObjectCtor = env->GetMethodID(commitObjectClass, "<init>",
-            "(Ljava/util/List;Lio/github/sh4/zabuton/git/User;Lio/github/sh4/zabuton/git/User;Ljava/lang/String;)V");
+// Option bits of Repository.status, see StatusList.
+constexpr jint StatusIncludeUntracked = 1 << 0;
+constexpr jint StatusRecurseUntrackedDirs = 1 << 1;
+constexpr jint StatusIncludeIgnored = 1 << 2;
 
-    return env->NewObject(commitObjectClass, commitObjectCtor, parentIdList, author, committer, message);
+unsigned int ToStatusOptions(jint flags)
+{
+    unsigned int options = 0;
+    if (flags & StatusIncludeUntracked) {
+        options |= GIT_STATUS_OPT_INCLUDE_UNTRACKED;
+    }
+    if (flags & StatusRecurseUntrackedDirs) {
+        options |= GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
+    }
+    if (flags & StatusIncludeIgnored) {
+        options |= GIT_STATUS_OPT_INCLUDE_IGNORED;
+    }
+    return options;
+}
+
+jobject NewStatusList(JNIEnv *env, const std::vector<StatusEntry>& entries)
+{
+    std::vector<jint> statuses;
+    std::vector<uint8_t> paths;
+    std::vector<jint> pathOffsets;
+    statuses.reserve(entries.size());
+    pathOffsets.reserve(entries.size() + 1);
+    for (const auto& entry : entries) {
+        statuses.push_back(static_cast<jint>(entry.status));
+        pathOffsets.push_back(static_cast<jint>(paths.size()));
+        paths.insert(paths.end(), entry.path.begin(), entry.path.end());
+    }
+    pathOffsets.push_back(static_cast<jint>(paths.size()));
+    const auto& statusList = GetRegistry().statusList;
+    return env->NewObject(statusList.clazz, statusList.ctor, static_cast<jint>(entries.size()),
+            NewJavaArray<jintArray>(env, true, statuses),
+            NewJavaArray<jbyteArray>(env, true, paths),
+            NewJavaArray<jintArray>(env, true, pathOffsets));
 }
 
 } // anonymous namespace
@@ -387,53 +1222,110 @@ Java_io_github_sh4_zabuton_git_LibGit2_init(JNIEnv *env, jclass /*type*/, jstrin
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_libgit2_opts(GIT_OPT_SET_SSL_CERT_LOCATIONS, sslCertsFile, nullptr));
 }
 
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_LibGit2_setCheckoutThreads(JNIEnv * /*env*/, jclass /*type*/, jint threads)
+{
+    zabuton::git::SetCheckoutThreads(static_cast<unsigned int>(std::max(threads, 0)));
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_git_LibGit2_getCheckoutThreads(JNIEnv * /*env*/, jclass /*type*/)
+{
+    return static_cast<jint>(zabuton::git::GetCheckoutThreads());
+}
+
 extern "C"
 JNIEXPORT jobject JNICALL
-Java_io_github_sh4_zabuton_git_Repository_clone(JNIEnv *env, jclass type, jstring url_, jstring clonePath_, jobject progressConsumer)
+Java_io_github_sh4_zabuton_git_Repository_clone(JNIEnv *env, jclass type, jstring url_, jstring clonePath_,
+        jobject options, jobject progressConsumer, jobject monitor)
 {
     const char *url = env->GetStringUTFChars(url_, 0);
     const char *clonePath = env->GetStringUTFChars(clonePath_, 0);
 
-    auto ctx = std::make_unique<CloneProgressReporter>(env, progressConsumer);
+    CloneProgressReporter reporter(env, progressConsumer, monitor);
     git_clone_options opts = GIT_CLONE_OPTIONS_INIT;
     opts.checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-    opts.checkout_opts.progress_cb = [](const char *path, size_t completed_steps, size_t total_steps, void *payload) -> void {
-        auto p = reinterpret_cast<CloneProgressReporter*>(payload);
-        assert(p != nullptr);
-        p->GetCheckoutProgress()->SetCompletedSteps(completed_steps);
-        p->GetCheckoutProgress()->SetTotalSteps(total_steps);
-        p->Accept();
-    };
-    opts.checkout_opts.progress_payload = ctx.get();
     opts.checkout_opts.disable_filters = 1;
-    opts.fetch_opts.callbacks.transfer_progress = [](const git_transfer_progress *stats, void *payload) -> int {
-        auto p = reinterpret_cast<CloneProgressReporter*>(payload);
-        assert(p != nullptr);
-        p->GetFetchProgress()->SetIndexedDeltas(stats->indexed_deltas);
-        p->GetFetchProgress()->SetIndexedObjects(stats->indexed_objects);
-        p->GetFetchProgress()->SetLocalObjects(stats->local_objects);
-        p->GetFetchProgress()->SetReceivedBytes(stats->received_bytes);
-        p->GetFetchProgress()->SetReceivedObjects(stats->received_objects);
-        p->GetFetchProgress()->SetTotalDeltas(stats->total_deltas);
-        p->GetFetchProgress()->SetTotalObjects(stats->total_objects);
-        p->Accept();
-        return 0;
-    };
-    opts.fetch_opts.callbacks.sideband_progress = [](const char *str, int len, void *payload) -> int {
-        auto p = reinterpret_cast<CloneProgressReporter*>(payload);
-        assert(p != nullptr);
-        if (len > 0) {
-            p->GetFetchProgress()->SetSideBandMessage(std::string(str, static_cast<size_t>(len)));
+    SetCheckoutProgressCallbacks(&opts.checkout_opts, &reporter);
+    SetRemoteProgressCallbacks(&opts.fetch_opts.callbacks, &reporter);
+
+    std::string branch;
+    std::string mirror;
+    SparsePaths sparsePaths;
+    if (options != nullptr) {
+        const auto& optionsClass = GetRegistry().cloneOptions;
+        auto branch_ = static_cast<jstring>(env->GetObjectField(options, optionsClass.branch));
+        if (branch_ != nullptr) {
+            const char *chars = env->GetStringUTFChars(branch_, nullptr);
+            branch = chars;
+            env->ReleaseStringUTFChars(branch_, chars);
         }
-        return 0;
-    };
-    opts.fetch_opts.callbacks.payload = ctx.get();
+        auto sparsePaths_ = static_cast<jobjectArray>(env->GetObjectField(options, optionsClass.sparsePaths));
+        if (sparsePaths_ != nullptr && !sparsePaths.Add(env, sparsePaths_)) {
+            return nullptr;
+        }
+        auto mirror_ = static_cast<jstring>(env->GetObjectField(options, optionsClass.mirror));
+        if (mirror_ != nullptr) {
+            const char *chars = env->GetStringUTFChars(mirror_, nullptr);
+            mirror = chars;
+            env->ReleaseStringUTFChars(mirror_, chars);
+        }
+    }
+    // The objects come from the local mirror, its packs hard-linked rather than copied, and
+    // origin is pointed at url afterwards.
+    if (!mirror.empty()) {
+        opts.local = GIT_CLONE_LOCAL;
+    }
+    if (!branch.empty()) {
+        opts.checkout_branch = branch.c_str();
+        opts.remote_cb = CreateSingleBranchRemote;
+        opts.remote_cb_payload = const_cast<char*>(branch.c_str());
+        opts.fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+    }
+    sparsePaths.Apply(&opts.checkout_opts);
+    // With more than one checkout thread the clone only fetches, and the tree is checked out
+    // after it through CheckoutTree.
+    git_checkout_options checkoutOpts = opts.checkout_opts;
+    bool parallelCheckout = zabuton::git::GetCheckoutThreads() > 1;
+    if (parallelCheckout) {
+        opts.checkout_opts.checkout_strategy = GIT_CHECKOUT_NONE;
+    }
 
-    ctx->Accept();
+    reporter.Notify(true);
     git_repository *repo = nullptr;
-    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_clone(&repo, url, clonePath, &opts), nullptr);
-    jmethodID ctor = env->GetMethodID(type, "<init>", "(J)V");
-    jobject repository = env->NewObject(type, ctor, reinterpret_cast<jlong>(repo));
+    int r = reporter.GetAggregator().CallbackResult();
+    if (r == 0) {
+        r = git_clone(&repo, mirror.empty() ? url : mirror.c_str(), clonePath, &opts);
+    }
+    if (r == 0 && !mirror.empty()) {
+        r = git_remote_set_url(repo, "origin", url);
+    }
+    if (r == 0 && parallelCheckout) {
+        git_object *head = nullptr;
+        // An empty remote leaves HEAD unborn and nothing to check out.
+        if (git_revparse_single(&head, repo, "HEAD^{tree}") == 0) {
+            r = CheckoutTree(repo, reinterpret_cast<git_tree*>(head), true, &checkoutOpts, &reporter);
+            git_object_free(head);
+        }
+    }
+    if (r == 0 && !sparsePaths.Empty()) {
+        r = sparsePaths.Save(repo);
+    }
+    if (r == 0) {
+        reporter.Notify(true);
+    }
+    if (ensureNoErrorProgress(env, reporter.GetAggregator(), r) < 0) {
+        git_repository_free(repo);
+        return nullptr;
+    }
+    int64_t handle = zabuton::git::AdoptSession(repo, clonePath);
+    UpdateCommitIndex(zabuton::git::FindSession(handle), repo);
+    jobject repository = env->NewObject(type, GetRegistry().repository.ctor, static_cast<jlong>(handle));
+    if (repository == nullptr) {
+        zabuton::git::CloseSession(handle);
+    }
     return repository;
 }
 
@@ -442,54 +1334,122 @@ JNIEXPORT jobject JNICALL
 Java_io_github_sh4_zabuton_git_Repository_open(JNIEnv *env, jclass type, jstring repoPath_)
 {
     const char *repoPath = env->GetStringUTFChars(repoPath_, 0);
-    git_repository *repo = nullptr;
-    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_repository_open(&repo, repoPath), nullptr);
-    jmethodID ctor = env->GetMethodID(type, "<init>", "(J)V");
-    jobject repository = env->NewObject(type, ctor, reinterpret_cast<jlong>(repo));
+    int64_t handle = 0;
+    int r = zabuton::git::OpenSession(&handle, repoPath);
+    env->ReleaseStringUTFChars(repoPath_, repoPath);
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+    jobject repository = env->NewObject(type, GetRegistry().repository.ctor, static_cast<jlong>(handle));
+    if (repository == nullptr) {
+        zabuton::git::CloseSession(handle);
+    }
     return repository;
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_io_github_sh4_zabuton_git_Repository_checkout(JNIEnv *env, jobject this_, jstring refspec_, jobject progressConsumer)
+Java_io_github_sh4_zabuton_git_Repository_updateMirror(JNIEnv *env, jclass /*type*/, jstring url_, jstring mirrorPath_,
+        jobject progressConsumer, jobject monitor)
+{
+    const char *url = env->GetStringUTFChars(url_, 0);
+    ZABUTON_MAKE_SCOPE([&]() { env->ReleaseStringUTFChars(url_, url); });
+    const char *mirrorPath = env->GetStringUTFChars(mirrorPath_, 0);
+    ZABUTON_MAKE_SCOPE([&]() { env->ReleaseStringUTFChars(mirrorPath_, mirrorPath); });
+
+    FetchProgressReporter reporter(env, progressConsumer, monitor);
+    reporter.Notify(true);
+    int r = reporter.GetAggregator().CallbackResult();
+    git_repository *repo = nullptr;
+    ZABUTON_MAKE_SCOPE([&]() { git_repository_free(repo); });
+    if (r == 0) {
+        r = git_repository_open_bare(&repo, mirrorPath);
+    }
+    if (r == GIT_ENOTFOUND) {
+        git_clone_options opts = GIT_CLONE_OPTIONS_INIT;
+        opts.bare = 1;
+        opts.remote_cb = CreateMirrorRemote;
+        SetRemoteProgressCallbacks(&opts.fetch_opts.callbacks, &reporter);
+        r = git_clone(&repo, url, mirrorPath, &opts);
+    } else if (r == 0) {
+        git_remote *remote = nullptr;
+        r = git_remote_lookup(&remote, repo, "origin");
+        if (r == 0) {
+            git_fetch_options opts = GIT_FETCH_OPTIONS_INIT;
+            SetRemoteProgressCallbacks(&opts.callbacks, &reporter);
+            // Branches deleted upstream go away from the mirror as well.
+            opts.prune = GIT_FETCH_PRUNE;
+            r = git_remote_fetch(remote, nullptr, &opts, nullptr);
+            git_remote_free(remote);
+        }
+    }
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, r);
+    reporter.Notify(true);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_checkout(JNIEnv *env, jobject this_, jstring refspec_,
+        jobject progressConsumer, jobject monitor)
 {
     const char *refspec = env->GetStringUTFChars(refspec_, 0);
 
-    git_repository *repo = GetGitRepository(env, this_);
-    assert(repo != nullptr);
+    RepositoryLease lease;
+    if (!AcquireWriter(env, this_, &lease)) {
+        return;
+    }
+    git_repository *repo = lease.Get();
 
-    auto ctx = std::make_unique<CheckoutProgressReporter>(env, progressConsumer);
+    CheckoutProgressReporter reporter(env, progressConsumer, monitor);
 
     git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
     opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-    opts.progress_cb = CheckoutProgressHandler<CheckoutProgressReporter>;
-    opts.progress_payload = ctx.get();
     opts.disable_filters = 1;
+    SetCheckoutProgressCallbacks(&opts, &reporter);
+    SparsePaths sparsePaths;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, sparsePaths.Load(repo));
+    sparsePaths.Apply(&opts);
 
     git_annotated_commit *commit = nullptr;
 
-    {
+    if (IsFullObjectId(refspec)) {
+        // dwim would try six reference names, each a failed file lookup, before revparse.
+        git_oid id;
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_oid_fromstr(&id, refspec));
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_annotated_commit_lookup(&commit, repo, &id));
+    } else {
         git_reference *ref = nullptr;
 
         if (git_reference_dwim(&ref, repo, refspec) == GIT_OK) {
             ZABUTON_MAKE_SCOPE([&]() { git_reference_free(ref); });
             ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_annotated_commit_from_ref(&commit, repo, ref));
         } else {
+            git_error_clear();
             git_object *obj = nullptr;
             ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_revparse_single(&obj, repo, refspec));
             ZABUTON_MAKE_SCOPE([&]() { git_object_free(obj); });
             ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_annotated_commit_lookup(&commit, repo, git_object_id(obj)));
         }
     }
+    ZABUTON_MAKE_SCOPE([&]() { git_annotated_commit_free(commit); });
 
     git_commit *targetCommit = nullptr;
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_commit_lookup(&targetCommit, repo, git_annotated_commit_id(commit)));
     ZABUTON_MAKE_SCOPE([&]() { git_commit_free(targetCommit); });
+    git_tree *targetTree = nullptr;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_commit_tree(&targetTree, targetCommit));
+    ZABUTON_MAKE_SCOPE([&]() { git_tree_free(targetTree); });
 
-    ctx->Accept();
-    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_checkout_tree(repo, reinterpret_cast<const git_object*>(targetCommit), &opts));
+    reporter.Notify(true);
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, reporter.GetAggregator().CallbackResult());
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, CheckoutTree(repo, targetTree, false, &opts, &reporter));
+    reporter.Notify(true);
 
+    // A commit looked up by id, rather than through a reference, has no name to put HEAD on.
     const char* canonicalName = git_annotated_commit_ref(commit);
+    if (canonicalName == nullptr) {
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_set_head_detached_from_annotated(repo, commit));
+        return;
+    }
+
     const char* remoteRefPrefix = "refs/remotes/";
     std::string refName = strncmp(remoteRefPrefix, canonicalName, strlen(remoteRefPrefix)) == 0
                           ? GetLocalReferenceNameFromRemoteName(env, repo, canonicalName)
@@ -498,100 +1458,234 @@ Java_io_github_sh4_zabuton_git_Repository_checkout(JNIEnv *env, jobject this_, j
         return;
     }
 
-    if (git_annotated_commit_ref(commit)) {
-        git_reference* newBranchRef = nullptr;
-        const char* headsRefPrefix = "refs/heads/";
-        std::string localRefName = refName.substr(strlen(headsRefPrefix));
-        int r = git_branch_lookup(&newBranchRef, repo, localRefName.c_str(), GIT_BRANCH_LOCAL);
-        if (r == 0) {
-            git_reference_free(newBranchRef);
-        } else if (r == GIT_ENOTFOUND) {
-            ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_branch_create(
-                    &newBranchRef,
-                    repo,
-                    refName.substr(strlen("refs/heads/")).c_str(),
-                    targetCommit, 0));
-        } else {
-            ensureNoErrorLibGit2(env, r);
-            return;
-        }
-        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_set_head(repo, refName.c_str()));
+    git_reference* newBranchRef = nullptr;
+    const char* headsRefPrefix = "refs/heads/";
+    std::string localRefName = refName.substr(strlen(headsRefPrefix));
+    int r = probeLibGit2(env, git_branch_lookup(&newBranchRef, repo, localRefName.c_str(), GIT_BRANCH_LOCAL));
+    if (r == 0) {
+        git_reference_free(newBranchRef);
+    } else if (r == GIT_ENOTFOUND) {
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_branch_create(
+                &newBranchRef,
+                repo,
+                refName.substr(strlen("refs/heads/")).c_str(),
+                targetCommit, 0));
     } else {
-        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_set_head_detached_from_annotated(repo, commit));
+        return;
     }
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_set_head(repo, refName.c_str()));
 }
 
 extern "C"
 JNIEXPORT void JNICALL
 Java_io_github_sh4_zabuton_git_Repository_destroy(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
-    if (repo != nullptr) {
-        git_repository_free(repo);
-        jfieldID handleField = env->GetFieldID(env->GetObjectClass(this_), "repositoryHandle", "J");
-        env->SetLongField(this_, handleField, 0);
-    }
+    zabuton::git::CloseSession(env->GetLongField(this_, GetRegistry().repository.handle));
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_io_github_sh4_zabuton_git_Repository_fetch(JNIEnv *env, jobject this_, jstring remoteName_, jobject progressConsumer)
+Java_io_github_sh4_zabuton_git_Repository_fetchFrom(JNIEnv *env, jobject this_, jstring remoteName_,
+        jstring url_, jobject progressConsumer, jobject monitor)
 {
-    git_repository *repo = GetGitRepository(env, this_);
-    assert(repo != nullptr);
+    RepositoryLease lease;
+    if (!AcquireWriter(env, this_, &lease)) {
+        return;
+    }
+    git_repository *repo = lease.Get();
 
-    auto ctx = std::make_unique<FetchProgressReporter>(env, progressConsumer);
+    FetchProgressReporter reporter(env, progressConsumer, monitor);
 
-    const char *remoteName = env->GetStringUTFChars(remoteName_, 0);
+    // Fetching from another URL, such as a local mirror, goes through an anonymous remote given
+    // the refspecs of the named one, so its tracking refs are updated as by a plain fetch.
     git_remote *remote = nullptr;
-    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_remote_lookup(&remote, repo, remoteName));
+    git_remote *anonymous = nullptr;
+    ZABUTON_MAKE_SCOPE([&]() { git_remote_free(remote); git_remote_free(anonymous); });
+    {
+        const char *remoteName = env->GetStringUTFChars(remoteName_, 0);
+        const char *url = url_ != nullptr ? env->GetStringUTFChars(url_, 0) : nullptr;
+        int r = LookupFetchSource(repo, remoteName, url, &remote, &anonymous);
+        env->ReleaseStringUTFChars(remoteName_, remoteName);
+        if (url != nullptr) {
+            env->ReleaseStringUTFChars(url_, url);
+        }
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, r);
+    }
+    git_remote *source = anonymous != nullptr ? anonymous : remote;
+    git_strarray refspecs = {};
+    ZABUTON_MAKE_SCOPE([&]() { git_strarray_free(&refspecs); });
+    if (anonymous != nullptr) {
+        ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_remote_get_fetch_refspecs(&refspecs, remote));
+    }
+
     git_fetch_options opts = GIT_FETCH_OPTIONS_INIT;
-    opts.callbacks.transfer_progress = [](const git_transfer_progress *stats, void *payload) -> int {
-        auto p = reinterpret_cast<FetchProgressReporter*>(payload);
-        assert(p != nullptr);
-        p->GetContext()->SetIndexedDeltas(stats->indexed_deltas);
-        p->GetContext()->SetIndexedObjects(stats->indexed_objects);
-        p->GetContext()->SetLocalObjects(stats->local_objects);
-        p->GetContext()->SetReceivedBytes(stats->received_bytes);
-        p->GetContext()->SetReceivedObjects(stats->received_objects);
-        p->GetContext()->SetTotalDeltas(stats->total_deltas);
-        p->GetContext()->SetTotalObjects(stats->total_objects);
-        return 0; // Note: Return a value less than zero to cancel the transfer.
-    };
-    opts.callbacks.sideband_progress = [](const char *str, int len, void *payload) -> int {
-        auto p = reinterpret_cast<FetchProgressReporter*>(payload);
-        assert(p != nullptr);
-        if (len > 0) {
-            p->GetContext()->SetSideBandMessage(std::string(str, static_cast<size_t>(len)));
+    SetRemoteProgressCallbacks(&opts.callbacks, &reporter);
+    opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_AUTO;
+    reporter.Notify(true);
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, reporter.GetAggregator().CallbackResult());
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter,
+            git_remote_fetch(source, refspecs.count > 0 ? &refspecs : nullptr, &opts, nullptr));
+    // The Repository may have been closed meanwhile; the fetch still succeeded.
+    UpdateCommitIndex(zabuton::git::FindSession(env->GetLongField(this_, GetRegistry().repository.handle)), repo);
+    reporter.Notify(true);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_fetchStaged(JNIEnv *env, jobject this_, jstring remoteName_,
+        jstring url_, jint refsPerStage, jobject monitor)
+{
+    if (refsPerStage <= 0) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "refsPerStage must be positive.");
+        return nullptr;
+    }
+    RepositoryLease lease;
+    if (!AcquireWriter(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
+
+    FetchProgressReporter reporter(env, nullptr, monitor);
+    ProgressAggregator& aggregator = reporter.GetAggregator();
+
+    git_remote *remote = nullptr;
+    git_remote *anonymous = nullptr;
+    ZABUTON_MAKE_SCOPE([&]() { git_remote_free(remote); git_remote_free(anonymous); });
+    {
+        const char *remoteName = env->GetStringUTFChars(remoteName_, 0);
+        const char *url = url_ != nullptr ? env->GetStringUTFChars(url_, 0) : nullptr;
+        int r = LookupFetchSource(repo, remoteName, url, &remote, &anonymous);
+        env->ReleaseStringUTFChars(remoteName_, remoteName);
+        if (url != nullptr) {
+            env->ReleaseStringUTFChars(url_, url);
         }
-        return 0; // Note:  Return a negative value to cancel the network operation.
-    };
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+    }
+    git_remote *source = anonymous != nullptr ? anonymous : remote;
+
+    git_fetch_options opts = GIT_FETCH_OPTIONS_INIT;
+    SetRemoteProgressCallbacks(&opts.callbacks, &reporter);
     opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_AUTO;
-    opts.callbacks.payload = ctx.get();
-    ctx->Accept();
-    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_remote_fetch(remote, nullptr, &opts, nullptr));
+    reporter.Notify(true);
+    ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, aggregator.CallbackResult(), nullptr);
+
+    const int64_t startNanos = MonotonicNanos();
+    jint connections = 0;
+    auto connect = [&]() {
+        connections++;
+        return git_remote_connect(source, GIT_DIRECTION_FETCH, &opts.callbacks, &opts.proxy_opts,
+                                  &opts.custom_headers);
+    };
+    ZABUTON_MAKE_SCOPE([&]() { git_remote_disconnect(source); });
+    ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, connect(), nullptr);
+    std::vector<std::string> refspecs;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, ListStageRefspecs(source, remote, &refspecs), nullptr);
+
+    // Each stage is downloaded, indexed into a pack of its own and has its tracking refs updated
+    // before the next one starts. If the connection drops, the stages done so far are kept, and
+    // the next fetch has their tips to negotiate with, so it only transfers the rest.
+    const bool reconnect = !IsStatelessUrl(git_remote_url(source));
+    const size_t perStage = static_cast<size_t>(refsPerStage);
+    const size_t stageCount = (refspecs.size() + perStage - 1) / perStage;
+    jlong receivedBytes = 0;
+    jlong receivedObjects = 0;
+    jlong localObjects = 0;
+    jlong indexedDeltas = 0;
+    for (size_t stage = 0; stage < stageCount; stage++) {
+        aggregator.SetCheckout(stage, stageCount);
+        if (!git_remote_connected(source)) {
+            ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, connect(), nullptr);
+        }
+        std::vector<char*> strings;
+        for (size_t i = stage * perStage; i < std::min(refspecs.size(), (stage + 1) * perStage); i++) {
+            strings.push_back(&refspecs[i][0]);
+        }
+        git_strarray stageRefspecs = {strings.data(), strings.size()};
+        ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, git_remote_download(source, &stageRefspecs, &opts),
+                nullptr);
+        ZABUTON_ENSURE_PROGRESS_NOERROR_WITH_RETURN(env, reporter, git_remote_update_tips(source, &opts.callbacks, 1,
+                GIT_REMOTE_DOWNLOAD_TAGS_AUTO, nullptr), nullptr);
+        const git_transfer_progress *stats = git_remote_stats(source);
+        receivedBytes += static_cast<jlong>(stats->received_bytes);
+        receivedObjects += stats->received_objects;
+        localObjects += stats->local_objects;
+        indexedDeltas += stats->indexed_deltas;
+        if (reconnect) {
+            git_remote_disconnect(source);
+        }
+    }
+    aggregator.SetCheckout(stageCount, stageCount);
+    // The Repository may have been closed meanwhile; the fetch still succeeded.
+    UpdateCommitIndex(zabuton::git::FindSession(env->GetLongField(this_, GetRegistry().repository.handle)), repo);
+    reporter.Notify(true);
+
+    const auto& fetchStats = GetRegistry().fetchStats;
+    return env->NewObject(fetchStats.clazz, fetchStats.ctor, static_cast<jint>(stageCount), connections,
+            receivedBytes, receivedObjects, localObjects, indexedDeltas, MonotonicNanos() - startNanos);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_repack(JNIEnv *env, jobject this_)
+{
+    RepositoryLease lease;
+    if (!AcquireWriter(env, this_, &lease)) {
+        return;
+    }
+    git_repository *repo = lease.Get();
+    // Dropping what is unreachable from the refs would lose objects only a working tree's index
+    // refers to.
+    if (!git_repository_is_bare(repo)) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "Only a bare repository can be repacked.");
+        return;
+    }
+
+    git_packbuilder *pb = nullptr;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_packbuilder_new(&pb, repo));
+    ZABUTON_MAKE_SCOPE([&]() { git_packbuilder_free(pb); });
+    git_packbuilder_set_threads(pb, 0);
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, InsertReachableObjects(repo, pb));
+    if (git_packbuilder_object_count(pb) == 0) {
+        return;
+    }
+    const std::string objectsDir = std::string(git_repository_path(repo)) + "objects/";
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_packbuilder_write(pb, (objectsDir + "pack").c_str(), 0, nullptr, nullptr));
+
+    char hash[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hash, sizeof(hash), git_packbuilder_hash(pb));
+    RemoveObjectsOutsidePack(objectsDir, std::string("pack-") + hash);
+    git_odb *odb = nullptr;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_odb(&odb, repo));
+    ZABUTON_MAKE_SCOPE([&]() { git_odb_free(odb); });
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_odb_refresh(odb));
 }
 
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_io_github_sh4_zabuton_git_Repository_reset(JNIEnv *env, jobject this_, jobject resetKind_, jobject progressConsumer)
+Java_io_github_sh4_zabuton_git_Repository_reset(JNIEnv *env, jobject this_, jobject resetKind_,
+        jobject progressConsumer, jobject monitor)
 {
     git_reset_t resetType;
     if (!EnsureParseGitRestType(&resetType, env, resetKind_)) {
         return;
     }
 
-    git_repository *repo = GetGitRepository(env, this_);
-    assert(repo != nullptr);
+    RepositoryLease lease;
+    if (!AcquireWriter(env, this_, &lease)) {
+        return;
+    }
+    git_repository *repo = lease.Get();
 
-    auto ctx = std::make_unique<ResetProgressReporter>(env, progressConsumer);
+    ResetProgressReporter reporter(env, progressConsumer, monitor);
 
     git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
     opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-    opts.progress_cb = CheckoutProgressHandler<ResetProgressReporter>;
-    opts.progress_payload = ctx.get();
     opts.disable_filters = 1;
+    SetCheckoutProgressCallbacks(&opts, &reporter);
+    SparsePaths sparsePaths;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, sparsePaths.Load(repo));
+    sparsePaths.Apply(&opts);
     git_reference *headRef = nullptr;
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_repository_head(&headRef, repo));
     ZABUTON_MAKE_SCOPE([&]() { git_reference_free(headRef); });
@@ -599,16 +1693,22 @@ Java_io_github_sh4_zabuton_git_Repository_reset(JNIEnv *env, jobject this_, jobj
     git_commit* headCommit = nullptr;
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_commit_lookup(&headCommit, repo, headOid));
     ZABUTON_MAKE_SCOPE([&]() { git_commit_free(headCommit); });
-    ctx->Accept();
-    ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_reset(repo, reinterpret_cast<const git_object*>(headCommit), resetType, &opts));
+    reporter.Notify(true);
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter, reporter.GetAggregator().CallbackResult());
+    ZABUTON_ENSURE_PROGRESS_NOERROR(env, reporter,
+            git_reset(repo, reinterpret_cast<const git_object*>(headCommit), resetType, &opts));
+    reporter.Notify(true);
 }
 
 extern "C"
 JNIEXPORT jobject JNICALL
 Java_io_github_sh4_zabuton_git_Repository_getHeadName(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
-    assert(repo != nullptr);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
 
     git_reference* headRef;
     ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_repository_head(&headRef, repo), nullptr);
@@ -624,7 +1724,11 @@ extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_sh4_zabuton_git_Repository_getLocalBranchNames(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
     jobjectArray refArray = GetBranchReferenceNameArray(env, repo, GIT_BRANCH_LOCAL);
     return refArray;
 }
@@ -633,7 +1737,11 @@ extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_sh4_zabuton_git_Repository_getRemoteBranchNames(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
     jobjectArray refArray = GetBranchReferenceNameArray(env, repo, GIT_BRANCH_REMOTE);
     return refArray;
 }
@@ -642,7 +1750,11 @@ extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_sh4_zabuton_git_Repository_getTagNames(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
     jobjectArray refArray = GetTagReferenceNameArray(env, repo);
     return refArray;
 }
@@ -651,16 +1763,18 @@ extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_sh4_zabuton_git_Repository_getRemotes(JNIEnv *env, jobject this_)
 {
-    git_repository *repo = GetGitRepository(env, this_);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
 
     git_strarray remotes = {0};
     ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_remote_list(&remotes, repo), nullptr);
     ZABUTON_MAKE_SCOPE([&] { git_strarray_free(&remotes); });
 
-    jclass remoteClass = env->FindClass("io/github/sh4/zabuton/git/Remote");
-    jmethodID remoteClassCtor = env->GetMethodID(remoteClass, "<init>",
-            "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
-    jobjectArray remoteArray = env->NewObjectArray(static_cast<int>(remotes.count), remoteClass, nullptr);
+    const auto& remoteClass = GetRegistry().remote;
+    jobjectArray remoteArray = env->NewObjectArray(static_cast<int>(remotes.count), remoteClass.clazz, nullptr);
     for (int i = 0; i < static_cast<int>(remotes.count); i++)
     {
         git_remote* remote = {0};
@@ -671,8 +1785,12 @@ Java_io_github_sh4_zabuton_git_Repository_getRemotes(JNIEnv *env, jobject this_)
         jstring fetchUrl = env->NewStringUTF(git_remote_url(remote));
         jstring pushUrl = env->NewStringUTF(git_remote_pushurl(remote));
 
-        jobject remoteObject = env->NewObject(remoteClass, remoteClassCtor, name, fetchUrl, pushUrl);
+        jobject remoteObject = env->NewObject(remoteClass.clazz, remoteClass.ctor, name, fetchUrl, pushUrl);
         env->SetObjectArrayElement(remoteArray, i, remoteObject);
+        env->DeleteLocalRef(remoteObject);
+        env->DeleteLocalRef(pushUrl);
+        env->DeleteLocalRef(fetchUrl);
+        env->DeleteLocalRef(name);
     }
     return remoteArray;
 }
@@ -681,7 +1799,11 @@ extern "C"
 JNIEXPORT void JNICALL
 Java_io_github_sh4_zabuton_git_Repository_log(JNIEnv *env, jobject this_, jobject callback)
 {
-    git_repository *repo = GetGitRepository(env, this_);
+    RepositoryLease lease;
+    if (!AcquireReader(env, this_, &lease)) {
+        return;
+    }
+    git_repository *repo = lease.Get();
     git_revwalk *walker = nullptr;
 
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_revwalk_new(&walker, repo));
@@ -690,43 +1812,296 @@ Java_io_github_sh4_zabuton_git_Repository_log(JNIEnv *env, jobject this_, jobjec
 
     ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_revwalk_push_head(walker));
 
-    jclass functionClass = env->FindClass("java/util/function/Function");
-    jmethodID applyMethod = env->GetMethodID(functionClass, "apply", "(Ljava/lang/Object;)Ljava/lang/Object;");
+    const auto& function = GetRegistry().function;
+    const auto& boolean = GetRegistry().boolean;
 
     git_oid oid;
     git_commit *commit = nullptr;
     ZABUTON_MAKE_SCOPE([&]() { git_commit_free(commit); });
-    jclass boolClass = env->FindClass("java/lang/Boolean");
-    jmethodID boolValueMethod = env->GetMethodID(boolClass, "booleanValue", "()Z");
     while(!git_revwalk_next(&oid, walker)) {
         if (commit != nullptr) {
             git_commit_free(commit);
             commit = nullptr;
         }
         ZABUTON_ENSURE_LIBGIT2_NOERROR(env, git_commit_lookup(&commit, repo, &oid));
+        // Every local reference created for this commit is released together with the frame.
+        if (env->PushLocalFrame(CommitObjectLocalReferences) != JNI_OK) {
+            return;
+        }
         jobject commitObject = GetCommitObject(env, commit);
-        jobject r = env->CallObjectMethod(callback, applyMethod, commitObject);
-        if (r != nullptr && env->IsInstanceOf(r, boolClass)) {
-            if (!env->CallBooleanMethod(r, boolValueMethod)) {
-                break;
+        jobject r = env->CallObjectMethod(callback, function.apply, commitObject);
+        bool continueWalk = !env->ExceptionCheck();
+        if (continueWalk && r != nullptr && env->IsInstanceOf(r, boolean.clazz)) {
+            continueWalk = env->CallBooleanMethod(r, boolean.booleanValue);
+        }
+        env->PopLocalFrame(nullptr);
+        if (!continueWalk) {
+            break;
+        }
+    }
+}
+
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_logWalker(JNIEnv *env, jobject this_, jstring start_)
+{
+    auto session = GetRepositorySession(env, this_);
+    RepositoryLease lease;
+    if (!session || ensureNoErrorLibGit2(env, session->AcquireReader(&lease)) < 0) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
+
+    git_oid startId;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, ResolveStart(env, repo, start_, &startId), nullptr);
+
+    auto logWalker = std::make_unique<LogWalker>(LogWalker { std::move(lease), nullptr });
+    ZABUTON_MAKE_SCOPE([&]() { if (logWalker) { git_revwalk_free(logWalker->walk); } });
+    auto graph = session->GetCommitIndex().Snapshot(repo);
+    uint32_t startPos = graph ? graph->Find(startId) : CommitGraph::NoPosition;
+    if (startPos != CommitGraph::NoPosition) {
+        // Everything reachable from an indexed commit is indexed too.
+        logWalker->graphWalk = std::make_unique<CommitGraphWalk>(graph);
+        logWalker->graphWalk->Push(startPos);
+    } else {
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_revwalk_new(&logWalker->walk, repo), nullptr);
+        git_revwalk_sorting(logWalker->walk, GIT_SORT_TIME);
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_revwalk_push(logWalker->walk, &startId), nullptr);
+    }
+
+    const auto& walkerClass = GetRegistry().commitLogWalker;
+    jobject walkerObject = env->NewObject(walkerClass.clazz, walkerClass.ctor, this_,
+            reinterpret_cast<jlong>(logWalker.get()));
+    if (walkerObject != nullptr) {
+        logWalker.release();
+    }
+    return walkerObject;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_CommitLogWalker_next(JNIEnv *env, jobject this_, jint maxCount, jint fields)
+{
+    auto logWalker = reinterpret_cast<LogWalker*>(env->GetLongField(this_, GetRegistry().commitLogWalker.handle));
+    if (logWalker == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "CommitLogWalker is already closed.");
+        return nullptr;
+    }
+    if (maxCount < 0) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "maxCount must not be negative.");
+        return nullptr;
+    }
+    git_repository *repo = logWalker->repo.Get();
+
+    CommitLogBatchBuilder builder(fields, maxCount);
+    if (logWalker->graphWalk) {
+        const CommitGraph& graph = logWalker->graphWalk->Graph();
+        uint32_t pos;
+        for (jint i = 0; i < maxCount && logWalker->graphWalk->Next(&pos); i++) {
+            git_commit *commit = nullptr;
+            if (builder.NeedsCommit(graph)) {
+                ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_commit_lookup(&commit, repo, &graph.Id(pos)), nullptr);
             }
+            builder.Append(graph, pos, commit);
+            git_commit_free(commit);
+        }
+        return builder.Build(env);
+    }
+    git_oid oid;
+    for (jint i = 0; i < maxCount; i++) {
+        int r = git_revwalk_next(&oid, logWalker->walk);
+        if (r == GIT_ITEROVER) {
+            break;
+        }
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+        if (!builder.NeedsCommit()) {
+            builder.Append(&oid, nullptr);
+            continue;
+        }
+        git_commit *commit = nullptr;
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_commit_lookup(&commit, repo, &oid), nullptr);
+        builder.Append(&oid, commit);
+        git_commit_free(commit);
+    }
+    return builder.Build(env);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_CommitLogWalker_destroy(JNIEnv *env, jobject this_)
+{
+    auto logWalker = reinterpret_cast<LogWalker*>(env->GetLongField(this_, GetRegistry().commitLogWalker.handle));
+    if (logWalker != nullptr) {
+        git_revwalk_free(logWalker->walk);
+        delete logWalker;
+        env->SetLongField(this_, GetRegistry().commitLogWalker.handle, 0);
+    }
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_logForPath(JNIEnv *env, jobject this_, jstring start_, jstring path_,
+        jint limit, jint fields)
+{
+    if (limit < 0) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "limit must not be negative.");
+        return nullptr;
+    }
+    if (limit == 0) {
+        return CommitLogBatchBuilder(fields, 0).Build(env);
+    }
+    auto session = GetRepositorySession(env, this_);
+    RepositoryLease lease;
+    if (!session || ensureNoErrorLibGit2(env, session->AcquireReader(&lease)) < 0) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
+    git_oid start;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, ResolveStart(env, repo, start_, &start), nullptr);
+    const char *pathChars = env->GetStringUTFChars(path_, nullptr);
+    const std::string path(pathChars);
+    env->ReleaseStringUTFChars(path_, pathChars);
+
+    auto graph = session->GetCommitIndex().Snapshot(repo);
+    CommitLogBatchBuilder builder(fields, limit);
+    jint count = 0;
+    int appendResult = 0;
+    int r = zabuton::git::WalkPathHistory(repo, graph.get(), session->GetTreeEntryCache(), start, path,
+            [&](const git_oid& id) {
+                appendResult = AppendCommit(&builder, repo, graph.get(), id);
+                return appendResult == 0 && ++count < limit;
+            });
+    if (r == 0) {
+        r = appendResult;
+    }
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+    return builder.Build(env);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_blame(JNIEnv *env, jobject this_, jstring start_, jstring path_, jint fields)
+{
+    auto session = GetRepositorySession(env, this_);
+    RepositoryLease lease;
+    if (!session || ensureNoErrorLibGit2(env, session->AcquireReader(&lease)) < 0) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
+    git_oid start;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, ResolveStart(env, repo, start_, &start), nullptr);
+    const char *pathChars = env->GetStringUTFChars(path_, nullptr);
+    const std::string path(pathChars);
+    env->ReleaseStringUTFChars(path_, pathChars);
+
+    auto graph = session->GetCommitIndex().Snapshot(repo);
+    std::vector<BlameRange> ranges;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env,
+            zabuton::git::BlameFile(repo, graph.get(), session->GetTreeEntryCache(), start, path, &ranges), nullptr);
+
+    // Each commit is in the batch once, in the order its first lines appear.
+    std::vector<jint> startLines, lineCounts, commitIndexes;
+    std::unordered_map<git_oid, jint, OidHash, OidEqual> indexes;
+    CommitLogBatchBuilder builder(fields | CommitLogFieldId, static_cast<jint>(ranges.size()));
+    for (const auto& range : ranges) {
+        auto index = indexes.emplace(range.commit, static_cast<jint>(indexes.size()));
+        if (index.second) {
+            ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, AppendCommit(&builder, repo, graph.get(), range.commit), nullptr);
         }
-   }
+        startLines.push_back(static_cast<jint>(range.start));
+        lineCounts.push_back(static_cast<jint>(range.count));
+        commitIndexes.push_back(index.first->second);
+    }
+    jobject commits = builder.Build(env);
+    if (commits == nullptr) {
+        return nullptr;
+    }
+    const auto& blameClass = GetRegistry().blame;
+    return env->NewObject(blameClass.clazz, blameClass.ctor, static_cast<jint>(ranges.size()),
+            NewJavaArray<jintArray>(env, true, startLines),
+            NewJavaArray<jintArray>(env, true, lineCounts),
+            NewJavaArray<jintArray>(env, true, commitIndexes),
+            commits);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_git_Repository_updateCommitIndex(JNIEnv *env, jobject this_)
+{
+    auto session = GetRepositorySession(env, this_);
+    if (!session) {
+        return;
+    }
+    RepositoryLease lease = session->AcquireWriter();
+    ensureNoErrorLibGit2(env, session->GetCommitIndex().Update(lease.Get()));
+}
+
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_io_github_sh4_zabuton_git_Repository_aheadBehind(JNIEnv *env, jobject this_, jstring local_, jstring upstream_)
+{
+    auto session = GetRepositorySession(env, this_);
+    RepositoryLease lease;
+    if (!session || ensureNoErrorLibGit2(env, session->AcquireReader(&lease)) < 0) {
+        return nullptr;
+    }
+    git_repository *repo = lease.Get();
+
+    git_oid local, upstream;
+    const char *localName = env->GetStringUTFChars(local_, nullptr);
+    int r = ResolveCommit(&local, repo, localName);
+    env->ReleaseStringUTFChars(local_, localName);
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+    const char *upstreamName = env->GetStringUTFChars(upstream_, nullptr);
+    r = ResolveCommit(&upstream, repo, upstreamName);
+    env->ReleaseStringUTFChars(upstream_, upstreamName);
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, r, nullptr);
+
+    size_t ahead = 0, behind = 0;
+    auto graph = session->GetCommitIndex().Snapshot(repo);
+    uint32_t localPos = graph ? graph->Find(local) : CommitGraph::NoPosition;
+    uint32_t upstreamPos = graph ? graph->Find(upstream) : CommitGraph::NoPosition;
+    if (localPos != CommitGraph::NoPosition && upstreamPos != CommitGraph::NoPosition) {
+        graph->AheadBehind(localPos, upstreamPos, &ahead, &behind);
+    } else {
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, git_graph_ahead_behind(&ahead, &behind, repo, &local, &upstream), nullptr);
+    }
+    const jint counts[] = { static_cast<jint>(ahead), static_cast<jint>(behind) };
+    jintArray result = env->NewIntArray(2);
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, 2, counts);
+    }
+    return result;
 }
 
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_io_github_sh4_zabuton_git_LibGit2Exception_getLastError(JNIEnv *env, jclass /*type*/)
-{
-    std::string message;
-    const git_error *e = giterr_last();
-    message += e->message;
-    if (message.empty()) {
-        return env->NewStringUTF("");
-    }
-    message += ' ';
-    message += '(';
-    message += std::to_string(e->klass);
-    message += ')';
-    return env->NewStringUTF(message.c_str());
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_git_Repository_status(JNIEnv *env, jobject this_, jint flags, jobjectArray pathspecs_)
+{
+    auto session = GetRepositorySession(env, this_);
+    if (!session) {
+        return nullptr;
+    }
+    RepositoryLease lease;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, session->AcquireReader(&lease), nullptr);
+    git_repository *repo = lease.Get();
+
+    SparsePaths sparsePaths;
+    ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env, sparsePaths.Load(repo), nullptr);
+    git_strarray sparse = sparsePaths.Get();
+    std::vector<StatusEntry> entries;
+    if (pathspecs_ == nullptr) {
+        // The whole tree is what the editor polls, so only that is cached.
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env,
+                session->GetStatusCache().Scan(repo, ToStatusOptions(flags), sparse, &entries), nullptr);
+    } else {
+        SparsePaths pathspecs;
+        if (!pathspecs.Add(env, pathspecs_)) {
+            return nullptr;
+        }
+        ZABUTON_ENSURE_LIBGIT2_NOERROR_WITH_RETURN(env,
+                zabuton::git::ScanStatus(repo, ToStatusOptions(flags), pathspecs.Get(), sparse, &entries), nullptr);
+    }
+    return NewStatusList(env, entries);
 }
@@ -0,0 +1,468 @@
+#include <jni.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "JniUtil.h"
+#include "MakeProcess.h"
+
+using zabuton::build::MakeEvent;
+using zabuton::build::MakeProcess;
+using zabuton::jni::GetRegistry;
+using zabuton::jni::GetStrings;
+using zabuton::util::MonotonicNanos;
+
+namespace zabuton { namespace build {
+
+namespace
+{
+
+constexpr size_t ReadChunkSize = 64 * 1024;
+constexpr int NotExited = -1;
+
+bool StartsWith(const char *line, size_t size, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return size >= n && memcmp(line, prefix, n) == 0;
+}
+
+// The word of line after prefix, up to the next space.
+std::string WordAfter(const char *line, size_t size, const char *prefix)
+{
+    size_t begin = strlen(prefix);
+    const char *end = static_cast<const char*>(memchr(line + begin, ' ', size - begin));
+    return std::string(line + begin, end != nullptr ? end : line + size);
+}
+
+// Lines make prints for --debug=j (job.c), which are not part of the build output.
+const char* const JobLinePrefixes[] = {
+    "Putting child ",
+    "Live child ",
+    "Reaping winning child ",
+    "Reaping losing child ",
+    "Removing child ",
+    "Need a job token;",
+    "Obtained token for child ",
+    "Released token for child ",
+    "Got a SIGCHLD;",
+};
+
+bool ReadInt(const char *path, long *value)
+{
+    FILE *file = fopen(path, "re");
+    if (file == nullptr) {
+        return false;
+    }
+    bool read = fscanf(file, "%ld", value) == 1;
+    fclose(file);
+    return read;
+}
+
+} // anonymous namespace
+
+unsigned int DefaultJobCount()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<long> frequencies;
+    for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF); cpu++) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        long online = 1;
+        long frequency = 0;
+        // cpu0 has no online file on most kernels, and can never go offline.
+        ReadInt((dir + "/online").c_str(), &online);
+        if (online != 0 && ReadInt((dir + "/cpufreq/cpuinfo_max_freq").c_str(), &frequency)) {
+            frequencies.push_back(frequency);
+        }
+    }
+    if (!frequencies.empty()) {
+        long slowest = *std::min_element(frequencies.begin(), frequencies.end());
+        long faster = std::count_if(frequencies.begin(), frequencies.end(), [&](long f) { return f > slowest; });
+        if (faster > 0) {
+            cores = faster;
+        }
+    }
+    return static_cast<unsigned int>(std::max(1L, cores));
+}
+
+MakeProcess::MakeProcess() :
+    pid_(-1),
+    startNanos_(MonotonicNanos()),
+    exitStatus_(NotExited),
+    outputRead_(0),
+    ended_(false),
+    closing_(false)
+{
+}
+
+MakeProcess::~MakeProcess()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+        outputTaken_.notify_all();
+    }
+    if (pid_ > 0) {
+        Signal(SIGKILL);
+        Wait();
+    }
+    if (reader_.joinable()) {
+        reader_.join();
+    }
+}
+
+std::unique_ptr<MakeProcess> MakeProcess::Start(const std::string& make, const std::vector<std::string>& args,
+                                                const std::vector<std::string>& env, const std::string& dir,
+                                                std::string *error)
+{
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(make.c_str()));
+    static char debugJobs[] = "--debug=j";
+    argv.push_back(debugJobs);
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    std::vector<char*> envp;
+    for (const auto& variable : env) {
+        envp.push_back(const_cast<char*>(variable.c_str()));
+    }
+    envp.push_back(nullptr);
+
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        *error = util::SystemError("Cannot create a pipe for", make);
+        return nullptr;
+    }
+    int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devNull < 0) {
+        *error = util::SystemError("Cannot open", "/dev/null");
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return nullptr;
+    }
+    sigset_t noSignals;
+    sigemptyset(&noSignals);
+
+    std::unique_ptr<MakeProcess> process(new MakeProcess());
+    // The child borrows the parent's memory until execve, so it only makes system calls and
+    // reports a failure through execErrno. posix_spawn needs API level 28 and does the same.
+    volatile int execErrno = 0;
+    pid_t pid = vfork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        sigprocmask(SIG_SETMASK, &noSignals, nullptr);
+        // ART ignores SIGPIPE, which make and the compilers would inherit.
+        signal(SIGPIPE, SIG_DFL);
+        if (dup2(devNull, STDIN_FILENO) < 0 || dup2(pipeFds[1], STDOUT_FILENO) < 0
+                || dup2(pipeFds[1], STDERR_FILENO) < 0 || chdir(dir.c_str()) != 0) {
+            execErrno = errno;
+            _exit(127);
+        }
+        execve(make.c_str(), argv.data(), envp.data());
+        execErrno = errno;
+        _exit(127);
+    }
+    int forkErrno = errno;
+    close(devNull);
+    close(pipeFds[1]);
+    if (pid < 0 || execErrno != 0) {
+        errno = pid < 0 ? forkErrno : execErrno;
+        *error = util::SystemError("Cannot run", make);
+        close(pipeFds[0]);
+        if (pid > 0) {
+            waitpid(pid, nullptr, 0);
+        }
+        return nullptr;
+    }
+    process->pid_ = pid;
+    int readFd = pipeFds[0];
+    MakeProcess *self = process.get();
+    process->reader_ = std::thread([self, readFd]() { self->Read(readFd); });
+    return process;
+}
+
+void MakeProcess::Read(int fd)
+{
+    std::vector<char> chunk(ReadChunkSize);
+    std::string partial;
+    for (;;) {
+        ssize_t n = read(fd, chunk.data(), chunk.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        int64_t now = MonotonicNanos() - startNanos_;
+        std::unique_lock<std::mutex> lock(mutex_);
+        outputTaken_.wait(lock, [&]() { return closing_ || output_.size() - outputRead_ < MaxBufferedOutput; });
+        size_t begin = 0;
+        size_t size = static_cast<size_t>(n);
+        const char *data = chunk.data();
+        while (begin < size) {
+            const char *newline = static_cast<const char*>(memchr(data + begin, '\n', size - begin));
+            if (newline == nullptr) {
+                partial.append(data + begin, size - begin);
+                break;
+            }
+            size_t end = static_cast<size_t>(newline - data) + 1;
+            if (partial.empty()) {
+                ReadLine(data + begin, end - begin, now);
+            } else {
+                partial.append(data + begin, end - begin);
+                ReadLine(partial.data(), partial.size(), now);
+                partial.clear();
+            }
+            begin = end;
+        }
+        outputReady_.notify_all();
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_.insert(output_.end(), partial.begin(), partial.end());
+    ended_ = true;
+    outputReady_.notify_all();
+}
+
+void MakeProcess::ReadLine(const char *line, size_t size, int64_t now)
+{
+    bool jobLine = false;
+    for (const char *prefix : JobLinePrefixes) {
+        if (StartsWith(line, size, prefix)) {
+            jobLine = true;
+            break;
+        }
+    }
+    if (!jobLine) {
+        if (closing_) {
+            return;
+        }
+        // Output the Java side has read is dropped before appending more.
+        if (outputRead_ == output_.size()) {
+            output_.clear();
+            outputRead_ = 0;
+        } else if (outputRead_ >= MaxBufferedOutput) {
+            output_.erase(output_.begin(), output_.begin() + outputRead_);
+            outputRead_ = 0;
+        }
+        output_.insert(output_.end(), line, line + size);
+        return;
+    }
+    if (StartsWith(line, size, "Putting child ")) {
+        // Putting child 0x... (target) PID 123 on the chain.
+        std::string child = WordAfter(line, size, "Putting child ");
+        const char *open = static_cast<const char*>(memchr(line, '(', size));
+        const char *close = open != nullptr ? static_cast<const char*>(memrchr(open, ')', size - (open - line))) : nullptr;
+        if (close == nullptr) {
+            return;
+        }
+        std::string target(open + 1, close);
+        events_.push_back(MakeEvent { MakeEventStarted, target, now });
+        children_[child] = std::move(target);
+    } else if (StartsWith(line, size, "Reaping losing child ")) {
+        failedChildren_[WordAfter(line, size, "Reaping losing child ")] = true;
+    } else if (StartsWith(line, size, "Removing child ")) {
+        std::string child = WordAfter(line, size, "Removing child ");
+        auto found = children_.find(child);
+        if (found == children_.end()) {
+            return;
+        }
+        bool failed = failedChildren_.erase(child) != 0;
+        events_.push_back(MakeEvent { failed ? MakeEventFailed : MakeEventFinished, std::move(found->second), now });
+        children_.erase(found);
+    }
+}
+
+size_t MakeProcess::ReadOutput(uint8_t *buffer, size_t size)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    outputReady_.wait(lock, [&]() { return ended_ || outputRead_ < output_.size(); });
+    size_t n = std::min(size, output_.size() - outputRead_);
+    memcpy(buffer, output_.data() + outputRead_, n);
+    outputRead_ += n;
+    outputTaken_.notify_all();
+    return n;
+}
+
+void MakeProcess::TakeEvents(std::vector<MakeEvent> *out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::move(events_.begin(), events_.end(), std::back_inserter(*out));
+    events_.clear();
+}
+
+int MakeProcess::Wait()
+{
+    if (exitStatus_ != NotExited) {
+        return exitStatus_;
+    }
+    // Waits without reaping, so that make stays a zombie holding its pid until reaped below,
+    // under the lock Signal() takes.
+    siginfo_t info = {};
+    while (waitid(P_PID, static_cast<id_t>(pid_), &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {
+    }
+    std::lock_guard<std::mutex> lock(waitMutex_);
+    if (exitStatus_ != NotExited) {
+        return exitStatus_;
+    }
+    int status = 0;
+    int r;
+    while ((r = waitpid(pid_, &status, 0)) < 0 && errno == EINTR) {
+    }
+    exitStatus_ = r < 0 ? 127 : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    return exitStatus_;
+}
+
+void MakeProcess::Signal(int signal)
+{
+    std::lock_guard<std::mutex> lock(waitMutex_);
+    if (exitStatus_ == NotExited && pid_ > 0) {
+        kill(-pid_, signal);
+    }
+}
+
+void MakeProcess::Terminate()
+{
+    Signal(SIGTERM);
+}
+
+}}
+
+namespace
+{
+
+MakeProcess* GetMakeProcess(JNIEnv *env, jobject this_)
+{
+    auto process = reinterpret_cast<MakeProcess*>(env->GetLongField(this_, GetRegistry().makeProcess.handle));
+    if (process == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "MakeProcess is already closed.");
+    }
+    return process;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_getDefaultJobCount(JNIEnv */*env*/, jclass /*type*/)
+{
+    return static_cast<jint>(zabuton::build::DefaultJobCount());
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_start(JNIEnv *env, jclass /*type*/, jstring make_, jobjectArray args_,
+                                                   jobjectArray environment_, jstring dir_)
+{
+    std::vector<std::string> args;
+    std::vector<std::string> environment;
+    if (!GetStrings(env, args_, &args) || !GetStrings(env, environment_, &environment)) {
+        return nullptr;
+    }
+    const char *make = env->GetStringUTFChars(make_, nullptr);
+    const char *dir = env->GetStringUTFChars(dir_, nullptr);
+    std::string error;
+    std::unique_ptr<MakeProcess> process = MakeProcess::Start(make, args, environment, dir, &error);
+    env->ReleaseStringUTFChars(make_, make);
+    env->ReleaseStringUTFChars(dir_, dir);
+    if (!process) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    const auto& makeProcess = GetRegistry().makeProcess;
+    jobject object = env->NewObject(makeProcess.clazz, makeProcess.ctor, reinterpret_cast<jlong>(process.get()));
+    if (object != nullptr) {
+        process.release();
+    }
+    return object;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_read(JNIEnv *env, jobject this_, jbyteArray b, jint off, jint len)
+{
+    MakeProcess *process = GetMakeProcess(env, this_);
+    if (process == nullptr) {
+        return -1;
+    }
+    uint8_t buffer[16 * 1024];
+    size_t n = process->ReadOutput(buffer, std::min<size_t>(static_cast<size_t>(len), sizeof(buffer)));
+    if (n == 0) {
+        return -1;
+    }
+    env->SetByteArrayRegion(b, off, static_cast<jsize>(n), reinterpret_cast<const jbyte*>(buffer));
+    return static_cast<jint>(n);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_takeEvents(JNIEnv *env, jobject this_)
+{
+    MakeProcess *process = GetMakeProcess(env, this_);
+    if (process == nullptr) {
+        return nullptr;
+    }
+    std::vector<MakeEvent> events;
+    process->TakeEvents(&events);
+    auto count = static_cast<jsize>(events.size());
+    jintArray kinds = env->NewIntArray(count);
+    jlongArray times = env->NewLongArray(count);
+    jobjectArray targets = env->NewObjectArray(count, GetRegistry().string.clazz, nullptr);
+    if (kinds == nullptr || times == nullptr || targets == nullptr) {
+        return nullptr;
+    }
+    std::vector<jint> kindValues(events.size());
+    std::vector<jlong> timeValues(events.size());
+    for (jsize i = 0; i < count; i++) {
+        kindValues[i] = events[i].kind;
+        timeValues[i] = events[i].timeNanos;
+        jstring target = env->NewStringUTF(events[i].target.c_str());
+        if (target == nullptr) {
+            return nullptr;
+        }
+        env->SetObjectArrayElement(targets, i, target);
+        env->DeleteLocalRef(target);
+    }
+    env->SetIntArrayRegion(kinds, 0, count, kindValues.data());
+    env->SetLongArrayRegion(times, 0, count, timeValues.data());
+    const auto& batch = GetRegistry().makeEventBatch;
+    return env->NewObject(batch.clazz, batch.ctor, count, kinds, targets, times);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_waitFor(JNIEnv *env, jobject this_)
+{
+    MakeProcess *process = GetMakeProcess(env, this_);
+    return process != nullptr ? process->Wait() : -1;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_terminate(JNIEnv *env, jobject this_)
+{
+    MakeProcess *process = GetMakeProcess(env, this_);
+    if (process != nullptr) {
+        process->Terminate();
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_build_MakeProcess_destroy(JNIEnv *env, jobject this_)
+{
+    auto process = reinterpret_cast<MakeProcess*>(env->GetLongField(this_, GetRegistry().makeProcess.handle));
+    if (process != nullptr) {
+        delete process;
+        env->SetLongField(this_, GetRegistry().makeProcess.handle, 0);
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace zabuton { namespace build {
+
+// Kinds shared with MakeEventBatch.java.
+enum MakeEventKind
+{
+    MakeEventStarted,
+    MakeEventFinished,
+    MakeEventFailed,
+};
+
+struct MakeEvent
+{
+    MakeEventKind kind;
+    std::string target;
+    // Since the process was started, CLOCK_MONOTONIC.
+    int64_t timeNanos;
+};
+
+// The number of make jobs that keeps a build on the faster cores: the online cores outside the
+// slowest cluster (by cpuinfo_max_freq), or every online core when they are all alike.
+unsigned int DefaultJobCount();
+
+// A make started with --debug=j, its stdout and stderr sharing one pipe. A reader thread drains
+// the pipe in large chunks, turns make's job lines into MakeEvents (a target starts when make
+// puts its first recipe line on the chain and ends when make removes it) and keeps everything
+// else as output, so the compiler output reaches Java in a few large copies. Once
+// MaxBufferedOutput bytes wait to be read, the reader stops draining the pipe and make blocks
+// until Java catches up. make runs in its own process group, which Terminate() signals as a
+// whole.
+class MakeProcess
+{
+    pid_t pid_;
+    int64_t startNanos_;
+    std::thread reader_;
+    // Set under waitMutex_ when make is reaped, so a signal never reaches a reused process group.
+    std::mutex waitMutex_;
+    std::atomic<int> exitStatus_;
+
+    std::mutex mutex_;
+    std::condition_variable outputReady_;
+    std::condition_variable outputTaken_;
+    std::vector<uint8_t> output_;
+    size_t outputRead_;
+    bool ended_;
+    // The output is dropped instead of waiting for a reader that is gone.
+    bool closing_;
+    std::vector<MakeEvent> events_;
+    // Targets by the address make prints for their child.
+    std::unordered_map<std::string, std::string> children_;
+    std::unordered_map<std::string, bool> failedChildren_;
+
+    MakeProcess();
+    void Read(int fd);
+    void ReadLine(const char *line, size_t size, int64_t now);
+    void Signal(int signal);
+public:
+    static constexpr size_t MaxBufferedOutput = 1024 * 1024;
+
+    MakeProcess(const MakeProcess&) = delete;
+    MakeProcess& operator=(const MakeProcess&) = delete;
+    ~MakeProcess();
+
+    // Runs make with args (without argv[0]) in dir, with env as its whole environment.
+    static std::unique_ptr<MakeProcess> Start(const std::string& make, const std::vector<std::string>& args,
+                                              const std::vector<std::string>& env, const std::string& dir,
+                                              std::string *error);
+
+    // Copies up to size bytes of output, blocking until there is some. Returns 0 at the end.
+    size_t ReadOutput(uint8_t *buffer, size_t size);
+
+    // Moves the events since the last call to out.
+    void TakeEvents(std::vector<MakeEvent> *out);
+
+    // Waits for make to exit; its exit code, or 128 plus the signal that killed it.
+    int Wait();
+
+    void Terminate();
+};
+
+}}
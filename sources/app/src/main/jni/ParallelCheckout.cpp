@@ -0,0 +1,389 @@
+#include "ParallelCheckout.h"
+#include "FileUtil.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+using zabuton::util::CreateDirectories;
+using zabuton::util::SystemError;
+using zabuton::util::WriteFully;
+
+// Below this many changed paths the threads cost more than they save.
+constexpr size_t MinParallelPaths = 64;
+
+std::atomic<unsigned int> checkoutThreads(0);
+
+bool IsCheckoutMode(uint16_t mode)
+{
+    return mode == GIT_FILEMODE_BLOB || mode == GIT_FILEMODE_BLOB_EXECUTABLE
+            || mode == GIT_FILEMODE_LINK || mode == GIT_FILEMODE_COMMIT;
+}
+
+// True when the working tree file at path is the baseline file old as recorded in the index, so
+// replacing or deleting it loses nothing. A racily clean entry never counts as unchanged.
+bool Unchanged(const git_index_entry *entry, const git_diff_file& old, const std::string& path,
+               const timespec& indexMtime)
+{
+    if (entry == nullptr || !git_oid_equal(&entry->id, &old.id) || entry->mode != old.mode) {
+        return false;
+    }
+    if (old.mode == GIT_FILEMODE_COMMIT) {
+        return true;
+    }
+    if (IsRacilyClean(entry, indexMtime)) {
+        return false;
+    }
+    struct stat st = {};
+    return lstat(path.c_str(), &st) == 0
+            && st.st_mtim.tv_sec == entry->mtime.seconds
+            // Without nanosecond support libgit2 stores 0 here.
+            && (entry->mtime.nanoseconds == 0 || static_cast<uint32_t>(st.st_mtim.tv_nsec) == entry->mtime.nanoseconds)
+            && static_cast<uint32_t>(st.st_size) == entry->file_size
+            && S_ISLNK(st.st_mode) == (old.mode == GIT_FILEMODE_LINK)
+            && ((st.st_mode & S_IXUSR) != 0) == (old.mode == GIT_FILEMODE_BLOB_EXECUTABLE);
+}
+
+// A file to write and, once written, its stat data for the index.
+struct CheckoutFile
+{
+    const git_diff_file *file;
+    bool added;
+    struct stat st;
+    bool written;
+};
+
+bool WriteCheckoutFile(git_odb *odb, const std::string& path, CheckoutFile *out, std::string *error)
+{
+    const git_diff_file& file = *out->file;
+    if (file.mode == GIT_FILEMODE_COMMIT) {
+        // A submodule is an empty directory, created with the others.
+        return true;
+    }
+    git_odb_object *blob = nullptr;
+    if (git_odb_read(&blob, odb, &file.id) < 0) {
+        const git_error *e = git_error_last();
+        *error = std::string("Cannot read the blob of ") + file.path + ": " + (e != nullptr ? e->message : "");
+        return false;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_odb_object_free(blob); });
+    const char *data = static_cast<const char*>(git_odb_object_data(blob));
+    size_t size = git_odb_object_size(blob);
+
+    if (file.mode == GIT_FILEMODE_LINK) {
+        std::string target(data, size);
+        if ((!out->added && unlink(path.c_str()) != 0 && errno != ENOENT)
+                || symlink(target.c_str(), path.c_str()) != 0 || lstat(path.c_str(), &out->st) != 0) {
+            *error = SystemError("Cannot create", path);
+            return false;
+        }
+        return true;
+    }
+
+    mode_t mode = file.mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0755 : 0644;
+    // An added path was checked to be absent while planning; O_EXCL keeps it that way.
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (out->added ? O_EXCL : O_TRUNC);
+    int fd = open(path.c_str(), flags, mode);
+    if (fd < 0) {
+        *error = SystemError("Cannot create", path);
+        return false;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { close(fd); });
+    // The mode of an existing file is kept by open, and the executable bit may have changed.
+    if ((!out->added && fchmod(fd, mode) != 0) || !WriteFully(fd, data, size) || fstat(fd, &out->st) != 0) {
+        *error = SystemError("Cannot write", path);
+        return false;
+    }
+    return true;
+}
+
+void FillIndexEntry(const CheckoutFile& f, git_index_entry *entry)
+{
+    *entry = {};
+    entry->path = f.file->path;
+    entry->id = f.file->id;
+    entry->mode = f.file->mode;
+    // Known to match the working tree, so writing the index does not re-check it as racy.
+    entry->flags_extended = GIT_INDEX_ENTRY_UPTODATE;
+    if (f.file->mode == GIT_FILEMODE_COMMIT) {
+        return;
+    }
+    entry->ctime.seconds = static_cast<int32_t>(f.st.st_ctim.tv_sec);
+    entry->ctime.nanoseconds = static_cast<uint32_t>(f.st.st_ctim.tv_nsec);
+    entry->mtime.seconds = static_cast<int32_t>(f.st.st_mtim.tv_sec);
+    entry->mtime.nanoseconds = static_cast<uint32_t>(f.st.st_mtim.tv_nsec);
+    entry->dev = static_cast<uint32_t>(f.st.st_dev);
+    entry->ino = static_cast<uint32_t>(f.st.st_ino);
+    entry->uid = f.st.st_uid;
+    entry->gid = f.st.st_gid;
+    entry->file_size = static_cast<uint32_t>(f.st.st_size);
+}
+
+// Removes the directories leading to path that have become empty, deepest first.
+void RemoveEmptyParents(const std::string& workdir, std::string path)
+{
+    for (size_t slash = path.rfind('/'); slash != std::string::npos && slash > 0; slash = path.rfind('/')) {
+        path.resize(slash);
+        if (rmdir((workdir + path).c_str()) != 0) {
+            return;
+        }
+    }
+}
+
+} // anonymous namespace
+
+void SetCheckoutThreads(unsigned int threads)
+{
+    checkoutThreads = std::min(threads, MaxCheckoutThreads);
+}
+
+unsigned int GetCheckoutThreads()
+{
+    unsigned int threads = checkoutThreads;
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = static_cast<unsigned int>(std::max(1L, std::min<long>(cores, MaxCheckoutThreads)));
+    }
+    return threads;
+}
+
+bool IsRacilyClean(const git_index_entry *entry, const timespec& indexMtime)
+{
+    return entry->mtime.seconds > indexMtime.tv_sec
+            || (entry->mtime.seconds == indexMtime.tv_sec && entry->mtime.nanoseconds >= indexMtime.tv_nsec);
+}
+
+int ParallelCheckout(git_repository *repo, git_tree *baseline, git_tree *target, const git_strarray& pathspecs,
+                     const CheckoutProgress& progress)
+{
+    unsigned int threads = GetCheckoutThreads();
+    const char *workdirPath = git_repository_workdir(repo);
+    if (threads < 2 || workdirPath == nullptr) {
+        return GIT_PASSTHROUGH;
+    }
+    const std::string workdir = workdirPath;
+
+    git_diff_options diffOptions = GIT_DIFF_OPTIONS_INIT;
+    diffOptions.flags = GIT_DIFF_INCLUDE_TYPECHANGE;
+    diffOptions.pathspec = pathspecs;
+    git_diff *diff = nullptr;
+    int r = git_diff_tree_to_tree(&diff, repo, baseline, target, &diffOptions);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_diff_free(diff); });
+    git_index *index = nullptr;
+    r = git_repository_index(&index, repo);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_index_free(index); });
+    r = git_index_read(index, 0);
+    if (r < 0) {
+        return r;
+    }
+    if (git_index_has_conflicts(index) || (baseline == nullptr && git_index_entrycount(index) != 0)) {
+        return GIT_PASSTHROUGH;
+    }
+    struct stat indexSt = {};
+    const char *indexPath = git_index_path(index);
+    timespec indexMtime = indexPath != nullptr && stat(indexPath, &indexSt) == 0 ? indexSt.st_mtim : timespec {};
+
+    // Plan: nothing is written until every path is known to be safe.
+    std::vector<const git_diff_file*> removed;
+    std::vector<CheckoutFile> files;
+    std::string path;
+    size_t deltas = git_diff_num_deltas(diff);
+    files.reserve(deltas);
+    for (size_t i = 0; i < deltas; i++) {
+        const git_diff_delta *delta = git_diff_get_delta(diff, i);
+        path = workdir;
+        switch (delta->status) {
+            case GIT_DELTA_ADDED: {
+                if (!IsCheckoutMode(delta->new_file.mode)) {
+                    return GIT_PASSTHROUGH;
+                }
+                // In a new clone the whole tree is added to an empty directory, where O_EXCL alone
+                // catches a path in the way.
+                if (baseline != nullptr) {
+                    struct stat st = {};
+                    path += delta->new_file.path;
+                    if (git_index_get_bypath(index, delta->new_file.path, 0) != nullptr
+                            || lstat(path.c_str(), &st) == 0 || errno != ENOENT) {
+                        return GIT_PASSTHROUGH;
+                    }
+                }
+                files.push_back(CheckoutFile { &delta->new_file, true, {}, false });
+                break;
+            }
+            case GIT_DELTA_DELETED:
+            case GIT_DELTA_MODIFIED: {
+                path += delta->old_file.path;
+                const git_index_entry *entry = git_index_get_bypath(index, delta->old_file.path, 0);
+                if (!Unchanged(entry, delta->old_file, path, indexMtime)) {
+                    return GIT_PASSTHROUGH;
+                }
+                if (delta->status == GIT_DELTA_DELETED) {
+                    removed.push_back(&delta->old_file);
+                } else if (IsCheckoutMode(delta->new_file.mode)
+                        && (delta->old_file.mode == GIT_FILEMODE_COMMIT) == (delta->new_file.mode == GIT_FILEMODE_COMMIT)) {
+                    files.push_back(CheckoutFile { &delta->new_file, false, {}, false });
+                } else {
+                    return GIT_PASSTHROUGH;
+                }
+                break;
+            }
+            default:
+                return GIT_PASSTHROUGH;
+        }
+    }
+    const size_t totalSteps = removed.size() + files.size();
+    if (totalSteps < MinParallelPaths) {
+        return GIT_PASSTHROUGH;
+    }
+
+    std::string error;
+    std::atomic<size_t> completed(0);
+    // The last chance to cancel. Once a file is touched the checkout runs to the end, or to the
+    // first failure, and the index records what was written, so that the working tree never looks
+    // modified against an index it has moved away from.
+    r = progress(0, totalSteps);
+    if (r < 0) {
+        return r;
+    }
+    std::atomic<bool> failed(false);
+    std::mutex errorMutex;
+    auto fail = [&](std::string message) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!failed.exchange(true)) {
+            error = std::move(message);
+        }
+    };
+
+    // Deletions go first, so that a directory may replace a deleted file of the same name.
+    size_t removedCount = 0;
+    for (const git_diff_file *file : removed) {
+        path = workdir + file->path;
+        bool deleted = file->mode == GIT_FILEMODE_COMMIT ? rmdir(path.c_str()) == 0 || errno == ENOTEMPTY
+                                                         : unlink(path.c_str()) == 0;
+        if (!deleted && errno != ENOENT) {
+            fail(SystemError("Cannot remove", path));
+            break;
+        }
+        RemoveEmptyParents(workdir, file->path);
+        removedCount++;
+        completed++;
+    }
+
+    // Directories are created in one sorted pass, parents first, so the threads never race on
+    // mkdir. A submodule's own directory is named with a trailing '/'.
+    if (!failed) {
+        std::vector<std::string> names;
+        names.reserve(files.size());
+        for (const auto& f : files) {
+            names.emplace_back(f.file->path);
+            if (f.file->mode == GIT_FILEMODE_COMMIT) {
+                names.back() += '/';
+            }
+        }
+        std::vector<const std::string*> namePointers;
+        namePointers.reserve(names.size());
+        for (const auto& name : names) {
+            namePointers.push_back(&name);
+        }
+        std::string directoryError;
+        if (!CreateDirectories(workdir.substr(0, workdir.size() - 1), namePointers, &directoryError)) {
+            fail(std::move(directoryError));
+        }
+    }
+
+    const std::string objectsDir = std::string(git_repository_path(repo)) + "objects";
+    std::atomic<size_t> next(0);
+    // The calling thread works too, and is the only one that reports progress. What the progress
+    // callback returns from here on is too late to stop the checkout.
+    auto worker = [&](bool reporting) {
+        // A git_odb handle is not shared between threads; each opens the object directory itself.
+        git_odb *odb = nullptr;
+        if (git_odb_open(&odb, objectsDir.c_str()) < 0) {
+            const git_error *e = git_error_last();
+            fail(std::string("Cannot open ") + objectsDir + ": " + (e != nullptr ? e->message : ""));
+            return;
+        }
+        ZABUTON_MAKE_SCOPE([&]() { git_odb_free(odb); });
+        std::string filePath = workdir;
+        std::string fileError;
+        for (size_t i = next++; i < files.size(); i = next++) {
+            if (failed.load(std::memory_order_relaxed)) {
+                return;
+            }
+            filePath.resize(workdir.size());
+            filePath += files[i].file->path;
+            if (!WriteCheckoutFile(odb, filePath, &files[i], &fileError)) {
+                fail(std::move(fileError));
+                return;
+            }
+            files[i].written = true;
+            size_t done = ++completed;
+            if (reporting) {
+                progress(done, totalSteps);
+            }
+        }
+    };
+
+    if (!failed) {
+        unsigned int workerCount =
+                std::max(1u, std::min<unsigned int>(threads, static_cast<unsigned int>(files.size())));
+        std::vector<std::thread> workers;
+        workers.reserve(workerCount - 1);
+        for (unsigned int i = 1; i < workerCount; i++) {
+            workers.emplace_back(worker, false);
+        }
+        worker(true);
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    for (size_t i = 0; i < removedCount; i++) {
+        r = git_index_remove(index, removed[i]->path, 0);
+        if (r < 0 && r != GIT_ENOTFOUND) {
+            return r;
+        }
+    }
+    git_index_entry entry;
+    for (const auto& f : files) {
+        if (!f.written) {
+            continue;
+        }
+        FillIndexEntry(f, &entry);
+        r = git_index_add(index, &entry);
+        if (r < 0) {
+            return r;
+        }
+    }
+    r = git_index_write(index);
+    if (r < 0) {
+        return r;
+    }
+    if (failed) {
+        git_error_set_str(GIT_ERROR_OS, error.c_str());
+        return -1;
+    }
+    progress(totalSteps, totalSteps);
+    return 0;
+}
+
+}}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <git2.h>
+#include <cstddef>
+#include <ctime>
+#include <functional>
+
+namespace zabuton { namespace git {
+
+// Threads writing the files of a checkout. With 1 every checkout is left to libgit2; by default
+// as many as there are online cores, at most MaxCheckoutThreads.
+constexpr unsigned int MaxCheckoutThreads = 8;
+void SetCheckoutThreads(unsigned int threads);
+unsigned int GetCheckoutThreads();
+
+// True when entry was written no earlier than indexMtime, the mtime of the index file holding it.
+// The file may then have been modified within the same timestamp without its stat data showing
+// it (racy git), so only its content tells whether it changed.
+bool IsRacilyClean(const git_index_entry *entry, const timespec& indexMtime);
+
+// Called on the calling thread between files with the steps done so far. A negative result stops
+// the checkout and is returned from it, but only before the first file is removed or written.
+using CheckoutProgress = std::function<int(size_t completedSteps, size_t totalSteps)>;
+
+// Moves the working tree and the index of repo from baseline (HEAD's tree, or nullptr for the
+// empty working tree and index of a new clone) to target, limited to pathspecs when not empty.
+//
+// The diff between the two trees is planned up front: every deleted or modified path must still
+// match its index entry by stat data, and no added path may exist. The parent directories of all
+// added files are then created in one sorted pass, the deletions are made, and the blobs are
+// written by a pool of threads, each reading through its own ODB. The index entries are filled
+// from an fstat of the written files, so nothing is stat'ed twice and the next status scan finds
+// the tree clean. When a file cannot be removed or written, the index is still updated with the
+// files that were, before the error is returned.
+//
+// Returns GIT_PASSTHROUGH before anything is touched when the plan finds a path it does not
+// handle (local changes, a file in the way, a type change, a conflicted index), when the change is
+// too small to be worth the threads, or when only one thread is configured. The caller then runs
+// git_checkout_tree instead, which reports or resolves those cases.
+int ParallelCheckout(git_repository *repo, git_tree *baseline, git_tree *target, const git_strarray& pathspecs,
+                     const CheckoutProgress& progress);
+
+}}
@@ -0,0 +1,414 @@
+#include "PathHistory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <utility>
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+struct CommitInfo
+{
+    git_oid tree;
+    int64_t time;
+    std::vector<git_oid> parents;
+};
+
+int ReadCommit(git_repository *repo, const CommitGraph *graph, const git_oid& id, CommitInfo *out)
+{
+    out->parents.clear();
+    uint32_t pos = graph ? graph->Find(id) : CommitGraph::NoPosition;
+    if (pos != CommitGraph::NoPosition) {
+        out->tree = graph->Tree(pos);
+        out->time = graph->CommitTime(pos);
+        for (auto parent = graph->ParentsBegin(pos); parent != graph->ParentsEnd(pos); ++parent) {
+            out->parents.push_back(graph->Id(*parent));
+        }
+        return 0;
+    }
+    git_commit *commit = nullptr;
+    int r = git_commit_lookup(&commit, repo, &id);
+    if (r < 0) {
+        return r;
+    }
+    out->tree = *git_commit_tree_id(commit);
+    out->time = git_commit_time(commit);
+    unsigned int parents = git_commit_parentcount(commit);
+    for (unsigned int i = 0; i < parents; i++) {
+        out->parents.push_back(*git_commit_parent_id(commit, i));
+    }
+    git_commit_free(commit);
+    return 0;
+}
+
+std::vector<std::string> SplitPath(const std::string& path)
+{
+    std::vector<std::string> components;
+    size_t begin = 0;
+    while (begin <= path.size()) {
+        size_t end = std::min(path.find('/', begin), path.size());
+        if (end > begin) {
+            components.push_back(path.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return components;
+}
+
+// The object at path below the root tree.
+int Resolve(git_repository *repo, TreeEntryCache& cache, const git_oid& root,
+            const std::vector<std::string>& components, git_oid *out, bool *found, bool *isTree)
+{
+    *out = root;
+    *found = true;
+    *isTree = true;
+    for (const auto& name : components) {
+        if (!*isTree) {
+            *found = false;
+            return 0;
+        }
+        int r = cache.Lookup(repo, *out, name, out, found, isTree);
+        if (r < 0 || !*found) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+// Whether path is the same in two root trees. The trees are compared one component at a time,
+// so the answer usually comes from the first level a commit left alone, without descending.
+int SamePath(git_repository *repo, TreeEntryCache& cache, const git_oid& a, const git_oid& b,
+             const std::vector<std::string>& components, bool *same)
+{
+    git_oid x = a, y = b;
+    bool xFound = true, yFound = true, xTree = true, yTree = true;
+    for (size_t i = 0; ; i++) {
+        if (xFound == yFound && (!xFound || git_oid_cmp(&x, &y) == 0)) {
+            *same = true;
+            return 0;
+        }
+        if (i == components.size()) {
+            *same = false;
+            return 0;
+        }
+        int r = 0;
+        if (xFound && xTree) {
+            r = cache.Lookup(repo, x, components[i], &x, &xFound, &xTree);
+        } else {
+            xFound = false;
+        }
+        if (r == 0 && yFound && yTree) {
+            r = cache.Lookup(repo, y, components[i], &y, &yFound, &yTree);
+        } else {
+            yFound = false;
+        }
+        if (r < 0) {
+            return r;
+        }
+    }
+}
+
+int CollectHunk(const git_diff_delta* /*delta*/, const git_diff_hunk *hunk, void *payload)
+{
+    static_cast<std::vector<git_diff_hunk>*>(payload)->push_back(*hunk);
+    return 0;
+}
+
+// The changed line ranges between two versions of a file, without context.
+int DiffBlobs(git_repository *repo, const git_oid& oldId, const git_oid& newId, std::vector<git_diff_hunk> *hunks)
+{
+    git_blob *oldBlob = nullptr;
+    git_blob *newBlob = nullptr;
+    int r = git_blob_lookup(&oldBlob, repo, &oldId);
+    if (r == 0) {
+        r = git_blob_lookup(&newBlob, repo, &newId);
+    }
+    if (r == 0) {
+        git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+        opts.flags = GIT_DIFF_FORCE_TEXT;
+        opts.context_lines = 0;
+        opts.interhunk_lines = 0;
+        r = git_diff_blobs(oldBlob, nullptr, newBlob, nullptr, &opts, nullptr, nullptr, CollectHunk, nullptr, hunks);
+    }
+    git_blob_free(newBlob);
+    git_blob_free(oldBlob);
+    return r;
+}
+
+int CountLines(git_repository *repo, const git_oid& id, uint32_t *lines)
+{
+    git_blob *blob = nullptr;
+    int r = git_blob_lookup(&blob, repo, &id);
+    if (r < 0) {
+        return r;
+    }
+    auto data = static_cast<const char*>(git_blob_rawcontent(blob));
+    auto size = static_cast<size_t>(git_blob_rawsize(blob));
+    *lines = static_cast<uint32_t>(std::count(data, data + size, '\n'));
+    if (size > 0 && data[size - 1] != '\n') {
+        ++*lines;
+    }
+    git_blob_free(blob);
+    return 0;
+}
+
+// True when every line of hunk lies before line (1-based) of the new version.
+bool HunkBefore(const git_diff_hunk& hunk, uint32_t line)
+{
+    // A hunk that only deletes starts at the line it deletes after.
+    return hunk.new_lines > 0 ? static_cast<uint32_t>(hunk.new_start + hunk.new_lines) <= line
+                              : static_cast<uint32_t>(hunk.new_start) < line;
+}
+
+} // anonymous namespace
+
+TreeEntryCache::TreeEntryCache(size_t capacity) :
+    capacity_(capacity)
+{
+}
+
+int TreeEntryCache::Lookup(git_repository *repo, const git_oid& tree, const std::string& name,
+                           git_oid *out, bool *found, bool *isTree)
+{
+    std::string key(reinterpret_cast<const char*>(tree.id), GIT_OID_RAWSZ);
+    key += name;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            order_.splice(order_.begin(), order_, it->second.second);
+            const Entry& entry = it->second.first;
+            *out = entry.id;
+            *found = entry.found;
+            *isTree = entry.tree;
+            return 0;
+        }
+    }
+
+    // Trees are read without the lock; two threads missing on the same entry both read it.
+    git_tree *t = nullptr;
+    int r = git_tree_lookup(&t, repo, &tree);
+    if (r < 0) {
+        return r;
+    }
+    Entry entry = {};
+    const git_tree_entry *e = git_tree_entry_byname(t, name.c_str());
+    if (e != nullptr) {
+        entry.id = *git_tree_entry_id(e);
+        entry.found = true;
+        entry.tree = git_tree_entry_type(e) == GIT_OBJECT_TREE;
+    }
+    git_tree_free(t);
+    *out = entry.id;
+    *found = entry.found;
+    *isTree = entry.tree;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.find(key) == entries_.end()) {
+        order_.push_front(key);
+        entries_.emplace(std::move(key), std::make_pair(entry, order_.begin()));
+        if (entries_.size() > capacity_) {
+            entries_.erase(order_.back());
+            order_.pop_back();
+        }
+    }
+    return 0;
+}
+
+int WalkPathHistory(git_repository *repo, const CommitGraph *graph, TreeEntryCache& cache,
+                    const git_oid& start, const std::string& path,
+                    const std::function<bool(const git_oid&)>& emit)
+{
+    const auto components = SplitPath(path);
+
+    // Newest committer time first and first come first on ties, as GIT_SORT_TIME.
+    struct Queued
+    {
+        int64_t time;
+        uint64_t order;
+        git_oid id;
+    };
+    auto older = [](const Queued& a, const Queued& b) {
+        return a.time != b.time ? a.time < b.time : a.order > b.order;
+    };
+    std::vector<Queued> queue;
+    std::unordered_set<git_oid, OidHash, OidEqual> seen;
+    uint64_t order = 0;
+    auto push = [&](const git_oid& id, int64_t time) {
+        if (seen.insert(id).second) {
+            queue.push_back(Queued { time, order++, id });
+            std::push_heap(queue.begin(), queue.end(), older);
+        }
+    };
+
+    CommitInfo commit, parent;
+    int r = ReadCommit(repo, graph, start, &commit);
+    if (r < 0) {
+        return r;
+    }
+    push(start, commit.time);
+    std::vector<std::pair<git_oid, int64_t>> next;
+    while (!queue.empty()) {
+        std::pop_heap(queue.begin(), queue.end(), older);
+        const git_oid id = queue.back().id;
+        queue.pop_back();
+        if ((r = ReadCommit(repo, graph, id, &commit)) < 0) {
+            return r;
+        }
+
+        bool changed = true;
+        if (commit.parents.empty()) {
+            git_oid entry;
+            bool isTree;
+            if ((r = Resolve(repo, cache, commit.tree, components, &entry, &changed, &isTree)) < 0) {
+                return r;
+            }
+        }
+        // Only the side of a merge that brought path as it is can have changed it.
+        next.clear();
+        for (const auto& p : commit.parents) {
+            if ((r = ReadCommit(repo, graph, p, &parent)) < 0) {
+                return r;
+            }
+            bool same;
+            if ((r = SamePath(repo, cache, commit.tree, parent.tree, components, &same)) < 0) {
+                return r;
+            }
+            if (same) {
+                next.assign(1, std::make_pair(p, parent.time));
+                changed = false;
+                break;
+            }
+            next.emplace_back(p, parent.time);
+        }
+        for (const auto& p : next) {
+            push(p.first, p.second);
+        }
+        if (changed && !emit(id)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int BlameFile(git_repository *repo, const CommitGraph *graph, TreeEntryCache& cache,
+              const git_oid& start, const std::string& path, std::vector<BlameRange> *out)
+{
+    const auto components = SplitPath(path);
+    CommitInfo commit, parent;
+    int r = ReadCommit(repo, graph, start, &commit);
+    if (r < 0) {
+        return r;
+    }
+    git_oid blob;
+    bool found, isTree;
+    if ((r = Resolve(repo, cache, commit.tree, components, &blob, &found, &isTree)) < 0) {
+        return r;
+    }
+    if (!found || isTree || components.empty()) {
+        git_error_set_str(GIT_ERROR_INVALID, (path + " is not a file of the commit.").c_str());
+        return GIT_ENOTFOUND;
+    }
+    uint32_t lineCount;
+    if ((r = CountLines(repo, blob, &lineCount)) < 0) {
+        return r;
+    }
+
+    // Lines not yet blamed, by their number in the version being looked at and in the final one.
+    struct Line
+    {
+        uint32_t current;
+        uint32_t final;
+    };
+    std::vector<Line> pending(lineCount);
+    for (uint32_t i = 0; i < lineCount; i++) {
+        pending[i] = Line { i + 1, i + 1 };
+    }
+    std::vector<git_oid> owners(lineCount + 1);
+    auto blameRemaining = [&](const git_oid& id) {
+        for (const auto& line : pending) {
+            owners[line.final] = id;
+        }
+        pending.clear();
+    };
+
+    git_oid id = start;
+    std::vector<Line> remaining;
+    std::vector<git_diff_hunk> hunks;
+    while (!pending.empty()) {
+        bool followed = false;
+        for (const auto& p : commit.parents) {
+            if ((r = ReadCommit(repo, graph, p, &parent)) < 0) {
+                return r;
+            }
+            bool same;
+            if ((r = SamePath(repo, cache, commit.tree, parent.tree, components, &same)) < 0) {
+                return r;
+            }
+            if (same) {
+                id = p;
+                std::swap(commit, parent);
+                followed = true;
+                break;
+            }
+        }
+        if (followed) {
+            continue;
+        }
+        if (commit.parents.empty()) {
+            blameRemaining(id);
+            break;
+        }
+
+        const git_oid first = commit.parents[0];
+        if ((r = ReadCommit(repo, graph, first, &parent)) < 0) {
+            return r;
+        }
+        git_oid parentBlob;
+        if ((r = Resolve(repo, cache, parent.tree, components, &parentBlob, &found, &isTree)) < 0) {
+            return r;
+        }
+        if (!found || isTree) {
+            blameRemaining(id);
+            break;
+        }
+        hunks.clear();
+        if ((r = DiffBlobs(repo, parentBlob, blob, &hunks)) < 0) {
+            return r;
+        }
+        // Lines the diff adds are this commit's; the others move to their place in the parent.
+        remaining.clear();
+        size_t h = 0;
+        int64_t shift = 0;
+        for (const auto& line : pending) {
+            while (h < hunks.size() && HunkBefore(hunks[h], line.current)) {
+                shift += hunks[h].old_lines - hunks[h].new_lines;
+                h++;
+            }
+            if (h < hunks.size() && hunks[h].new_lines > 0 && line.current >= static_cast<uint32_t>(hunks[h].new_start)) {
+                owners[line.final] = id;
+            } else {
+                remaining.push_back(Line { static_cast<uint32_t>(line.current + shift), line.final });
+            }
+        }
+        pending.swap(remaining);
+        id = first;
+        blob = parentBlob;
+        std::swap(commit, parent);
+    }
+
+    out->clear();
+    for (uint32_t line = 1; line <= lineCount; line++) {
+        if (!out->empty() && git_oid_cmp(&out->back().commit, &owners[line]) == 0) {
+            out->back().count++;
+        } else {
+            out->push_back(BlameRange { line, 1, owners[line] });
+        }
+    }
+    return 0;
+}
+
+}}
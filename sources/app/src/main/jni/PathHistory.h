@@ -0,0 +1,66 @@
+#pragma once
+
+#include <git2.h>
+#include "CommitIndex.h"
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+// Entries of trees by name, least recently used first out. Trees are immutable, so what is
+// cached never goes stale and the cache is shared by every handle of a repository session.
+// Keymap paths are a few levels deep and most commits leave the upper trees alone, so path
+// queries mostly hit.
+class TreeEntryCache
+{
+    struct Entry
+    {
+        git_oid id;
+        bool found;
+        bool tree;
+    };
+    using Order = std::list<std::string>;
+
+    std::mutex mutex_;
+    const size_t capacity_;
+    Order order_;
+    std::unordered_map<std::string, std::pair<Entry, Order::iterator>> entries_;
+public:
+    explicit TreeEntryCache(size_t capacity = 64 * 1024);
+    TreeEntryCache(const TreeEntryCache&) = delete;
+    TreeEntryCache& operator=(const TreeEntryCache&) = delete;
+
+    // The entry name of tree, read through repo on a miss. *found is false when the tree has no
+    // such entry; *isTree tells whether the entry is a subtree.
+    int Lookup(git_repository *repo, const git_oid& tree, const std::string& name,
+               git_oid *out, bool *found, bool *isTree);
+};
+
+// Walks the history from start newest first and calls emit(id) for every commit that changed
+// path (a file or a directory, '/' separated), until emit returns false. History is simplified
+// as git log -- path does: a merge that left path as one of its parents had it is skipped along
+// with the other parents' side. Commits are read from graph when it has them.
+int WalkPathHistory(git_repository *repo, const CommitGraph *graph, TreeEntryCache& cache,
+                    const git_oid& start, const std::string& path,
+                    const std::function<bool(const git_oid&)>& emit);
+
+// Lines [start, start + count) (1-based) of a file last changed by commit.
+struct BlameRange
+{
+    uint32_t start;
+    uint32_t count;
+    git_oid commit;
+};
+
+// Assigns each line of the file at path in start to the commit that introduced it, following
+// the same simplified history as WalkPathHistory and the first parent of a merge that changed
+// the file. Renames are not followed: lines of a file that was moved belong to the move.
+int BlameFile(git_repository *repo, const CommitGraph *graph, TreeEntryCache& cache,
+              const git_oid& start, const std::string& path, std::vector<BlameRange> *out);
+
+}}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+
+namespace zabuton { namespace jni {
+
+// Slot layout of the direct buffer shared with io.github.sh4.zabuton.git.ProgressMonitor
+enum ProgressSlot
+{
+    ProgressSlotCompletedSteps,
+    ProgressSlotTotalSteps,
+    ProgressSlotTotalObjects,
+    ProgressSlotIndexedObjects,
+    ProgressSlotReceivedObjects,
+    ProgressSlotLocalObjects,
+    ProgressSlotTotalDeltas,
+    ProgressSlotIndexedDeltas,
+    ProgressSlotReceivedBytes,
+    ProgressSlotCancelled,
+    ProgressSlotCount,
+};
+
+// A long field of a progress class that mirrors a ProgressMonitor slot.
+struct ProgressField
+{
+    const char *name;
+    ProgressSlot slot;
+};
+
+// The tables are the single declaration of the progress fields: the registry resolves their IDs
+// in table order, and the reporters in LibGit2.cpp store them by walking the same tables.
+
+// Fields of CheckoutProgress, ResetProgress and CloneProgress.
+inline constexpr ProgressField CheckoutProgressFieldTable[] = {
+    { "completedSteps", ProgressSlotCompletedSteps },
+    { "totalSteps", ProgressSlotTotalSteps },
+};
+
+// Fields of FetchProgress and CloneProgress, besides sidebandMessage.
+inline constexpr ProgressField FetchProgressFieldTable[] = {
+    { "totalObjects", ProgressSlotTotalObjects },
+    { "indexedObjects", ProgressSlotIndexedObjects },
+    { "receivedObjects", ProgressSlotReceivedObjects },
+    { "localObjects", ProgressSlotLocalObjects },
+    { "totalDeltas", ProgressSlotTotalDeltas },
+    { "indexedDeltas", ProgressSlotIndexedDeltas },
+    { "receivedBytes", ProgressSlotReceivedBytes },
+};
+
+constexpr size_t CheckoutProgressFieldCount = sizeof(CheckoutProgressFieldTable) / sizeof(ProgressField);
+constexpr size_t FetchProgressFieldCount = sizeof(FetchProgressFieldTable) / sizeof(ProgressField);
+
+}}
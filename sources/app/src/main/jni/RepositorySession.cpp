@@ -0,0 +1,196 @@
+#include "RepositorySession.h"
+
+#include <climits>
+#include <cstdlib>
+#include <unordered_map>
+#include <utility>
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+// Idle reader handles kept per session; readers beyond this are freed when they are returned.
+constexpr size_t MaxIdleReaders = 4;
+
+std::mutex sessionsMutex;
+std::unordered_map<int64_t, std::shared_ptr<RepositorySession>> sessionsByHandle;
+std::unordered_map<std::string, std::weak_ptr<RepositorySession>> sessionsByPath;
+int64_t lastHandle = 0;
+
+std::string CanonicalPath(const char *path)
+{
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) == nullptr) {
+        return path;
+    }
+    return resolved;
+}
+
+int64_t RegisterLocked(std::shared_ptr<RepositorySession> session)
+{
+    int64_t handle = ++lastHandle;
+    sessionsByHandle.emplace(handle, std::move(session));
+    return handle;
+}
+
+} // anonymous namespace
+
+RepositoryLease::RepositoryLease(std::shared_ptr<RepositorySession> session, git_repository *repo,
+                                 std::unique_lock<std::mutex> writeLock) :
+    session_(std::move(session)),
+    repo_(repo),
+    writeLock_(std::move(writeLock))
+{
+}
+
+RepositoryLease::RepositoryLease(RepositoryLease&& that) noexcept :
+    session_(std::move(that.session_)),
+    repo_(that.repo_),
+    writeLock_(std::move(that.writeLock_))
+{
+    that.repo_ = nullptr;
+}
+
+RepositoryLease& RepositoryLease::operator=(RepositoryLease&& that) noexcept
+{
+    if (this != &that) {
+        Release();
+        session_ = std::move(that.session_);
+        repo_ = that.repo_;
+        writeLock_ = std::move(that.writeLock_);
+        that.repo_ = nullptr;
+    }
+    return *this;
+}
+
+void RepositoryLease::Release()
+{
+    if (session_ && repo_ != nullptr && !writeLock_.owns_lock()) {
+        session_->ReturnReader(repo_);
+    }
+    repo_ = nullptr;
+    if (writeLock_.owns_lock()) {
+        writeLock_.unlock();
+    }
+    session_.reset();
+}
+
+RepositorySession::RepositorySession(std::string path, git_repository *writer) :
+    path_(std::move(path)),
+    writer_(writer)
+{
+}
+
+RepositorySession::~RepositorySession()
+{
+    for (git_repository *reader : readers_) {
+        git_repository_free(reader);
+    }
+    git_repository_free(writer_);
+}
+
+int RepositorySession::AcquireReader(RepositoryLease *out)
+{
+    git_repository *repo = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(readersMutex_);
+        if (!readers_.empty()) {
+            repo = readers_.back();
+            readers_.pop_back();
+        }
+    }
+    if (repo == nullptr) {
+        int r = git_repository_open(&repo, path_.c_str());
+        if (r < 0) {
+            return r;
+        }
+    }
+    *out = RepositoryLease(shared_from_this(), repo);
+    return 0;
+}
+
+RepositoryLease RepositorySession::AcquireWriter()
+{
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    return RepositoryLease(shared_from_this(), writer_, std::move(lock));
+}
+
+void RepositorySession::ReturnReader(git_repository *repo)
+{
+    {
+        std::lock_guard<std::mutex> lock(readersMutex_);
+        if (readers_.size() < MaxIdleReaders) {
+            readers_.push_back(repo);
+            return;
+        }
+    }
+    git_repository_free(repo);
+}
+
+int OpenSession(int64_t *outHandle, const char *path)
+{
+    std::string key = CanonicalPath(path);
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto found = sessionsByPath.find(key);
+    if (found != sessionsByPath.end()) {
+        if (auto session = found->second.lock()) {
+            *outHandle = RegisterLocked(std::move(session));
+            return 0;
+        }
+    }
+    git_repository *repo = nullptr;
+    int r = git_repository_open(&repo, path);
+    if (r < 0) {
+        return r;
+    }
+    auto session = std::make_shared<RepositorySession>(key, repo);
+    sessionsByPath[key] = session;
+    *outHandle = RegisterLocked(std::move(session));
+    return 0;
+}
+
+int64_t AdoptSession(git_repository *repo, const char *path)
+{
+    std::string key = CanonicalPath(path);
+    auto session = std::make_shared<RepositorySession>(key, repo);
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    sessionsByPath[key] = session;
+    return RegisterLocked(std::move(session));
+}
+
+std::shared_ptr<RepositorySession> FindSession(int64_t handle)
+{
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto found = sessionsByHandle.find(handle);
+    return found != sessionsByHandle.end() ? found->second : nullptr;
+}
+
+void CloseSession(int64_t handle)
+{
+    std::shared_ptr<RepositorySession> session;
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        auto found = sessionsByHandle.find(handle);
+        if (found == sessionsByHandle.end()) {
+            return;
+        }
+        session = std::move(found->second);
+        sessionsByHandle.erase(found);
+        // The path stops sharing the session with its last handle, even while a lease such as a
+        // CommitLogWalker keeps it alive, so the entry does not linger once the lease is gone.
+        for (const auto& entry : sessionsByHandle) {
+            if (entry.second == session) {
+                return;
+            }
+        }
+        auto byPath = sessionsByPath.find(session->Path());
+        if (byPath != sessionsByPath.end()
+                && !byPath->second.owner_before(session) && !session.owner_before(byPath->second)) {
+            sessionsByPath.erase(byPath);
+        }
+    }
+    // The handles are freed here, outside the lock, unless a lease or another handle still uses the session.
+}
+
+}}
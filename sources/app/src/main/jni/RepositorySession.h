@@ -0,0 +1,86 @@
+#pragma once
+
+#include <git2.h>
+#include "CommitIndex.h"
+#include "PathHistory.h"
+#include "StatusCache.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+class RepositorySession;
+
+// A git_repository borrowed from a session. Reader leases go back to the session's pool when
+// released; a writer lease holds the session's write lock for as long as it lives.
+class RepositoryLease
+{
+    std::shared_ptr<RepositorySession> session_;
+    git_repository *repo_;
+    std::unique_lock<std::mutex> writeLock_;
+
+    void Release();
+public:
+    RepositoryLease() : repo_(nullptr) {
+    }
+    RepositoryLease(std::shared_ptr<RepositorySession> session, git_repository *repo,
+                    std::unique_lock<std::mutex> writeLock = std::unique_lock<std::mutex>());
+    RepositoryLease(RepositoryLease&& that) noexcept;
+    RepositoryLease& operator=(RepositoryLease&& that) noexcept;
+    RepositoryLease(const RepositoryLease&) = delete;
+    RepositoryLease& operator=(const RepositoryLease&) = delete;
+    ~RepositoryLease() { Release(); }
+
+    git_repository* Get() const { return repo_; }
+};
+
+// Open handles of one working tree, kept across calls so libgit2's object, ODB and refdb caches
+// stay warm. A git_repository must not be used by two threads at once, so mutating operations
+// are serialized on a single writer handle while read-only queries each borrow a pooled reader.
+class RepositorySession : public std::enable_shared_from_this<RepositorySession>
+{
+    friend class RepositoryLease;
+
+    const std::string path_;
+    git_repository *writer_;
+    std::mutex writeMutex_;
+    std::mutex readersMutex_;
+    std::vector<git_repository*> readers_;
+    StatusCache statusCache_;
+    CommitIndex commitIndex_;
+    TreeEntryCache treeEntryCache_;
+
+    void ReturnReader(git_repository *repo);
+public:
+    RepositorySession(std::string path, git_repository *writer);
+    RepositorySession(const RepositorySession&) = delete;
+    RepositorySession& operator=(const RepositorySession&) = delete;
+    ~RepositorySession();
+
+    const std::string& Path() const { return path_; }
+
+    // Borrows an idle reader handle, opening a new one when every reader is in use.
+    int AcquireReader(RepositoryLease *out);
+    // Waits for the running mutating operation, if any, and borrows the writer handle.
+    RepositoryLease AcquireWriter();
+
+    // Working tree status remembered between scans; shared by every handle on the session.
+    StatusCache& GetStatusCache() { return statusCache_; }
+    // Commit graph for history queries; also shared by every handle.
+    CommitIndex& GetCommitIndex() { return commitIndex_; }
+    TreeEntryCache& GetTreeEntryCache() { return treeEntryCache_; }
+};
+
+// Java holds sessions through opaque handles instead of raw pointers, so that a handle closed on
+// one thread cannot be dereferenced by a call racing on another. Handles are never reused.
+// Opening a path that already has a live session shares it.
+int OpenSession(int64_t *outHandle, const char *path);
+// Takes ownership of a freshly created repository (e.g. by git_clone) opened at path.
+int64_t AdoptSession(git_repository *repo, const char *path);
+std::shared_ptr<RepositorySession> FindSession(int64_t handle);
+void CloseSession(int64_t handle);
+
+}}
@@ -0,0 +1,419 @@
+#include <jni.h>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "SharedRing.h"
+
+using zabuton::util::MonotonicNanos;
+using zabuton::util::SystemError;
+
+namespace zabuton { namespace programmer {
+
+namespace
+{
+
+constexpr int64_t NanosPerMillisecond = 1000000;
+constexpr int64_t NanosPerSecond = 1000000000;
+
+int64_t Deadline(int timeoutMilliseconds)
+{
+    return timeoutMilliseconds < 0 ? INT64_MAX : MonotonicNanos() + timeoutMilliseconds * NanosPerMillisecond;
+}
+
+// Sleeps while *signal is value, until woken or deadline. The futex is not private: the word lives
+// in memory shared with another process. Returns false once the deadline passed.
+bool Wait(uint32_t *signal, uint32_t *waiters, uint32_t value, int64_t deadline)
+{
+    timespec timeout = {};
+    timespec *timeoutPtr = nullptr;
+    if (deadline != INT64_MAX) {
+        int64_t remaining = deadline - MonotonicNanos();
+        if (remaining <= 0) {
+            return false;
+        }
+        timeout.tv_sec = static_cast<time_t>(remaining / NanosPerSecond);
+        timeout.tv_nsec = static_cast<long>(remaining % NanosPerSecond);
+        timeoutPtr = &timeout;
+    }
+    // The waker reads waiters after bumping the signal, so one of us sees the other's store; the
+    // kernel rechecks the signal, so a bump between here and the sleep is not lost either.
+    __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(signal, __ATOMIC_SEQ_CST) == value) {
+        syscall(SYS_futex, signal, FUTEX_WAIT, value, timeoutPtr, nullptr, 0);
+    }
+    __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+void Signal(uint32_t *signal, uint32_t *waiters)
+{
+    __atomic_fetch_add(signal, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, signal, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+size_t MapSize(uint32_t capacity)
+{
+    return sizeof(RingHeader) + 2 * static_cast<size_t>(capacity);
+}
+
+} // anonymous namespace
+
+size_t Ring::Readable() const
+{
+    return __atomic_load_n(&control_->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&control_->tail, __ATOMIC_RELAXED);
+}
+
+ptrdiff_t Ring::AwaitReadable(int timeoutMilliseconds)
+{
+    int64_t deadline = Deadline(timeoutMilliseconds);
+    for (;;) {
+        uint32_t signal = __atomic_load_n(&control_->headSignal, __ATOMIC_SEQ_CST);
+        size_t readable = Readable();
+        if (readable > 0) {
+            return static_cast<ptrdiff_t>(readable);
+        }
+        if (__atomic_load_n(&control_->closed, __ATOMIC_ACQUIRE)) {
+            // The writer may have published its last bytes just before closing.
+            readable = Readable();
+            return readable > 0 ? static_cast<ptrdiff_t>(readable) : -1;
+        }
+        if (!Wait(&control_->headSignal, &control_->headWaiters, signal, deadline)) {
+            return 0;
+        }
+    }
+}
+
+ptrdiff_t Ring::AwaitWritable(int timeoutMilliseconds)
+{
+    int64_t deadline = Deadline(timeoutMilliseconds);
+    for (;;) {
+        uint32_t signal = __atomic_load_n(&control_->tailSignal, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&control_->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        uint32_t tail = __atomic_load_n(&control_->tail, __ATOMIC_ACQUIRE);
+        uint32_t writable = capacity_ - (__atomic_load_n(&control_->head, __ATOMIC_RELAXED) - tail);
+        if (writable > 0) {
+            return writable;
+        }
+        if (!Wait(&control_->tailSignal, &control_->tailWaiters, signal, deadline)) {
+            return 0;
+        }
+    }
+}
+
+void Ring::Consumed(size_t size)
+{
+    __atomic_fetch_add(&control_->tail, static_cast<uint32_t>(size), __ATOMIC_RELEASE);
+    Signal(&control_->tailSignal, &control_->tailWaiters);
+}
+
+void Ring::Produced(size_t size)
+{
+    __atomic_fetch_add(&control_->head, static_cast<uint32_t>(size), __ATOMIC_RELEASE);
+    Signal(&control_->headSignal, &control_->headWaiters);
+}
+
+ptrdiff_t Ring::Read(void *buffer, size_t size, int timeoutMilliseconds)
+{
+    auto out = static_cast<uint8_t*>(buffer);
+    return Read(size, timeoutMilliseconds, [&](const uint8_t *data, size_t n) {
+        memcpy(out, data, n);
+        out += n;
+    });
+}
+
+bool Ring::Write(const void *buffer, size_t size, int timeoutMilliseconds)
+{
+    auto in = static_cast<const uint8_t*>(buffer);
+    return Write(size, timeoutMilliseconds, [&](uint8_t *data, size_t n) {
+        memcpy(data, in, n);
+        in += n;
+    });
+}
+
+void Ring::Close()
+{
+    __atomic_store_n(&control_->closed, 1, __ATOMIC_SEQ_CST);
+    // Waiters on either side wake up and recheck closed.
+    Signal(&control_->headSignal, &control_->headWaiters);
+    Signal(&control_->tailSignal, &control_->tailWaiters);
+}
+
+SharedTransport::SharedTransport(int fd, void *map, size_t mapSize, bool server) :
+    fd_(fd),
+    map_(map),
+    mapSize_(mapSize)
+{
+    auto header = static_cast<RingHeader*>(map);
+    uint8_t *requests = static_cast<uint8_t*>(map) + sizeof(RingHeader);
+    uint8_t *responses = requests + header->capacity;
+    Ring requestRing(&header->requests, requests, header->capacity);
+    Ring responseRing(&header->responses, responses, header->capacity);
+    input_ = server ? requestRing : responseRing;
+    output_ = server ? responseRing : requestRing;
+}
+
+SharedTransport::~SharedTransport()
+{
+    output_.Close();
+    input_.Close();
+    munmap(map_, mapSize_);
+    close(fd_);
+}
+
+std::unique_ptr<SharedTransport> SharedTransport::Create(int fd, uint32_t capacity, std::string *error)
+{
+    uint32_t ringCapacity = MinRingCapacity;
+    while (ringCapacity < capacity && ringCapacity < MaxRingCapacity) {
+        ringCapacity <<= 1;
+    }
+    size_t mapSize = MapSize(ringCapacity);
+    if (ftruncate(fd, static_cast<off_t>(mapSize)) != 0) {
+        *error = SystemError("Cannot resize", "shared ring");
+        return nullptr;
+    }
+    void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        *error = SystemError("Cannot map", "shared ring");
+        return nullptr;
+    }
+    auto header = static_cast<RingHeader*>(map);
+    memset(header, 0, sizeof(RingHeader));
+    header->version = RingVersion;
+    header->capacity = ringCapacity;
+    // Published last: a client that sees the magic sees an initialized header.
+    __atomic_store_n(&header->magic, RingMagic, __ATOMIC_RELEASE);
+    return std::unique_ptr<SharedTransport>(new SharedTransport(fd, map, mapSize, true));
+}
+
+std::unique_ptr<SharedTransport> SharedTransport::Connect(int fd, std::string *error)
+{
+    struct stat st = {};
+    if (fstat(fd, &st) != 0) {
+        *error = SystemError("Cannot stat", "shared ring");
+        return nullptr;
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(RingHeader)) {
+        *error = "Not a shared ring.";
+        return nullptr;
+    }
+    void *map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        *error = SystemError("Cannot map", "shared ring");
+        return nullptr;
+    }
+    auto header = static_cast<RingHeader*>(map);
+    uint32_t capacity = header->capacity;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != RingMagic || header->version != RingVersion
+            || capacity < MinRingCapacity || capacity > MaxRingCapacity || (capacity & (capacity - 1)) != 0
+            || MapSize(capacity) > static_cast<size_t>(st.st_size)) {
+        munmap(map, static_cast<size_t>(st.st_size));
+        *error = "Not a shared ring.";
+        return nullptr;
+    }
+    return std::unique_ptr<SharedTransport>(new SharedTransport(fd, map, static_cast<size_t>(st.st_size), false));
+}
+
+int SharedTransport::CreateMemoryFile(const char *name, std::string *error)
+{
+#ifdef __NR_memfd_create
+    int fd = static_cast<int>(syscall(__NR_memfd_create, name, MFD_CLOEXEC));
+    if (fd >= 0) {
+        return fd;
+    }
+    *error = SystemError("Cannot create", name);
+#else
+    (void)name;
+    *error = "memfd_create is not available.";
+#endif
+    return -1;
+}
+
+}}
+
+using zabuton::jni::GetRegistry;
+using zabuton::programmer::MaxRingCapacity;
+using zabuton::programmer::SharedTransport;
+
+namespace
+{
+
+// A negative jint would wrap to a huge uint32_t and map the largest ring there is.
+bool CheckCapacity(JNIEnv *env, jint capacity)
+{
+    if (capacity <= 0 || static_cast<uint32_t>(capacity) > MaxRingCapacity) {
+        env->ThrowNew(GetRegistry().illegalArgumentException.clazz, "capacity is out of range.");
+        return false;
+    }
+    return true;
+}
+
+SharedTransport* GetSharedTransport(JNIEnv *env, jobject this_)
+{
+    auto transport = reinterpret_cast<SharedTransport*>(env->GetLongField(this_, GetRegistry().sharedMemoryTransport.handle));
+    if (transport == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "SharedMemoryTransport is already closed.");
+    }
+    return transport;
+}
+
+jobject NewSharedMemoryTransport(JNIEnv *env, std::unique_ptr<SharedTransport> transport, const std::string& error)
+{
+    if (!transport) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    const auto& sharedMemoryTransport = GetRegistry().sharedMemoryTransport;
+    jobject object = env->NewObject(sharedMemoryTransport.clazz, sharedMemoryTransport.ctor,
+            reinterpret_cast<jlong>(transport.get()));
+    if (object != nullptr) {
+        transport.release();
+    }
+    return object;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_createInMemory(JNIEnv *env, jclass /*type*/, jint capacity)
+{
+    if (!CheckCapacity(env, capacity)) {
+        return nullptr;
+    }
+    std::string error;
+    int fd = SharedTransport::CreateMemoryFile("zabuton-programmer", &error);
+    if (fd < 0) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    std::unique_ptr<SharedTransport> transport = SharedTransport::Create(fd, static_cast<uint32_t>(capacity), &error);
+    if (!transport) {
+        close(fd);
+    }
+    return NewSharedMemoryTransport(env, std::move(transport), error);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_open(JNIEnv *env, jclass /*type*/, jstring path_,
+                                                                 jint capacity, jboolean create)
+{
+    if (create && !CheckCapacity(env, capacity)) {
+        return nullptr;
+    }
+    const char *path = env->GetStringUTFChars(path_, nullptr);
+    if (path == nullptr) {
+        return nullptr;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { env->ReleaseStringUTFChars(path_, path); });
+    int fd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        env->ThrowNew(GetRegistry().ioException.clazz, SystemError("Cannot open", path).c_str());
+        return nullptr;
+    }
+    std::string error;
+    std::unique_ptr<SharedTransport> transport = create
+            ? SharedTransport::Create(fd, static_cast<uint32_t>(capacity), &error)
+            : SharedTransport::Connect(fd, &error);
+    if (!transport) {
+        close(fd);
+    }
+    return NewSharedMemoryTransport(env, std::move(transport), error);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_getFd(JNIEnv *env, jobject this_)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    return transport != nullptr ? transport->Fd() : -1;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_available(JNIEnv *env, jobject this_)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    return transport != nullptr ? static_cast<jint>(transport->Input().Readable()) : 0;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_read(JNIEnv *env, jobject this_, jbyteArray buffer,
+                                                                 jint offset, jint length)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    if (transport == nullptr) {
+        return -1;
+    }
+    // Copied straight from the mapped ring into the Java array.
+    ptrdiff_t n = transport->Input().Read(static_cast<size_t>(length), -1, [&](const uint8_t *data, size_t size) {
+        env->SetByteArrayRegion(buffer, offset, static_cast<jsize>(size), reinterpret_cast<const jbyte*>(data));
+        offset += static_cast<jint>(size);
+    });
+    return n < 0 ? -1 : static_cast<jint>(n);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_write(JNIEnv *env, jobject this_, jbyteArray buffer,
+                                                                  jint offset, jint length)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    if (transport == nullptr) {
+        return;
+    }
+    bool written = transport->Output().Write(static_cast<size_t>(length), -1, [&](uint8_t *data, size_t size) {
+        env->GetByteArrayRegion(buffer, offset, static_cast<jsize>(size), reinterpret_cast<jbyte*>(data));
+        offset += static_cast<jint>(size);
+    });
+    if (!written) {
+        env->ThrowNew(GetRegistry().ioException.clazz, "The other end closed the shared ring.");
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_closeInput(JNIEnv *env, jobject this_)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    if (transport != nullptr) {
+        transport->Input().Close();
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_closeOutput(JNIEnv *env, jobject this_)
+{
+    SharedTransport *transport = GetSharedTransport(env, this_);
+    if (transport != nullptr) {
+        transport->Output().Close();
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_programmer_SharedMemoryTransport_destroy(JNIEnv *env, jobject this_)
+{
+    auto transport = reinterpret_cast<SharedTransport*>(env->GetLongField(this_, GetRegistry().sharedMemoryTransport.handle));
+    if (transport != nullptr) {
+        delete transport;
+        env->SetLongField(this_, GetRegistry().sharedMemoryTransport.handle, 0);
+    }
+}
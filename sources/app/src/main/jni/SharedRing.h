@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace zabuton { namespace programmer {
+
+// Layout of the shared memory transport between avrdude and FirmwareProgrammerServer. Both
+// processes map the same file (a memfd, or a file avrdude is given the path of):
+//
+//   RingHeader       magic, version, capacity, then the control words of the two rings
+//   requests ring    capacity bytes written by the client (avrdude), read by the server
+//   responses ring   capacity bytes written by the server, read by the client
+//
+// Each ring has one writer and one reader. head counts the bytes ever written and tail the bytes
+// ever read, both wrapping at 2^32; capacity is a power of two. Every write and close bumps
+// headSignal, every read and close tailSignal; a reader waiting for data sleeps on a futex on
+// headSignal and a writer waiting for room on tailSignal, so a side blocked in the other process is
+// woken without a pipe. Either side sets closed when it is done with a ring.
+constexpr uint32_t RingMagic = 0x5A425247;
+constexpr uint32_t RingVersion = 1;
+constexpr uint32_t MinRingCapacity = 4096;
+constexpr uint32_t MaxRingCapacity = 1u << 30;
+
+struct RingControl
+{
+    alignas(64) uint32_t head;
+    uint32_t headSignal;
+    uint32_t headWaiters;
+    alignas(64) uint32_t tail;
+    uint32_t tailSignal;
+    uint32_t tailWaiters;
+    alignas(64) uint32_t closed;
+};
+
+struct RingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    RingControl requests;
+    RingControl responses;
+};
+
+// One direction of the transport, a view into the shared mapping.
+class Ring
+{
+    RingControl *control_;
+    uint8_t *data_;
+    uint32_t capacity_;
+
+    // Waits until the ring holds data (reading) or room (writing). Returns the available bytes,
+    // 0 on timeout, or -1 when closed.
+    ptrdiff_t AwaitReadable(int timeoutMilliseconds);
+    ptrdiff_t AwaitWritable(int timeoutMilliseconds);
+    // Publishes a read or write and wakes the other side if it sleeps.
+    void Consumed(size_t size);
+    void Produced(size_t size);
+public:
+    Ring() : control_(nullptr), data_(nullptr), capacity_(0) {}
+    Ring(RingControl *control, uint8_t *data, uint32_t capacity) : control_(control), data_(data), capacity_(capacity) {}
+
+    // Bytes that can be read without waiting.
+    size_t Readable() const;
+
+    // Waits up to timeoutMilliseconds (forever when negative) until data is readable, then hands
+    // out the readable bytes as up to two contiguous spans (the second when they wrap around) to
+    // consume(const uint8_t*, size_t), limited to size bytes in total. Returns the bytes consumed,
+    // 0 on timeout, or -1 once the writer closed the ring and everything was read.
+    template <typename Consume>
+    ptrdiff_t Read(size_t size, int timeoutMilliseconds, Consume consume);
+
+    // Waits for room and copies all of size bytes in through produce(uint8_t*, size_t), which is
+    // called for up to two spans per chunk. Returns false if the reader closed the ring or the
+    // timeout expired first.
+    template <typename Produce>
+    bool Write(size_t size, int timeoutMilliseconds, Produce produce);
+
+    ptrdiff_t Read(void *buffer, size_t size, int timeoutMilliseconds);
+    bool Write(const void *buffer, size_t size, int timeoutMilliseconds);
+
+    // Marks the ring closed and wakes both sides.
+    void Close();
+};
+
+// An end of the transport: the server reads requests and writes responses, the client the reverse.
+class SharedTransport
+{
+    int fd_;
+    void *map_;
+    size_t mapSize_;
+    Ring input_;
+    Ring output_;
+
+    SharedTransport(int fd, void *map, size_t mapSize, bool server);
+public:
+    SharedTransport(const SharedTransport&) = delete;
+    SharedTransport& operator=(const SharedTransport&) = delete;
+    // Closes both rings: the other side reads the end of the stream and its writes fail.
+    ~SharedTransport();
+
+    // Sizes and initializes the server end in fd (taking ownership of it on success), with rings
+    // of capacity bytes rounded up to a power of two.
+    static std::unique_ptr<SharedTransport> Create(int fd, uint32_t capacity, std::string *error);
+    // Maps the client end of a transport created in fd, taking ownership of it on success.
+    static std::unique_ptr<SharedTransport> Connect(int fd, std::string *error);
+    // An anonymous memfd for Create, or -1 with error set where the kernel lacks memfd_create.
+    static int CreateMemoryFile(const char *name, std::string *error);
+
+    int Fd() const { return fd_; }
+    Ring& Input() { return input_; }
+    Ring& Output() { return output_; }
+};
+
+template <typename Consume>
+ptrdiff_t Ring::Read(size_t size, int timeoutMilliseconds, Consume consume)
+{
+    ptrdiff_t readable = AwaitReadable(timeoutMilliseconds);
+    if (readable <= 0) {
+        return readable;
+    }
+    size = std::min(size, static_cast<size_t>(readable));
+    uint32_t tail = __atomic_load_n(&control_->tail, __ATOMIC_RELAXED);
+    size_t offset = tail & (capacity_ - 1);
+    size_t first = std::min(size, capacity_ - offset);
+    consume(data_ + offset, first);
+    if (first < size) {
+        consume(data_, size - first);
+    }
+    Consumed(size);
+    return static_cast<ptrdiff_t>(size);
+}
+
+template <typename Produce>
+bool Ring::Write(size_t size, int timeoutMilliseconds, Produce produce)
+{
+    while (size > 0) {
+        ptrdiff_t writable = AwaitWritable(timeoutMilliseconds);
+        if (writable <= 0) {
+            return false;
+        }
+        size_t chunk = std::min(size, static_cast<size_t>(writable));
+        uint32_t head = __atomic_load_n(&control_->head, __ATOMIC_RELAXED);
+        size_t offset = head & (capacity_ - 1);
+        size_t first = std::min(chunk, capacity_ - offset);
+        produce(data_ + offset, first);
+        if (first < chunk) {
+            produce(data_, chunk - first);
+        }
+        Produced(chunk);
+        size -= chunk;
+    }
+    return true;
+}
+
+}}
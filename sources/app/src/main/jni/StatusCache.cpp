@@ -0,0 +1,407 @@
+#include "StatusCache.h"
+#include "ParallelCheckout.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace zabuton { namespace git {
+
+namespace
+{
+
+// Options that change which paths show up at all; a cached result is only reused for the same ones.
+constexpr unsigned int StatusScopeFlags = GIT_STATUS_OPT_INCLUDE_UNTRACKED
+        | GIT_STATUS_OPT_INCLUDE_IGNORED
+        | GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
+
+// Git file modes of index entries.
+constexpr uint32_t GitFileModeLink = 0120000;
+constexpr uint32_t GitFileModeExecutable = 0100;
+
+bool SameTime(const timespec& a, const timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+bool NewerThan(const timespec& a, const timespec& b)
+{
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+std::string JoinPath(const std::string& dir, const char *name)
+{
+    return dir.empty() ? std::string(name) : dir + '/' + name;
+}
+
+class Pathspec
+{
+    git_pathspec *pathspec_;
+public:
+    Pathspec() : pathspec_(nullptr) {
+    }
+    Pathspec(const Pathspec&) = delete;
+    Pathspec& operator=(const Pathspec&) = delete;
+    ~Pathspec() {
+        git_pathspec_free(pathspec_);
+    }
+
+    int Init(const git_strarray& paths) {
+        return paths.count == 0 ? 0 : git_pathspec_new(&pathspec_, &paths);
+    }
+
+    const git_pathspec* Get() const { return pathspec_; }
+};
+
+bool InSparseCheckout(const git_pathspec *sparse, const char *path)
+{
+    return sparse == nullptr || git_pathspec_matches_path(sparse, 0, path) == 1;
+}
+
+const char* StatusEntryPath(const git_status_entry *entry)
+{
+    const git_diff_delta *delta = entry->index_to_workdir != nullptr ? entry->index_to_workdir : entry->head_to_index;
+    return delta->old_file.path != nullptr ? delta->old_file.path : delta->new_file.path;
+}
+
+// Calls callback(path, status) for every changed path inside the sparse checkout.
+template <typename TCallback>
+int ForEachStatus(git_repository *repo, unsigned int flags, const git_strarray *pathspec,
+                  const git_pathspec *sparse, TCallback&& callback)
+{
+    git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+    opts.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+    opts.flags = flags | GIT_STATUS_OPT_EXCLUDE_SUBMODULES;
+    if (pathspec != nullptr) {
+        opts.pathspec = *pathspec;
+    }
+    git_status_list *list = nullptr;
+    int r = git_status_list_new(&list, repo, &opts);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_status_list_free(list); });
+    size_t count = git_status_list_entrycount(list);
+    for (size_t i = 0; i < count; i++) {
+        const git_status_entry *entry = git_status_byindex(list, i);
+        if (entry->status == GIT_STATUS_CURRENT) {
+            continue;
+        }
+        const char *path = StatusEntryPath(entry);
+        if (InSparseCheckout(sparse, path)) {
+            callback(path, static_cast<unsigned int>(entry->status));
+        }
+    }
+    return 0;
+}
+
+void ReadFingerprint(git_repository *repo, git_oid *head, timespec *indexMtime)
+{
+    if (git_reference_name_to_id(head, repo, "HEAD") < 0) {
+        memset(head, 0, sizeof(*head));
+    }
+    std::string indexPath = git_repository_path(repo);
+    indexPath += "index";
+    struct stat st = {};
+    *indexMtime = stat(indexPath.c_str(), &st) == 0 ? st.st_mtim : timespec {};
+}
+
+// The repository-wide ignore files, info/exclude and core.excludesFile, with their mtimes. They
+// live outside the working tree, so the walk does not see them change.
+std::string ReadExcludesKey(git_repository *repo)
+{
+    std::vector<std::string> paths;
+    paths.push_back(std::string(git_repository_path(repo)) + "info/exclude");
+    git_config *config = nullptr;
+    if (git_repository_config_snapshot(&config, repo) == 0) {
+        git_buf excludesFile = {};
+        if (git_config_get_path(&excludesFile, config, "core.excludesfile") == 0) {
+            paths.emplace_back(excludesFile.ptr, excludesFile.size);
+        }
+        git_buf_dispose(&excludesFile);
+        git_config_free(config);
+    }
+    git_error_clear();
+    std::string key;
+    for (const auto& path : paths) {
+        struct stat st = {};
+        key += path;
+        if (stat(path.c_str(), &st) == 0) {
+            key += ' ' + std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec)
+                   + ' ' + std::to_string(st.st_size);
+        }
+        key += '\n';
+    }
+    return key;
+}
+
+// Index entries whose stat data differs from the working tree, i.e. the only tracked files
+// that may have changed. libgit2 compares the same fields before hashing a file. Every entry is
+// lstat'ed, not only those in directories with a new mtime: writing to a file in place leaves
+// its directory's mtime unchanged. Racily clean entries are collected too, since their stat
+// data may match a file modified after the index was written.
+int CollectStatDirty(git_repository *repo, const std::string& workdir, const git_pathspec *sparse,
+                     std::vector<std::string> *out)
+{
+    git_index *index = nullptr;
+    int r = git_repository_index(&index, repo);
+    if (r < 0) {
+        return r;
+    }
+    ZABUTON_MAKE_SCOPE([&]() { git_index_free(index); });
+    r = git_index_read(index, 0);
+    if (r < 0) {
+        return r;
+    }
+    struct stat indexSt = {};
+    const char *indexPath = git_index_path(index);
+    timespec indexMtime = indexPath != nullptr && stat(indexPath, &indexSt) == 0 ? indexSt.st_mtim : timespec {};
+    std::string path = workdir;
+    size_t count = git_index_entrycount(index);
+    for (size_t i = 0; i < count; i++) {
+        const git_index_entry *entry = git_index_get_byindex(index, i);
+        if (!InSparseCheckout(sparse, entry->path)) {
+            continue;
+        }
+        path.resize(workdir.size());
+        path += entry->path;
+        struct stat st = {};
+        bool dirty = git_index_entry_stage(entry) != 0
+                || IsRacilyClean(entry, indexMtime)
+                || lstat(path.c_str(), &st) != 0
+                || st.st_mtim.tv_sec != entry->mtime.seconds
+                // Without nanosecond support libgit2 stores 0 here.
+                || (entry->mtime.nanoseconds != 0 && static_cast<uint32_t>(st.st_mtim.tv_nsec) != entry->mtime.nanoseconds)
+                || static_cast<uint32_t>(st.st_size) != entry->file_size
+                || S_ISLNK(st.st_mode) != (entry->mode == GitFileModeLink)
+                || ((st.st_mode & S_IXUSR) != 0) != ((entry->mode & GitFileModeExecutable) != 0);
+        if (dirty) {
+            out->push_back(entry->path);
+        }
+    }
+    return 0;
+}
+
+} // anonymous namespace
+
+struct StatusCache::Walk
+{
+    git_repository *repo;
+    std::string workdir;
+    bool includeIgnored;
+    // Entries of changed directories are collected for the rescan.
+    bool collect;
+    std::unordered_map<std::string, Directory> visited;
+    std::vector<std::string> pathlist;
+    bool ignoreRulesChanged;
+};
+
+StatusCache::StatusCache() :
+    valid_(false),
+    flags_(0),
+    head_(),
+    indexMtime_(),
+    scannedAt_()
+{
+}
+
+void StatusCache::WalkDirectory(Walk *walk, const std::string& dir)
+{
+    std::string fullPath = walk->workdir + dir;
+    struct stat st = {};
+    if (lstat(fullPath.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        // Removed since the last scan; its parent has a new mtime.
+        return;
+    }
+
+    Directory directory;
+    auto cached = directories_.find(dir);
+    if (cached != directories_.end() && SameTime(cached->second.mtime, st.st_mtim)) {
+        directory = std::move(cached->second);
+        if (directory.hasIgnoreFile) {
+            struct stat ignoreSt = {};
+            if (lstat(JoinPath(fullPath, ".gitignore").c_str(), &ignoreSt) != 0
+                    || NewerThan(ignoreSt.st_mtim, scannedAt_)) {
+                walk->ignoreRulesChanged = true;
+            }
+        }
+    } else {
+        directory.mtime = st.st_mtim;
+        directory.hasIgnoreFile = false;
+        const std::vector<std::string> *known = cached != directories_.end() ? &cached->second.subdirectories : nullptr;
+        DIR *d = opendir(fullPath.c_str());
+        if (d != nullptr) {
+            ZABUTON_MAKE_SCOPE([&]() { closedir(d); });
+            while (dirent *ent = readdir(d)) {
+                const char *name = ent->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0) {
+                    continue;
+                }
+                std::string path = JoinPath(dir, name);
+                bool isDirectory = ent->d_type == DT_DIR;
+                if (ent->d_type == DT_UNKNOWN || strcmp(name, ".gitignore") == 0) {
+                    struct stat entrySt = {};
+                    if (lstat((walk->workdir + path).c_str(), &entrySt) != 0) {
+                        continue;
+                    }
+                    isDirectory = S_ISDIR(entrySt.st_mode);
+                    if (!isDirectory && strcmp(name, ".gitignore") == 0) {
+                        directory.hasIgnoreFile = true;
+                        if (NewerThan(entrySt.st_mtim, scannedAt_)) {
+                            walk->ignoreRulesChanged = true;
+                        }
+                    }
+                }
+                if (!isDirectory) {
+                    if (walk->collect) {
+                        walk->pathlist.push_back(std::move(path));
+                    }
+                    continue;
+                }
+                bool isKnown = known != nullptr && std::binary_search(known->begin(), known->end(), path);
+                if (!isKnown) {
+                    int ignored = 0;
+                    if (!walk->includeIgnored
+                            && git_ignore_path_is_ignored(&ignored, walk->repo, (path + '/').c_str()) == 0
+                            && ignored) {
+                        continue;
+                    }
+                    if (walk->collect) {
+                        walk->pathlist.push_back(path);
+                    }
+                }
+                directory.subdirectories.push_back(std::move(path));
+            }
+        }
+        std::sort(directory.subdirectories.begin(), directory.subdirectories.end());
+        if (cached != directories_.end() && cached->second.hasIgnoreFile && !directory.hasIgnoreFile) {
+            walk->ignoreRulesChanged = true;
+        }
+    }
+
+    for (const auto& subdirectory : directory.subdirectories) {
+        WalkDirectory(walk, subdirectory);
+    }
+    walk->visited.emplace(dir, std::move(directory));
+}
+
+int StatusCache::FullScan(git_repository *repo, const git_pathspec *sparse, Walk * /*walk*/)
+{
+    entries_.clear();
+    return ForEachStatus(repo, flags_, nullptr, sparse, [&](const char *path, unsigned int status) {
+        entries_[path] = status;
+    });
+}
+
+int StatusCache::Rescan(git_repository *repo, const git_pathspec *sparse, Walk *walk)
+{
+    std::vector<std::string>& pathlist = walk->pathlist;
+    int r = CollectStatDirty(repo, walk->workdir, sparse, &pathlist);
+    if (r < 0) {
+        return r;
+    }
+    // Paths reported last time are asked again, so that reverted changes disappear.
+    for (const auto& entry : entries_) {
+        std::string path = entry.first;
+        if (!path.empty() && path.back() == '/') {
+            path.pop_back();
+        }
+        pathlist.push_back(std::move(path));
+    }
+    entries_.clear();
+    if (pathlist.empty()) {
+        return 0;
+    }
+    std::sort(pathlist.begin(), pathlist.end());
+    pathlist.erase(std::unique(pathlist.begin(), pathlist.end()), pathlist.end());
+
+    std::vector<char*> strings;
+    strings.reserve(pathlist.size());
+    for (auto& path : pathlist) {
+        strings.push_back(const_cast<char*>(path.c_str()));
+    }
+    git_strarray pathspec = { strings.data(), strings.size() };
+    // Exact paths let libgit2 skip every directory that is not on the list.
+    return ForEachStatus(repo, flags_ | GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH, &pathspec, sparse,
+            [&](const char *path, unsigned int status) {
+                entries_[path] = status;
+            });
+}
+
+int StatusCache::Scan(git_repository *repo, unsigned int flags, const git_strarray& sparsePaths,
+                      std::vector<StatusEntry> *out)
+{
+    const char *workdir = git_repository_workdir(repo);
+    Pathspec sparse;
+    int r = sparse.Init(sparsePaths);
+    if (r < 0) {
+        return r;
+    }
+    if (workdir == nullptr) {
+        // Let libgit2 report the bare repository.
+        return ForEachStatus(repo, flags, nullptr, nullptr, [](const char*, unsigned int) {});
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    flags &= StatusScopeFlags;
+    std::string sparseKey;
+    for (size_t i = 0; i < sparsePaths.count; i++) {
+        sparseKey += sparsePaths.strings[i];
+        sparseKey += '\n';
+    }
+    git_oid head;
+    timespec indexMtime;
+    ReadFingerprint(repo, &head, &indexMtime);
+    std::string excludesKey = ReadExcludesKey(repo);
+    timespec startedAt = {};
+    clock_gettime(CLOCK_REALTIME, &startedAt);
+
+    bool full = !valid_
+            || flags != flags_
+            || sparseKey != sparseKey_
+            || git_oid_cmp(&head, &head_) != 0
+            || !SameTime(indexMtime, indexMtime_)
+            || excludesKey != excludesKey_;
+    Walk walk = { repo, workdir, (flags & GIT_STATUS_OPT_INCLUDE_IGNORED) != 0, !full, {}, {}, false };
+    WalkDirectory(&walk, "");
+    full = full || walk.ignoreRulesChanged;
+
+    valid_ = false;
+    flags_ = flags;
+    r = full ? FullScan(repo, sparse.Get(), &walk) : Rescan(repo, sparse.Get(), &walk);
+    if (r < 0) {
+        entries_.clear();
+        directories_.clear();
+        return r;
+    }
+    directories_ = std::move(walk.visited);
+    sparseKey_ = std::move(sparseKey);
+    head_ = head;
+    indexMtime_ = indexMtime;
+    excludesKey_ = std::move(excludesKey);
+    scannedAt_ = startedAt;
+    valid_ = true;
+
+    out->reserve(out->size() + entries_.size());
+    for (const auto& entry : entries_) {
+        out->push_back(StatusEntry { entry.first, entry.second });
+    }
+    return 0;
+}
+
+int ScanStatus(git_repository *repo, unsigned int flags, const git_strarray& pathspec,
+               const git_strarray& sparsePaths, std::vector<StatusEntry> *out)
+{
+    Pathspec sparse;
+    int r = sparse.Init(sparsePaths);
+    if (r < 0) {
+        return r;
+    }
+    return ForEachStatus(repo, flags, &pathspec, sparse.Get(), [&](const char *path, unsigned int status) {
+        out->push_back(StatusEntry { path, status });
+    });
+}
+
+}}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <git2.h>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zabuton { namespace git {
+
+struct StatusEntry
+{
+    std::string path;
+    unsigned int status; // git_status_t bits
+};
+
+// Working tree status of one repository that is refreshed incrementally. After a full scan, a
+// rescan only stats the directories it knows about and the index entries; libgit2 is then asked
+// about the entries of directories whose mtime changed, the files whose stat data no longer
+// matches the index, and the paths reported last time. A moved HEAD, a rewritten index, changed
+// ignore rules (a .gitignore, info/exclude or core.excludesFile) or different options fall back
+// to a full scan.
+class StatusCache
+{
+    struct Directory
+    {
+        timespec mtime;
+        std::vector<std::string> subdirectories;
+        // Its .gitignore is stat'ed on every rescan, as editing one leaves the directory alone.
+        bool hasIgnoreFile;
+    };
+
+    std::mutex mutex_;
+    bool valid_;
+    unsigned int flags_;
+    std::string sparseKey_;
+    git_oid head_;
+    timespec indexMtime_;
+    std::string excludesKey_;
+    timespec scannedAt_;
+    std::map<std::string, unsigned int> entries_;
+    std::unordered_map<std::string, Directory> directories_;
+
+    struct Walk;
+    void WalkDirectory(Walk *walk, const std::string& dir);
+    int FullScan(git_repository *repo, const git_pathspec *sparse, Walk *walk);
+    int Rescan(git_repository *repo, const git_pathspec *sparse, Walk *walk);
+public:
+    StatusCache();
+    StatusCache(const StatusCache&) = delete;
+    StatusCache& operator=(const StatusCache&) = delete;
+
+    // Status of the whole working tree. flags are git_status_opt_t bits (untracked and ignored
+    // file handling); a non-empty sparsePaths drops everything outside a sparse checkout.
+    int Scan(git_repository *repo, unsigned int flags, const git_strarray& sparsePaths,
+             std::vector<StatusEntry> *out);
+};
+
+// Uncached status of the paths matching pathspec.
+int ScanStatus(git_repository *repo, unsigned int flags, const git_strarray& pathspec,
+               const git_strarray& sparsePaths, std::vector<StatusEntry> *out);
+
+}}
@@ -0,0 +1,695 @@
+#include <jni.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "WorkspaceRegistry.h"
+
+using zabuton::jni::GetRegistry;
+using zabuton::util::ReadFully;
+using zabuton::util::ReplacingFile;
+using zabuton::util::SystemError;
+using zabuton::util::WriteFully;
+using zabuton::workspace::WorkspaceEntry;
+using zabuton::workspace::WorkspaceFilter;
+using zabuton::workspace::WorkspaceKey;
+using zabuton::workspace::WorkspaceRegistry;
+
+namespace zabuton { namespace workspace {
+
+struct RegistryRecord
+{
+    WorkspaceKey id;
+    // Of the strings in the heap; unused in the log, where they follow the record.
+    uint64_t stringsOffset;
+    uint32_t flags;
+    uint32_t nameHash;
+    uint32_t nameLength;
+    uint32_t commentLength;
+    uint32_t kindLength;
+    uint32_t rootLength;
+    // Of a log entry, with this field 0; unused in the table.
+    uint32_t checksum;
+    uint8_t reserved[12];
+};
+
+static_assert(sizeof(RegistryRecord) == 64, "RegistryRecord is part of the file format");
+
+namespace
+{
+
+constexpr uint32_t RegistryMagic = 0x5253575a; // "ZWSR"
+constexpr uint32_t RegistryVersion = 1;
+
+// The workspace is in the trash.
+constexpr uint32_t RecordDeleted = 1;
+// A log entry of a removed workspace.
+constexpr uint32_t RecordRemoved = 2;
+
+struct RegistryHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tableCount;
+    // The table and its heap end here, and the log starts.
+    uint64_t logOffset;
+    uint64_t reserved;
+};
+
+uint32_t Fnv1a(const void *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    auto p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint64_t StringsSize(const RegistryRecord& record)
+{
+    return static_cast<uint64_t>(record.nameLength) + record.commentLength + record.kindLength + record.rootLength;
+}
+
+// A log entry is padded to keep the next record aligned.
+uint64_t EntrySize(const RegistryRecord& record)
+{
+    return sizeof(RegistryRecord) + ((StringsSize(record) + 7) & ~static_cast<uint64_t>(7));
+}
+
+WorkspaceEntry ToEntry(const RegistryRecord& record, const char *strings)
+{
+    WorkspaceEntry entry;
+    entry.id = record.id;
+    entry.deleted = (record.flags & RecordDeleted) != 0;
+    const char *p = strings;
+    entry.name.assign(p, record.nameLength);
+    p += record.nameLength;
+    entry.comment.assign(p, record.commentLength);
+    p += record.commentLength;
+    entry.worktreeKind.assign(p, record.kindLength);
+    p += record.kindLength;
+    entry.worktreeRoot.assign(p, record.rootLength);
+    return entry;
+}
+
+} // anonymous namespace
+
+bool WorkspaceKey::operator==(const WorkspaceKey& other) const
+{
+    return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+}
+
+bool WorkspaceKey::operator<(const WorkspaceKey& other) const
+{
+    return memcmp(bytes, other.bytes, sizeof(bytes)) < 0;
+}
+
+size_t WorkspaceKeyHash::operator()(const WorkspaceKey& key) const
+{
+    // UUIDs are random already.
+    size_t hash;
+    memcpy(&hash, key.bytes + sizeof(key.bytes) - sizeof(hash), sizeof(hash));
+    return hash;
+}
+
+WorkspaceRegistry::WorkspaceRegistry() :
+    fd_(-1),
+    map_(nullptr),
+    mapSize_(0),
+    table_(nullptr),
+    tableCount_(0),
+    heap_(nullptr),
+    heapSize_(0),
+    logEnd_(0)
+{
+}
+
+WorkspaceRegistry::~WorkspaceRegistry()
+{
+    Unmap();
+}
+
+std::unique_ptr<WorkspaceRegistry> WorkspaceRegistry::Open(const std::string& path, std::string *error)
+{
+    if (access(path.c_str(), F_OK) != 0) {
+        if (errno != ENOENT) {
+            *error = SystemError("Failed to access", path);
+            return nullptr;
+        }
+        RegistryHeader header = { RegistryMagic, RegistryVersion, 0, sizeof(RegistryHeader), 0 };
+        ReplacingFile file;
+        if (!file.Open(path, 0600, sizeof(header), error) || !file.Write(&header, sizeof(header), error)
+                || !file.Commit(error)) {
+            return nullptr;
+        }
+    }
+    std::unique_ptr<WorkspaceRegistry> registry(new WorkspaceRegistry());
+    registry->path_ = path;
+    return registry->Map(error) ? std::move(registry) : nullptr;
+}
+
+bool WorkspaceRegistry::Map(std::string *error)
+{
+    fd_ = open(path_.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        *error = SystemError("Failed to open", path_);
+        return false;
+    }
+    const auto size = static_cast<uint64_t>(st.st_size);
+    RegistryHeader header;
+    if (size < sizeof(header) || !ReadFully(fd_, &header, sizeof(header), 0)
+            || header.magic != RegistryMagic || header.version != RegistryVersion
+            || header.logOffset < sizeof(header) || header.logOffset > size
+            || header.tableCount > (header.logOffset - sizeof(header)) / sizeof(RegistryRecord)) {
+        *error = path_ + " is not a workspace registry.";
+        return false;
+    }
+    if (header.logOffset > sizeof(header)) {
+        void *map = mmap(nullptr, static_cast<size_t>(header.logOffset), PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            *error = SystemError("Failed to map", path_);
+            return false;
+        }
+        map_ = map;
+        mapSize_ = static_cast<size_t>(header.logOffset);
+    }
+    if (map_ != nullptr) {
+        tableCount_ = static_cast<size_t>(header.tableCount);
+        table_ = reinterpret_cast<const RegistryRecord*>(static_cast<const char*>(map_) + sizeof(header));
+        heap_ = reinterpret_cast<const char*>(table_ + tableCount_);
+        heapSize_ = mapSize_ - sizeof(header) - tableCount_ * sizeof(RegistryRecord);
+    }
+
+    uint64_t offset = header.logOffset;
+    while (size - offset >= sizeof(RegistryRecord)) {
+        RegistryRecord record;
+        if (!ReadFully(fd_, &record, sizeof(record), offset) || EntrySize(record) > size - offset) {
+            break;
+        }
+        std::string entry(static_cast<size_t>(EntrySize(record)), '\0');
+        if (!ReadFully(fd_, &entry[0], entry.size(), offset)) {
+            break;
+        }
+        memset(&entry[offsetof(RegistryRecord, checksum)], 0, sizeof(record.checksum));
+        if (Fnv1a(entry.data(), entry.size()) != record.checksum) {
+            break;
+        }
+        logIndex_[record.id] = log_.size();
+        log_.push_back(std::move(entry));
+        offset += EntrySize(record);
+    }
+    // What follows the last whole entry was torn by a crash while it was being appended.
+    if (offset < size && ftruncate(fd_, static_cast<off_t>(offset)) != 0) {
+        *error = SystemError("Failed to truncate", path_);
+        return false;
+    }
+    logEnd_ = offset;
+    return true;
+}
+
+void WorkspaceRegistry::Unmap()
+{
+    if (map_ != nullptr) {
+        munmap(map_, mapSize_);
+        map_ = nullptr;
+        mapSize_ = 0;
+    }
+    table_ = nullptr;
+    tableCount_ = 0;
+    heap_ = nullptr;
+    heapSize_ = 0;
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    logEnd_ = 0;
+    log_.clear();
+    logIndex_.clear();
+}
+
+void WorkspaceRegistry::TakeMapping(WorkspaceRegistry *other)
+{
+    Unmap();
+    fd_ = other->fd_;
+    map_ = other->map_;
+    mapSize_ = other->mapSize_;
+    table_ = other->table_;
+    tableCount_ = other->tableCount_;
+    heap_ = other->heap_;
+    heapSize_ = other->heapSize_;
+    logEnd_ = other->logEnd_;
+    log_ = std::move(other->log_);
+    logIndex_ = std::move(other->logIndex_);
+    other->fd_ = -1;
+    other->map_ = nullptr;
+    other->Unmap();
+}
+
+// A table record whose strings lie in the heap. They are checked as they are read, so opening
+// does not touch the table at all.
+bool WorkspaceRegistry::TableView(size_t i, View *out) const
+{
+    const RegistryRecord& record = table_[i];
+    if (record.stringsOffset > heapSize_ || StringsSize(record) > heapSize_ - record.stringsOffset) {
+        return false;
+    }
+    *out = View { &record, heap_ + record.stringsOffset };
+    return true;
+}
+
+bool WorkspaceRegistry::FindLocked(const WorkspaceKey& id, View *out) const
+{
+    auto logged = logIndex_.find(id);
+    if (logged != logIndex_.end()) {
+        const std::string& entry = log_[logged->second];
+        auto record = reinterpret_cast<const RegistryRecord*>(entry.data());
+        *out = View { record, entry.data() + sizeof(RegistryRecord) };
+        return (record->flags & RecordRemoved) == 0;
+    }
+    const RegistryRecord *end = table_ + tableCount_;
+    const RegistryRecord *found = std::lower_bound(table_, end, id,
+            [](const RegistryRecord& record, const WorkspaceKey& key) { return record.id < key; });
+    return found != end && found->id == id && TableView(static_cast<size_t>(found - table_), out);
+}
+
+bool WorkspaceRegistry::Find(const WorkspaceKey& id, WorkspaceEntry *out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    View view;
+    if (!FindLocked(id, &view)) {
+        return false;
+    }
+    *out = ToEntry(*view.record, view.strings);
+    return true;
+}
+
+void WorkspaceRegistry::Scan(const WorkspaceFilter& filter, std::vector<WorkspaceEntry> *out)
+{
+    const uint32_t nameHash = Fnv1a(filter.name.data(), filter.name.size());
+    auto matches = [&](const View& view) {
+        const RegistryRecord& record = *view.record;
+        if (filter.deleted >= 0 && ((record.flags & RecordDeleted) != 0) != (filter.deleted != 0)) {
+            return false;
+        }
+        if (filter.byName && (record.nameHash != nameHash || record.nameLength != filter.name.size()
+                || memcmp(view.strings, filter.name.data(), filter.name.size()) != 0)) {
+            return false;
+        }
+        return filter.comment.empty() ||
+               std::string_view(view.strings + record.nameLength, record.commentLength).find(filter.comment)
+                       != std::string_view::npos;
+    };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < tableCount_; i++) {
+        View view;
+        if (logIndex_.count(table_[i].id) == 0 && TableView(i, &view) && matches(view)) {
+            out->push_back(ToEntry(*view.record, view.strings));
+        }
+    }
+    for (const auto& logged : logIndex_) {
+        const std::string& entry = log_[logged.second];
+        View view = { reinterpret_cast<const RegistryRecord*>(entry.data()), entry.data() + sizeof(RegistryRecord) };
+        if ((view.record->flags & RecordRemoved) == 0 && matches(view)) {
+            out->push_back(ToEntry(*view.record, view.strings));
+        }
+    }
+}
+
+bool WorkspaceRegistry::AppendLocked(const WorkspaceEntry& entry, uint32_t flags, std::string *error)
+{
+    if (fd_ < 0) {
+        *error = path_ + " could not be reopened after compaction; open it again.";
+        return false;
+    }
+    RegistryRecord record = {};
+    record.id = entry.id;
+    record.flags = flags | (entry.deleted ? RecordDeleted : 0);
+    record.nameHash = Fnv1a(entry.name.data(), entry.name.size());
+    record.nameLength = static_cast<uint32_t>(entry.name.size());
+    record.commentLength = static_cast<uint32_t>(entry.comment.size());
+    record.kindLength = static_cast<uint32_t>(entry.worktreeKind.size());
+    record.rootLength = static_cast<uint32_t>(entry.worktreeRoot.size());
+
+    std::string bytes(static_cast<size_t>(EntrySize(record)), '\0');
+    char *p = &bytes[sizeof(record)];
+    for (const std::string *s : { &entry.name, &entry.comment, &entry.worktreeKind, &entry.worktreeRoot }) {
+        p = std::copy(s->begin(), s->end(), p);
+    }
+    memcpy(&bytes[0], &record, sizeof(record));
+    record.checksum = Fnv1a(bytes.data(), bytes.size());
+    memcpy(&bytes[offsetof(RegistryRecord, checksum)], &record.checksum, sizeof(record.checksum));
+
+    if (lseek(fd_, static_cast<off_t>(logEnd_), SEEK_SET) < 0 || !WriteFully(fd_, bytes.data(), bytes.size())
+            || fdatasync(fd_) != 0) {
+        *error = SystemError("Failed to write", path_);
+        // A partial entry would fail its checksum anyway; leave no garbage for the next one.
+        if (ftruncate(fd_, static_cast<off_t>(logEnd_)) != 0) {
+            *error += " and to truncate it";
+        }
+        return false;
+    }
+    logEnd_ += bytes.size();
+    logIndex_[record.id] = log_.size();
+    log_.push_back(std::move(bytes));
+    if (log_.size() >= CompactLogEntries) {
+        // The entry is synced already; a failed compaction only leaves the log longer, and is
+        // tried again on the next write.
+        std::string compactError;
+        CompactLocked(&compactError);
+    }
+    return true;
+}
+
+bool WorkspaceRegistry::PutWorkspace(const WorkspaceKey& id, const std::string& name, const std::string& comment,
+                                     bool deleted, std::string *error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    WorkspaceEntry entry = {};
+    View view;
+    if (FindLocked(id, &view)) {
+        entry = ToEntry(*view.record, view.strings);
+    }
+    entry.id = id;
+    entry.name = name;
+    entry.comment = comment;
+    entry.deleted = deleted;
+    return AppendLocked(entry, 0, error);
+}
+
+bool WorkspaceRegistry::SetWorktree(const WorkspaceKey& id, const std::string& kind, const std::string& root,
+                                    std::string *error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    View view;
+    if (!FindLocked(id, &view)) {
+        return false;
+    }
+    WorkspaceEntry entry = ToEntry(*view.record, view.strings);
+    entry.worktreeKind = kind;
+    entry.worktreeRoot = kind.empty() ? std::string() : root;
+    return AppendLocked(entry, 0, error);
+}
+
+bool WorkspaceRegistry::Remove(const WorkspaceKey& id, std::string *error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    View view;
+    if (!FindLocked(id, &view)) {
+        return false;
+    }
+    WorkspaceEntry entry = {};
+    entry.id = id;
+    return AppendLocked(entry, RecordRemoved, error);
+}
+
+bool WorkspaceRegistry::CompactLocked(std::string *error)
+{
+    std::vector<View> live;
+    live.reserve(tableCount_ + logIndex_.size());
+    for (size_t i = 0; i < tableCount_; i++) {
+        View view;
+        if (logIndex_.count(table_[i].id) == 0 && TableView(i, &view)) {
+            live.push_back(view);
+        }
+    }
+    for (const auto& logged : logIndex_) {
+        const std::string& entry = log_[logged.second];
+        View view = { reinterpret_cast<const RegistryRecord*>(entry.data()), entry.data() + sizeof(RegistryRecord) };
+        if ((view.record->flags & RecordRemoved) == 0) {
+            live.push_back(view);
+        }
+    }
+    std::sort(live.begin(), live.end(), [](const View& a, const View& b) { return a.record->id < b.record->id; });
+
+    std::vector<RegistryRecord> table;
+    table.reserve(live.size());
+    std::string heap;
+    for (const View& view : live) {
+        RegistryRecord record = *view.record;
+        record.stringsOffset = heap.size();
+        record.checksum = 0;
+        table.push_back(record);
+        heap.append(view.strings, static_cast<size_t>(StringsSize(record)));
+    }
+    const size_t tableBytes = table.size() * sizeof(RegistryRecord);
+    RegistryHeader header = { RegistryMagic, RegistryVersion, table.size(),
+                              sizeof(RegistryHeader) + tableBytes + heap.size(), 0 };
+    ReplacingFile file;
+    if (!file.Open(path_, 0600, header.logOffset, error)
+            || !file.Write(&header, sizeof(header), error)
+            || !file.Write(table.data(), tableBytes, error)
+            || !file.Write(heap.data(), heap.size(), error)
+            || !file.Commit(error)) {
+        return false;
+    }
+    // The old mapping and log stay readable until the new file is mapped. Should that fail, the
+    // file descriptor of the replaced file is closed, so that no write is lost to it.
+    WorkspaceRegistry compacted;
+    compacted.path_ = path_;
+    if (!compacted.Map(error)) {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    TakeMapping(&compacted);
+    return true;
+}
+
+bool WorkspaceRegistry::Compact(std::string *error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return CompactLocked(error);
+}
+
+size_t WorkspaceRegistry::LogSize()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return log_.size();
+}
+
+}}
+
+namespace
+{
+
+WorkspaceRegistry* GetWorkspaceRegistry(JNIEnv *env, jobject this_)
+{
+    auto registry = reinterpret_cast<WorkspaceRegistry*>(
+            env->GetLongField(this_, GetRegistry().workspaceRegistry.handle));
+    if (registry == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "WorkspaceRegistry is already closed.");
+    }
+    return registry;
+}
+
+WorkspaceKey ToKey(jlong mostSigBits, jlong leastSigBits)
+{
+    WorkspaceKey key;
+    for (int i = 0; i < 8; i++) {
+        key.bytes[i] = static_cast<uint8_t>(static_cast<uint64_t>(mostSigBits) >> (56 - 8 * i));
+        key.bytes[8 + i] = static_cast<uint8_t>(static_cast<uint64_t>(leastSigBits) >> (56 - 8 * i));
+    }
+    return key;
+}
+
+jlong KeyBits(const WorkspaceKey& key, int offset)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        bits = (bits << 8) | key.bytes[offset + i];
+    }
+    return static_cast<jlong>(bits);
+}
+
+// Copies a java.lang.String, or an empty string for null.
+std::string GetString(JNIEnv *env, jstring value_)
+{
+    if (value_ == nullptr) {
+        return std::string();
+    }
+    const char *value = env->GetStringUTFChars(value_, nullptr);
+    if (value == nullptr) {
+        return std::string();
+    }
+    std::string result(value);
+    env->ReleaseStringUTFChars(value_, value);
+    return result;
+}
+
+jobject NewWorkspaceRecord(JNIEnv *env, const WorkspaceEntry& entry)
+{
+    jstring name = env->NewStringUTF(entry.name.c_str());
+    jstring comment = env->NewStringUTF(entry.comment.c_str());
+    jstring kind = entry.worktreeKind.empty() ? nullptr : env->NewStringUTF(entry.worktreeKind.c_str());
+    jstring root = entry.worktreeKind.empty() ? nullptr : env->NewStringUTF(entry.worktreeRoot.c_str());
+    if (name == nullptr || comment == nullptr || env->ExceptionCheck()) {
+        return nullptr;
+    }
+    const auto& record = GetRegistry().workspaceRecord;
+    jobject object = env->NewObject(record.clazz, record.ctor, KeyBits(entry.id, 0), KeyBits(entry.id, 8),
+            name, comment, entry.deleted ? JNI_TRUE : JNI_FALSE, kind, root);
+    env->DeleteLocalRef(name);
+    env->DeleteLocalRef(comment);
+    env->DeleteLocalRef(kind);
+    env->DeleteLocalRef(root);
+    return object;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_open(JNIEnv *env, jclass /*type*/, jstring path_)
+{
+    std::string error;
+    std::unique_ptr<WorkspaceRegistry> registry = WorkspaceRegistry::Open(GetString(env, path_), &error);
+    if (!registry) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    const auto& workspaceRegistry = GetRegistry().workspaceRegistry;
+    jobject object = env->NewObject(workspaceRegistry.clazz, workspaceRegistry.ctor,
+            reinterpret_cast<jlong>(registry.get()));
+    if (object != nullptr) {
+        registry.release();
+    }
+    return object;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_get(JNIEnv *env, jobject this_, jlong mostSigBits,
+        jlong leastSigBits)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    WorkspaceEntry entry;
+    if (registry == nullptr || !registry->Find(ToKey(mostSigBits, leastSigBits), &entry)) {
+        return nullptr;
+    }
+    return NewWorkspaceRecord(env, entry);
+}
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_scan(JNIEnv *env, jobject this_, jstring name_,
+        jint deleted, jstring comment_)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    if (registry == nullptr) {
+        return nullptr;
+    }
+    WorkspaceFilter filter = { name_ != nullptr, GetString(env, name_), deleted, GetString(env, comment_) };
+    std::vector<WorkspaceEntry> entries;
+    registry->Scan(filter, &entries);
+    const auto& record = GetRegistry().workspaceRecord;
+    jobjectArray records = env->NewObjectArray(static_cast<jsize>(entries.size()), record.clazz, nullptr);
+    if (records == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        jobject object = NewWorkspaceRecord(env, entries[i]);
+        if (object == nullptr) {
+            return nullptr;
+        }
+        env->SetObjectArrayElement(records, static_cast<jsize>(i), object);
+        env->DeleteLocalRef(object);
+    }
+    return records;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_putWorkspace(JNIEnv *env, jobject this_, jlong mostSigBits,
+        jlong leastSigBits, jstring name_, jstring comment_, jboolean deleted)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    if (registry == nullptr) {
+        return;
+    }
+    std::string error;
+    if (!registry->PutWorkspace(ToKey(mostSigBits, leastSigBits), GetString(env, name_), GetString(env, comment_),
+                                deleted == JNI_TRUE, &error)) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+    }
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_setWorktree(JNIEnv *env, jobject this_, jlong mostSigBits,
+        jlong leastSigBits, jstring kind_, jstring root_)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    if (registry == nullptr) {
+        return JNI_FALSE;
+    }
+    std::string error;
+    if (!registry->SetWorktree(ToKey(mostSigBits, leastSigBits), GetString(env, kind_), GetString(env, root_),
+                               &error)) {
+        if (!error.empty()) {
+            env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        }
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_remove(JNIEnv *env, jobject this_, jlong mostSigBits,
+        jlong leastSigBits)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    if (registry == nullptr) {
+        return JNI_FALSE;
+    }
+    std::string error;
+    if (!registry->Remove(ToKey(mostSigBits, leastSigBits), &error)) {
+        if (!error.empty()) {
+            env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        }
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_compact(JNIEnv *env, jobject this_)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    std::string error;
+    if (registry != nullptr && !registry->Compact(&error)) {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+    }
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_getLogSize(JNIEnv *env, jobject this_)
+{
+    WorkspaceRegistry *registry = GetWorkspaceRegistry(env, this_);
+    return registry != nullptr ? static_cast<jint>(registry->LogSize()) : 0;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_workspace_WorkspaceRegistry_destroy(JNIEnv *env, jobject this_)
+{
+    auto registry = reinterpret_cast<WorkspaceRegistry*>(
+            env->GetLongField(this_, GetRegistry().workspaceRegistry.handle));
+    if (registry != nullptr) {
+        delete registry;
+        env->SetLongField(this_, GetRegistry().workspaceRegistry.handle, 0);
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zabuton { namespace workspace {
+
+// A UUID in big-endian byte order, so that ids sort as UUIDs do.
+struct WorkspaceKey
+{
+    uint8_t bytes[16];
+
+    bool operator==(const WorkspaceKey& other) const;
+    bool operator<(const WorkspaceKey& other) const;
+};
+
+struct WorkspaceKeyHash
+{
+    size_t operator()(const WorkspaceKey& key) const;
+};
+
+struct WorkspaceEntry
+{
+    WorkspaceKey id;
+    bool deleted;
+    std::string name;
+    std::string comment;
+    // Empty when the workspace has no worktree.
+    std::string worktreeKind;
+    std::string worktreeRoot;
+};
+
+// What Scan() matches: the workspaces named name (with byName), deleted or not (unless deleted
+// is negative) and with a comment containing comment.
+struct WorkspaceFilter
+{
+    bool byName;
+    std::string name;
+    int deleted;
+    std::string comment;
+};
+
+struct RegistryRecord;
+
+// The workspaces of the app in one file: a table of fixed size records sorted by id, followed
+// by the strings they refer to, and a log of the records written since, each followed by its
+// own strings. Opening maps the table and reads the log, which compaction keeps short, so it
+// takes the same time for ten workspaces as for a thousand. Lookups by id binary search the
+// table, and scans compare names by hash and flags in place, so nothing but the matches is
+// copied out. Writes append to the log; a record torn by a crash fails its checksum and is
+// dropped with everything after it.
+class WorkspaceRegistry
+{
+    // A record with its strings, in the map or in log_.
+    struct View
+    {
+        const RegistryRecord *record;
+        const char *strings;
+    };
+
+    std::mutex mutex_;
+    std::string path_;
+    int fd_;
+    void *map_;
+    size_t mapSize_;
+    const RegistryRecord *table_;
+    size_t tableCount_;
+    const char *heap_;
+    size_t heapSize_;
+    uint64_t logEnd_;
+    // The log entries, and the latest one of each id.
+    std::vector<std::string> log_;
+    std::unordered_map<WorkspaceKey, size_t, WorkspaceKeyHash> logIndex_;
+
+    WorkspaceRegistry();
+    bool Map(std::string *error);
+    void Unmap();
+    // Moves the mapping, file and log of other, which is left empty, replacing these.
+    void TakeMapping(WorkspaceRegistry *other);
+    bool TableView(size_t i, View *out) const;
+    bool FindLocked(const WorkspaceKey& id, View *out) const;
+    bool AppendLocked(const WorkspaceEntry& entry, uint32_t flags, std::string *error);
+    bool CompactLocked(std::string *error);
+public:
+    // Log entries that trigger a compaction, bounding the work of Open().
+    static constexpr size_t CompactLogEntries = 256;
+
+    WorkspaceRegistry(const WorkspaceRegistry&) = delete;
+    WorkspaceRegistry& operator=(const WorkspaceRegistry&) = delete;
+    ~WorkspaceRegistry();
+
+    // Opens the registry at path, creating an empty one if there is none.
+    static std::unique_ptr<WorkspaceRegistry> Open(const std::string& path, std::string *error);
+
+    bool Find(const WorkspaceKey& id, WorkspaceEntry *out);
+    void Scan(const WorkspaceFilter& filter, std::vector<WorkspaceEntry> *out);
+
+    // Adds or replaces a workspace, keeping the worktree it has.
+    bool PutWorkspace(const WorkspaceKey& id, const std::string& name, const std::string& comment, bool deleted,
+                      std::string *error);
+    // Records the worktree of a workspace, or none with an empty kind. Returns false without an
+    // error for an unknown id.
+    bool SetWorktree(const WorkspaceKey& id, const std::string& kind, const std::string& root, std::string *error);
+    // Returns false without an error for an unknown id.
+    bool Remove(const WorkspaceKey& id, std::string *error);
+
+    // Rewrites the file as a table holding the live workspaces only.
+    bool Compact(std::string *error);
+    size_t LogSize();
+};
+
+}}
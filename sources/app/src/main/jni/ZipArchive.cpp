@@ -0,0 +1,892 @@
+#include <jni.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "JniUtil.h"
+#include "ZipArchive.h"
+
+using zabuton::jni::ExtractArchive;
+using zabuton::jni::GetRegistry;
+using zabuton::util::AddExtractedBytes;
+using zabuton::util::CreateDirectories;
+using zabuton::util::ExtractCancelled;
+using zabuton::util::ExtractInParallel;
+using zabuton::util::IsSafeName;
+using zabuton::util::Le16;
+using zabuton::util::Le32;
+using zabuton::util::Le64;
+using zabuton::util::ReadFully;
+using zabuton::util::ReplacingFile;
+using zabuton::util::SystemError;
+using zabuton::util::WriteFully;
+using zabuton::zip::ZipArchive;
+using zabuton::zip::ZipEntry;
+using zabuton::zip::ZipStream;
+
+namespace zabuton { namespace zip {
+
+namespace
+{
+
+constexpr uint32_t EndOfCentralDirectorySignature = 0x06054b50;
+constexpr uint32_t Zip64EndOfCentralDirectorySignature = 0x06064b50;
+constexpr uint32_t Zip64LocatorSignature = 0x07064b50;
+constexpr uint32_t CentralDirectorySignature = 0x02014b50;
+constexpr uint32_t LocalHeaderSignature = 0x04034b50;
+constexpr uint32_t DataDescriptorSignature = 0x08074b50;
+
+constexpr size_t EndOfCentralDirectorySize = 22;
+constexpr size_t Zip64EndOfCentralDirectorySize = 56;
+constexpr size_t Zip64LocatorSize = 20;
+constexpr size_t CentralDirectoryHeaderSize = 46;
+constexpr size_t LocalHeaderSize = 30;
+constexpr size_t MaxCommentSize = 0xffff;
+constexpr uint16_t Zip64ExtraFieldId = 0x0001;
+constexpr uint16_t FlagEncrypted = 1 << 0;
+constexpr uint16_t FlagDataDescriptor = 1 << 3;
+constexpr uint16_t MethodStored = 0;
+constexpr uint16_t MethodDeflated = 8;
+constexpr uint16_t HostUnix = 3;
+
+// Per thread read and write buffer size.
+constexpr size_t ChunkSize = 256 * 1024;
+
+// Reads the sizes and the offset saturated in a central or local header from its zip64 extra
+// field. Only the saturated fields are present, in this order. Returns whether there was one.
+bool ReadZip64Extra(const uint8_t *extra, size_t extraSize, ZipEntry *entry)
+{
+    bool found = false;
+    for (size_t e = 0; e + 4 <= extraSize; ) {
+        uint16_t id = Le16(extra + e);
+        size_t size = Le16(extra + e + 2);
+        if (id == Zip64ExtraFieldId) {
+            const uint8_t *field = extra + e + 4;
+            const uint8_t *end = field + std::min(size, extraSize - e - 4);
+            if (entry->uncompressedSize == 0xffffffff && field + 8 <= end) {
+                entry->uncompressedSize = Le64(field);
+                field += 8;
+            }
+            if (entry->compressedSize == 0xffffffff && field + 8 <= end) {
+                entry->compressedSize = Le64(field);
+                field += 8;
+            }
+            if (entry->localHeaderOffset == 0xffffffff && field + 8 <= end) {
+                entry->localHeaderOffset = Le64(field);
+            }
+            found = true;
+        }
+        e += 4 + size;
+    }
+    return found;
+}
+
+// Rejects what neither ZipArchive nor ZipStream can extract.
+bool CheckEntry(const ZipEntry& entry, uint16_t flags, std::string *error)
+{
+    if (!IsSafeName(entry.name)) {
+        *error = "Unsafe zip entry name: " + entry.name;
+        return false;
+    }
+    if ((flags & FlagEncrypted) != 0) {
+        *error = "Encrypted zip entry: " + entry.name;
+        return false;
+    }
+    if (!entry.IsDirectory() && entry.method != MethodStored && entry.method != MethodDeflated) {
+        *error = "Unsupported zip compression method " + std::to_string(entry.method) + ": " + entry.name;
+        return false;
+    }
+    return true;
+}
+
+// Parses the central directory header at p, of at most available bytes, into entry.
+bool ReadCentralDirectoryHeader(const uint8_t *p, size_t available, ZipEntry *entry, size_t *headerSize,
+                                std::string *error)
+{
+    if (available < CentralDirectoryHeaderSize || Le32(p) != CentralDirectorySignature) {
+        *error = "Corrupt zip central directory.";
+        return false;
+    }
+    size_t nameSize = Le16(p + 28);
+    size_t extraSize = Le16(p + 30);
+    size_t commentSize = Le16(p + 32);
+    if (available - CentralDirectoryHeaderSize < nameSize + extraSize + commentSize) {
+        *error = "Corrupt zip central directory.";
+        return false;
+    }
+    entry->name.assign(reinterpret_cast<const char*>(p + CentralDirectoryHeaderSize), nameSize);
+    entry->method = Le16(p + 10);
+    entry->crc32 = Le32(p + 16);
+    entry->compressedSize = Le32(p + 20);
+    entry->uncompressedSize = Le32(p + 24);
+    entry->localHeaderOffset = Le32(p + 42);
+    entry->mode = (Le16(p + 4) >> 8) == HostUnix ? (Le32(p + 38) >> 16) & 0777 : 0;
+    ReadZip64Extra(p + CentralDirectoryHeaderSize + nameSize, extraSize, entry);
+    *headerSize = CentralDirectoryHeaderSize + nameSize + extraSize + commentSize;
+    return CheckEntry(*entry, Le16(p + 8), error);
+}
+
+} // anonymous namespace
+
+ZipArchive::ZipArchive(int fd, uint64_t base, uint64_t length) :
+    fd_(fd),
+    base_(base),
+    length_(length),
+    uncompressedSize_(0)
+{
+}
+
+ZipArchive::~ZipArchive()
+{
+    close(fd_);
+}
+
+std::unique_ptr<ZipArchive> ZipArchive::Open(int fd, int64_t offset, int64_t length, std::string *error)
+{
+    if (length < 0) {
+        struct stat st = {};
+        if (fstat(fd, &st) != 0) {
+            *error = SystemError("Cannot stat", "zip archive");
+            return nullptr;
+        }
+        length = st.st_size - offset;
+    }
+    if (offset < 0 || length < 0) {
+        *error = "Invalid zip archive range.";
+        return nullptr;
+    }
+    std::unique_ptr<ZipArchive> archive(new ZipArchive(fd, static_cast<uint64_t>(offset), static_cast<uint64_t>(length)));
+    if (!archive->ReadCentralDirectory(error)) {
+        // The caller keeps fd.
+        archive->fd_ = -1;
+        return nullptr;
+    }
+    return archive;
+}
+
+bool ZipArchive::ReadCentralDirectory(std::string *error)
+{
+    size_t tailSize = static_cast<size_t>(std::min<uint64_t>(length_, EndOfCentralDirectorySize + MaxCommentSize));
+    std::vector<uint8_t> tail(tailSize);
+    if (tailSize < EndOfCentralDirectorySize || !ReadFully(fd_, tail.data(), tailSize, base_ + length_ - tailSize)) {
+        *error = "Not a zip archive.";
+        return false;
+    }
+    const uint8_t *eocd = nullptr;
+    for (size_t i = tailSize - EndOfCentralDirectorySize + 1; i-- > 0; ) {
+        if (Le32(&tail[i]) == EndOfCentralDirectorySignature) {
+            eocd = &tail[i];
+            break;
+        }
+    }
+    if (eocd == nullptr) {
+        *error = "Zip end of central directory not found.";
+        return false;
+    }
+    uint64_t entryCount = Le16(eocd + 10);
+    uint64_t directorySize = Le32(eocd + 12);
+    uint64_t directoryOffset = Le32(eocd + 16);
+    if (entryCount == 0xffff || directorySize == 0xffffffff || directoryOffset == 0xffffffff) {
+        const uint8_t *locator = eocd - Zip64LocatorSize;
+        if (eocd - tail.data() >= static_cast<ptrdiff_t>(Zip64LocatorSize) && Le32(locator) == Zip64LocatorSignature) {
+            uint8_t record[Zip64EndOfCentralDirectorySize];
+            uint64_t recordOffset = Le64(locator + 8);
+            if (recordOffset + sizeof(record) > length_ || !ReadFully(fd_, record, sizeof(record), base_ + recordOffset)
+                    || Le32(record) != Zip64EndOfCentralDirectorySignature) {
+                *error = "Corrupt zip64 end of central directory.";
+                return false;
+            }
+            entryCount = Le64(record + 32);
+            directorySize = Le64(record + 40);
+            directoryOffset = Le64(record + 48);
+        }
+    }
+    if (directoryOffset > length_ || directorySize > length_ - directoryOffset) {
+        *error = "Zip central directory is out of range.";
+        return false;
+    }
+
+    std::vector<uint8_t> directory(static_cast<size_t>(directorySize));
+    if (!ReadFully(fd_, directory.data(), directory.size(), base_ + directoryOffset)) {
+        *error = SystemError("Cannot read", "zip central directory");
+        return false;
+    }
+    entries_.reserve(static_cast<size_t>(std::min<uint64_t>(entryCount, directorySize / CentralDirectoryHeaderSize)));
+    size_t pos = 0;
+    for (uint64_t n = 0; n < entryCount; n++) {
+        ZipEntry entry;
+        size_t headerSize = 0;
+        if (!ReadCentralDirectoryHeader(directory.data() + pos, directory.size() - pos, &entry, &headerSize, error)) {
+            return false;
+        }
+        if (!entry.IsDirectory()) {
+            uncompressedSize_ += entry.uncompressedSize;
+        }
+        entries_.push_back(std::move(entry));
+        pos += headerSize;
+    }
+    return true;
+}
+
+bool ZipArchive::ExtractEntry(const ZipEntry& entry, const std::string& path, std::vector<uint8_t> *input,
+                              std::vector<uint8_t> *output, int64_t *slots, std::string *error) const
+{
+    uint8_t header[LocalHeaderSize];
+    if (!ReadFully(fd_, header, sizeof(header), base_ + entry.localHeaderOffset)
+            || Le32(header) != LocalHeaderSignature) {
+        *error = "Corrupt zip local header: " + entry.name;
+        return false;
+    }
+    uint64_t dataOffset = entry.localHeaderOffset + LocalHeaderSize + Le16(header + 26) + Le16(header + 28);
+    if (dataOffset > length_ || entry.compressedSize > length_ - dataOffset) {
+        *error = "Zip entry is out of range: " + entry.name;
+        return false;
+    }
+
+    ReplacingFile out;
+    if (!out.Open(path, entry.mode != 0 ? entry.mode : 0644, entry.uncompressedSize, error)) {
+        return false;
+    }
+
+    uLong crc = crc32(0, nullptr, 0);
+    uint64_t written = 0;
+    uint64_t offset = base_ + dataOffset;
+    uint64_t remaining = entry.compressedSize;
+    auto readChunk = [&](size_t *size) {
+        *size = static_cast<size_t>(std::min<uint64_t>(remaining, input->size()));
+        if (!ReadFully(fd_, input->data(), *size, offset)) {
+            *error = SystemError("Cannot read", entry.name);
+            return false;
+        }
+        offset += *size;
+        remaining -= *size;
+        return true;
+    };
+    auto writeChunk = [&](const uint8_t *data, size_t size) {
+        if (!out.Write(data, size, error)) {
+            return false;
+        }
+        crc = crc32(crc, data, static_cast<uInt>(size));
+        written += size;
+        AddExtractedBytes(slots, size);
+        return true;
+    };
+
+    if (entry.method == MethodStored) {
+        while (remaining > 0) {
+            if (ExtractCancelled(slots)) {
+                return false;
+            }
+            size_t size = 0;
+            if (!readChunk(&size) || !writeChunk(input->data(), size)) {
+                return false;
+            }
+        }
+    } else {
+        z_stream stream = {};
+        // Negative window bits: raw deflate data without a zlib header.
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+            *error = "Cannot initialize zlib.";
+            return false;
+        }
+        ZABUTON_MAKE_SCOPE([&]() { inflateEnd(&stream); });
+        int r = Z_OK;
+        while (r != Z_STREAM_END) {
+            if (ExtractCancelled(slots)) {
+                return false;
+            }
+            if (stream.avail_in == 0) {
+                if (remaining == 0) {
+                    *error = "Truncated zip entry: " + entry.name;
+                    return false;
+                }
+                size_t size = 0;
+                if (!readChunk(&size)) {
+                    return false;
+                }
+                stream.next_in = input->data();
+                stream.avail_in = static_cast<uInt>(size);
+            }
+            stream.next_out = output->data();
+            stream.avail_out = static_cast<uInt>(output->size());
+            r = inflate(&stream, Z_NO_FLUSH);
+            if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+                *error = "Corrupt zip entry: " + entry.name;
+                return false;
+            }
+            if (!writeChunk(output->data(), output->size() - stream.avail_out)) {
+                return false;
+            }
+        }
+    }
+
+    if (written != entry.uncompressedSize || crc != entry.crc32) {
+        *error = "Zip entry checksum mismatch: " + entry.name;
+        return false;
+    }
+    return out.Commit(error);
+}
+
+bool ZipArchive::Extract(const std::string& dir, const std::unordered_set<std::string> *names, unsigned int threads,
+                         int64_t *slots, std::string *error) const
+{
+    std::vector<const std::string*> extracted;
+    std::vector<const ZipEntry*> files;
+    for (const auto& entry : entries_) {
+        if (names != nullptr && names->count(entry.name) == 0) {
+            continue;
+        }
+        extracted.push_back(&entry.name);
+        if (!entry.IsDirectory()) {
+            files.push_back(&entry);
+        }
+    }
+    if (!CreateDirectories(dir, extracted, error)) {
+        return false;
+    }
+
+    // Largest first: the compressed size approximates the inflate cost, and handing out the
+    // big entries early keeps one thread from being left with a large file at the end.
+    std::sort(files.begin(), files.end(), [](const ZipEntry *a, const ZipEntry *b) {
+        return a->compressedSize > b->compressedSize;
+    });
+
+    return ExtractInParallel(files.size(), threads, slots, error, [&]() {
+        return [&, input = std::vector<uint8_t>(ChunkSize), output = std::vector<uint8_t>(ChunkSize)]
+                (size_t i, std::string *entryError) mutable {
+            const ZipEntry& entry = *files[i];
+            return ExtractEntry(entry, dir + '/' + entry.name, &input, &output, slots, entryError);
+        };
+    });
+}
+
+
+ZipStream::ZipStream(std::string dir, std::string spillPath) :
+    dir_(std::move(dir)),
+    spillPath_(std::move(spillPath)),
+    state_(State::LocalHeader),
+    offset_(0),
+    flags_(0),
+    zip64_(false),
+    consumed_(0),
+    written_(0),
+    crc_(0),
+    files_(0),
+    spillFd_(-1)
+{
+}
+
+ZipStream::~ZipStream()
+{
+    if (inflater_) {
+        inflateEnd(inflater_.get());
+    }
+    if (spillFd_ >= 0) {
+        close(spillFd_);
+    }
+}
+
+size_t ZipStream::Buffer(size_t size, const uint8_t *data, size_t available)
+{
+    size_t n = std::min(available, size > buffer_.size() ? size - buffer_.size() : 0);
+    buffer_.insert(buffer_.end(), data, data + n);
+    return n;
+}
+
+bool ZipStream::CreateParent(const std::string& name, std::string *error)
+{
+    size_t slash = !name.empty() && name.back() == '/' ? name.size() - 1 : name.rfind('/');
+    if (slash == std::string::npos || slash == 0 || directories_.count(name.substr(0, slash)) != 0) {
+        return true;
+    }
+    if (!CreateDirectories(dir_, { &name }, error)) {
+        return false;
+    }
+    directories_.insert(name.substr(0, slash));
+    return true;
+}
+
+bool ZipStream::Push(const uint8_t *data, size_t size, int64_t *slots, std::string *error)
+{
+    while (size > 0) {
+        if (ExtractCancelled(slots)) {
+            error->clear();
+            return false;
+        }
+        size_t used = 0;
+        switch (state_) {
+        case State::LocalHeader:
+            if (!ReadLocalHeader(data, size, &used, error)) {
+                return false;
+            }
+            break;
+        case State::Data:
+            if (!ReadData(data, size, &used, slots, error)) {
+                return false;
+            }
+            break;
+        case State::Descriptor:
+            if (!ReadDescriptor(data, size, &used, error)) {
+                return false;
+            }
+            break;
+        case State::Spill:
+            if (!WriteFully(spillFd_, data, size)) {
+                *error = SystemError("Cannot write", spillPath_);
+                return false;
+            }
+            used = size;
+            break;
+        case State::CentralDirectory:
+            buffer_.insert(buffer_.end(), data, data + size);
+            used = size;
+            break;
+        }
+        data += used;
+        size -= used;
+        offset_ += used;
+    }
+    return true;
+}
+
+bool ZipStream::ReadLocalHeader(const uint8_t *data, size_t size, size_t *used, std::string *error)
+{
+    *used = Buffer(4, data, size);
+    if (buffer_.size() < 4) {
+        return true;
+    }
+    uint32_t signature = Le32(buffer_.data());
+    if (signature != LocalHeaderSignature) {
+        if (signature == CentralDirectorySignature || signature == EndOfCentralDirectorySignature) {
+            state_ = State::CentralDirectory;
+            return true;
+        }
+        *error = offset_ + *used == 4 ? "Not a zip archive." : "Corrupt zip local header.";
+        return false;
+    }
+    *used += Buffer(LocalHeaderSize, data + *used, size - *used);
+    if (buffer_.size() < LocalHeaderSize) {
+        return true;
+    }
+    size_t headerSize = LocalHeaderSize + Le16(&buffer_[26]) + Le16(&buffer_[28]);
+    *used += Buffer(headerSize, data + *used, size - *used);
+    if (buffer_.size() < headerSize) {
+        return true;
+    }
+    entry_.localHeaderOffset = offset_ + *used - headerSize;
+    return BeginEntry(error);
+}
+
+bool ZipStream::BeginEntry(std::string *error)
+{
+    const uint8_t *p = buffer_.data();
+    size_t nameSize = Le16(p + 26);
+    uint64_t localHeaderOffset = entry_.localHeaderOffset;
+    entry_ = ZipEntry();
+    entry_.name.assign(reinterpret_cast<const char*>(p + LocalHeaderSize), nameSize);
+    entry_.method = Le16(p + 8);
+    entry_.crc32 = Le32(p + 14);
+    entry_.compressedSize = Le32(p + 18);
+    entry_.uncompressedSize = Le32(p + 22);
+    entry_.mode = 0;
+    flags_ = Le16(p + 6);
+    zip64_ = ReadZip64Extra(p + LocalHeaderSize + nameSize, Le16(p + 28), &entry_);
+    entry_.localHeaderOffset = localHeaderOffset;
+    if (!CheckEntry(entry_, flags_, error) || !CreateParent(entry_.name, error)) {
+        return false;
+    }
+    bool descriptor = (flags_ & FlagDataDescriptor) != 0;
+    if (descriptor && entry_.method == MethodStored) {
+        return BeginSpill(error);
+    }
+    buffer_.clear();
+    consumed_ = 0;
+    written_ = 0;
+    crc_ = static_cast<uint32_t>(crc32(0, nullptr, 0));
+    state_ = State::Data;
+
+    if (!entry_.IsDirectory() && !out_.Open(dir_ + '/' + entry_.name, 0644,
+            descriptor ? 0 : entry_.uncompressedSize, error)) {
+        return false;
+    }
+    if (entry_.method == MethodDeflated) {
+        if (!descriptor && entry_.compressedSize == 0) {
+            *error = "Corrupt zip entry: " + entry_.name;
+            return false;
+        }
+        if (!inflater_) {
+            inflater_.reset(new z_stream());
+            output_.resize(ChunkSize);
+            // Negative window bits: raw deflate data without a zlib header.
+            if (inflateInit2(inflater_.get(), -MAX_WBITS) != Z_OK) {
+                inflater_.reset();
+                *error = "Cannot initialize zlib.";
+                return false;
+            }
+        } else {
+            inflateReset(inflater_.get());
+        }
+    } else if (entry_.compressedSize == 0) {
+        return EndData(error);
+    }
+    return true;
+}
+
+bool ZipStream::BeginSpill(std::string *error)
+{
+    spillFd_ = open(spillPath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (spillFd_ < 0) {
+        *error = SystemError("Cannot create", spillPath_);
+        return false;
+    }
+    unlink(spillPath_.c_str());
+    // Entries before this one are extracted already and left as a hole.
+    if (lseek(spillFd_, static_cast<off_t>(entry_.localHeaderOffset), SEEK_SET) < 0
+            || !WriteFully(spillFd_, buffer_.data(), buffer_.size())) {
+        *error = SystemError("Cannot write", spillPath_);
+        return false;
+    }
+    buffer_.clear();
+    state_ = State::Spill;
+    return true;
+}
+
+bool ZipStream::WriteData(const uint8_t *data, size_t size, int64_t *slots, std::string *error)
+{
+    if (!entry_.IsDirectory() && !out_.Write(data, size, error)) {
+        return false;
+    }
+    crc_ = static_cast<uint32_t>(crc32(crc_, data, static_cast<uInt>(size)));
+    written_ += size;
+    AddExtractedBytes(slots, size);
+    return true;
+}
+
+bool ZipStream::ReadData(const uint8_t *data, size_t size, size_t *used, int64_t *slots, std::string *error)
+{
+    bool descriptor = (flags_ & FlagDataDescriptor) != 0;
+    if (entry_.method == MethodStored) {
+        *used = static_cast<size_t>(std::min<uint64_t>(size, entry_.compressedSize - consumed_));
+        if (!WriteData(data, *used, slots, error)) {
+            return false;
+        }
+        consumed_ += *used;
+        return consumed_ < entry_.compressedSize || EndData(error);
+    }
+
+    z_stream& stream = *inflater_;
+    size_t available = descriptor ? size : static_cast<size_t>(std::min<uint64_t>(size, entry_.compressedSize - consumed_));
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = static_cast<uInt>(std::min<size_t>(available, UINT32_MAX));
+    int r = Z_OK;
+    do {
+        stream.next_out = output_.data();
+        stream.avail_out = static_cast<uInt>(output_.size());
+        r = inflate(&stream, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+            *error = "Corrupt zip entry: " + entry_.name;
+            return false;
+        }
+        if (!WriteData(output_.data(), output_.size() - stream.avail_out, slots, error)) {
+            return false;
+        }
+    } while (r == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    *used = available - stream.avail_in;
+    consumed_ += *used;
+    if (r == Z_STREAM_END) {
+        return EndData(error);
+    }
+    if (!descriptor && consumed_ == entry_.compressedSize) {
+        *error = "Truncated zip entry: " + entry_.name;
+        return false;
+    }
+    return true;
+}
+
+bool ZipStream::EndData(std::string *error)
+{
+    if ((flags_ & FlagDataDescriptor) != 0) {
+        state_ = State::Descriptor;
+        return true;
+    }
+    return EndEntry(entry_.crc32, entry_.compressedSize, entry_.uncompressedSize, error);
+}
+
+bool ZipStream::ReadDescriptor(const uint8_t *data, size_t size, size_t *used, std::string *error)
+{
+    *used = Buffer(4, data, size);
+    if (buffer_.size() < 4) {
+        return true;
+    }
+    // The signature is optional, and the sizes are 8 bytes long in a zip64 entry.
+    size_t begin = Le32(buffer_.data()) == DataDescriptorSignature ? 4 : 0;
+    size_t descriptorSize = begin + (zip64_ ? 20 : 12);
+    *used += Buffer(descriptorSize, data + *used, size - *used);
+    if (buffer_.size() < descriptorSize) {
+        return true;
+    }
+    const uint8_t *p = buffer_.data() + begin;
+    uint32_t crc = Le32(p);
+    uint64_t compressedSize = zip64_ ? Le64(p + 4) : Le32(p + 4);
+    uint64_t uncompressedSize = zip64_ ? Le64(p + 12) : Le32(p + 8);
+    buffer_.clear();
+    return EndEntry(crc, compressedSize, uncompressedSize, error);
+}
+
+bool ZipStream::EndEntry(uint32_t crc, uint64_t compressedSize, uint64_t uncompressedSize, std::string *error)
+{
+    if (consumed_ != compressedSize || written_ != uncompressedSize || crc_ != crc) {
+        *error = "Zip entry checksum mismatch: " + entry_.name;
+        return false;
+    }
+    state_ = State::LocalHeader;
+    if (entry_.IsDirectory()) {
+        return true;
+    }
+    files_++;
+    return out_.Commit(error);
+}
+
+bool ZipStream::SetModes(const ZipEntry& entry, std::string *error) const
+{
+    if (entry.IsDirectory() || entry.mode == 0 || entry.mode == 0644) {
+        return true;
+    }
+    std::string path = dir_ + '/' + entry.name;
+    if (chmod(path.c_str(), entry.mode) != 0) {
+        *error = SystemError("Cannot change the mode of", path);
+        return false;
+    }
+    return true;
+}
+
+bool ZipStream::Finish(unsigned int threads, int64_t *slots, std::string *error)
+{
+    if (state_ == State::Spill) {
+        int fd = spillFd_;
+        spillFd_ = -1;
+        std::unique_ptr<ZipArchive> archive = ZipArchive::Open(fd, 0, static_cast<int64_t>(offset_), error);
+        if (!archive) {
+            close(fd);
+            return false;
+        }
+        std::unordered_set<std::string> names;
+        for (const auto& entry : archive->Entries()) {
+            if (entry.localHeaderOffset >= entry_.localHeaderOffset) {
+                names.insert(entry.name);
+            } else if (!SetModes(entry, error)) {
+                return false;
+            }
+        }
+        return archive->Extract(dir_, &names, threads, slots, error);
+    }
+    if (state_ != State::CentralDirectory) {
+        *error = "Truncated zip archive.";
+        return false;
+    }
+    uint64_t files = 0;
+    for (size_t pos = 0; pos + 4 <= buffer_.size() && Le32(&buffer_[pos]) == CentralDirectorySignature; ) {
+        ZipEntry entry;
+        size_t headerSize = 0;
+        if (!ReadCentralDirectoryHeader(&buffer_[pos], buffer_.size() - pos, &entry, &headerSize, error)
+                || !SetModes(entry, error)) {
+            return false;
+        }
+        files += entry.IsDirectory() ? 0 : 1;
+        pos += headerSize;
+    }
+    if (files != files_) {
+        *error = "Zip entries do not match the central directory.";
+        return false;
+    }
+    return true;
+}
+
+}}
+
+namespace
+{
+
+ZipArchive* GetZipArchive(JNIEnv *env, jobject this_)
+{
+    auto archive = reinterpret_cast<ZipArchive*>(env->GetLongField(this_, GetRegistry().zipArchive.handle));
+    if (archive == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "ZipArchive is already closed.");
+    }
+    return archive;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_ZipArchive_open(JNIEnv *env, jclass /*type*/, jint fd, jlong offset, jlong length)
+{
+    // The archive keeps its own descriptor, so the caller may close the one it passed.
+    int ownFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (ownFd < 0) {
+        env->ThrowNew(GetRegistry().ioException.clazz, strerror(errno));
+        return nullptr;
+    }
+    std::string error;
+    std::unique_ptr<ZipArchive> archive = ZipArchive::Open(ownFd, offset, length, &error);
+    if (!archive) {
+        close(ownFd);
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    const auto& zipArchive = GetRegistry().zipArchive;
+    jobject object = env->NewObject(zipArchive.clazz, zipArchive.ctor, reinterpret_cast<jlong>(archive.get()));
+    if (object != nullptr) {
+        archive.release();
+    }
+    return object;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_util_ZipArchive_getEntryCount(JNIEnv *env, jobject this_)
+{
+    ZipArchive *archive = GetZipArchive(env, this_);
+    return archive != nullptr ? static_cast<jint>(archive->Entries().size()) : 0;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_sh4_zabuton_util_ZipArchive_getUncompressedSize(JNIEnv *env, jobject this_)
+{
+    ZipArchive *archive = GetZipArchive(env, this_);
+    return archive != nullptr ? static_cast<jlong>(archive->UncompressedSize()) : 0;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZipArchive_extract(JNIEnv *env, jobject this_, jstring extractDir_,
+                                                   jobjectArray names_, jint threads)
+{
+    ZipArchive *archive = GetZipArchive(env, this_);
+    if (archive == nullptr) {
+        return;
+    }
+    ExtractArchive(env, this_, GetRegistry().zipArchive.state, extractDir_, names_, "The zip extraction was cancelled.",
+            [&](const std::string& dir, const std::unordered_set<std::string> *names, int64_t *slots, std::string *error) {
+                return archive->Extract(dir, names, static_cast<unsigned int>(std::max(threads, 1)), slots, error);
+            });
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZipArchive_destroy(JNIEnv *env, jobject this_)
+{
+    auto archive = reinterpret_cast<ZipArchive*>(env->GetLongField(this_, GetRegistry().zipArchive.handle));
+    if (archive != nullptr) {
+        delete archive;
+        env->SetLongField(this_, GetRegistry().zipArchive.handle, 0);
+    }
+}
+
+namespace
+{
+
+ZipStream* GetZipStream(JNIEnv *env, jobject this_)
+{
+    auto stream = reinterpret_cast<ZipStream*>(env->GetLongField(this_, GetRegistry().zipStream.handle));
+    if (stream == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "ZipStream is already closed.");
+    }
+    return stream;
+}
+
+int64_t* GetZipStreamSlots(JNIEnv *env, jobject this_)
+{
+    jobject state = env->GetObjectField(this_, GetRegistry().zipStream.state);
+    auto slots = static_cast<int64_t*>(env->GetDirectBufferAddress(state));
+    env->DeleteLocalRef(state);
+    return slots;
+}
+
+void ThrowZipStreamError(JNIEnv *env, const std::string& error)
+{
+    if (error.empty()) {
+        env->ThrowNew(GetRegistry().cancellationException.clazz, "The zip extraction was cancelled.");
+    } else {
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+    }
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_ZipStream_create(JNIEnv *env, jclass /*type*/, jstring extractDir_, jstring spillPath_)
+{
+    const char *extractDir = env->GetStringUTFChars(extractDir_, nullptr);
+    const char *spillPath = env->GetStringUTFChars(spillPath_, nullptr);
+    std::unique_ptr<ZipStream> stream(new ZipStream(extractDir, spillPath));
+    env->ReleaseStringUTFChars(extractDir_, extractDir);
+    env->ReleaseStringUTFChars(spillPath_, spillPath);
+    const auto& zipStream = GetRegistry().zipStream;
+    jobject object = env->NewObject(zipStream.clazz, zipStream.ctor, reinterpret_cast<jlong>(stream.get()));
+    if (object != nullptr) {
+        stream.release();
+    }
+    return object;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZipStream_write(JNIEnv *env, jobject this_, jbyteArray b, jint off, jint len)
+{
+    ZipStream *stream = GetZipStream(env, this_);
+    if (stream == nullptr) {
+        return;
+    }
+    int64_t *slots = GetZipStreamSlots(env, this_);
+    // Copied out in chunks rather than pinned, since inflating and writing a chunk takes a while.
+    uint8_t buffer[16 * 1024];
+    std::string error;
+    while (len > 0) {
+        jint n = std::min<jint>(len, sizeof(buffer));
+        env->GetByteArrayRegion(b, off, n, reinterpret_cast<jbyte*>(buffer));
+        if (env->ExceptionCheck()) {
+            return;
+        }
+        if (!stream->Push(buffer, static_cast<size_t>(n), slots, &error)) {
+            ThrowZipStreamError(env, error);
+            return;
+        }
+        off += n;
+        len -= n;
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZipStream_finish(JNIEnv *env, jobject this_, jint threads)
+{
+    ZipStream *stream = GetZipStream(env, this_);
+    if (stream == nullptr) {
+        return;
+    }
+    std::string error;
+    if (!stream->Finish(static_cast<unsigned int>(std::max(threads, 1)), GetZipStreamSlots(env, this_), &error)) {
+        ThrowZipStreamError(env, error);
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZipStream_destroy(JNIEnv *env, jobject this_)
+{
+    auto stream = reinterpret_cast<ZipStream*>(env->GetLongField(this_, GetRegistry().zipStream.handle));
+    if (stream != nullptr) {
+        delete stream;
+        env->SetLongField(this_, GetRegistry().zipStream.handle, 0);
+    }
+}
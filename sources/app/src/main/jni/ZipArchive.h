@@ -0,0 +1,127 @@
+#pragma once
+
+#include "FileUtil.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct z_stream_s;
+
+namespace zabuton { namespace zip {
+
+struct ZipEntry
+{
+    std::string name;
+    uint64_t localHeaderOffset;
+    uint64_t compressedSize;
+    uint64_t uncompressedSize;
+    uint32_t crc32;
+    uint16_t method;
+    // Permission bits recorded by a Unix zip, or 0.
+    uint32_t mode;
+
+    bool IsDirectory() const { return !name.empty() && name.back() == '/'; }
+};
+
+// A zip archive read through random access on a file descriptor. The central directory is parsed
+// once, so entries can be located and inflated independently of each other.
+class ZipArchive
+{
+    int fd_;
+    uint64_t base_;
+    uint64_t length_;
+    std::vector<ZipEntry> entries_;
+    uint64_t uncompressedSize_;
+
+    ZipArchive(int fd, uint64_t base, uint64_t length);
+    bool ReadCentralDirectory(std::string *error);
+    bool ExtractEntry(const ZipEntry& entry, const std::string& path, std::vector<uint8_t> *input,
+                      std::vector<uint8_t> *output, int64_t *slots, std::string *error) const;
+public:
+    ZipArchive(const ZipArchive&) = delete;
+    ZipArchive& operator=(const ZipArchive&) = delete;
+    ~ZipArchive();
+
+    // Takes ownership of fd on success. The archive spans length bytes from offset (up to the end
+    // of the file when length is negative), e.g. an uncompressed asset inside an APK.
+    static std::unique_ptr<ZipArchive> Open(int fd, int64_t offset, int64_t length, std::string *error);
+
+    const std::vector<ZipEntry>& Entries() const { return entries_; }
+    uint64_t UncompressedSize() const { return uncompressedSize_; }
+
+    // Extracts the entries named in names, or every entry when names is null, below dir with the
+    // given number of threads. Entries are handed out largest first, so the threads finish at
+    // about the same time. Each file is written next to its destination and renamed over it, so
+    // files of a tree in use are replaced, never truncated. slots (ExtractSlotCount values) receive
+    // the progress and are polled for cancellation. Returns false with error set on failure, or
+    // with an empty error when cancelled.
+    bool Extract(const std::string& dir, const std::unordered_set<std::string> *names, unsigned int threads,
+                 int64_t *slots, std::string *error) const;
+};
+
+// A zip archive extracted while it is being received, such as an HTTP download. Entries are
+// read from their local headers in order and inflated as their bytes arrive, so nothing but the
+// central directory is kept. A stored entry followed by a data descriptor has no length to find
+// its end by; from such an entry on, the stream is written to spillPath at its archive offsets
+// (a sparse file, unlinked as soon as it is created) and the rest is extracted from the central
+// directory by Finish(). Push() and Finish() must not race; slots are as for ZipArchive.
+class ZipStream
+{
+    enum class State
+    {
+        LocalHeader,
+        Data,
+        Descriptor,
+        Spill,
+        CentralDirectory,
+    };
+
+    std::string dir_;
+    std::string spillPath_;
+    State state_;
+    uint64_t offset_;
+    // The header being read, or the central directory once the entries are over.
+    std::vector<uint8_t> buffer_;
+    ZipEntry entry_;
+    uint16_t flags_;
+    bool zip64_;
+    uint64_t consumed_;
+    uint64_t written_;
+    uint32_t crc_;
+    util::ReplacingFile out_;
+    std::unique_ptr<z_stream_s> inflater_;
+    std::vector<uint8_t> output_;
+    std::unordered_set<std::string> directories_;
+    uint64_t files_;
+    int spillFd_;
+
+    size_t Buffer(size_t size, const uint8_t *data, size_t available);
+    bool CreateParent(const std::string& name, std::string *error);
+    bool ReadLocalHeader(const uint8_t *data, size_t size, size_t *used, std::string *error);
+    bool BeginEntry(std::string *error);
+    bool BeginSpill(std::string *error);
+    bool ReadData(const uint8_t *data, size_t size, size_t *used, int64_t *slots, std::string *error);
+    bool WriteData(const uint8_t *data, size_t size, int64_t *slots, std::string *error);
+    bool EndData(std::string *error);
+    bool ReadDescriptor(const uint8_t *data, size_t size, size_t *used, std::string *error);
+    bool EndEntry(uint32_t crc, uint64_t compressedSize, uint64_t uncompressedSize, std::string *error);
+    bool SetModes(const ZipEntry& entry, std::string *error) const;
+public:
+    ZipStream(std::string dir, std::string spillPath);
+    ZipStream(const ZipStream&) = delete;
+    ZipStream& operator=(const ZipStream&) = delete;
+    ~ZipStream();
+
+    // Extracts what size more bytes of the archive complete. Returns false with error set on
+    // failure, or with an empty error when cancelled.
+    bool Push(const uint8_t *data, size_t size, int64_t *slots, std::string *error);
+
+    // Called at the end of the stream: checks that the entries extracted are those of the central
+    // directory and applies their permission bits, after extracting the spilled entries, if any,
+    // on the given number of threads.
+    bool Finish(unsigned int threads, int64_t *slots, std::string *error);
+};
+
+}}
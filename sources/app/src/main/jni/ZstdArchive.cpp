@@ -0,0 +1,421 @@
+#include <jni.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "FileUtil.h"
+#include "JniRegistry.h"
+#include "JniUtil.h"
+#include "ZstdArchive.h"
+
+using zabuton::jni::ExtractArchive;
+using zabuton::jni::GetRegistry;
+using zabuton::util::AddExtractedBytes;
+using zabuton::util::CreateDirectories;
+using zabuton::util::ExtractCancelled;
+using zabuton::util::ExtractInParallel;
+using zabuton::util::IsSafeName;
+using zabuton::util::Le16;
+using zabuton::util::Le32;
+using zabuton::util::Le64;
+using zabuton::util::ReadFully;
+using zabuton::util::ReplacingFile;
+using zabuton::util::SystemError;
+using zabuton::zstd::ZstdArchive;
+
+namespace zabuton { namespace zstd {
+
+namespace
+{
+
+// Largest window a frame may ask for. The packer stays well below it, and it bounds the memory
+// each decoding thread may allocate for a corrupt archive.
+constexpr int MaxWindowLog = 27;
+
+} // anonymous namespace
+
+ZstdArchive::ZstdArchive(int fd, uint64_t base, uint64_t length) :
+    fd_(fd),
+    base_(base),
+    length_(length),
+    uncompressedSize_(0)
+{
+}
+
+ZstdArchive::~ZstdArchive()
+{
+    close(fd_);
+}
+
+std::unique_ptr<ZstdArchive> ZstdArchive::Open(int fd, int64_t offset, int64_t length, std::string *error)
+{
+    if (length < 0) {
+        struct stat st = {};
+        if (fstat(fd, &st) != 0) {
+            *error = SystemError("Cannot stat", "zstd archive");
+            return nullptr;
+        }
+        length = st.st_size - offset;
+    }
+    if (offset < 0 || length < 0) {
+        *error = "Invalid zstd archive range.";
+        return nullptr;
+    }
+    std::unique_ptr<ZstdArchive> archive(new ZstdArchive(fd, static_cast<uint64_t>(offset), static_cast<uint64_t>(length)));
+    if (!archive->ReadIndex(error)) {
+        // The caller keeps fd.
+        archive->fd_ = -1;
+        return nullptr;
+    }
+    return archive;
+}
+
+bool ZstdArchive::ReadIndex(std::string *error)
+{
+    uint8_t footer[IndexFooterSize];
+    if (length_ < SkippableFrameHeaderSize + IndexFooterSize
+            || !ReadFully(fd_, footer, sizeof(footer), base_ + length_ - sizeof(footer))
+            || Le32(footer + 12) != IndexMagic) {
+        *error = "Not a seekable zstd archive.";
+        return false;
+    }
+    uint64_t indexSize = Le32(footer);
+    uint64_t frameCount = Le32(footer + 4);
+    uint64_t entryCount = Le32(footer + 8);
+    if (indexSize > length_ - SkippableFrameHeaderSize - IndexFooterSize
+            || frameCount * IndexFrameSize > indexSize
+            || entryCount * IndexEntryHeaderSize > indexSize - frameCount * IndexFrameSize) {
+        *error = "Zstd archive index is out of range.";
+        return false;
+    }
+    uint64_t framesEnd = length_ - SkippableFrameHeaderSize - indexSize - IndexFooterSize;
+    std::vector<uint8_t> index(static_cast<size_t>(SkippableFrameHeaderSize + indexSize));
+    if (!ReadFully(fd_, index.data(), index.size(), base_ + framesEnd)) {
+        *error = SystemError("Cannot read", "zstd archive index");
+        return false;
+    }
+    if (Le32(index.data()) != SkippableFrameMagic || Le32(index.data() + 4) != indexSize + IndexFooterSize) {
+        *error = "Corrupt zstd archive index.";
+        return false;
+    }
+
+    const uint8_t *p = index.data() + SkippableFrameHeaderSize;
+    const uint8_t *end = p + indexSize;
+    uint64_t offset = 0;
+    frames_.reserve(static_cast<size_t>(frameCount));
+    for (uint64_t n = 0; n < frameCount; n++, p += IndexFrameSize) {
+        ZstdFrame frame = {};
+        frame.offset = offset;
+        frame.compressedSize = Le32(p);
+        frame.uncompressedSize = Le32(p + 4);
+        offset += frame.compressedSize;
+        frames_.push_back(frame);
+    }
+    if (offset != framesEnd) {
+        *error = "Zstd archive frames are out of range.";
+        return false;
+    }
+
+    entries_.reserve(static_cast<size_t>(entryCount));
+    std::vector<uint64_t> frameSizes(frames_.size());
+    uint32_t lastFrame = NoFrame;
+    for (uint64_t n = 0; n < entryCount; n++) {
+        if (static_cast<size_t>(end - p) < IndexEntryHeaderSize
+                || static_cast<size_t>(end - p) - IndexEntryHeaderSize < Le16(p + 20)) {
+            *error = "Corrupt zstd archive index.";
+            return false;
+        }
+        ZstdEntry entry;
+        entry.frame = Le32(p);
+        entry.mode = Le32(p + 4) & 0777;
+        entry.size = Le64(p + 8);
+        entry.crc32 = Le32(p + 16);
+        entry.name.assign(reinterpret_cast<const char*>(p + IndexEntryHeaderSize), Le16(p + 20));
+        p += IndexEntryHeaderSize + entry.name.size();
+
+        if (!IsSafeName(entry.name)) {
+            *error = "Unsafe zstd archive entry name: " + entry.name;
+            return false;
+        }
+        if (entry.IsDirectory()) {
+            if (entry.frame != NoFrame || entry.size != 0) {
+                *error = "Corrupt zstd archive directory entry: " + entry.name;
+                return false;
+            }
+        } else {
+            // The files of a frame are consecutive entries, possibly with directories between
+            // them, so a frame is the range of entries from its first file to its last one.
+            if (entry.frame >= frames_.size()
+                    || (entry.frame != lastFrame && frames_[entry.frame].endEntry != 0)) {
+                *error = "Corrupt zstd archive entry: " + entry.name;
+                return false;
+            }
+            lastFrame = entry.frame;
+            ZstdFrame& frame = frames_[entry.frame];
+            if (frame.endEntry == 0) {
+                frame.firstEntry = entries_.size();
+            }
+            frame.endEntry = entries_.size() + 1;
+            frameSizes[entry.frame] += entry.size;
+            uncompressedSize_ += entry.size;
+        }
+        entries_.push_back(std::move(entry));
+    }
+    for (size_t i = 0; i < frames_.size(); i++) {
+        if (frameSizes[i] != frames_[i].uncompressedSize) {
+            *error = "Zstd archive frame size mismatch: " + std::to_string(i);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ZstdArchive::ExtractFrame(const ZstdFrame& frame, const std::string& dir, const std::vector<bool>& selected,
+                               ZSTD_DCtx *dctx, std::vector<uint8_t> *input, std::vector<uint8_t> *output,
+                               int64_t *slots, std::string *error) const
+{
+    // The entry being written, and how many of its bytes are still to come.
+    size_t entryIndex = frame.firstEntry;
+    uint64_t entryRemaining = 0;
+    uLong crc = 0;
+    ReplacingFile file;
+    // Starts writing the next file from entries_[entryIndex] on; empty files are completed right
+    // away.
+    auto beginEntries = [&]() {
+        for (; entryIndex < frame.endEntry; entryIndex++) {
+            const ZstdEntry& entry = entries_[entryIndex];
+            if (entry.IsDirectory()) {
+                continue;
+            }
+            entryRemaining = entry.size;
+            crc = crc32(0, nullptr, 0);
+            if (selected[entryIndex]
+                    && !file.Open(dir + '/' + entry.name, entry.mode != 0 ? entry.mode : 0644, entry.size, error)) {
+                return false;
+            }
+            if (entryRemaining > 0) {
+                return true;
+            }
+            if (selected[entryIndex] && !file.Commit(error)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto consume = [&](const uint8_t *data, size_t size) {
+        while (size > 0) {
+            if (entryIndex >= frame.endEntry) {
+                *error = "Zstd archive frame is longer than its entries: " + std::to_string(&frame - frames_.data());
+                return false;
+            }
+            const ZstdEntry& entry = entries_[entryIndex];
+            size_t n = static_cast<size_t>(std::min<uint64_t>(size, entryRemaining));
+            if (selected[entryIndex]) {
+                if (!file.Write(data, n, error)) {
+                    return false;
+                }
+                crc = crc32(crc, data, static_cast<uInt>(n));
+                AddExtractedBytes(slots, n);
+            }
+            data += n;
+            size -= n;
+            entryRemaining -= n;
+            if (entryRemaining == 0) {
+                if (selected[entryIndex]) {
+                    if (crc != entry.crc32) {
+                        *error = "Zstd archive entry checksum mismatch: " + entry.name;
+                        return false;
+                    }
+                    if (!file.Commit(error)) {
+                        return false;
+                    }
+                }
+                entryIndex++;
+                if (!beginEntries()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    if (!beginEntries()) {
+        return false;
+    }
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    uint64_t offset = base_ + frame.offset;
+    uint64_t remaining = frame.compressedSize;
+    ZSTD_inBuffer in = { input->data(), 0, 0 };
+    size_t r = 1;
+    while (r != 0) {
+        if (ExtractCancelled(slots)) {
+            return false;
+        }
+        if (in.pos == in.size) {
+            if (remaining == 0) {
+                *error = "Truncated zstd archive frame: " + std::to_string(&frame - frames_.data());
+                return false;
+            }
+            size_t size = static_cast<size_t>(std::min<uint64_t>(remaining, input->size()));
+            if (!ReadFully(fd_, input->data(), size, offset)) {
+                *error = SystemError("Cannot read", "zstd archive frame");
+                return false;
+            }
+            offset += size;
+            remaining -= size;
+            in = { input->data(), size, 0 };
+        }
+        ZSTD_outBuffer out = { output->data(), output->size(), 0 };
+        r = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(r)) {
+            *error = std::string("Corrupt zstd archive frame: ") + ZSTD_getErrorName(r);
+            return false;
+        }
+        if (!consume(output->data(), out.pos)) {
+            return false;
+        }
+    }
+    if (remaining != 0 || in.pos != in.size || entryIndex != frame.endEntry) {
+        *error = "Zstd archive frame size mismatch: " + std::to_string(&frame - frames_.data());
+        return false;
+    }
+    return true;
+}
+
+bool ZstdArchive::Extract(const std::string& dir, const std::unordered_set<std::string> *names, unsigned int threads,
+                          int64_t *slots, std::string *error) const
+{
+    std::vector<const std::string*> extracted;
+    std::vector<bool> selected(entries_.size());
+    std::vector<bool> frameSelected(frames_.size());
+    for (size_t i = 0; i < entries_.size(); i++) {
+        const ZstdEntry& entry = entries_[i];
+        if (names != nullptr && names->count(entry.name) == 0) {
+            continue;
+        }
+        extracted.push_back(&entry.name);
+        selected[i] = true;
+        if (!entry.IsDirectory()) {
+            frameSelected[entry.frame] = true;
+        }
+    }
+    if (!CreateDirectories(dir, extracted, error)) {
+        return false;
+    }
+
+    // Largest first, so one thread is not left decoding a big frame at the end.
+    std::vector<const ZstdFrame*> frames;
+    for (size_t i = 0; i < frames_.size(); i++) {
+        if (frameSelected[i]) {
+            frames.push_back(&frames_[i]);
+        }
+    }
+    std::sort(frames.begin(), frames.end(), [](const ZstdFrame *a, const ZstdFrame *b) {
+        return a->compressedSize > b->compressedSize;
+    });
+
+    return ExtractInParallel(frames.size(), threads, slots, error, [&]() {
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        if (dctx != nullptr) {
+            ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_windowLogMax, MaxWindowLog);
+        }
+        return [&, dctx = std::move(dctx), input = std::vector<uint8_t>(ZSTD_DStreamInSize()),
+                output = std::vector<uint8_t>(ZSTD_DStreamOutSize())](size_t i, std::string *frameError) mutable {
+            if (dctx == nullptr) {
+                *frameError = "Cannot initialize zstd.";
+                return false;
+            }
+            return ExtractFrame(*frames[i], dir, selected, dctx.get(), &input, &output, slots, frameError);
+        };
+    });
+}
+
+}}
+
+namespace
+{
+
+ZstdArchive* GetZstdArchive(JNIEnv *env, jobject this_)
+{
+    auto archive = reinterpret_cast<ZstdArchive*>(env->GetLongField(this_, GetRegistry().zstdArchive.handle));
+    if (archive == nullptr) {
+        env->ThrowNew(GetRegistry().illegalStateException.clazz, "ZstdArchive is already closed.");
+    }
+    return archive;
+}
+
+} // anonymous namespace
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_sh4_zabuton_util_ZstdArchive_open(JNIEnv *env, jclass /*type*/, jint fd, jlong offset, jlong length)
+{
+    // The archive keeps its own descriptor, so the caller may close the one it passed.
+    int ownFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (ownFd < 0) {
+        env->ThrowNew(GetRegistry().ioException.clazz, strerror(errno));
+        return nullptr;
+    }
+    std::string error;
+    std::unique_ptr<ZstdArchive> archive = ZstdArchive::Open(ownFd, offset, length, &error);
+    if (!archive) {
+        close(ownFd);
+        env->ThrowNew(GetRegistry().ioException.clazz, error.c_str());
+        return nullptr;
+    }
+    const auto& zstdArchive = GetRegistry().zstdArchive;
+    jobject object = env->NewObject(zstdArchive.clazz, zstdArchive.ctor, reinterpret_cast<jlong>(archive.get()));
+    if (object != nullptr) {
+        archive.release();
+    }
+    return object;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_sh4_zabuton_util_ZstdArchive_getEntryCount(JNIEnv *env, jobject this_)
+{
+    ZstdArchive *archive = GetZstdArchive(env, this_);
+    return archive != nullptr ? static_cast<jint>(archive->Entries().size()) : 0;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_sh4_zabuton_util_ZstdArchive_getUncompressedSize(JNIEnv *env, jobject this_)
+{
+    ZstdArchive *archive = GetZstdArchive(env, this_);
+    return archive != nullptr ? static_cast<jlong>(archive->UncompressedSize()) : 0;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZstdArchive_extract(JNIEnv *env, jobject this_, jstring extractDir_,
+                                                    jobjectArray names_, jint threads)
+{
+    ZstdArchive *archive = GetZstdArchive(env, this_);
+    if (archive == nullptr) {
+        return;
+    }
+    ExtractArchive(env, this_, GetRegistry().zstdArchive.state, extractDir_, names_,
+            "The zstd archive extraction was cancelled.",
+            [&](const std::string& dir, const std::unordered_set<std::string> *names, int64_t *slots, std::string *error) {
+                return archive->Extract(dir, names, static_cast<unsigned int>(std::max(threads, 1)), slots, error);
+            });
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_sh4_zabuton_util_ZstdArchive_destroy(JNIEnv *env, jobject this_)
+{
+    auto archive = reinterpret_cast<ZstdArchive*>(env->GetLongField(this_, GetRegistry().zstdArchive.handle));
+    if (archive != nullptr) {
+        delete archive;
+        env->SetLongField(this_, GetRegistry().zstdArchive.handle, 0);
+    }
+}
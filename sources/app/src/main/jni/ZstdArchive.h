@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct ZSTD_DCtx_s;
+
+namespace zabuton { namespace zstd {
+
+// Layout of a seekable zstd archive, shared with resources/pack_toolchain.cpp. All integers are
+// little endian.
+//
+//   zstd frame 0 .. N-1  the contents of the files in index order, concatenated. A file never spans
+//                        two frames, so every frame can be decoded independently of the others.
+//   skippable frame      SkippableFrameMagic, u32 payload size, then the payload:
+//     frames             per frame: u32 compressed size, u32 uncompressed size
+//     entries            per entry: u32 frame, u32 mode, u64 size, u32 crc32, u16 name size, name
+//     footer             u32 index size (frames and entries), u32 frame count, u32 entry count,
+//                        u32 IndexMagic
+//
+// Directory entries end with '/', have the frame NoFrame and no content. Since the index is a
+// skippable frame, `zstd -d` decodes the archive into the concatenated files.
+constexpr uint32_t SkippableFrameMagic = 0x184D2A5E;
+constexpr uint32_t IndexMagic = 0x5A425449;
+constexpr uint32_t NoFrame = 0xffffffff;
+constexpr size_t SkippableFrameHeaderSize = 8;
+constexpr size_t IndexFooterSize = 16;
+constexpr size_t IndexFrameSize = 8;
+constexpr size_t IndexEntryHeaderSize = 22;
+
+struct ZstdFrame
+{
+    uint64_t offset;
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+    // Entries [firstEntry, endEntry) are stored in this frame.
+    size_t firstEntry;
+    size_t endEntry;
+};
+
+struct ZstdEntry
+{
+    std::string name;
+    uint32_t frame;
+    uint32_t mode;
+    uint64_t size;
+    uint32_t crc32;
+
+    bool IsDirectory() const { return !name.empty() && name.back() == '/'; }
+};
+
+// A seekable zstd archive read through random access on a file descriptor. The index is read
+// once, and the frames are decoded by several threads at once, each streaming its frame straight
+// into the files it holds.
+class ZstdArchive
+{
+    int fd_;
+    uint64_t base_;
+    uint64_t length_;
+    std::vector<ZstdFrame> frames_;
+    std::vector<ZstdEntry> entries_;
+    uint64_t uncompressedSize_;
+
+    ZstdArchive(int fd, uint64_t base, uint64_t length);
+    bool ReadIndex(std::string *error);
+    bool ExtractFrame(const ZstdFrame& frame, const std::string& dir, const std::vector<bool>& selected,
+                      ZSTD_DCtx_s *dctx, std::vector<uint8_t> *input, std::vector<uint8_t> *output,
+                      int64_t *slots, std::string *error) const;
+public:
+    ZstdArchive(const ZstdArchive&) = delete;
+    ZstdArchive& operator=(const ZstdArchive&) = delete;
+    ~ZstdArchive();
+
+    // Takes ownership of fd on success. The archive spans length bytes from offset (up to the end
+    // of the file when length is negative), e.g. an uncompressed asset inside an APK.
+    static std::unique_ptr<ZstdArchive> Open(int fd, int64_t offset, int64_t length, std::string *error);
+
+    const std::vector<ZstdEntry>& Entries() const { return entries_; }
+    uint64_t UncompressedSize() const { return uncompressedSize_; }
+
+    // Extracts the entries named in names, or every entry when names is null, below dir with the
+    // given number of threads, replacing existing files atomically. Frames are handed out
+    // largest first; a frame without a requested entry is not read at all. slots (ExtractSlotCount
+    // values) receive the progress and are polled for cancellation. Returns false with error set
+    // on failure, or with an empty error when cancelled.
+    bool Extract(const std::string& dir, const std::unordered_set<std::string> *names, unsigned int threads,
+                 int64_t *slots, std::string *error) const;
+};
+
+}}
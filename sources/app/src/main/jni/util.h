@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <ctime>
 #include <utility>
 
 #define ZABUTON_DETAIL_CONCAT_EXPAND(a, b) a##b
@@ -11,7 +13,7 @@ namespace zabuton { namespace util {
 template <typename T>
 class ScopeGuard
 {
-    T&& lambda_;
+    T lambda_;
 public:
     explicit ScopeGuard(T&& lambda) : lambda_(std::forward<T>(lambda)) {
     }
@@ -27,4 +29,12 @@ ScopeGuard<T> MakeScopeGuard(T&& lambda) {
     return ScopeGuard<T>(std::forward<T>(lambda));
 }
 
+// CLOCK_MONOTONIC in nanoseconds, for intervals and deadlines.
+inline int64_t MonotonicNanos()
+{
+    timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
 }}
\ No newline at end of file